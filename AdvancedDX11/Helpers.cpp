@@ -1,4 +1,7 @@
 
+// std::wstring_convert is deprecated in C++17 but has no standard replacement
+#define _SILENCE_CXX17_CODECVT_HEADER_DEPRECATION_WARNING
+
 #include <Windows.h>
 #include <codecvt>
 #include <locale>
@@ -1,7 +1,11 @@
 #include "Mesh.h"
+#include "Helpers.h"
+#include "ObjParser.h"
 #include <DirectXMath.h>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
 #include <vector>
-#include <fstream>
 
 using namespace DirectX;
 
@@ -23,6 +27,7 @@ Mesh::Mesh(Vertex* vertArray, size_t numVerts, unsigned int* indexArray, size_t
 
 // --------------------------------------------------------
 // Creates a new mesh by loading vertices from the given .obj file
+// (see ObjParser for what it reads)
 // 
 // objFile  - Path to the .obj 3D model file to load
 // device   - The D3D device to use for buffer creation
@@ -30,166 +35,29 @@ Mesh::Mesh(Vertex* vertArray, size_t numVerts, unsigned int* indexArray, size_t
 Mesh::Mesh(const std::wstring& objFile, Microsoft::WRL::ComPtr<ID3D11Device> device) :
 	numIndices(0)
 {
-	// File input object
-	std::ifstream obj(objFile);
-
-	// Check for successful open
-	if (!obj.is_open())
-		return;
-
-	// Variables used while reading the file
-	std::vector<XMFLOAT3> positions;     // Positions from the file
-	std::vector<XMFLOAT3> normals;       // Normals from the file
-	std::vector<XMFLOAT2> uvs;           // UVs from the file
-	std::vector<Vertex> verts;           // Verts we're assembling
-	std::vector<UINT> indices;           // Indices of these verts
-	unsigned int vertCounter = 0;        // Count of vertices/indices
-	char chars[100];                     // String for line reading
-
-	// Still have data left?
-	while (obj.good())
+	// Parse the whole file, large ones on several threads
+	ObjParser parser;
+	if (!parser.ParseFile(objFile))
 	{
-		// Get the line (100 characters should be more than enough)
-		obj.getline(chars, 100);
-
-		// Check the type of line
-		if (chars[0] == 'v' && chars[1] == 'n')
-		{
-			// Read the 3 numbers directly into an XMFLOAT3
-			XMFLOAT3 norm = { 0, 0, 0 };
-			sscanf_s(
-				chars,
-				"vn %f %f %f",
-				&norm.x, &norm.y, &norm.z);
-
-			// Add to the list of normals
-			normals.push_back(norm);
-		}
-		else if (chars[0] == 'v' && chars[1] == 't')
-		{
-			// Read the 2 numbers directly into an XMFLOAT2
-			XMFLOAT2 uv = { 0, 0 };
-			sscanf_s(
-				chars,
-				"vt %f %f",
-				&uv.x, &uv.y);
-
-			// Add to the list of uv's
-			uvs.push_back(uv);
-		}
-		else if (chars[0] == 'v')
-		{
-			// Read the 3 numbers directly into an XMFLOAT3
-			XMFLOAT3 pos = { 0, 0, 0 };
-			sscanf_s(
-				chars,
-				"v %f %f %f",
-				&pos.x, &pos.y, &pos.z);
-
-			// Add to the positions
-			positions.push_back(pos);
-		}
-		else if (chars[0] == 'f')
-		{
-			// Read the face indices into an array
-			// NOTE: This assumes the given obj file contains
-			//  vertex positions, uv coordinates AND normals.
-			//  If the model is missing any of these, this 
-			//  code will not handle the file correctly!
-			unsigned int i[12] = {};
-			int facesRead = sscanf_s(
-				chars,
-				"f %d/%d/%d %d/%d/%d %d/%d/%d %d/%d/%d",
-				&i[0], &i[1], &i[2],
-				&i[3], &i[4], &i[5],
-				&i[6], &i[7], &i[8],
-				&i[9], &i[10], &i[11]);
-
-			// - Create the verts by looking up
-			//    corresponding data from vectors
-			// - OBJ File indices are 1-based, so
-			//    they need to be adusted
-			Vertex v1 = {};
-			v1.Position = positions[max(i[0] - 1, 0)];
-			v1.UV = uvs[max(i[1] - 1, 0)];
-			v1.Normal = normals[max(i[2] - 1, 0)];
-
-			Vertex v2 = {};
-			v2.Position = positions[max(i[3] - 1, 0)];
-			v2.UV = uvs[max(i[4] - 1, 0)];
-			v2.Normal = normals[max(i[5] - 1, 0)];
-
-			Vertex v3 = {};
-			v3.Position = positions[max(i[6] - 1, 0)];
-			v3.UV = uvs[max(i[7] - 1, 0)];
-			v3.Normal = normals[max(i[8] - 1, 0)];
-
-			// The model is most likely in a right-handed space,
-			// especially if it came from Maya.  We want to convert
-			// to a left-handed space for DirectX.  This means we 
-			// need to:
-			//  - Invert the Z position
-			//  - Invert the normal's Z
-			//  - Flip the winding order
-			// We also need to flip the UV coordinate since DirectX
-			// defines (0,0) as the top left of the texture, and many
-			// 3D modeling packages use the bottom left as (0,0)
-
-			// Flip the UV's since they're probably "upside down"
-			v1.UV.y = 1.0f - v1.UV.y;
-			v2.UV.y = 1.0f - v2.UV.y;
-			v3.UV.y = 1.0f - v3.UV.y;
-
-			// Flip Z (LH vs. RH)
-			v1.Position.z *= -1.0f;
-			v2.Position.z *= -1.0f;
-			v3.Position.z *= -1.0f;
-
-			// Flip normal Z
-			v1.Normal.z *= -1.0f;
-			v2.Normal.z *= -1.0f;
-			v3.Normal.z *= -1.0f;
-
-			// Add the verts to the vector (flipping the winding order)
-			verts.push_back(v1);
-			verts.push_back(v3);
-			verts.push_back(v2);
-
-			// Add three more indices
-			indices.push_back(vertCounter); vertCounter += 1;
-			indices.push_back(vertCounter); vertCounter += 1;
-			indices.push_back(vertCounter); vertCounter += 1;
-
-			// Was there a 4th face?
-			if (facesRead == 12)
-			{
-				// Make the last vertex
-				Vertex v4 = {};
-				v4.Position = positions[max(i[9] - 1, 0)];
-				v4.UV = uvs[max(i[10] - 1, 0)];
-				v4.Normal = normals[max(i[11] - 1, 0)];
-
-				// Flip the UV, Z pos and normal
-				v4.UV.y = 1.0f - v4.UV.y;
-				v4.Position.z *= -1.0f;
-				v4.Normal.z *= -1.0f;
-
-				// Add a whole triangle (flipping the winding order)
-				verts.push_back(v1);
-				verts.push_back(v4);
-				verts.push_back(v3);
-
-				// Add three more indices
-				indices.push_back(vertCounter); vertCounter += 1;
-				indices.push_back(vertCounter); vertCounter += 1;
-				indices.push_back(vertCounter); vertCounter += 1;
-			}
-		}
+		std::string message = "Error loading " + WideToNarrow(objFile) + ": " + parser.GetError() + "\n";
+		printf_s("%s", message.c_str());
+		OutputDebugStringA(message.c_str());
+		return;
 	}
+	if (parser.GetVertices().empty())
+		return;
 
-	// Close the file and create the actual buffers
-	obj.close();
-	CreateBuffers(&verts[0], vertCounter, &indices[0], vertCounter, device);
+	// ObjVertex is laid out exactly like Vertex, so the
+	// parsed vertices can be copied across as they are
+	static_assert(sizeof(ObjVertex) == sizeof(Vertex), "ObjVertex must match Vertex");
+	static_assert(offsetof(ObjVertex, UV) == offsetof(Vertex, UV), "ObjVertex must match Vertex");
+	static_assert(offsetof(ObjVertex, Normal) == offsetof(Vertex, Normal), "ObjVertex must match Vertex");
+	static_assert(offsetof(ObjVertex, Tangent) == offsetof(Vertex, Tangent), "ObjVertex must match Vertex");
+	std::vector<Vertex> verts(parser.GetVertices().size());
+	memcpy(verts.data(), parser.GetVertices().data(), sizeof(Vertex) * verts.size());
+	std::vector<unsigned int> indices = parser.GetIndices();
+
+	CreateBuffers(verts.data(), verts.size(), indices.data(), indices.size(), device);
 }
 
 
@@ -298,8 +166,14 @@ void Mesh::CalculateTangents(Vertex* verts, size_t numVerts, unsigned int* indic
 		float s2 = v3->UV.x - v1->UV.x;
 		float t2 = v3->UV.y - v1->UV.y;
 
+		// Skip triangles whose UVs don't span an area (such as
+		// those from a model without UVs), which have no tangent
+		float area = s1 * t2 - s2 * t1;
+		if (area == 0.0f)
+			continue;
+
 		// Create vectors for tangent calculation
-		float r = 1.0f / (s1 * t2 - s2 * t1);
+		float r = 1.0f / area;
 
 		float tx = (t2 * x1 - t1 * x2) * r;
 		float ty = (t2 * y1 - t1 * y2) * r;
@@ -0,0 +1,517 @@
+#include "ObjParser.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <thread>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+	// Files smaller than this per thread aren't worth splitting
+	const size_t MinChunkBytes = 1 << 20;
+
+	// --------------------------------------------------------
+	// A read-only view of a whole file mapped into memory
+	// --------------------------------------------------------
+	class MappedFile
+	{
+	public:
+		MappedFile(const std::filesystem::path& path)
+		{
+#ifdef _WIN32
+			file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+			if (file == INVALID_HANDLE_VALUE)
+				return;
+
+			LARGE_INTEGER fileSize = {};
+			if (!GetFileSizeEx(file, &fileSize))
+				return;
+			size = (size_t)fileSize.QuadPart;
+			if (size == 0)
+			{
+				open = true;
+				return;
+			}
+
+			mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (mapping == nullptr)
+				return;
+			data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			open = data != nullptr;
+#else
+			int fd = ::open(path.c_str(), O_RDONLY);
+			if (fd < 0)
+				return;
+
+			struct stat info = {};
+			if (fstat(fd, &info) == 0)
+			{
+				size = (size_t)info.st_size;
+				if (size == 0)
+					open = true;
+				else
+				{
+					void* view = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+					if (view != MAP_FAILED)
+					{
+						madvise(view, size, MADV_WILLNEED);
+						data = (const char*)view;
+						open = true;
+					}
+				}
+			}
+
+			// The mapping stays valid once the file is closed
+			close(fd);
+#endif
+		}
+
+		~MappedFile()
+		{
+#ifdef _WIN32
+			if (data) UnmapViewOfFile(data);
+			if (mapping) CloseHandle(mapping);
+			if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+			if (data) munmap((void*)data, size);
+#endif
+		}
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		bool IsOpen() const { return open; }
+		const char* GetData() const { return data; }
+		size_t GetSize() const { return size; }
+
+	private:
+		const char* data = nullptr;
+		size_t size = 0;
+		bool open = false;
+#ifdef _WIN32
+		HANDLE file = INVALID_HANDLE_VALUE;
+		HANDLE mapping = nullptr;
+#endif
+	};
+
+	enum class LineType { Other, Position, UV, Normal, Face };
+
+	// One corner of a triangle: indices into the file's positions,
+	// UVs and normals, or -1 for a UV or normal the face doesn't give
+	struct Corner
+	{
+		int Position;
+		int UV;
+		int Normal;
+	};
+
+	// --------------------------------------------------------
+	// A run of whole lines parsed by one thread
+	// --------------------------------------------------------
+	struct Chunk
+	{
+		const char* Begin;
+		const char* End;
+
+		// Counted in the first pass
+		size_t Lines = 0;
+		size_t Positions = 0;
+		size_t UVs = 0;
+		size_t Normals = 0;
+
+		// Totals over the chunks before this one
+		size_t FirstLine = 0;
+		size_t PositionBase = 0;
+		size_t UVBase = 0;
+		size_t NormalBase = 0;
+		size_t FirstCorner = 0;
+
+		// Parsed in the second pass: three corners per triangle,
+		// already in DirectX winding order
+		std::vector<Corner> Corners;
+
+		// Why the second pass stopped, and on which line of the chunk
+		std::string Error;
+		size_t ErrorLine = 0;
+	};
+
+	bool IsBlank(char c)
+	{
+		return c == ' ' || c == '\t' || c == '\r';
+	}
+
+	void SkipBlanks(const char*& p, const char* end)
+	{
+		while (p < end && IsBlank(*p))
+			p++;
+	}
+
+	// --------------------------------------------------------
+	// Works out what a line holds and moves p past its keyword
+	// --------------------------------------------------------
+	LineType ClassifyLine(const char*& p, const char* end)
+	{
+		SkipBlanks(p, end);
+		size_t length = 0;
+		while (p + length < end && !IsBlank(p[length]))
+			length++;
+
+		LineType type = LineType::Other;
+		if (length == 1 && p[0] == 'v') type = LineType::Position;
+		else if (length == 1 && p[0] == 'f') type = LineType::Face;
+		else if (length == 2 && p[0] == 'v' && p[1] == 't') type = LineType::UV;
+		else if (length == 2 && p[0] == 'v' && p[1] == 'n') type = LineType::Normal;
+
+		p += length;
+		return type;
+	}
+
+	// --------------------------------------------------------
+	// Reads one number that must end at a blank or the line's end
+	// --------------------------------------------------------
+	bool ParseFloat(const char*& p, const char* end, float& value)
+	{
+		SkipBlanks(p, end);
+		if (p < end && *p == '+')
+			p++;
+
+		std::from_chars_result result = std::from_chars(p, end, value);
+		if (result.ec == std::errc::result_out_of_range)
+		{
+			// Too small (or large) for a float; let the conversion round it
+			double wide = 0;
+			result = std::from_chars(p, end, wide);
+			value = (float)wide;
+		}
+		if (result.ec != std::errc() || (result.ptr < end && !IsBlank(*result.ptr)))
+			return false;
+
+		p = result.ptr;
+		return true;
+	}
+
+	// --------------------------------------------------------
+	// Reads one index of a face corner and resolves it to a
+	// 0-based index: positive indices count from the start of
+	// the file, negative ones back from the last element read
+	//
+	// defined - Elements of this kind before this line
+	// total   - Elements of this kind in the whole file
+	// --------------------------------------------------------
+	bool ParseIndex(const char*& p, const char* end, size_t defined, size_t total, int& index)
+	{
+		int raw = 0;
+		std::from_chars_result result = std::from_chars(p, end, raw);
+		if (result.ec != std::errc() || raw == 0)
+			return false;
+
+		long long resolved = raw > 0 ? (long long)raw - 1 : (long long)defined + raw;
+		if (resolved < 0 || resolved >= (long long)total)
+			return false;
+
+		p = result.ptr;
+		index = (int)resolved;
+		return true;
+	}
+
+	// --------------------------------------------------------
+	// Runs the work on every chunk, each on its own thread
+	// --------------------------------------------------------
+	template<typename Work>
+	void ForEachChunk(std::vector<Chunk>& chunks, Work work)
+	{
+		if (chunks.size() == 1)
+		{
+			work(chunks[0]);
+			return;
+		}
+
+		std::vector<std::thread> threads;
+		for (Chunk& chunk : chunks)
+			threads.emplace_back([&work, &chunk]() { work(chunk); });
+		for (std::thread& t : threads)
+			t.join();
+	}
+}
+
+
+// --------------------------------------------------------
+// Creates a parser
+//
+// threadCount - Most threads a parse may use (0 for all)
+// --------------------------------------------------------
+ObjParser::ObjParser(unsigned int threadCount) :
+	threadCount(threadCount),
+	chunkCount(0)
+{
+	if (this->threadCount == 0)
+		this->threadCount = std::max(1u, std::thread::hardware_concurrency());
+}
+
+
+// --------------------------------------------------------
+// Maps the given .obj file into memory and parses it
+// --------------------------------------------------------
+bool ObjParser::ParseFile(const std::filesystem::path& objFile)
+{
+	MappedFile file(objFile);
+	if (!file.IsOpen())
+	{
+		vertices.clear();
+		indices.clear();
+		chunkCount = 0;
+		error = "Unable to open " + objFile.string();
+		return false;
+	}
+
+	return Parse(file.GetData(), file.GetSize());
+}
+
+
+// --------------------------------------------------------
+// Parses .obj text already in memory
+//
+// Three passes, each over every chunk in parallel:
+//  1. Count the lines and the positions, UVs and normals in
+//     each chunk, so every chunk knows where its elements go
+//     and what a relative index before it refers to
+//  2. Parse the elements straight into the shared arrays and
+//     split faces into triangles of resolved corners
+//  3. Build each chunk's vertices at its place in the output
+// --------------------------------------------------------
+bool ObjParser::Parse(const char* data, size_t size)
+{
+	vertices.clear();
+	indices.clear();
+	error.clear();
+
+	// Split the text into chunks of whole lines
+	size_t count = std::max<size_t>(1, std::min<size_t>(threadCount, size / MinChunkBytes));
+	std::vector<Chunk> chunks(count);
+	const char* dataEnd = data + size;
+	for (size_t i = 0; i < count; i++)
+	{
+		chunks[i].Begin = i == 0 ? data : chunks[i - 1].End;
+		chunks[i].End = dataEnd;
+		if (i + 1 < count)
+		{
+			const char* split = std::max(chunks[i].Begin, data + size * (i + 1) / count);
+			const char* newline = (const char*)memchr(split, '\n', dataEnd - split);
+			chunks[i].End = newline ? newline + 1 : dataEnd;
+		}
+	}
+	chunkCount = (unsigned int)count;
+
+	// Pass 1: count
+	ForEachChunk(chunks, [](Chunk& chunk)
+		{
+			for (const char* line = chunk.Begin; line < chunk.End;)
+			{
+				const char* lineEnd = (const char*)memchr(line, '\n', chunk.End - line);
+				if (!lineEnd) lineEnd = chunk.End;
+
+				switch (ClassifyLine(line, lineEnd))
+				{
+				case LineType::Position: chunk.Positions++; break;
+				case LineType::UV: chunk.UVs++; break;
+				case LineType::Normal: chunk.Normals++; break;
+				default: break;
+				}
+
+				chunk.Lines++;
+				line = lineEnd < chunk.End ? lineEnd + 1 : chunk.End;
+			}
+		});
+
+	for (size_t i = 1; i < count; i++)
+	{
+		const Chunk& before = chunks[i - 1];
+		chunks[i].FirstLine = before.FirstLine + before.Lines;
+		chunks[i].PositionBase = before.PositionBase + before.Positions;
+		chunks[i].UVBase = before.UVBase + before.UVs;
+		chunks[i].NormalBase = before.NormalBase + before.Normals;
+	}
+	const Chunk& last = chunks.back();
+	std::vector<ObjFloat3> positions(last.PositionBase + last.Positions);
+	std::vector<ObjFloat2> uvs(last.UVBase + last.UVs);
+	std::vector<ObjFloat3> normals(last.NormalBase + last.Normals);
+
+	// Pass 2: parse
+	ForEachChunk(chunks, [&](Chunk& chunk)
+		{
+			size_t position = chunk.PositionBase;
+			size_t uv = chunk.UVBase;
+			size_t normal = chunk.NormalBase;
+			std::vector<Corner> face;
+
+			size_t lineNumber = 0;
+			for (const char* line = chunk.Begin; line < chunk.End; lineNumber++)
+			{
+				const char* lineEnd = (const char*)memchr(line, '\n', chunk.End - line);
+				if (!lineEnd) lineEnd = chunk.End;
+				const char* p = line;
+				line = lineEnd < chunk.End ? lineEnd + 1 : chunk.End;
+
+				switch (ClassifyLine(p, lineEnd))
+				{
+				case LineType::Position:
+				{
+					// Any w or vertex colour after x, y and z is ignored
+					ObjFloat3& v = positions[position++];
+					if (!ParseFloat(p, lineEnd, v.x) || !ParseFloat(p, lineEnd, v.y) || !ParseFloat(p, lineEnd, v.z))
+						chunk.Error = "expected three numbers after v";
+					break;
+				}
+
+				case LineType::UV:
+				{
+					// v is optional (and w is ignored)
+					ObjFloat2& t = uvs[uv++];
+					t = {};
+					SkipBlanks(p, lineEnd);
+					if (!ParseFloat(p, lineEnd, t.x) || (p < lineEnd && !ParseFloat(p, lineEnd, t.y)))
+						chunk.Error = "expected numbers after vt";
+					break;
+				}
+
+				case LineType::Normal:
+				{
+					ObjFloat3& n = normals[normal++];
+					if (!ParseFloat(p, lineEnd, n.x) || !ParseFloat(p, lineEnd, n.y) || !ParseFloat(p, lineEnd, n.z))
+						chunk.Error = "expected three numbers after vn";
+					break;
+				}
+
+				case LineType::Face:
+				{
+					face.clear();
+					for (SkipBlanks(p, lineEnd); p < lineEnd && chunk.Error.empty(); SkipBlanks(p, lineEnd))
+					{
+						Corner c = { -1, -1, -1 };
+						bool valid = ParseIndex(p, lineEnd, position, positions.size(), c.Position);
+						if (valid && p < lineEnd && *p == '/')
+						{
+							p++;
+							if (p < lineEnd && *p != '/')
+								valid = ParseIndex(p, lineEnd, uv, uvs.size(), c.UV);
+							if (valid && p < lineEnd && *p == '/')
+							{
+								p++;
+								valid = ParseIndex(p, lineEnd, normal, normals.size(), c.Normal);
+							}
+						}
+						if (!valid || (p < lineEnd && !IsBlank(*p)))
+							chunk.Error = "invalid or out of range face index";
+						face.push_back(c);
+					}
+					if (chunk.Error.empty() && face.size() < 3)
+						chunk.Error = "face with fewer than three corners";
+					if (!chunk.Error.empty())
+						break;
+
+					// A fan of triangles around the first corner, each
+					// flipped from the file's winding for DirectX
+					for (size_t k = 1; k + 1 < face.size(); k++)
+					{
+						chunk.Corners.push_back(face[0]);
+						chunk.Corners.push_back(face[k + 1]);
+						chunk.Corners.push_back(face[k]);
+					}
+					break;
+				}
+
+				default:
+					break;
+				}
+
+				if (!chunk.Error.empty())
+				{
+					chunk.ErrorLine = lineNumber;
+					return;
+				}
+			}
+		});
+
+	for (size_t i = 0; i < count; i++)
+	{
+		if (!chunks[i].Error.empty())
+		{
+			error = "Line " + std::to_string(chunks[i].FirstLine + chunks[i].ErrorLine + 1) + ": " + chunks[i].Error;
+			return false;
+		}
+		if (i > 0)
+			chunks[i].FirstCorner = chunks[i - 1].FirstCorner + chunks[i - 1].Corners.size();
+	}
+	vertices.resize(last.FirstCorner + last.Corners.size());
+	indices.resize(vertices.size());
+
+	// Pass 3: build the vertices
+	ForEachChunk(chunks, [&](Chunk& chunk)
+		{
+			for (size_t i = 0; i < chunk.Corners.size(); i += 3)
+			{
+				const Corner* corners = &chunk.Corners[i];
+
+				// The face normal, from the triangle in the file's winding,
+				// for corners that don't have their own
+				ObjFloat3 faceNormal = {};
+				if (corners[0].Normal < 0 || corners[1].Normal < 0 || corners[2].Normal < 0)
+				{
+					const ObjFloat3& a = positions[corners[0].Position];
+					const ObjFloat3& b = positions[corners[2].Position];
+					const ObjFloat3& c = positions[corners[1].Position];
+					ObjFloat3 e1 = { b.x - a.x, b.y - a.y, b.z - a.z };
+					ObjFloat3 e2 = { c.x - a.x, c.y - a.y, c.z - a.z };
+					ObjFloat3 n = { e1.y * e2.z - e1.z * e2.y, e1.z * e2.x - e1.x * e2.z, e1.x * e2.y - e1.y * e2.x };
+					float length = std::sqrt(n.x * n.x + n.y * n.y + n.z * n.z);
+					if (length > 0)
+						faceNormal = { n.x / length, n.y / length, n.z / length };
+				}
+
+				for (size_t k = 0; k < 3; k++)
+				{
+					const Corner& c = corners[k];
+					ObjVertex v = {};
+					v.Position = positions[c.Position];
+					if (c.UV >= 0) v.UV = uvs[c.UV];
+					v.Normal = c.Normal >= 0 ? normals[c.Normal] : faceNormal;
+
+					// Left-handed for DirectX, with V running down the texture
+					if (c.UV >= 0) v.UV.y = 1.0f - v.UV.y;
+					v.Position.z *= -1.0f;
+					v.Normal.z *= -1.0f;
+
+					size_t at = chunk.FirstCorner + i + k;
+					vertices[at] = v;
+					indices[at] = (unsigned int)at;
+				}
+			}
+		});
+
+	return true;
+}
+
+
+// --------------------------------------------------------
+// Getters for the results of the last parse
+// --------------------------------------------------------
+const std::vector<ObjVertex>& ObjParser::GetVertices() const { return vertices; }
+const std::vector<unsigned int>& ObjParser::GetIndices() const { return indices; }
+const std::string& ObjParser::GetError() const { return error; }
+unsigned int ObjParser::GetChunkCount() const { return chunkCount; }
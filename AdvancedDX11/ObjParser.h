@@ -0,0 +1,80 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+// --------------------------------------------------------
+// Plain float vectors with the layout of DirectXMath's
+// XMFLOAT2 and XMFLOAT3, so the parser builds (and can be
+// tested) without DirectX
+// --------------------------------------------------------
+struct ObjFloat2
+{
+	float x;
+	float y;
+};
+
+struct ObjFloat3
+{
+	float x;
+	float y;
+	float z;
+};
+
+// --------------------------------------------------------
+// A parsed vertex, member for member the same layout as
+// Vertex (see Vertex.h) so Mesh can copy it straight into
+// its vertex buffer
+// --------------------------------------------------------
+struct ObjVertex
+{
+	ObjFloat3 Position;
+	ObjFloat2 UV;
+	ObjFloat3 Normal;
+	ObjFloat3 Tangent;	// Always zero; Mesh calculates tangents
+};
+
+// --------------------------------------------------------
+// Loads triangles from Wavefront .obj files
+//
+// - The file is memory mapped and numbers are read with
+//   std::from_chars, so there is no line length limit
+// - Faces may use any index form (v, v/vt, v//vn, v/vt/vn),
+//   negative (relative) indices and any number of corners;
+//   polygons are split into a fan of triangles
+// - Corners without a UV get (0, 0); corners without a
+//   normal get their triangle's face normal
+// - Large files are parsed in chunks on several threads
+//   and merged, with the same result as one thread
+//
+// The output matches what Mesh has always built: one vertex
+// per triangle corner, converted to DirectX's left-handed
+// space (Z and normal Z negated, winding flipped) with V
+// flipped, and indices 0, 1, 2, ...
+// --------------------------------------------------------
+class ObjParser
+{
+public:
+	// threadCount of 0 uses every hardware thread
+	ObjParser(unsigned int threadCount = 0);
+
+	// Both return false, with a message in GetError(), if the
+	// file can't be read or holds something that isn't valid
+	bool ParseFile(const std::filesystem::path& objFile);
+	bool Parse(const char* data, size_t size);
+
+	// Results of the last parse
+	const std::vector<ObjVertex>& GetVertices() const;
+	const std::vector<unsigned int>& GetIndices() const;
+	const std::string& GetError() const;
+	unsigned int GetChunkCount() const;
+
+private:
+	unsigned int threadCount;
+	unsigned int chunkCount;
+
+	std::vector<ObjVertex> vertices;
+	std::vector<unsigned int> indices;
+	std::string error;
+};
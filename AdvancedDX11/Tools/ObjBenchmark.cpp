@@ -0,0 +1,232 @@
+// --------------------------------------------------------
+// Times ObjParser against the loader Mesh used before it
+// (line by line with getline and sscanf_s), in MB/s, and
+// checks that both build the same vertices
+//
+// Builds on its own, with no DirectX, from this folder:
+//   g++ -std=c++17 -O2 -pthread -I.. ObjBenchmark.cpp ../ObjParser.cpp -o ObjBenchmark
+//   cl /std:c++17 /O2 /EHsc /I.. ObjBenchmark.cpp ..\ObjParser.cpp
+//
+// Usage: ObjBenchmark [--segments n] [model.obj ...]
+// With no models, times a generated torus of n x n quads
+// (default 600, about 60 MB)
+// --------------------------------------------------------
+
+#include "ObjParser.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _MSC_VER
+#define sscanf_s sscanf
+#endif
+
+// --------------------------------------------------------
+// The loader Mesh(objFile, device) used before ObjParser,
+// minus buffer creation. Like the original it only handles
+// faces of 3 or 4 v/vt/vn corners on lines under 100 chars.
+// --------------------------------------------------------
+bool LegacyLoad(const std::filesystem::path& objFile, std::vector<ObjVertex>& verts, std::vector<unsigned int>& indices)
+{
+	std::ifstream obj(objFile);
+	if (!obj.is_open())
+		return false;
+
+	std::vector<ObjFloat3> positions;
+	std::vector<ObjFloat3> normals;
+	std::vector<ObjFloat2> uvs;
+	unsigned int vertCounter = 0;
+	char chars[100];
+	verts.clear();
+	indices.clear();
+
+	while (obj.good())
+	{
+		obj.getline(chars, 100);
+
+		if (chars[0] == 'v' && chars[1] == 'n')
+		{
+			ObjFloat3 norm = { 0, 0, 0 };
+			sscanf_s(chars, "vn %f %f %f", &norm.x, &norm.y, &norm.z);
+			normals.push_back(norm);
+		}
+		else if (chars[0] == 'v' && chars[1] == 't')
+		{
+			ObjFloat2 uv = { 0, 0 };
+			sscanf_s(chars, "vt %f %f", &uv.x, &uv.y);
+			uvs.push_back(uv);
+		}
+		else if (chars[0] == 'v')
+		{
+			ObjFloat3 pos = { 0, 0, 0 };
+			sscanf_s(chars, "v %f %f %f", &pos.x, &pos.y, &pos.z);
+			positions.push_back(pos);
+		}
+		else if (chars[0] == 'f')
+		{
+			unsigned int i[12] = {};
+			int facesRead = sscanf_s(
+				chars,
+				"f %d/%d/%d %d/%d/%d %d/%d/%d %d/%d/%d",
+				&i[0], &i[1], &i[2],
+				&i[3], &i[4], &i[5],
+				&i[6], &i[7], &i[8],
+				&i[9], &i[10], &i[11]);
+
+			ObjVertex v[4] = {};
+			for (int k = 0; k < (facesRead == 12 ? 4 : 3); k++)
+			{
+				v[k].Position = positions[std::max(i[k * 3] - 1, 0u)];
+				v[k].UV = uvs[std::max(i[k * 3 + 1] - 1, 0u)];
+				v[k].Normal = normals[std::max(i[k * 3 + 2] - 1, 0u)];
+				v[k].UV.y = 1.0f - v[k].UV.y;
+				v[k].Position.z *= -1.0f;
+				v[k].Normal.z *= -1.0f;
+			}
+
+			verts.push_back(v[0]);
+			verts.push_back(v[2]);
+			verts.push_back(v[1]);
+			if (facesRead == 12)
+			{
+				verts.push_back(v[0]);
+				verts.push_back(v[3]);
+				verts.push_back(v[2]);
+			}
+			while (vertCounter < verts.size())
+				indices.push_back(vertCounter++);
+		}
+	}
+
+	return true;
+}
+
+// --------------------------------------------------------
+// Writes a torus of segments x segments quads with
+// positions, UVs and normals
+// --------------------------------------------------------
+void WriteTorus(const std::filesystem::path& path, int segments)
+{
+	std::ofstream out(path, std::ios::binary);
+	out << std::fixed << std::setprecision(6);
+	const float pi = 3.14159265f;
+
+	for (int pass = 0; pass < 3; pass++)
+	{
+		for (int i = 0; i < segments; i++)
+		{
+			for (int j = 0; j < segments; j++)
+			{
+				float u = 2 * pi * i / segments;
+				float w = 2 * pi * j / segments;
+				float nx = std::cos(u) * std::cos(w), ny = std::sin(w), nz = std::sin(u) * std::cos(w);
+				if (pass == 0)
+					out << "v " << std::cos(u) + 0.25f * nx << ' ' << 0.25f * ny << ' ' << std::sin(u) + 0.25f * nz << '\n';
+				else if (pass == 1)
+					out << "vt " << float(i) / segments << ' ' << float(j) / segments << '\n';
+				else
+					out << "vn " << nx << ' ' << ny << ' ' << nz << '\n';
+			}
+		}
+	}
+
+	for (int i = 0; i < segments; i++)
+	{
+		for (int j = 0; j < segments; j++)
+		{
+			int corners[4] = {
+				i * segments + j + 1,
+				((i + 1) % segments) * segments + j + 1,
+				((i + 1) % segments) * segments + (j + 1) % segments + 1,
+				i * segments + (j + 1) % segments + 1 };
+			out << 'f';
+			for (int c : corners)
+				out << ' ' << c << '/' << c << '/' << c;
+			out << '\n';
+		}
+	}
+}
+
+// --------------------------------------------------------
+// Best time of a few runs, in milliseconds
+// --------------------------------------------------------
+template<typename Work>
+double BestMs(Work work, int rounds = 3)
+{
+	double best = 1e30;
+	for (int r = 0; r < rounds; r++)
+	{
+		auto start = std::chrono::steady_clock::now();
+		work();
+		best = std::min(best, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+	}
+	return best;
+}
+
+int main(int argc, char* argv[])
+{
+	int segments = 600;
+	std::vector<std::filesystem::path> models;
+	for (int i = 1; i < argc; i++)
+	{
+		if (std::string(argv[i]) == "--segments" && i + 1 < argc)
+			segments = std::stoi(argv[++i]);
+		else
+			models.push_back(argv[i]);
+	}
+
+	std::filesystem::path generated;
+	if (models.empty())
+	{
+		generated = std::filesystem::temp_directory_path() / "ObjBenchmarkTorus.obj";
+		WriteTorus(generated, segments);
+		models.push_back(generated);
+	}
+
+	unsigned int threads = std::max(1u, std::thread::hardware_concurrency());
+	std::cout << std::fixed << std::setprecision(1);
+	for (const std::filesystem::path& model : models)
+	{
+		double mb = std::filesystem::file_size(model) / (1024.0 * 1024.0);
+
+		std::vector<ObjVertex> legacyVerts;
+		std::vector<unsigned int> legacyIndices;
+		double legacyMs = BestMs([&]() { LegacyLoad(model, legacyVerts, legacyIndices); });
+
+		ObjParser single(1);
+		double singleMs = BestMs([&]() { single.ParseFile(model); });
+		ObjParser parallel(threads);
+		double parallelMs = BestMs([&]() { parallel.ParseFile(model); });
+		if (!parallel.GetError().empty())
+		{
+			std::cout << model.string() << ": " << parallel.GetError() << "\n";
+			continue;
+		}
+
+		const std::vector<ObjVertex>& verts = parallel.GetVertices();
+		bool identical = verts.size() == legacyVerts.size() && parallel.GetIndices() == legacyIndices &&
+			memcmp(verts.data(), legacyVerts.data(), verts.size() * sizeof(ObjVertex)) == 0 &&
+			single.GetVertices().size() == verts.size() &&
+			memcmp(single.GetVertices().data(), verts.data(), verts.size() * sizeof(ObjVertex)) == 0;
+
+		std::cout << model.filename().string() << ": " << mb << " MB, " << verts.size() / 3 << " triangles\n"
+			<< "  legacy loader:          " << legacyMs << " ms, " << mb * 1000 / legacyMs << " MB/s\n"
+			<< "  ObjParser, 1 thread:    " << singleMs << " ms, " << mb * 1000 / singleMs << " MB/s\n"
+			<< "  ObjParser, " << threads << " threads:   " << parallelMs << " ms, " << mb * 1000 / parallelMs << " MB/s ("
+			<< parallel.GetChunkCount() << " chunks)\n"
+			<< "  same vertices as the legacy loader: " << (identical ? "yes" : "no") << "\n";
+	}
+
+	if (!generated.empty())
+		std::filesystem::remove(generated);
+	return 0;
+}
@@ -3,73 +3,559 @@
 
 //#include "rtweekend.h"
 
+#include "accelerator.h"
+#include "benchmark.h"
+#include "bvh.h"
 #include "camera.h"
+#include "distributed.h"
 #include "hittable_list.h"
+#include "numa.h"
+#include "numa_replicas.h"
+#include "preview_stream.h"
+#include "render_server.h"
 #include "sphere.h"
+#include "scene.h"
+#include "scene_generator.h"
+#include "sequence.h"
 
 #include "material.h"
 
-int main() {
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+struct render_options {
+    int image_width = 0;         // Overrides the scene's camera when non-zero
+    int samples_per_pixel = 0;   // Overrides the scene's camera when non-zero
+    std::string heatmap_prefix;  // Cost heatmaps to write when built with RT_STATS
+    int tile_size = 0;           // Overrides the camera's tile size when non-zero
+    std::string traversal;       // Overrides the camera's tile order when non-empty
+    int thread_count = 0;        // Render threads; 0 uses every hardware thread
+    double time_budget_ms = 0;   // Progressive rendering within this budget when non-zero
+    int band_height = 0;         // Stream the image out in bands of this many rows when non-zero
+    bool binary_output = false;  // Binary P6 rather than text P3
+    bool sort_rays = false;      // Trace tiles a bounce at a time with sorted rays
+    bool guide_paths = false;    // Learn incident light during the render and guide diffuse bounces
+    bool cache_radiance = false; // End paths at their second diffuse hit on cached irradiance
+    int cache_rays = 0;          // Overrides the rays per cache record when non-zero
+    double cache_error = 0;      // Overrides the cache record radius factor when non-zero
+    double cache_spacing = 0;    // Overrides the largest cache record radius when non-zero
+    double exposure = 0;         // Stops of exposure applied before writing when non-zero
+    bool bloom = false;          // Bloom the light above bloom_threshold
+    double bloom_threshold = 0;  // Overrides the bloom threshold when non-zero
+    double bloom_strength = 0;   // Overrides the bloom strength when non-zero
+    bool tonemap = false;        // ACES filmic tonemapping before gamma
+    int preview_port = 0;        // Stream a live preview to a viewer on this port when non-zero
+    bool numa = false;           // Pin render threads per NUMA node and give each node a replica of the world
+    int numa_nodes = 0;          // With numa, split the hardware threads into this many nodes when non-zero
+    std::string environment_path;  // Replaces the scene's environment map when non-empty
+    std::string env_sampling;      // Overrides the scene's environment sampling when non-empty
+    std::string light_selection;   // Overrides the scene's light selection when non-empty
+    int64_t photon_count = -1;     // Overrides the scene's caustic photon count when not negative
+    int photon_gather = 0;         // Overrides the photons gathered per diffuse hit when non-zero
+    double photon_radius = 0;      // Overrides the largest gather radius when non-zero
+    bool shutter = false;          // Overrides the scene's shutter with shutter_open..shutter_close
+    double shutter_open = 0;
+    double shutter_close = 0;
+    accelerator structure = accelerator::bvh;   // What the render traces the world through
+};
+
+// Loads a scene file, or generates one from a generator spec ("rooms" for the two-room scene),
+// or falls back to the demo scene.
+scene load_scene(const std::string& path, const std::string& generator_spec = "") {
+    if (generator_spec == "rooms")
+        return two_rooms_scene();
+    if (!generator_spec.empty())
+        return generate_scene(generator_settings::parse(generator_spec));
+    if (path.empty())
+        return random_spheres_scene();
+
+    auto start = std::chrono::steady_clock::now();
+    auto s = scene::load(path);
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    std::clog << "Loaded " << path << ": " << s.primitive_count() << " primitives in "
+              << elapsed.count() << " ms\n";
+    return s;
+}
+
+// Applies the command line's camera overrides to the scene.
+void apply_options(scene& s, const render_options& options) {
+    if (options.image_width > 0) s.cam.image_width = options.image_width;
+    if (options.samples_per_pixel > 0) s.cam.samples_per_pixel = options.samples_per_pixel;
+    s.cam.heatmap_prefix = options.heatmap_prefix;
+    if (options.tile_size > 0) s.cam.tile_size = options.tile_size;
+    if (!options.traversal.empty()) s.cam.order = parse_tile_order(options.traversal);
+    s.cam.thread_count = options.thread_count;
+    if (options.time_budget_ms > 0) s.cam.time_budget_ms = options.time_budget_ms;
+    if (options.band_height > 0) s.cam.band_height = options.band_height;
+    if (options.binary_output) s.cam.binary_output = true;
+    if (options.sort_rays) s.cam.sort_rays = true;
+    if (options.guide_paths) s.cam.guide_paths = true;
+    if (options.cache_radiance) s.cam.cache_radiance = true;
+    if (options.cache_rays > 0) s.cam.cache_rays = options.cache_rays;
+    if (options.cache_error > 0) s.cam.cache_error = options.cache_error;
+    if (options.cache_spacing > 0) s.cam.cache_spacing = options.cache_spacing;
+    if (options.exposure != 0) s.cam.post.exposure = options.exposure;
+    if (options.bloom) s.cam.post.bloom = true;
+    if (options.bloom_threshold > 0) s.cam.post.bloom_threshold = options.bloom_threshold;
+    if (options.bloom_strength > 0) s.cam.post.bloom_strength = options.bloom_strength;
+    if (options.tonemap) s.cam.post.tonemap = true;
+    if (!options.env_sampling.empty()) s.cam.env_sampling = parse_environment_sampling(options.env_sampling);
+    if (!options.light_selection.empty()) s.cam.light_mode = parse_light_selection(options.light_selection);
+    if (options.photon_count >= 0) s.photon_count = uint64_t(options.photon_count);
+    if (options.photon_gather > 0) s.photon_gather = uint32_t(options.photon_gather);
+    if (options.photon_radius > 0) s.photon_radius = options.photon_radius;
+    if (options.shutter) {
+        s.cam.shutter_open = options.shutter_open;
+        s.cam.shutter_close = options.shutter_close;
+    }
+    if (!options.environment_path.empty() && options.environment_path != s.environment_path) {
+        // Absolute, so distributed workers find it from their own directories.
+        s.environment_path = std::filesystem::absolute(options.environment_path).string();
+        s.load_environment();
+    }
+}
+
+// Renders the scene to a PPM file, or to stdout when no output path is given.
+void render_scene(scene& s, const std::string& output_path, const render_options& options) {
+    apply_options(s, options);
+
     hittable_list world;
+    s.build_world(world);
 
-    auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
-    world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, ground_material));
-
-    for (int a = -11; a < 11; a++) {
-        for (int b = -11; b < 11; b++) {
-            auto choose_mat = random_double();
-            point3 center(a + 0.9 * random_double(), 0.2, b + 0.9 * random_double());
-
-            if ((center - point3(4, 0.2, 0)).length() > 0.9) {
-                shared_ptr<material> sphere_material;
-
-                if (choose_mat < 0.8) {
-                    // diffuse
-                    auto albedo = color::random() * color::random();
-                    sphere_material = make_shared<lambertian>(albedo);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                }
-                else if (choose_mat < 0.95) {
-                    // metal
-                    auto albedo = color::random(0.5, 1);
-                    auto fuzz = random_double(0, 0.5);
-                    sphere_material = make_shared<metal>(albedo, fuzz);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                }
-                else {
-                    // glass
-                    sphere_material = make_shared<dielectric>(1.5);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                }
-            }
+    auto start = std::chrono::steady_clock::now();
+    auto accelerated = build_accelerator(options.structure, world, interval(s.cam.shutter_open, s.cam.shutter_close));
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    std::clog << "Built " << accelerator_name(options.structure) << " over " << world.objects.size() << " objects in "
+              << elapsed.count() << " ms\n";
+
+    std::unique_ptr<numa_replicas> replicas;
+    if (options.numa) {
+        auto topology = numa_topology::detect();
+        if (options.numa_nodes > 0)
+            topology = topology.split(options.numa_nodes);
+        s.cam.numa = make_shared<const numa_topology>(topology);
+        if (topology.node_count() > 1) {
+            start = std::chrono::steady_clock::now();
+            replicas.reset(new numa_replicas(s, topology, options.structure, interval(s.cam.shutter_open, s.cam.shutter_close)));
+            s.cam.node_worlds = replicas->worlds();
+            elapsed = std::chrono::steady_clock::now() - start;
+            std::clog << "Replicated the world on " << topology.node_count() << " NUMA nodes in " << elapsed.count() << " ms\n";
         }
+        else {
+            std::clog << "One NUMA node: rendering without NUMA placement\n";
+        }
+    }
+
+    std::unique_ptr<preview_stream> preview;
+    if (options.preview_port > 0) {
+        preview.reset(new preview_stream(options.preview_port, s.cam.image_width, s.cam.pixel_height()));
+        auto stream = preview.get();
+        s.cam.on_tile = [stream](const tile& t, const std::vector<color>& pixels, double done) { stream->update(t, pixels, done); };
+        std::clog << "Streaming a preview on port " << preview->port() << " (watch it with --watch " << preview->port() << " <image.ppm>)\n";
+    }
+
+    if (output_path.empty()) {
+#ifdef _WIN32
+        if (s.cam.binary_output)
+            _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        s.cam.render(*accelerated, std::cout);
+    }
+    else {
+        std::ofstream out(output_path, std::ios::binary);
+        if (!out)
+            throw std::runtime_error("cannot write image '" + output_path + "'");
+        s.cam.render(*accelerated, out);
     }
 
-    auto material1 = make_shared<dielectric>(1.5);
-    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
+    if (preview) {
+        preview->finish();
+        std::clog << "Preview sent " << preview->messages_sent() << " messages, " << preview->bytes_sent() << " bytes\n";
+    }
+}
+
+// Each non-blank line of a batch file is "<scene file> <output image>"; '#' starts a comment.
+void render_batch(const std::string& batch_path, const render_options& options) {
+    std::ifstream in(batch_path);
+    if (!in)
+        throw std::runtime_error("cannot open batch file '" + batch_path + "'");
+
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string scene_path, output_path;
+        if (!(fields >> scene_path) || scene_path[0] == '#')
+            continue;
+        if (!(fields >> output_path))
+            throw std::runtime_error(batch_path + ": missing output image for '" + scene_path + "'");
+
+        auto s = load_scene(scene_path);
+        render_scene(s, output_path, options);
+    }
+}
+
+void print_usage() {
+    std::cerr <<
+        "Usage: OfflineRayTracing [options]\n"
+        "  --scene <file>       Scene to render (.rts text or .rtsb binary); defaults to the built-in demo\n"
+        "  --generate <spec>    Generate a stress scene, e.g. spheres=100000,distribution=clustered,layers=4,\n"
+        "                       metal=0.15,glass=0.05,clusters=32,seed=1\n"
+        "                       (lights=<n> adds emitters, motion=<fraction> moves that share of the spheres)\n"
+        "                       or \"rooms\" for two rooms lit through a doorway\n"
+        "  --output <file>      PPM image to write; defaults to stdout\n"
+        "  --batch <file>       Render every \"<scene> <output>\" line of the file in this process\n"
+        "  --sequence <file>    Render the frames of an animation (camera path, frame range, output\n"
+        "                       pattern; see sequence.h) in this process, frames overlapping\n"
+        "  --frames <first> <last>  Override the sequence's frame range\n"
+        "  --save-scene <file>  Write the selected scene (.rtsb binary, otherwise text) instead of rendering\n"
+        "  --width <pixels>     Override the camera's image_width\n"
+        "  --spp <samples>      Override the camera's samples_per_pixel\n"
+        "  --heatmap <prefix>   Write per-pixel cost heatmaps (needs a build with RT_STATS defined)\n"
+        "  --tile-size <pixels> Edge length of the square tiles render threads take (default 16)\n"
+        "  --tile-order <order> Tile traversal: hilbert (default), morton or scanline\n"
+        "  --threads <count>    Render threads; defaults to every hardware thread\n"
+        "  --time-budget <s>    Render progressive passes for this many seconds instead of a fixed spp\n"
+        "  --band-height <rows> Render and write the image this many rows at a time to bound memory\n"
+        "  --binary-ppm         Write a binary P6 image instead of text P3\n"
+        "  --sort-rays          Trace each tile a bounce at a time, sorting rays by origin and direction\n"
+        "  --guide              Learn where light comes from over doubling passes and guide diffuse bounces\n"
+        "  --radiance-cache     End paths at their second diffuse hit on irradiance cached in world space\n"
+        "  --cache-rays <n>     Rays that compute each cache record (default 64; more is smoother and slower)\n"
+        "  --cache-error <e>    Record radius over the mean distance to nearby surfaces (default 0.5;\n"
+        "                       larger reuses records further and is faster and blurrier)\n"
+        "  --cache-spacing <f>  Largest record radius as a share of the scene's diagonal (default 0.02)\n"
+        "  --exposure <stops>   Scale the linear image by 2^stops before writing it\n"
+        "  --bloom              Spread light above the bloom threshold over a pyramid of blurs (whole images only)\n"
+        "  --bloom-threshold <l>  Luminance above which pixels bloom (default 1)\n"
+        "  --bloom-strength <s>   Share of the light above the threshold that blooms (default 0.1)\n"
+        "  --tonemap            Roll highlights off with the ACES filmic curve instead of clipping them\n"
+        "  --preview <port>     Stream tiles as they finish to a viewer on this machine (see preview_stream.h)\n"
+        "  --watch <port> <image.ppm>  Reference viewer: follow a --preview render, rewriting the image as it goes\n"
+        "  --numa               Pin render threads to NUMA nodes, give each node its own copy of the world\n"
+        "                       and hand out tiles node by node (one node on machines without NUMA)\n"
+        "  --numa-nodes <n>     With --numa, treat the hardware threads as n nodes, e.g. to try it on one socket\n"
+        "  --environment <file> Light the scene with an equirectangular .hdr or .pfm map\n"
+        "  --env-sampling <s>   How diffuse hits find the environment: importance (default), uniform or bsdf\n"
+        "  --light-selection <s> How diffuse hits pick an emitter to sample: tree (default), uniform or bsdf\n"
+        "  --photons <count>    Trace this many caustic photons before rendering (0 turns the pass off)\n"
+        "  --photon-gather <k>  Photons each diffuse hit gathers for its caustics (default 64)\n"
+        "  --photon-radius <r>  Largest gather radius (default: a quarter of the specular spheres' radius)\n"
+        "  --shutter <open> <close>  Spread camera rays over this time so moving objects blur\n"
+        "  --accelerator <a>    Structure rays traverse: bvh (default), grid or grid2 (two-level grid)\n"
+        "  --distribute <dir>   Render through a shared work directory, leasing tiles to worker processes\n"
+        "  --workers <count>    Local worker processes to start (default: one per hardware thread;\n"
+        "                       0 waits for workers started elsewhere with --worker)\n"
+        "  --lease-timeout <s>  Re-lease a worker's tiles after this long without a heartbeat (default 10)\n"
+        "  --worker <dir>       Render tiles leased from a shared work directory until the frame is done\n"
+        "  --worker-id <id>     Name of this worker in lease files; random by default\n"
+        "  --make-texture <image.ppm> <out.rtx>  Convert a PPM image into a tiled, mip-mapped texture\n"
+        "  --texture-cache-mb <n>  Memory for texture tiles shared by all textures (default 64)\n"
+        "  --serve              Keep scenes resident and render requests read from stdin (see render_server.h)\n"
+        "  --server-jobs <n>    Renders the server runs concurrently (default 2)\n"
+        "  --benchmark          Time the standard scenes under fixed cameras and print JSON lines\n"
+        "  --benchmark-scene <spec>         Benchmark this generator spec (or \"demo\") instead; repeatable\n"
+        "  --benchmark-max-spheres <count>  Largest sphere count in the standard suite (default 1e6)\n"
+        "  --benchmark-output <file>        Write benchmark results to a file instead of stdout\n"
+        "  --benchmark-tiles                Render every view in row order and in Morton and Hilbert\n"
+        "                                   tiles of several sizes, with cache misses where perf is available\n"
+        "  --benchmark-grids                Render every view through the BVH, the grid and the two-level grid\n"
+        "  --benchmark-noise                Time Perlin noise, fBm and turbulence in ns per evaluation\n"
+        "  --benchmark-media                Time finding collisions in voxel smoke in ns per volume ray:\n"
+        "                                   delta tracking with a majorant grid, with one majorant, and marching\n"
+        "  --benchmark-post                 Time each post-processing stage on a synthetic HDR image at 1080p,\n"
+        "                                   4K and --width if given, against scalar per-pixel doubles\n"
+        "  --benchmark-jobs                 Run library render jobs on a shared pool: one, two at once, and one\n"
+        "                                   cancelled a quarter through, timing how soon it stops\n"
+        "  --benchmark-environment <map>    Compare environment sampling strategies: RMS error against spp\n"
+        "  --benchmark-lights <spec>        Compare light selection at equal render time on a generated scene\n"
+        "                                   with emitters, e.g. spheres=2000,lights=1000\n"
+        "  --benchmark-motion <spec>        Time BVH rebuilds against refits over 240 frames of a generated\n"
+        "                                   scene with moving spheres, e.g. spheres=100000,motion=0.5\n"
+        "  --benchmark-sorting <spec>       Compare ray throughput with and without --sort-rays at depths 1 to 8\n"
+        "                                   on a generated scene, or \"demo\" for the random spheres scene\n"
+        "  --benchmark-numa <spec>          Compare rendering a generated scene (or \"demo\") without NUMA placement,\n"
+        "                                   with node-local tiles over one world and with a world per node,\n"
+        "                                   with each node's Mrays/s (--numa-nodes splits one node to try it)\n"
+        "  --benchmark-guiding              Compare the noise of unguided and guided renders of the two-room\n"
+        "                                   scene at equal render time (--width and --time-budget apply)\n";
+}
+
+int main(int argc, char* argv[]) {
+    std::string scene_path, generator_spec, output_path, batch_path, save_path, sequence_path;
+    int first_frame = 0, last_frame = -1;
+    render_options options;
+    benchmark_options bench_options;
+    bool run_benchmark = false;
+    bool run_noise_benchmark = false;
+    bool run_media_benchmark = false;
+    bool run_post_benchmark = false;
+    bool run_jobs_benchmark = false;
+    std::string environment_benchmark_map;
+    std::string lights_benchmark_spec;
+    std::string motion_benchmark_spec;
+    std::string sorting_benchmark_spec;
+    std::string numa_benchmark_spec;
+    bool run_guiding_benchmark = false;
+    distributed_options distribute_options;
+    distribute_options.executable = argv[0];
+    distribute_options.local_workers = std::max(1, int(std::thread::hardware_concurrency()));
+    std::string worker_dir, worker_id;
+    server_options serve_options;
+    bool serve = false;
+    std::string texture_image, texture_output;
+    int watch_port = 0;
+    std::string watch_path;
+
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            auto value = [&]() -> std::string {
+                if (i + 1 >= argc)
+                    throw std::runtime_error("missing value for " + arg);
+                return argv[++i];
+            };
+
+            if (arg == "--scene")           scene_path = value();
+            else if (arg == "--generate")   generator_spec = value();
+            else if (arg == "--output")     output_path = value();
+            else if (arg == "--batch")      batch_path = value();
+            else if (arg == "--sequence")   sequence_path = value();
+            else if (arg == "--frames") {
+                first_frame = std::stoi(value());
+                last_frame = std::stoi(value());
+            }
+            else if (arg == "--save-scene") save_path = value();
+            else if (arg == "--width")      options.image_width = std::stoi(value());
+            else if (arg == "--spp")        options.samples_per_pixel = std::stoi(value());
+            else if (arg == "--heatmap")    options.heatmap_prefix = value();
+            else if (arg == "--tile-size")  options.tile_size = std::stoi(value());
+            else if (arg == "--tile-order") options.traversal = value();
+            else if (arg == "--threads")    options.thread_count = std::stoi(value());
+            else if (arg == "--time-budget") options.time_budget_ms = 1000 * std::stod(value());
+            else if (arg == "--band-height") options.band_height = std::stoi(value());
+            else if (arg == "--binary-ppm")  options.binary_output = true;
+            else if (arg == "--sort-rays")   options.sort_rays = true;
+            else if (arg == "--guide")       options.guide_paths = true;
+            else if (arg == "--radiance-cache") options.cache_radiance = true;
+            else if (arg == "--cache-rays")    options.cache_rays = std::stoi(value());
+            else if (arg == "--cache-error")   options.cache_error = std::stod(value());
+            else if (arg == "--cache-spacing") options.cache_spacing = std::stod(value());
+            else if (arg == "--exposure")      options.exposure = std::stod(value());
+            else if (arg == "--bloom")         options.bloom = true;
+            else if (arg == "--bloom-threshold") options.bloom_threshold = std::stod(value());
+            else if (arg == "--bloom-strength")  options.bloom_strength = std::stod(value());
+            else if (arg == "--tonemap")       options.tonemap = true;
+            else if (arg == "--preview")       options.preview_port = std::stoi(value());
+            else if (arg == "--numa")          options.numa = true;
+            else if (arg == "--numa-nodes")    options.numa_nodes = std::stoi(value());
+            else if (arg == "--watch") {
+                watch_port = std::stoi(value());
+                watch_path = value();
+            }
+            else if (arg == "--environment")   options.environment_path = value();
+            else if (arg == "--env-sampling")  options.env_sampling = value();
+            else if (arg == "--light-selection") options.light_selection = value();
+            else if (arg == "--photons")       options.photon_count = int64_t(std::stod(value()));
+            else if (arg == "--photon-gather") options.photon_gather = std::stoi(value());
+            else if (arg == "--photon-radius") options.photon_radius = std::stod(value());
+            else if (arg == "--shutter") {
+                options.shutter = true;
+                options.shutter_open = std::stod(value());
+                options.shutter_close = std::stod(value());
+            }
+            else if (arg == "--accelerator")   options.structure = parse_accelerator(value());
+            else if (arg == "--distribute")    distribute_options.work_dir = value();
+            else if (arg == "--workers")       distribute_options.local_workers = std::stoi(value());
+            else if (arg == "--lease-timeout") distribute_options.lease_timeout_s = std::stod(value());
+            else if (arg == "--worker")        worker_dir = value();
+            else if (arg == "--worker-id")     worker_id = value();
+            else if (arg == "--make-texture") {
+                texture_image = value();
+                texture_output = value();
+            }
+            else if (arg == "--texture-cache-mb") texture_cache::global().set_capacity(size_t(std::stod(value()) * (1 << 20)));
+            else if (arg == "--serve")         serve = true;
+            else if (arg == "--server-jobs")   serve_options.job_count = std::stoi(value());
+            else if (arg == "--benchmark")  run_benchmark = true;
+            else if (arg == "--benchmark-scene")       bench_options.scenes.push_back(value());
+            else if (arg == "--benchmark-max-spheres") bench_options.max_spheres = size_t(std::stod(value()));
+            else if (arg == "--benchmark-output")      bench_options.output_path = value();
+            else if (arg == "--benchmark-noise")       run_noise_benchmark = true;
+            else if (arg == "--benchmark-media")       run_media_benchmark = true;
+            else if (arg == "--benchmark-post")        run_post_benchmark = true;
+            else if (arg == "--benchmark-jobs")        run_jobs_benchmark = true;
+            else if (arg == "--benchmark-environment") environment_benchmark_map = value();
+            else if (arg == "--benchmark-lights")      lights_benchmark_spec = value();
+            else if (arg == "--benchmark-motion")      motion_benchmark_spec = value();
+            else if (arg == "--benchmark-numa")        numa_benchmark_spec = value();
+            else if (arg == "--benchmark-sorting")     sorting_benchmark_spec = value();
+            else if (arg == "--benchmark-guiding")     run_guiding_benchmark = true;
+            else if (arg == "--benchmark-tiles")       bench_options.tile_configs = benchmark::tile_sweep();
+            else if (arg == "--benchmark-grids")       bench_options.accelerators = { accelerator::bvh, accelerator::grid, accelerator::grid2 };
+            else {
+                print_usage();
+                return arg == "--help" ? 0 : 1;
+            }
+        }
+
+#ifndef RT_STATS
+        if (!options.heatmap_prefix.empty())
+            std::clog << "Ignoring --heatmap: statistics are compiled out (define RT_STATS to enable them)\n";
+#endif
+
+        if (run_noise_benchmark) {
+            benchmark::run_noise(std::cout);
+            return 0;
+        }
+
+        if (run_media_benchmark) {
+            benchmark::run_media(std::cout);
+            return 0;
+        }
 
-    auto material2 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
-    world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
+        if (run_post_benchmark) {
+            benchmark::run_post(std::cout, options.thread_count, options.image_width);
+            return 0;
+        }
 
-    auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-    world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
+        if (run_jobs_benchmark) {
+            benchmark::run_jobs(std::cout, options.thread_count);
+            return 0;
+        }
 
-    camera cam;
+        if (!environment_benchmark_map.empty()) {
+            benchmark::run_environment(std::cout, environment_benchmark_map, options.thread_count);
+            return 0;
+        }
 
-    cam.aspect_ratio = 16.0 / 9.0;
-    cam.image_width = 1200;
-    cam.samples_per_pixel = 10;
-    cam.max_depth = 50;
+        if (!lights_benchmark_spec.empty()) {
+            benchmark::run_lights(std::cout, lights_benchmark_spec, options.thread_count);
+            return 0;
+        }
 
-    cam.vfov = 20;
-    cam.lookfrom = point3(13, 2, 3);
-    cam.lookat = point3(0, 0, 0);
-    cam.vup = vec3(0, 1, 0);
+        if (!motion_benchmark_spec.empty()) {
+            benchmark::run_motion(std::cout, motion_benchmark_spec, options.thread_count);
+            return 0;
+        }
 
-    cam.defocus_angle = 0.6;
-    cam.focus_dist = 10.0;
+        if (!sorting_benchmark_spec.empty()) {
+            benchmark::run_sorting(std::cout, sorting_benchmark_spec, options.thread_count,
+                                   options.image_width > 0 ? options.image_width : 320,
+                                   options.samples_per_pixel > 0 ? options.samples_per_pixel : 4,
+                                   options.tile_size > 0 ? options.tile_size : 16);
+            return 0;
+        }
+
+        if (!numa_benchmark_spec.empty()) {
+            benchmark::run_numa(std::cout, numa_benchmark_spec, options.thread_count, options.numa_nodes,
+                                options.image_width > 0 ? options.image_width : 320,
+                                options.samples_per_pixel > 0 ? options.samples_per_pixel : 4);
+            return 0;
+        }
+
+        if (run_guiding_benchmark) {
+            benchmark::run_guiding(std::cout, options.thread_count, options.image_width > 0 ? options.image_width : 96,
+                                   options.time_budget_ms > 0 ? options.time_budget_ms : 4000);
+            return 0;
+        }
+
+        if (run_benchmark) {
+            if (options.image_width > 0) bench_options.image_width = options.image_width;
+            if (options.samples_per_pixel > 0) bench_options.samples_per_pixel = options.samples_per_pixel;
+            bench_options.thread_count = options.thread_count;
+            benchmark(bench_options).run();
+            return 0;
+        }
+
+        if (!texture_image.empty()) {
+            uint32_t width, height;
+            auto rgb = read_ppm(texture_image, width, height);
+            tiled_texture_file::write(texture_output, rgb, width, height);
+            std::clog << "Wrote " << texture_output << ": " << width << 'x' << height << " in tiles\n";
+            return 0;
+        }
 
-    cam.render(world);
+        if (watch_port > 0) {
+            watch_preview(watch_port, watch_path);
+            return 0;
+        }
+
+        if (serve) {
+#ifdef _WIN32
+            _setmode(_fileno(stdout), _O_BINARY);
+#endif
+            serve_options.thread_count = options.thread_count;
+            render_server(serve_options, std::cin, std::cout).run();
+            return 0;
+        }
+
+        if (!worker_dir.empty()) {
+            render_worker(worker_dir, worker_id, options.thread_count > 0 ? options.thread_count : 1).run();
+            return 0;
+        }
+
+        if (!batch_path.empty()) {
+            render_batch(batch_path, options);
+            return 0;
+        }
+
+        if (!sequence_path.empty()) {
+            auto settings = sequence_settings::load(sequence_path);
+            if (last_frame >= first_frame) {
+                settings.first_frame = first_frame;
+                settings.last_frame = last_frame;
+            }
+            auto s = load_scene(scene_path.empty() && generator_spec.empty() ? settings.scene_path : scene_path, generator_spec);
+            apply_options(s, options);
+            sequence_renderer(s, settings, options.thread_count).render();
+            texture_cache::global().report(std::clog);
+            return 0;
+        }
+
+        auto s = load_scene(scene_path, generator_spec);
+        if (!save_path.empty()) {
+            s.save(save_path);
+            return 0;
+        }
+
+        if (!distribute_options.work_dir.empty()) {
+            if (options.numa)
+                throw std::runtime_error("--numa applies to one process and cannot be combined with --distribute");
+            if (options.preview_port > 0)
+                throw std::runtime_error("--preview cannot be combined with --distribute");
+            apply_options(s, options);
+            if (options.tile_size > 0) distribute_options.tile_size = options.tile_size;
+            if (options.thread_count > 0) distribute_options.worker_threads = options.thread_count;
+            std::ofstream file;
+#ifdef _WIN32
+            if (output_path.empty() && s.cam.binary_output)
+                _setmode(_fileno(stdout), _O_BINARY);
+#endif
+            if (!output_path.empty()) {
+                file.open(output_path, std::ios::binary);
+                if (!file)
+                    throw std::runtime_error("cannot write image '" + output_path + "'");
+            }
+            render_coordinator(distribute_options).render(s, output_path.empty() ? std::cout : file);
+            return 0;
+        }
+
+        render_scene(s, output_path, options);
+        texture_cache::global().report(std::clog);
+    }
+    catch (const std::exception& e) {
+        std::cerr << "error: " << e.what() << '\n';
+        return 1;
+    }
 }
 
 // Run program: Ctrl + F5 or Debug > Start Without Debugging menu
@@ -0,0 +1 @@
+#include "aabb.h"
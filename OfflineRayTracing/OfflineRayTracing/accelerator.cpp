@@ -0,0 +1 @@
+#include "accelerator.h"
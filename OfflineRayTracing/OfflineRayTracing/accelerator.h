@@ -0,0 +1,44 @@
+#pragma once
+#ifndef ACCELERATOR_H
+#define ACCELERATOR_H
+
+#include "bvh.h"
+#include "grid.h"
+#include "hittable_list.h"
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+// The structure a render traces the world through.
+enum class accelerator {
+    bvh,        // Binned SAH tree (the default)
+    grid,       // Uniform grid
+    grid2       // Two-level grid: coarse cells, crowded ones with grids of their own
+};
+
+inline accelerator parse_accelerator(const std::string& name) {
+    if (name == "bvh") return accelerator::bvh;
+    if (name == "grid") return accelerator::grid;
+    if (name == "grid2") return accelerator::grid2;
+    throw std::runtime_error("unknown accelerator '" + name + "' (bvh, grid or grid2)");
+}
+
+inline const char* accelerator_name(accelerator kind) {
+    switch (kind) {
+    case accelerator::grid:  return "grid";
+    case accelerator::grid2: return "grid2";
+    default:                 return "bvh";
+    }
+}
+
+// Builds the chosen structure over the world's objects, bounding moving ones during time.
+inline std::unique_ptr<hittable> build_accelerator(accelerator kind, const hittable_list& world, const interval& time) {
+    switch (kind) {
+    case accelerator::grid:  return std::make_unique<grid>(world, time);
+    case accelerator::grid2: return std::make_unique<grid>(world, time, true);
+    default:                 return std::make_unique<bvh>(world, time);
+    }
+}
+
+#endif
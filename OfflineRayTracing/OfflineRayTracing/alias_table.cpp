@@ -0,0 +1 @@
+#include "alias_table.h"
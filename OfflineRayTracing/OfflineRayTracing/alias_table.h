@@ -0,0 +1,88 @@
+#pragma once
+#ifndef ALIAS_TABLE_H
+#define ALIAS_TABLE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Walker's alias method: picks index i with probability weight[i] / sum of weights in O(1),
+// whatever the number of entries, from one uniform random number. Built in O(n) with Vose's
+// two-worklist construction; 12 bytes per entry.
+class alias_table {
+public:
+    alias_table() = default;
+
+    explicit alias_table(const std::vector<double>& weights) {
+        auto n = weights.size();
+        double total = 0;
+        for (auto w : weights)
+            total += w > 0 ? w : 0;
+
+        entries.resize(n);
+        probabilities.resize(n);
+        if (n == 0 || total <= 0) {
+            // Nothing to prefer: fall back to uniform.
+            for (size_t i = 0; i < n; ++i) {
+                entries[i] = { 1, uint32_t(i) };
+                probabilities[i] = float(1.0 / n);
+            }
+            return;
+        }
+
+        // Scale so the average entry is 1; entries below 1 borrow the rest of their slot
+        // from an entry above 1.
+        std::vector<double> scaled(n);
+        std::vector<uint32_t> small, large;
+        for (size_t i = 0; i < n; ++i) {
+            auto p = (weights[i] > 0 ? weights[i] : 0) / total;
+            probabilities[i] = float(p);
+            scaled[i] = p * n;
+            (scaled[i] < 1 ? small : large).push_back(uint32_t(i));
+        }
+
+        while (!small.empty() && !large.empty()) {
+            auto s = small.back(), l = large.back();
+            small.pop_back();
+            entries[s] = { float(scaled[s]), l };
+            scaled[l] -= 1 - scaled[s];
+            if (scaled[l] < 1) {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+        // Whatever is left is 1 up to rounding error.
+        for (auto i : large) entries[i] = { 1, i };
+        for (auto i : small) entries[i] = { 1, i };
+    }
+
+    size_t size() const { return entries.size(); }
+
+    // Index for a uniform random number u in [0, 1).
+    uint32_t sample(double u) const {
+        auto scaled = u * entries.size();
+        auto i = uint32_t(scaled);
+        if (i >= entries.size())
+            i = uint32_t(entries.size() - 1);
+        const auto& e = entries[i];
+        return scaled - i < e.threshold ? i : e.alias;
+    }
+
+    // Probability of sample() returning index i.
+    double probability(uint32_t i) const { return probabilities[i]; }
+
+    size_t memory_bytes() const {
+        return entries.size() * sizeof(entry) + probabilities.size() * sizeof(float);
+    }
+
+private:
+    struct entry {
+        float    threshold;   // Keep i when the fraction within slot i is below this
+        uint32_t alias;       // Otherwise take this index
+    };
+
+    std::vector<entry> entries;
+    std::vector<float> probabilities;
+};
+
+#endif
@@ -0,0 +1 @@
+#include "benchmark.h"
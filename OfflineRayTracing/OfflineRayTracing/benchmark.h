@@ -0,0 +1,942 @@
+#pragma once
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include "rtweekend.h"
+#include "accelerator.h"
+#include "bvh.h"
+#include "camera.h"
+#include "hittable_list.h"
+#include "numa.h"
+#include "numa_replicas.h"
+#include "perlin.h"
+#include "renderer.h"
+#include "scene.h"
+#include "scene_generator.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN   // Leaves out winsock.h, which winsock2.h in preview_stream.h replaces
+#endif
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Memory the whole process holds resident right now, in megabytes. Unlike the peak, it falls
+// again when a scene is freed, so the difference across building one scene is that scene's.
+inline double resident_memory_mb() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return counters.WorkingSetSize / (1024.0 * 1024.0);
+    return 0;
+#else
+    // The second field of statm is the resident size in pages.
+    std::ifstream statm("/proc/self/statm");
+    long pages = 0, resident = 0;
+    if (statm >> pages >> resident)
+        return resident * double(sysconf(_SC_PAGESIZE)) / (1024.0 * 1024.0);
+    return 0;
+#endif
+}
+
+// Counts last-level cache references and misses of this thread and every thread it starts
+// while counting, through Linux perf events. Elsewhere, or when the kernel refuses access
+// (see /proc/sys/kernel/perf_event_paranoid), available() is false and the counts are zero.
+class cache_counters {
+public:
+    cache_counters() {
+#ifdef __linux__
+        references_fd = open_counter(PERF_COUNT_HW_CACHE_REFERENCES);
+        misses_fd = open_counter(PERF_COUNT_HW_CACHE_MISSES);
+#endif
+    }
+
+    ~cache_counters() {
+#ifdef __linux__
+        if (references_fd >= 0) close(references_fd);
+        if (misses_fd >= 0) close(misses_fd);
+#endif
+    }
+
+    cache_counters(const cache_counters&) = delete;
+    cache_counters& operator=(const cache_counters&) = delete;
+
+    bool available() const { return references_fd >= 0 && misses_fd >= 0; }
+
+    void start() {
+#ifdef __linux__
+        for (int fd : { references_fd, misses_fd }) {
+            if (fd < 0) continue;
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    void stop() {
+#ifdef __linux__
+        for (int fd : { references_fd, misses_fd })
+            if (fd >= 0) ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+#endif
+    }
+
+    uint64_t references() const { return read_counter(references_fd); }
+    uint64_t misses() const { return read_counter(misses_fd); }
+
+private:
+    int references_fd = -1;
+    int misses_fd = -1;
+
+#ifdef __linux__
+    static int open_counter(uint64_t config) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.inherit = 1;           // Also count the render threads started while enabled
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        return int(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+#endif
+
+    static uint64_t read_counter(int fd) {
+        uint64_t value = 0;
+#ifdef __linux__
+        if (fd >= 0 && read(fd, &value, sizeof(value)) != sizeof(value))
+            value = 0;
+#endif
+        return value;
+    }
+};
+
+// A stream buffer that accepts and drops everything, so rendered images cost no I/O.
+class discard_buffer : public std::streambuf {
+protected:
+    int overflow(int c) override { return c; }
+    std::streamsize xsputn(const char*, std::streamsize count) override { return count; }
+};
+
+// A tile traversal to compare; see benchmark_options::tile_configs.
+struct tile_config {
+    tile_order order;
+    int tile_size;
+};
+
+struct benchmark_options {
+    std::vector<std::string> scenes;     // Generator specs; empty runs the standard suite
+    size_t max_spheres = 1000000;        // Largest sphere count in the standard suite
+    int    image_width = 320;
+    int    samples_per_pixel = 4;
+    int    max_depth = 8;
+    int    thread_count = 0;             // Render threads; 0 uses every hardware thread
+    std::vector<tile_config> tile_configs = { { tile_order::hilbert, 16 } };  // Each view renders once per entry
+    std::vector<accelerator> accelerators = { accelerator::bvh };              // ... and once per structure
+    std::string output_path;             // JSON lines destination; stdout when empty
+};
+
+class benchmark {
+public:
+    benchmark(const benchmark_options& _options) : options(_options) {}
+
+    // Row order against both space-filling curves at a few tile sizes.
+    static std::vector<tile_config> tile_sweep() {
+        std::vector<tile_config> configs = { { tile_order::scanline, 1 } };
+        for (auto order : { tile_order::morton, tile_order::hilbert })
+            for (int size : { 8, 16, 32, 64 })
+                configs.push_back({ order, size });
+        return configs;
+    }
+
+    // Runs every scene under every fixed camera and writes one JSON object per line.
+    void run() {
+        std::ofstream file;
+        if (!options.output_path.empty()) {
+            file.open(options.output_path);
+            if (!file)
+                throw std::runtime_error("cannot write benchmark results '" + options.output_path + "'");
+        }
+        std::ostream& out = options.output_path.empty() ? std::cout : file;
+
+        auto specs = options.scenes.empty() ? standard_scenes() : options.scenes;
+        for (const auto& spec : specs) {
+            std::clog << "Benchmarking " << spec << '\n';
+
+            auto resident_before = resident_memory_mb();
+            auto start = clock::now();
+            auto s = spec == "demo" ? random_spheres_scene() : generate_scene(generator_settings::parse(spec));
+            auto generate_ms = elapsed_ms(start);
+
+            start = clock::now();
+            hittable_list world;
+            s.build_world(world);
+            auto world_ms = elapsed_ms(start);
+
+            for (auto structure : options.accelerators) {
+                start = clock::now();
+                auto accelerated = build_accelerator(structure, world, interval(s.cam.shutter_open, s.cam.shutter_close));
+                auto build_ms = elapsed_ms(start);
+                // The scene, its world and this structure; earlier structures are freed by now.
+                auto scene_mb = resident_memory_mb() - resident_before;
+
+                for (const auto& view : views(s)) {
+                    for (const auto& config : options.tile_configs) {
+                        camera cam = s.cam;
+                        cam.image_width = options.image_width;
+                        cam.samples_per_pixel = options.samples_per_pixel;
+                        cam.max_depth = options.max_depth;
+                        cam.lookfrom = view.lookfrom;
+                        cam.lookat = view.lookat;
+                        cam.vfov = view.vfov;
+                        cam.defocus_angle = 0;
+                        cam.focus_dist = (view.lookfrom - view.lookat).length();
+                        cam.order = config.order;
+                        cam.tile_size = config.tile_size;
+                        cam.thread_count = options.thread_count;
+                        cam.show_progress = false;
+
+                        cache_counters cache;
+                        discard_buffer buffer;
+                        std::ostream discard(&buffer);
+                        start = clock::now();
+                        cache.start();
+                        cam.render(*accelerated, discard);
+                        cache.stop();
+                        auto render_ms = elapsed_ms(start);
+
+                        auto rays = cam.rays_traced();
+                        out << "{\"scene\":\"" << spec << "\",\"camera\":\"" << view.name << "\""
+                            << ",\"primitives\":" << s.primitive_count()
+                            << ",\"width\":" << cam.image_width
+                            << ",\"spp\":" << cam.samples_per_pixel
+                            << ",\"max_depth\":" << cam.max_depth
+                            << ",\"tile_order\":\"" << tile_order_name(config.order) << "\""
+                            << ",\"tile_size\":" << config.tile_size
+                            << ",\"generate_ms\":" << generate_ms
+                            << ",\"world_ms\":" << world_ms
+                            << ",\"accelerator\":\"" << accelerator_name(structure) << "\""
+                            << ",\"build_ms\":" << build_ms;
+                        if (auto tree = dynamic_cast<const bvh*>(accelerated.get()))
+                            out << ",\"bvh_nodes\":" << tree->node_count() << ",\"bvh_bytes\":" << tree->memory_bytes();
+                        if (auto cells = dynamic_cast<const grid*>(accelerated.get()))
+                            out << ",\"grid_cells\":" << cells->cell_count() << ",\"grid_children\":" << cells->child_count()
+                                << ",\"grid_bytes\":" << cells->memory_bytes();
+                        out << ",\"scene_rss_mb\":" << scene_mb
+                            << ",\"rays\":" << rays
+                            << ",\"render_ms\":" << render_ms
+                            << ",\"mrays_per_s\":" << (render_ms > 0 ? rays / (render_ms * 1000.0) : 0)
+                            << ",\"ns_per_ray\":" << (rays > 0 ? render_ms * 1e6 / rays : 0);
+                        if (cache.available()) {
+                            out << ",\"cache_references\":" << cache.references()
+                                << ",\"cache_misses\":" << cache.misses()
+                                << ",\"cache_misses_per_kray\":" << (rays > 0 ? cache.misses() * 1000.0 / rays : 0);
+                        }
+                        out << "}\n" << std::flush;
+                    }
+                }
+            }
+        }
+    }
+
+    // Times noise evaluation over a fixed set of points and prints one JSON line per variant,
+    // comparing the vectorized octave sums with the scalar ones.
+    static void run_noise(std::ostream& out, int octaves = 7) {
+        perlin noise;
+        rng generator(42);
+        std::vector<point3> points(1 << 16);
+        for (auto& p : points)
+            p = point3(100 * generator.next_double(), 100 * generator.next_double(), 100 * generator.next_double());
+
+        double max_difference = 0;
+        for (const auto& p : points)
+            max_difference = fmax(max_difference, fabs(noise.fbm(p, octaves) - noise.octaves_scalar(p, octaves, false)));
+
+        auto time = [&](const char* name, int evaluations_per_call, auto evaluate) {
+            const int rounds = 16;
+            double sink = 0;
+            auto start = clock::now();
+            for (int round = 0; round < rounds; ++round)
+                for (const auto& p : points)
+                    sink += evaluate(p);
+            auto ms = elapsed_ms(start);
+            auto calls = double(rounds) * points.size();
+            out << "{\"noise\":\"" << name << "\",\"octaves\":" << evaluations_per_call
+                << ",\"ns_per_call\":" << ms * 1e6 / calls
+                << ",\"ns_per_octave\":" << ms * 1e6 / (calls * evaluations_per_call)
+                << ",\"checksum\":" << sink << "}\n";
+        };
+
+        time("noise", 1, [&](const point3& p) { return noise.noise(p); });
+        time("fbm_scalar", octaves, [&](const point3& p) { return noise.octaves_scalar(p, octaves, false); });
+        time("fbm", octaves, [&](const point3& p) { return noise.fbm(p, octaves); });
+        time("turb_scalar", octaves, [&](const point3& p) { return noise.octaves_scalar(p, octaves, true); });
+        time("turb", octaves, [&](const point3& p) { return noise.turb(p, octaves); });
+        out << "{\"noise\":\"vector_vs_scalar\",\"max_difference\":" << max_difference << "}\n" << std::flush;
+    }
+
+    // Times finding where rays collide with smoke in a unit box, at several voxel resolutions, and
+    // prints ns per volume ray as JSON lines for three ways of finding it:
+    // - delta tracking against the majorants of the brick grid (what medium::hit does);
+    // - delta tracking against one majorant for the whole box;
+    // - ray marching in half-voxel steps, summing the optical depth until it passes the one drawn.
+    // The share of rays that collide should agree between them. A constant medium of the smoke's
+    // mean extinction gives the cost of the box alone.
+    static void run_media(std::ostream& out, double density = 8, int ray_count = 1 << 17) {
+        aabb box(point3(-1, -1, -1), point3(1, 1, 1));
+        rng generator(7);
+        std::vector<ray> rays;
+        rays.reserve(size_t(ray_count));
+        for (int i = 0; i < ray_count; ++i) {
+            auto from = 3 * unit_vector(vec3(generator.next_double() - 0.5, generator.next_double() - 0.5, generator.next_double() - 0.5));
+            auto to = point3(2 * generator.next_double() - 1, 2 * generator.next_double() - 1, 2 * generator.next_double() - 1);
+            rays.push_back(ray(from, to - from));
+        }
+
+        auto time = [&](const char* method, int resolution, const hittable& volume) {
+            seed_random(1);
+            hit_record rec;
+            size_t collisions = 0;
+            auto start = clock::now();
+            for (const auto& r : rays)
+                collisions += volume.hit(r, interval(0.001, infinity), rec);
+            auto ms = elapsed_ms(start);
+            out << "{\"method\":\"" << method << "\",\"resolution\":" << resolution
+                << ",\"ns_per_ray\":" << ms * 1e6 / rays.size()
+                << ",\"collided\":" << double(collisions) / rays.size() << "}\n" << std::flush;
+        };
+
+        for (int resolution : { 32, 64, 128, 256 }) {
+            auto start = clock::now();
+            auto grid = smoke_grid(box, resolution, 3, 5);
+            auto build_ms = elapsed_ms(start);
+            double sum = 0;
+            for (int k = 0; k < grid->size_z(); ++k)
+                for (int j = 0; j < grid->size_y(); ++j)
+                    for (int i = 0; i < grid->size_x(); ++i)
+                        sum += grid->value(i, j, k);
+            auto mean = sum / (double(grid->size_x()) * grid->size_y() * grid->size_z());
+            out << "{\"resolution\":" << resolution << ",\"build_ms\":" << build_ms
+                << ",\"bricks\":" << grid->bricks_x() * grid->bricks_y() * grid->bricks_z()
+                << ",\"stored_bricks\":" << grid->stored_bricks()
+                << ",\"brick_bytes\":" << grid->memory_bytes() << ",\"dense_bytes\":" << grid->dense_bytes()
+                << ",\"mean_density\":" << mean << "}\n";
+
+            medium smoke(box, density, color(1, 1, 1), grid);
+            time("majorant_grid", resolution, smoke);
+            smoke.per_brick_majorants = false;
+            time("global_majorant", resolution, smoke);
+            time("ray_march", resolution, marched_medium(box, density, grid));
+            time("constant", resolution, medium(box, density * mean, color(1, 1, 1)));
+        }
+    }
+
+    // Times each post-processing stage on a synthetic HDR image (a dim gradient with scattered
+    // hot pixels) at 1080p, 4K and the given width, and prints JSON lines: the pipeline with every
+    // stage on, and the per-pixel scalar doubles it replaces (exposure, tonemap and gamma one pixel
+    // at a time on one thread, as colorTest::to_bytes does). Without bloom both must produce the
+    // same bytes up to rounding, which max_byte_difference reports.
+    static void run_post(std::ostream& out, int thread_count = 0, int width = 0) {
+        std::vector<int> widths = { 1920, 3840 };
+        if (width > 0 && width != 1920 && width != 3840)
+            widths.push_back(width);
+
+        for (int w : widths) {
+            int h = std::max(1, w * 9 / 16);
+            const int samples = 16;
+            rng generator(11);
+            std::vector<color> sums(size_t(w) * h);
+            for (int y = 0; y < h; ++y)
+                for (int x = 0; x < w; ++x) {
+                    auto hot = generator.next_double() < 0.001 ? 50.0 : 0.0;
+                    sums[size_t(y) * w + x] = samples * (color(double(x) / w, double(y) / h, 0.5) + color(hot, hot, hot));
+                }
+
+            post_process post;
+            post.exposure = 1;
+            post.tonemap = true;
+
+            auto start = clock::now();
+            std::vector<uint8_t> scalar(sums.size() * 3);
+            auto factor = std::pow(2.0, post.exposure) / samples;
+            for (size_t i = 0; i < sums.size(); ++i) {
+                for (int c = 0; c < 3; ++c) {
+                    auto v = std::max(sums[i][c] * factor, 0.0);
+                    v = std::min(v * (2.51 * v + 0.03) / (v * (2.43 * v + 0.59) + 0.14), 1.0);
+                    scalar[3 * i + c] = static_cast<unsigned char>(256 * interval(0, 0.999).clamp(sqrt(v)));
+                }
+            }
+            auto scalar_ms = elapsed_ms(start);
+
+            const auto& pipeline = post.process(sums, w, h, samples, thread_count);
+            int max_difference = 0;
+            for (size_t i = 0; i < scalar.size(); ++i)
+                max_difference = std::max(max_difference, std::abs(int(scalar[i]) - int(pipeline[i])));
+
+            post.bloom = true;
+            post.reset_timings();
+            const int rounds = 3;
+            start = clock::now();
+            for (int round = 0; round < rounds; ++round)
+                post.process(sums, w, h, samples, thread_count);
+            auto total_ms = elapsed_ms(start) / rounds;
+            const auto& t = post.timings();
+            out << "{\"post\":\"scalar\",\"width\":" << w << ",\"height\":" << h << ",\"ms\":" << scalar_ms
+                << ",\"max_byte_difference\":" << max_difference << "}\n";
+            out << "{\"post\":\"pipeline\",\"width\":" << w << ",\"height\":" << h
+                << ",\"resolve_ms\":" << t.resolve_ms / rounds << ",\"exposure_ms\":" << t.exposure_ms / rounds
+                << ",\"bloom_ms\":" << t.bloom_ms / rounds << ",\"tonemap_ms\":" << t.tonemap_ms / rounds
+                << ",\"encode_ms\":" << t.encode_ms / rounds << ",\"total_ms\":" << total_ms
+                << ",\"mpixels_per_s\":" << double(w) * h / (total_ms * 1e3) << "}\n" << std::flush;
+        }
+    }
+
+    // Renders jobs through the library's shared pool and prints JSON lines:
+    // - one job alone, then two of it at once, which should take about twice as long and no
+    //   more, with the image checked against a render on the camera's own threads;
+    // - a job cancelled a quarter of the way through, with the time from cancel() until its
+    //   result is ready and the share of its preview filled in by then (the sky leaves no
+    //   pixel of a finished tile black).
+    // Throws if the cancelled job does not end cancelled.
+    static void run_jobs(std::ostream& out, int thread_count = 0) {
+        renderer r(thread_count);
+        auto prepared = renderer::prepare(random_spheres_scene());
+        auto cam = prepared->cam();
+        cam.image_width = 320;
+        cam.samples_per_pixel = 16;
+        cam.show_progress = false;
+
+        std::ostringstream direct;
+        cam.render(prepared->world(), direct);
+
+        auto start = clock::now();
+        auto solo = r.render(prepared, cam);
+        solo->result().wait();
+        auto solo_ms = elapsed_ms(start);
+
+        start = clock::now();
+        auto first = r.render(prepared, cam);
+        auto second = r.render(prepared, cam);
+        first->result().wait();
+        second->result().wait();
+        auto pair_ms = elapsed_ms(start);
+        bool identical = solo->result().get() == direct.str() && first->result().get() == direct.str()
+                         && second->result().get() == direct.str();
+        out << "{\"jobs\":\"shared_pool\",\"threads\":" << r.thread_count() << ",\"one_job_ms\":" << solo_ms
+            << ",\"two_jobs_ms\":" << pair_ms << ",\"ratio\":" << pair_ms / solo_ms
+            << ",\"identical\":" << (identical ? "true" : "false") << "}\n" << std::flush;
+
+        auto job = r.render(prepared, cam);
+        while (job->progress() < 0.25 && job->state() == job_state::running)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        auto progress = job->progress();
+        start = clock::now();
+        job->cancel();
+        job->result().wait();
+        auto cancel_ms = elapsed_ms(start);
+        auto preview = job->snapshot();
+        auto filled = std::count_if(preview.begin(), preview.end(), [](const color& c) { return c.length_squared() > 0; });
+        out << "{\"jobs\":\"cancel\",\"progress_at_cancel\":" << progress << ",\"cancel_ms\":" << cancel_ms
+            << ",\"one_job_ms\":" << solo_ms << ",\"preview_filled\":" << double(filled) / preview.size() << "}\n" << std::flush;
+        if (job->state() != job_state::cancelled)
+            throw std::runtime_error("the cancelled job ran to the end");
+    }
+
+    // Renders a small diffuse scene lit only by the environment map with each environment
+    // sampling strategy at increasing sample counts, and prints the RMS error of the linear image
+    // against a high-sample importance-sampled reference as JSON lines. Mirrors and glass are
+    // left out: the caustics they focus are found by no strategy here and would swamp the error.
+    static void run_environment(std::ostream& out, const std::string& map_path, int thread_count = 0,
+                                int reference_spp = 1024) {
+        scene s;
+        s.environment_path = map_path;
+        s.load_environment();
+        auto ground = s.add_material("ground", lambertian_material(color(0.5, 0.5, 0.5)));
+        auto diffuse = s.add_material("diffuse", lambertian_material(color(0.7, 0.3, 0.2)));
+        auto pale = s.add_material("pale", lambertian_material(color(0.8, 0.8, 0.8)));
+        auto green = s.add_material("green", lambertian_material(color(0.2, 0.6, 0.3)));
+        s.add_sphere(point3(0, -1000, 0), 1000, ground);
+        s.add_sphere(point3(0, 1, 0), 1, diffuse);
+        s.add_sphere(point3(-2.2, 1, 0.5), 1, pale);
+        s.add_sphere(point3(2.2, 1, -0.5), 1, green);
+
+        hittable_list world;
+        s.build_world(world);
+        bvh accelerated(world);
+
+        camera cam = s.cam;
+        cam.image_width = 96;
+        cam.aspect_ratio = 16.0 / 9.0;
+        cam.max_depth = 8;
+        cam.vfov = 35;
+        cam.lookfrom = point3(0, 2.5, 9);
+        cam.lookat = point3(0, 0.8, 0);
+        cam.thread_count = thread_count;
+        cam.show_progress = false;
+        tile whole = { 0, 0, cam.image_width, cam.pixel_height() };
+
+        auto render = [&](environment_sampling sampling, int spp, double& ms, uint64_t& rays) {
+            cam.env_sampling = sampling;
+            cam.samples_per_pixel = spp;
+            auto start = clock::now();
+            auto sums = cam.render_region(accelerated, whole);
+            ms = elapsed_ms(start);
+            rays = cam.rays_traced();
+            for (auto& c : sums)
+                c = c / spp;
+            return sums;
+        };
+
+        double ms;
+        uint64_t rays;
+        std::clog << "Rendering the " << reference_spp << " spp reference\n";
+        auto reference = render(environment_sampling::importance, reference_spp, ms, rays);
+
+        for (auto sampling : { environment_sampling::bsdf, environment_sampling::uniform, environment_sampling::importance }) {
+            for (int spp = 1; spp <= 256; spp *= 4) {
+                auto image = render(sampling, spp, ms, rays);
+                double squared = 0;
+                for (size_t i = 0; i < image.size(); ++i)
+                    squared += (image[i] - reference[i]).length_squared() / 3;
+                out << "{\"sampling\":\"" << environment_sampling_name(sampling) << "\",\"spp\":" << spp
+                    << ",\"rmse\":" << sqrt(squared / image.size())
+                    << ",\"ms\":" << ms << ",\"rays\":" << rays << "}\n" << std::flush;
+            }
+        }
+    }
+
+    // Renders a generated scene lit by its emissive spheres with each light selection strategy
+    // for the same wall-clock time, and prints the samples each managed and the RMS error of the
+    // linear image against a high-sample light-tree reference as JSON lines. Each strategy's cost
+    // per sample is measured first, so the slower tree traversal pays for itself only if it
+    // lowers the noise by more than the samples it loses. Mirrors and glass are left out, as in
+    // run_environment.
+    static void run_lights(std::ostream& out, const std::string& spec, int thread_count = 0,
+                           double budget_ms = 2000, int reference_spp = 1024) {
+        auto settings = generator_settings::parse(spec);
+        if (settings.light_count == 0)
+            settings.light_count = 1000;
+        settings.metal_fraction = 0;
+        settings.dielectric_fraction = 0;
+        auto s = generate_scene(settings);
+
+        hittable_list world;
+        auto start = clock::now();
+        s.build_world(world);
+        bvh accelerated(world);
+        out << "{\"scene\":\"" << settings.describe() << "\",\"lights\":" << s.cam.lights->size()
+            << ",\"tree_nodes\":" << s.cam.lights->node_count()
+            << ",\"tree_bytes\":" << s.cam.lights->memory_bytes()
+            << ",\"build_ms\":" << elapsed_ms(start) << "}\n" << std::flush;
+
+        camera cam = s.cam;
+        // A close view, so pixels hold a few spheres each rather than whole clusters whose
+        // coverage noise would be the same for every strategy.
+        cam.image_width = 96;
+        cam.max_depth = 2;       // Direct light only: one shadow ray and one bounce per camera hit
+        cam.lookfrom = point3(0, 3, 5);
+        cam.lookat = point3(0, 0.2, 0);
+        cam.vfov = 45;
+        cam.focus_dist = (cam.lookfrom - cam.lookat).length();
+        cam.thread_count = thread_count;
+        cam.show_progress = false;
+        tile whole = { 0, 0, cam.image_width, cam.pixel_height() };
+
+        auto render = [&](light_selection mode, int spp, double& ms) {
+            cam.light_mode = mode;
+            cam.samples_per_pixel = spp;
+            auto begin = clock::now();
+            auto sums = cam.render_region(accelerated, whole);
+            ms = elapsed_ms(begin);
+            for (auto& c : sums)
+                c = c / spp;
+            return sums;
+        };
+
+        // Emitters seen straight from the camera are the same under every strategy, but cover a
+        // fraction of a pixel whose noise would swamp the error; leave out the pixels that see any.
+        double ms;
+        auto depth = cam.max_depth;
+        cam.max_depth = 1;
+        auto direct = render(light_selection::bsdf, 64, ms);
+        cam.max_depth = depth;
+        std::vector<bool> measured(direct.size());
+        size_t measured_count = 0;
+        for (size_t i = 0; i < direct.size(); ++i)
+            if ((measured[i] = direct[i].length_squared() == 0))
+                ++measured_count;
+
+        std::clog << "Rendering the " << reference_spp << " spp reference\n";
+        auto reference = render(light_selection::tree, reference_spp, ms);
+
+        for (auto mode : { light_selection::bsdf, light_selection::uniform, light_selection::tree }) {
+            const int calibration_spp = 4;
+            render(mode, calibration_spp, ms);
+            auto spp = std::max(1, int(budget_ms / (ms / calibration_spp)));
+            auto image = render(mode, spp, ms);
+            double squared = 0;
+            for (size_t i = 0; i < image.size(); ++i)
+                if (measured[i])
+                    squared += (image[i] - reference[i]).length_squared() / 3;
+            out << "{\"selection\":\"" << light_selection_name(mode) << "\",\"spp\":" << spp
+                << ",\"ms\":" << ms << ",\"ns_per_sample\":" << ms * 1e6 / (double(spp) * image.size())
+                << ",\"rmse\":" << sqrt(squared / std::max<size_t>(1, measured_count))
+                << ",\"pixels\":" << measured_count << "}\n" << std::flush;
+        }
+    }
+
+    // Renders the two-room scene, whose near room is lit only through a doorway, without and
+    // with path guiding at equal render time, and prints the RMS error of each against a guided
+    // reference as JSON lines. Guided renders learn over their own passes, which are counted in
+    // their time.
+    static void run_guiding(std::ostream& out, int thread_count = 0, int image_width = 96,
+                            double budget_ms = 4000, int reference_spp = 2048) {
+        auto s = two_rooms_scene();
+        hittable_list world;
+        s.build_world(world);
+        bvh accelerated(world);
+
+        camera cam = s.cam;
+        cam.image_width = image_width;
+        cam.thread_count = thread_count;
+        cam.show_progress = false;
+        tile whole = { 0, 0, cam.image_width, cam.pixel_height() };
+
+        auto render = [&](bool guided, int spp, double& ms) {
+            cam.guide_paths = guided;
+            cam.samples_per_pixel = spp;
+            auto begin = clock::now();
+            auto sums = cam.render_region(accelerated, whole);
+            ms = elapsed_ms(begin);
+            for (auto& c : sums)
+                c = c / spp;
+            return sums;
+        };
+
+        double ms;
+        std::clog << "Rendering the " << reference_spp << " spp reference\n";
+        auto reference = render(true, reference_spp, ms);
+        out << "{\"scene\":\"rooms\",\"width\":" << image_width << ",\"reference_spp\":" << reference_spp
+            << ",\"reference_ms\":" << ms << ",\"budget_ms\":" << budget_ms << "}\n" << std::flush;
+
+        for (bool guided : { false, true }) {
+            // Enough passes that a guided sample costs about what it will once the guide has learned.
+            const int calibration_spp = 32;
+            render(guided, calibration_spp, ms);
+            auto spp = std::max(1, int(budget_ms / (ms / calibration_spp)));
+            auto image = render(guided, spp, ms);
+            double squared = 0;
+            for (size_t i = 0; i < image.size(); ++i)
+                squared += (image[i] - reference[i]).length_squared() / 3;
+            out << "{\"guided\":" << (guided ? "true" : "false") << ",\"spp\":" << spp << ",\"ms\":" << ms
+                << ",\"ns_per_sample\":" << ms * 1e6 / (double(spp) * image.size())
+                << ",\"rmse\":" << sqrt(squared / image.size());
+            if (guided)
+                out << ",\"regions\":" << cam.learned_guide()->region_count()
+                    << ",\"direction_cells\":" << cam.learned_guide()->direction_node_count();
+            out << "}\n" << std::flush;
+        }
+    }
+
+    // Plays a generated scene with moving spheres as an animation of frames, each with its own
+    // shutter, and prints as JSON lines what keeping the BVH up to date costs per frame: a full
+    // rebuild over the frame's shutter against refitting one tree built for the first frame. At a
+    // few frames it also times rendering through the rebuilt tree, the refit one (whose topology
+    // grows stale as spheres drift from where they started) and one tree bounding every
+    // sphere's whole motion, which needs no updates at all.
+    static void run_motion(std::ostream& out, const std::string& spec, int thread_count = 0, int frames = 240) {
+        auto settings = generator_settings::parse(spec);
+        if (settings.motion_fraction == 0)
+            settings.motion_fraction = 0.5;
+        auto s = generate_scene(settings);
+
+        hittable_list world;
+        s.build_world(world);
+        out << "{\"scene\":\"" << settings.describe() << "\",\"objects\":" << world.objects.size()
+            << ",\"moving\":" << s.sphere_motions.size() << ",\"frames\":" << frames << "}\n" << std::flush;
+
+        // The generator moves spheres over [0, 1]; each frame's shutter is open for half its length.
+        auto shutter = [&](int frame) { return interval(double(frame) / frames, (frame + 0.5) / frames); };
+
+        camera cam = s.cam;
+        cam.image_width = 96;
+        cam.samples_per_pixel = 16;
+        cam.max_depth = 4;
+        cam.thread_count = thread_count;
+        cam.show_progress = false;
+        tile whole = { 0, 0, cam.image_width, cam.pixel_height() };
+        auto render_ms = [&](const bvh& tree, int frame) {
+            cam.shutter_open = shutter(frame).min;
+            cam.shutter_close = shutter(frame).max;
+            auto begin = clock::now();
+            cam.render_region(tree, whole);
+            return elapsed_ms(begin);
+        };
+
+        bvh whole_motion(world);
+        bvh refitted(world, shutter(0));
+        double rebuild_total = 0, refit_total = 0;
+        for (int frame = 0; frame < frames; ++frame) {
+            auto begin = clock::now();
+            bvh rebuilt(world, shutter(frame));
+            auto rebuild_ms = elapsed_ms(begin);
+            begin = clock::now();
+            refitted.refit(shutter(frame));
+            auto refit_ms = elapsed_ms(begin);
+            rebuild_total += rebuild_ms;
+            refit_total += refit_ms;
+
+            if (frame % (frames / 4 > 0 ? frames / 4 : 1) == 0 || frame == frames - 1) {
+                out << "{\"frame\":" << frame << ",\"rebuild_ms\":" << rebuild_ms << ",\"refit_ms\":" << refit_ms
+                    << ",\"render_ms_rebuilt\":" << render_ms(rebuilt, frame)
+                    << ",\"render_ms_refit\":" << render_ms(refitted, frame)
+                    << ",\"render_ms_whole_motion\":" << render_ms(whole_motion, frame) << "}\n" << std::flush;
+            }
+        }
+        out << "{\"rebuild_ms_per_frame\":" << rebuild_total / frames << ",\"refit_ms_per_frame\":" << refit_total / frames
+            << ",\"refit_speedup\":" << rebuild_total / std::max(1e-9, refit_total) << "}\n" << std::flush;
+    }
+
+    // Renders a scene ("demo" for the random spheres scene, or a generator spec) at several
+    // path depths, tracing each tile's paths one at a time and then a bounce at a time with
+    // sorted rays, and prints the throughput of each as JSON lines. The two alternate for a few
+    // rounds and the fastest of each counts, as timings on a shared machine wander. The sorted
+    // rate includes sorting; sort_ms gives that share on its own, and identical confirms both
+    // produced the same image.
+    static void run_sorting(std::ostream& out, const std::string& spec, int thread_count = 0, int image_width = 320,
+                            int samples_per_pixel = 4, int tile_size = 16, int rounds = 3) {
+        auto s = spec == "demo" ? random_spheres_scene() : generate_scene(generator_settings::parse(spec));
+        hittable_list world;
+        s.build_world(world);
+        bvh accelerated(world, interval(s.cam.shutter_open, s.cam.shutter_close));
+
+        camera cam = s.cam;
+        cam.image_width = image_width;
+        cam.samples_per_pixel = samples_per_pixel;
+        cam.tile_size = tile_size;
+        cam.thread_count = thread_count;
+        cam.show_progress = false;
+        tile whole = { 0, 0, cam.image_width, cam.pixel_height() };
+
+        for (int depth : { 1, 2, 4, 8 }) {
+            cam.max_depth = depth;
+            double ms[2] = { infinity, infinity }, sort_ms = 0, misses[2] = { infinity, infinity };
+            std::vector<color> images[2];
+            bool counted = false;
+            for (int round = 0; round < rounds; ++round) {
+                for (int sorted = 0; sorted < 2; ++sorted) {
+                    cam.sort_rays = sorted != 0;
+                    cache_counters cache;
+                    auto begin = clock::now();
+                    cache.start();
+                    images[sorted] = cam.render_region(accelerated, whole);
+                    cache.stop();
+                    auto round_ms = elapsed_ms(begin);
+                    if (round_ms < ms[sorted]) {
+                        ms[sorted] = round_ms;
+                        if (sorted)
+                            sort_ms = cam.sort_ms();
+                    }
+                    counted = cache.available();
+                    if (counted)
+                        misses[sorted] = fmin(misses[sorted], cache.misses() * 1000.0 / std::max<uint64_t>(1, cam.rays_traced()));
+                }
+            }
+
+            auto rays = cam.rays_traced();
+            out << "{\"scene\":\"" << spec << "\",\"max_depth\":" << depth << ",\"tile_size\":" << tile_size
+                << ",\"rays\":" << rays << ",\"ms\":" << ms[0] << ",\"sorted_ms\":" << ms[1] << ",\"sort_ms\":" << sort_ms
+                << ",\"mrays_per_s\":" << rays / (ms[0] * 1000.0) << ",\"sorted_mrays_per_s\":" << rays / (ms[1] * 1000.0)
+                << ",\"speedup\":" << ms[0] / ms[1];
+            if (counted)
+                out << ",\"cache_misses_per_kray\":" << misses[0] << ",\"sorted_cache_misses_per_kray\":" << misses[1];
+            bool identical = std::equal(images[0].begin(), images[0].end(), images[1].begin(), images[1].end(),
+                                        [](const color& x, const color& y) { return x[0] == y[0] && x[1] == y[1] && x[2] == y[2]; });
+            out << ",\"identical\":" << (identical ? "true" : "false") << "}\n" << std::flush;
+        }
+    }
+
+    // Renders a generated scene (or "demo") without NUMA placement, with threads pinned and tiles
+    // handed out node by node over the one world, and with a replica of the world per node, and
+    // prints each node's throughput. nodes of 0 uses the machine's nodes; more splits its
+    // hardware threads into that many, to try the scheduling on a machine without NUMA.
+    static void run_numa(std::ostream& out, const std::string& spec, int thread_count = 0, int nodes = 0,
+                         int image_width = 320, int samples_per_pixel = 4, int rounds = 3) {
+        auto s = spec == "demo" ? random_spheres_scene() : generate_scene(generator_settings::parse(spec));
+        hittable_list world;
+        s.build_world(world);
+        interval time(s.cam.shutter_open, s.cam.shutter_close);
+        bvh accelerated(world, time);
+
+        auto topology = numa_topology::detect();
+        if (nodes > 0)
+            topology = topology.split(nodes);
+        auto start = clock::now();
+        numa_replicas replicas(s, topology, accelerator::bvh, time);
+        auto replicate_ms = elapsed_ms(start);
+
+        camera cam = s.cam;
+        cam.image_width = image_width;
+        cam.samples_per_pixel = samples_per_pixel;
+        cam.thread_count = thread_count;
+        cam.show_progress = false;
+
+        std::string baseline;
+        for (const char* mode : { "off", "node_local", "replicated" }) {
+            cam.numa = std::string(mode) == "off" ? nullptr : make_shared<const numa_topology>(topology);
+            cam.node_worlds = std::string(mode) == "replicated" ? replicas.worlds() : std::vector<const hittable*>();
+            double ms = infinity;
+            std::string image;
+            std::vector<camera::node_statistics> per_node;
+            for (int round = 0; round < rounds; ++round) {
+                std::ostringstream rendered;
+                auto begin = clock::now();
+                cam.render(accelerated, rendered);
+                auto round_ms = elapsed_ms(begin);
+                if (round_ms < ms) {
+                    ms = round_ms;
+                    per_node = cam.node_stats();
+                }
+                image = rendered.str();
+            }
+            if (baseline.empty())
+                baseline = image;
+
+            out << "{\"scene\":\"" << spec << "\",\"numa\":\"" << mode << "\",\"nodes\":" << topology.node_count()
+                << ",\"ms\":" << ms << ",\"mrays_per_s\":" << cam.rays_traced() / (ms * 1000.0);
+            if (std::string(mode) == "replicated")
+                out << ",\"replicate_ms\":" << replicate_ms;
+            if (!per_node.empty()) {
+                out << ",\"per_node\":[";
+                for (size_t n = 0; n < per_node.size(); ++n)
+                    out << (n ? "," : "") << "{\"node\":" << topology.nodes()[n].id << ",\"threads\":" << per_node[n].threads
+                        << ",\"tiles\":" << per_node[n].tiles << ",\"stolen\":" << per_node[n].stolen
+                        << ",\"mrays_per_s\":" << per_node[n].rays / (1000 * std::max(cam.trace_ms(), 1e-3)) << "}";
+                out << "]";
+            }
+            out << ",\"identical\":" << (image == baseline ? "true" : "false") << "}\n" << std::flush;
+        }
+    }
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    struct view {
+        const char* name;
+        point3 lookfrom;
+        point3 lookat;
+        double vfov;
+    };
+
+    benchmark_options options;
+
+    static double elapsed_ms(clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(clock::now() - start).count();
+    }
+
+    // The baseline run_media compares delta tracking with: marches the ray through the grid's box
+    // in steps of half a voxel, adding up the optical depth until it passes one drawn up front.
+    class marched_medium : public hittable {
+    public:
+        marched_medium(const aabb& box, double density, shared_ptr<const brick_grid> grid)
+          : box(box), density(density), grid(std::move(grid)) {}
+
+        bool stochastic() const override { return true; }
+
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            for (int a = 0; a < 3; ++a) {
+                auto inverse = 1 / r.direction()[a];
+                auto near = (box.axis(a).min - r.origin()[a]) * inverse;
+                auto far = (box.axis(a).max - r.origin()[a]) * inverse;
+                if (inverse < 0)
+                    std::swap(near, far);
+                ray_t.min = std::max(ray_t.min, near);
+                ray_t.max = std::min(ray_t.max, far);
+                if (ray_t.max <= ray_t.min)
+                    return false;
+            }
+            auto length = r.direction().length();
+            auto step = 0.5 * box.x.size() / grid->size_x() / length;
+            auto depth = -std::log(1 - random_double());
+            for (auto t = ray_t.min; t < ray_t.max; t += step) {
+                auto p = r.at(t + 0.5 * step);
+                int index[3], size[3] = { grid->size_x(), grid->size_y(), grid->size_z() };
+                for (int a = 0; a < 3; ++a)
+                    index[a] = std::min(std::max(int((p[a] - box.axis(a).min) / box.axis(a).size() * size[a]), 0), size[a] - 1);
+                depth -= density * grid->value(index[0], index[1], index[2]) * step * length;
+                if (depth <= 0) {
+                    rec.t = t;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        aabb bounding_box() const override { return box; }
+
+    private:
+        aabb box;
+        double density;
+        shared_ptr<const brick_grid> grid;
+    };
+
+    // Sphere counts from 1e2 up to the limit on one flat uniform layer, plus clustered and
+    // deep (many layers) variants at a few sizes, plus the demo scene.
+    std::vector<std::string> standard_scenes() const {
+        std::vector<std::string> specs = { "demo" };
+        for (size_t count = 100; count <= options.max_spheres; count *= 10)
+            specs.push_back("spheres=" + std::to_string(count));
+        for (size_t count = 10000; count <= options.max_spheres; count *= 100) {
+            specs.push_back("spheres=" + std::to_string(count) + ",distribution=clustered");
+            specs.push_back("spheres=" + std::to_string(count) + ",layers=8");
+        }
+        return specs;
+    }
+
+    // Fixed cameras placed relative to the extent of the sphere field: the scene's own view,
+    // a grazing view along the ground with high depth complexity, and a view from straight above.
+    static std::vector<view> views(const scene& s) {
+        double extent = 1, top = 1;
+        for (const auto& sp : s.spheres) {
+            if (sp.radius > 100) continue;    // Skip the ground sphere
+            extent = fmax(extent, fmax(fabs(sp.center[0]), fabs(sp.center[2])));
+            top = fmax(top, sp.center[1] + sp.radius);
+        }
+
+        return {
+            { "scene", s.cam.lookfrom, s.cam.lookat, s.cam.vfov },
+            { "grazing", point3(extent + 2, 0.5 * top, 0.3), point3(-extent, 0.5 * top, 0), 30 },
+            { "top", point3(0, top + 2 * extent, 0.01), point3(0, 0, 0), 60 },
+        };
+    }
+};
+
+#endif
@@ -0,0 +1 @@
+#include "bvh.h"
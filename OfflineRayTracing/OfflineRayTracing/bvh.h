@@ -0,0 +1,316 @@
+#pragma once
+#ifndef BVH_H
+#define BVH_H
+
+#include "rtweekend.h"
+#include "aabb.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Bounding volume hierarchy over a list of objects. Built top-down with binned SAH splits and
+// stored as one flat array of nodes in depth-first order, so the first child of an interior
+// node is always the next node and traversal walks mostly contiguous memory.
+//
+// With moving objects the tree can be built over their bounds during a time interval (usually a
+// shutter) rather than over their whole motion, and later refit to another interval: the topology
+// stays, only the boxes are recomputed bottom-up. Refitting is far cheaper than rebuilding, but
+// the tree degrades as objects drift away from where they were when it was built.
+class bvh : public hittable {
+public:
+    bvh(const hittable_list& list) : bvh(list.objects, nullptr) {}
+
+    bvh(const std::vector<shared_ptr<hittable>>& src_objects) : bvh(src_objects, nullptr) {}
+
+    bvh(const hittable_list& list, const interval& time) : bvh(list.objects, &time) {}
+
+    // Recomputes every box for the objects' bounds during the given time, keeping the topology.
+    // Nodes are stored depth-first, so walking them backwards visits children before parents.
+    void refit(const interval& time) {
+        for (size_t i = nodes.size(); i-- > 0;) {
+            node& n = nodes[i];
+            if (n.count > 0) {
+                aabb box;
+                for (uint32_t j = n.offset; j < n.offset + n.count; ++j)
+                    box = aabb(box, objects[j]->motion_bounds(time));
+                n.box = box;
+            }
+            else
+                n.box = aabb(nodes[i + 1].box, nodes[n.offset].box);
+        }
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (nodes.empty()) return false;
+
+        const point3 orig = r.origin();
+        const vec3 dir = r.direction();
+        const vec3 inv_dir(1 / dir[0], 1 / dir[1], 1 / dir[2]);
+        const int dir_is_neg[3] = { inv_dir[0] < 0, inv_dir[1] < 0, inv_dir[2] < 0 };
+        RT_STAT(auto& stats = render_stats::local());
+
+        bool hit_anything = false;
+        uint32_t stack[max_depth];
+        int stack_size = 0;
+        uint32_t current = 0;
+
+        while (true) {
+            const node& n = nodes[current];
+            RT_STAT(++stats.box_tests);
+            if (hit_box(n.box, orig, inv_dir, ray_t)) {
+                if (n.count > 0) {
+                    RT_STAT(stats.primitive_tests += n.count);
+                    for (uint32_t i = n.offset; i < n.offset + n.count; ++i) {
+                        if (objects[i]->hit(r, ray_t, rec)) {
+                            hit_anything = true;
+                            ray_t.max = rec.t;
+                        }
+                    }
+                }
+                else {
+                    // Visit the child nearer along the split axis first; the other waits on the stack.
+                    if (dir_is_neg[n.axis]) {
+                        stack[stack_size++] = current + 1;
+                        current = n.offset;
+                    }
+                    else {
+                        stack[stack_size++] = n.offset;
+                        current = current + 1;
+                    }
+                    continue;
+                }
+            }
+            if (stack_size == 0) break;
+            current = stack[--stack_size];
+        }
+
+        return hit_anything;
+    }
+
+    aabb bounding_box() const override { return nodes.empty() ? aabb() : nodes[0].box; }
+
+    bool stochastic() const override { return any_stochastic; }
+
+    size_t node_count() const { return nodes.size(); }
+
+    // Expected cost of a ray that hits the root box, counting box and object tests alike, under the
+    // surface area heuristic. Refits grow and overlap boxes, which shows up as a rising cost.
+    double sah_cost() const {
+        if (nodes.empty())
+            return 0;
+        auto root_area = nodes[0].box.surface_area();
+        if (root_area <= 0)
+            return 1;
+        double cost = 0;
+        for (const auto& n : nodes)
+            cost += n.box.surface_area() * (n.count > 0 ? 1 + n.count : 1);
+        return cost / root_area;
+    }
+
+    size_t memory_bytes() const {
+        return nodes.capacity() * sizeof(node) + objects.capacity() * sizeof(shared_ptr<hittable>);
+    }
+
+private:
+    struct node {
+        aabb     box;
+        uint32_t offset;   // First object for leaves, second child for interior nodes
+        uint16_t count;    // Number of objects for leaves, zero for interior nodes
+        uint16_t axis;     // Split axis of interior nodes
+    };
+
+    // Build-time copy of an object's bounds. These are partitioned in place, so the build
+    // streams through contiguous memory instead of chasing object pointers.
+    struct build_object {
+        aabb     box;
+        point3   centroid;
+        uint32_t index;
+    };
+
+    static const size_t max_leaf_size = 4;
+    static const int    bin_count = 16;
+    // Traversal keeps one pending child per level on a fixed stack, so the tree may be no deeper
+    // than this. Below half of it the build stops trusting SAH, which can peel one object off a
+    // degenerate cluster per level, and halves every range at its median instead: after
+    // max_depth / 2 halvings any range that fits a uint32_t index is down to a leaf.
+    static constexpr int max_depth = 64;
+
+    std::vector<node> nodes;
+    std::vector<shared_ptr<hittable>> objects;
+    bool any_stochastic = false;
+
+    // Builds over each object's whole bounding box, or over its bounds during time if given.
+    bvh(const std::vector<shared_ptr<hittable>>& src_objects, const interval* time) {
+        std::vector<build_object> build_objects;
+        build_objects.reserve(src_objects.size());
+        for (size_t i = 0; i < src_objects.size(); ++i) {
+            auto box = time ? src_objects[i]->motion_bounds(*time) : src_objects[i]->bounding_box();
+            build_objects.push_back({ box, box.centroid(), static_cast<uint32_t>(i) });
+            any_stochastic = any_stochastic || src_objects[i]->stochastic();
+        }
+
+        if (!build_objects.empty()) {
+            nodes.reserve(2 * build_objects.size() / max_leaf_size + 1);
+            build(build_objects, 0, build_objects.size(), 0);
+        }
+        nodes.shrink_to_fit();
+
+        // Store the objects in leaf order so each leaf references a contiguous range.
+        objects.reserve(src_objects.size());
+        for (const auto& object : build_objects)
+            objects.push_back(src_objects[object.index]);
+    }
+
+    static bool hit_box(const aabb& box, const point3& orig, const vec3& inv_dir, interval ray_t) {
+        for (int a = 0; a < 3; a++) {
+            auto t0 = (box.axis(a).min - orig[a]) * inv_dir[a];
+            auto t1 = (box.axis(a).max - orig[a]) * inv_dir[a];
+            if (inv_dir[a] < 0)
+                std::swap(t0, t1);
+
+            if (t0 > ray_t.min) ray_t.min = t0;
+            if (t1 < ray_t.max) ray_t.max = t1;
+            if (ray_t.max <= ray_t.min)
+                return false;
+        }
+        return true;
+    }
+
+    // Builds the subtree over objects [begin, end), whose root is depth levels below the tree's,
+    // and returns the index of its root node.
+    uint32_t build(std::vector<build_object>& data, size_t begin, size_t end, int depth) {
+        uint32_t index = static_cast<uint32_t>(nodes.size());
+        nodes.push_back(node());
+
+        aabb bounds, centroid_bounds;
+        for (size_t i = begin; i < end; ++i) {
+            bounds = aabb(bounds, data[i].box);
+            const auto& c = data[i].centroid;
+            centroid_bounds = aabb(centroid_bounds, aabb(interval(c[0], c[0]), interval(c[1], c[1]), interval(c[2], c[2])));
+        }
+        nodes[index].box = bounds;
+
+        size_t count = end - begin;
+        int axis;
+        size_t mid = begin;
+        if (count > max_leaf_size)
+            mid = depth < max_depth / 2 ? split(data, begin, end, bounds, centroid_bounds, axis)
+                                        : centroid_median_split(data, begin, end, centroid_bounds, axis);
+        if (mid == begin) {
+            nodes[index].offset = static_cast<uint32_t>(begin);
+            nodes[index].count = static_cast<uint16_t>(count);
+            nodes[index].axis = 0;
+            return index;
+        }
+
+        build(data, begin, mid, depth + 1);
+        auto second = build(data, mid, end, depth + 1);
+        nodes[index].offset = second;
+        nodes[index].count = 0;
+        nodes[index].axis = static_cast<uint16_t>(axis);
+        return index;
+    }
+
+    // Picks the cheapest binned SAH split and partitions objects [begin, end) around it. Returns
+    // the partition point, or begin if a leaf is cheaper than any split.
+    size_t split(std::vector<build_object>& data, size_t begin, size_t end, const aabb& bounds, const aabb& centroid_bounds,
+                 int& best_axis) {
+        struct bin {
+            aabb   box;
+            size_t count = 0;
+        };
+
+        size_t count = end - begin;
+        double best_cost = infinity;
+        int best_bin = -1;
+        best_axis = 0;
+
+        for (int axis = 0; axis < 3; ++axis) {
+            const auto& extent = centroid_bounds.axis(axis);
+            if (extent.size() <= 0) continue;
+
+            bin bins[bin_count];
+            auto scale = bin_count / extent.size();
+            for (size_t i = begin; i < end; ++i) {
+                auto b = bin_index(data[i].centroid[axis], extent.min, scale);
+                bins[b].box = aabb(bins[b].box, data[i].box);
+                bins[b].count++;
+            }
+
+            // Sweep from the right to get the area and count of everything right of each plane.
+            double right_area[bin_count];
+            size_t right_count[bin_count];
+            aabb right_box;
+            size_t right_sum = 0;
+            for (int b = bin_count - 1; b > 0; --b) {
+                right_box = aabb(right_box, bins[b].box);
+                right_sum += bins[b].count;
+                right_area[b] = right_box.surface_area();
+                right_count[b] = right_sum;
+            }
+
+            aabb left_box;
+            size_t left_sum = 0;
+            for (int b = 0; b < bin_count - 1; ++b) {
+                left_box = aabb(left_box, bins[b].box);
+                left_sum += bins[b].count;
+                if (left_sum == 0 || right_count[b + 1] == 0) continue;
+
+                auto cost = left_box.surface_area() * left_sum + right_area[b + 1] * right_count[b + 1];
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_bin = b;
+                }
+            }
+        }
+
+        // Every centroid coincides, so no plane separates them; just halve the range.
+        if (best_bin < 0)
+            return median_split(begin, end, bounds, best_axis);
+
+        // Compare against intersecting every object in one leaf, with a node traversal costing
+        // about as much as one object test.
+        auto leaf_cost = static_cast<double>(count);
+        auto split_cost = 1 + best_cost / bounds.surface_area();
+        if (split_cost >= leaf_cost && count <= 4 * max_leaf_size)
+            return begin;
+
+        const auto& extent = centroid_bounds.axis(best_axis);
+        auto scale = bin_count / extent.size();
+        auto mid = std::partition(data.begin() + begin, data.begin() + end, [&](const build_object& object) {
+            return bin_index(object.centroid[best_axis], extent.min, scale) <= best_bin;
+        });
+        return static_cast<size_t>(mid - data.begin());
+    }
+
+    static size_t median_split(size_t begin, size_t end, const aabb& bounds, int& axis) {
+        axis = 0;
+        if (bounds.y.size() > bounds.axis(axis).size()) axis = 1;
+        if (bounds.z.size() > bounds.axis(axis).size()) axis = 2;
+        return begin + (end - begin) / 2;
+    }
+
+    // Halves objects [begin, end) around their median centroid on the centroids' widest axis.
+    static size_t centroid_median_split(std::vector<build_object>& data, size_t begin, size_t end,
+                                        const aabb& centroid_bounds, int& axis) {
+        axis = 0;
+        if (centroid_bounds.y.size() > centroid_bounds.axis(axis).size()) axis = 1;
+        if (centroid_bounds.z.size() > centroid_bounds.axis(axis).size()) axis = 2;
+        auto mid = begin + (end - begin) / 2;
+        std::nth_element(data.begin() + begin, data.begin() + mid, data.begin() + end,
+                         [axis](const build_object& a, const build_object& b) { return a.centroid[axis] < b.centroid[axis]; });
+        return mid;
+    }
+
+    static int bin_index(double value, double min, double scale) {
+        auto b = static_cast<int>((value - min) * scale);
+        return b < 0 ? 0 : (b >= bin_count ? bin_count - 1 : b);
+    }
+};
+
+#endif
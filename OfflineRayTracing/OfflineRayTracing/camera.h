@@ -5,10 +5,36 @@
 #include "rtweekend.h"
 #include "material.h"
 #include "color.h"
+#include "environment.h"
+#include "light_tree.h"
+#include "numa.h"
+#include "path_guide.h"
+#include "post_process.h"
+#include "radiance_cache.h"
+#include "render_pool.h"
+#include "photon_map.h"
 #include "hittable.h"
+#include "stats.h"
+#include "tiles.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
 
 //using color = vec3;
 
+// Thrown by camera::render once its cancel flag is set.
+class render_cancelled : public std::runtime_error {
+public:
+    render_cancelled() : std::runtime_error("render cancelled") {}
+};
+
 class camera {
 public:
     double aspect_ratio = 1.0;  // Ratio of image width over height
@@ -21,27 +47,154 @@ public:
     vec3   vup = vec3(0, 1, 0);     // Camera-relative "up" direction
     double defocus_angle = 0;  // Variation angle of rays through each pixel
     double focus_dist = 10;    // Distance from camera lookfrom point to plane of perfect focus
+    double shutter_open = 0;   // Camera rays get times spread evenly over [shutter_open, shutter_close];
+    double shutter_close = 0;  // an empty shutter takes every ray at shutter_open, with no motion blur
+    int    frame = 0;          // Frame of an animation; each frame's pixels draw different random numbers
+    int    tile_size = 16;     // Width and height of the square tiles handed to render threads
+    tile_order order = tile_order::hilbert;  // Order tiles, and pixels inside them, are rendered in
+    int    thread_count = 0;   // Render threads; 0 uses every hardware thread
+    double time_budget_ms = 0; // Render progressive passes until this wall-clock budget is spent; 0 renders samples_per_pixel
+    int    band_height = 0;    // Rows rendered and written out at a time; 0 holds the whole image
+    bool   sort_rays = false;  // Trace each tile's paths a bounce at a time, sorting the rays of each bounce
+    bool   binary_output = false;  // Write a binary P6 PPM instead of text P3
+    bool   show_progress = true;  // Report remaining tiles on std::clog
+    std::string heatmap_prefix;   // With RT_STATS, write <prefix>_tests.ppm and <prefix>_depth.ppm
+    shared_ptr<const environment_map> environment;  // Lights the scene in place of the gradient sky when set
+    environment_sampling env_sampling = environment_sampling::importance;  // How diffuse hits find the environment
+    shared_ptr<const light_tree> lights;  // The scene's emitters, set by scene::build_world
+    light_selection light_mode = light_selection::tree;  // How diffuse hits pick an emitter to sample
+    bool   gradient_sky = true;  // Rays that leave the scene see the white-to-blue sky, or else background
+    color  background = color(0, 0, 0);
+    shared_ptr<caustic_photons> caustics;  // Caustic photon map, set by scene::build_world when the scene asks for photons
+    bool   guide_paths = false;  // Learn where light arrives from while rendering, and aim diffuse bounces there
+    // With guide_paths, a guide learned over the whole frame (see learn_guide) that render_region
+    // samples from instead of learning one from its region alone. Never changed once set, so
+    // regions rendered at the same time can share it.
+    shared_ptr<const path_guide> frame_guide;
+    bool   cache_radiance = false;  // Paths end at their second diffuse surface on irradiance cached near it
+    int    cache_rays = 64;         // Rays that compute each cache record
+    double cache_error = 0.5;       // Record radius over the harmonic mean distance to the surfaces around it
+    double cache_spacing = 0.02;    // Largest record radius as a share of the scene's diagonal
+    post_process post;  // Exposure, bloom and tonemapping between the samples and the written bytes; all off by default
+    shared_ptr<render_pool> pool;  // Renders passes on these shared threads when set; otherwise each pass starts its own
+    const std::atomic<bool>* cancel = nullptr;  // Checked before every tile; once set, rendering stops and throws render_cancelled
+    // Called from a render thread after every tile it renders, with the tile's pixels (row by
+    // row, averaged over the samples they have so far) and the share of the render done.
+    std::function<void(const tile&, const std::vector<color>&, double)> on_tile;
+    shared_ptr<const numa_topology> numa;  // Pin render threads to these nodes and hand out tiles node by node; ignored with a pool
+    std::vector<const hittable*> node_worlds;  // With numa, a replica of the world per node for its threads; empty traces the one rendered
 
 
     void render(const hittable& world) {
-        initialize();
+        render(world, std::cout);
+    }
 
-        std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+    // Renders the image in horizontal bands of band_height rows and writes each band as soon as
+    // it is finished, so only one band is ever held in memory. A time budget is shared out
+    // between the bands in proportion to their height.
+    void render(const hittable& world, std::ostream& out) {
+        initialize();
+        prepare_caustics(world);
+        prepare_guide(world);
+        prepare_cache(world);
+        begin_statistics();
+        post.reset_timings();
 
-        for (int j = 0; j < image_height; ++j) {
-            std::clog << "\rScanlines remaining: " << (image_height - j) << ' ' << std::flush;
-            for (int i = 0; i < image_width; ++i) {
-                color pixel_color(0, 0, 0);
-                for (int sample = 0; sample < samples_per_pixel; ++sample) {
-                    ray r = get_ray(i, j);
-                    pixel_color += ray_color(r, max_depth, world);
-                }
-                colorTest::write_color(std::cout, pixel_color, samples_per_pixel);
-            }
+        int rows = band_height > 0 ? std::min(band_height, image_height) : image_height;
+        streaming = rows < image_height;
+        // Bloom spreads light across band edges, so it needs every band at once.
+        if (streaming && post.bloom)
+            throw std::runtime_error("bloom needs the whole image; render without bands");
+        write_header(out);
+        for (int y0 = 0; y0 < image_height; y0 += rows) {
+            if (streaming && show_progress)
+                std::clog << "\rRows remaining: " << (image_height - y0) << ' ' << std::flush;
+            begin_region({ 0, y0, image_width, std::min(y0 + rows, image_height) });
+            if (time_budget_ms > 0)
+                render_progressive(world, time_budget_ms * (region.y1 - region.y0) / image_height);
+            else
+                render_samples(world);
+            write_band(out);
+            RT_STAT(tile_ms.insert(tile_ms.end(), band_tile_ms.begin(), band_tile_ms.end()));
+            fewest_samples = y0 == 0 ? sample_count : std::min(fewest_samples, sample_count);
         }
 
-        std::clog << "\rDone.                 \n";
+        if (streaming && show_progress)
+            std::clog << "\rDone.                 \n";
+        if (post.enabled() && show_progress)
+            post.report(std::clog);
+        if (numa && !pool && show_progress)
+            report_nodes(std::clog);
+        if (guide && show_progress)
+            std::clog << "Guide learned " << guide->region_count() << " regions, "
+                      << guide->direction_node_count() << " direction cells in " << guide->passes_learned() << " passes\n";
+        if (cache && show_progress)
+            std::clog << "Radiance cache holds " << cache->record_count() << " records, computed with "
+                      << cache->rays_traced() << " of the " << ray_count << " rays traced\n";
+        end_statistics();
+        if (!out)
+            throw std::runtime_error("failed writing the image");
+    }
+
+    // Renders only the pixels of the given rectangle and returns the sum of their
+    // samples_per_pixel samples, row by row. Every pixel traces exactly the rays it would in a
+    // whole-image render, so regions rendered anywhere assemble into the identical image.
+    // (Guided regions are the exception: they sample frame_guide, or else learn from their own
+    // pixels alone.)
+    std::vector<color> render_region(const hittable& world, const tile& area) {
+        initialize();
+        prepare_caustics(world);
+        prepare_guide(world, true);
+        prepare_cache(world);
+        begin_statistics();
+        streaming = true;
+        begin_region(area);
+        render_samples(world);
+        fewest_samples = sample_count;
+        return framebuffer;
+    }
+
+    // Image height in pixels implied by image_width and aspect_ratio.
+    int pixel_height() const {
+        int height = static_cast<int>(image_width / aspect_ratio);
+        return (height < 1) ? 1 : height;
+    }
+
+    uint64_t rays_traced() const { return ray_count; }   // Rays traced by the last render
+    double sort_ms() const { return sort_ns * 1e-6; }    // Thread time the last render spent sorting rays
+    int samples_taken() const { return fewest_samples; } // Samples per pixel of the least sampled band
+    const path_guide* learned_guide() const { return guide.get(); }  // What the last guided render learned or sampled
+
+    // Learns a guide for a frame that will be rendered in regions, by a guided render of the
+    // whole frame guide_training_shrink times narrower, whose pixels are thrown away. Its samples
+    // per pixel are rounded up to one less than a power of two, so the last pass, whose records
+    // the guide keeps, is the largest. That costs at most half the frame's rays, once, instead
+    // of every region learning from nothing and from its own pixels only.
+    shared_ptr<const path_guide> learn_guide(const hittable& world) const {
+        camera trainer = *this;
+        trainer.image_width = std::max(1, image_width / guide_training_shrink);
+        trainer.samples_per_pixel = 1;
+        while (trainer.samples_per_pixel < samples_per_pixel)
+            trainer.samples_per_pixel = 2 * trainer.samples_per_pixel + 1;
+        trainer.guide_paths = true;
+        trainer.frame_guide = nullptr;
+        trainer.cache_radiance = false;
+        trainer.show_progress = false;
+        trainer.on_tile = nullptr;
+        trainer.render_region(world, { 0, 0, trainer.image_width, trainer.pixel_height() });
+        return trainer.guide;
     }
+    const radiance_cache* cached_radiance() const { return cache.get(); }  // What the last render cached
+
+    // What each NUMA node's threads did in the last render with numa set.
+    struct node_statistics {
+        int      threads = 0;
+        uint64_t tiles = 0;    // Tiles rendered, summed over passes
+        uint64_t stolen = 0;   // Of those, tiles taken from another node's share
+        uint64_t rays = 0;
+    };
+    const std::vector<node_statistics>& node_stats() const { return per_node; }
+    double trace_ms() const { return pass_ms; }   // Wall-clock time the last render spent in passes
 
 private:
     int    image_height;   // Rendered image height
@@ -49,13 +202,34 @@ private:
     point3 pixel00_loc;    // Location of pixel 0, 0
     vec3   pixel_delta_u;  // Offset to pixel to the right
     vec3   pixel_delta_v;  // Offset to pixel below
+    double pixel_spread;   // Angle one pixel subtends, the spread of camera ray cones
     vec3   u, v, w;        // Camera frame basis vectors
     vec3   defocus_disk_u;  // Defocus disk horizontal radius
     vec3   defocus_disk_v;  // Defocus disk vertical radius
+    std::vector<color> framebuffer;  // Sum of the samples of each pixel of the region, row by row
+    tile     region = {};       // The part of the image being rendered: a band or a leased tile
+    bool     streaming = false; // Only part of the image is rendered at a time
+    uint64_t ray_count = 0;
+    uint64_t sort_ns = 0;
+    int      sample_count = 0;  // Samples per pixel taken in the current band
+    int      fewest_samples = 0;
+    std::chrono::steady_clock::time_point render_start;  // For the share of a time budget spent
+    std::vector<node_statistics> per_node;
+    double   pass_ms = 0;
+    shared_ptr<const path_guide> guide;   // Set while a guided render samples a guide
+    shared_ptr<path_guide> learning;      // The same guide, while the render also learns it
+    static constexpr int guide_training_shrink = 2;   // learn_guide renders a frame this many times narrower
+    shared_ptr<radiance_cache> cache;  // Set while a render caches radiance
+
+#ifdef RT_STATS
+    std::vector<double> tile_ms;     // Render time of each tile, summed over passes
+    std::vector<double> band_tile_ms;  // The same for the tiles of the current band
+    std::vector<double> heat_tests;  // Primitive and box tests per pixel
+    std::vector<double> heat_depth;  // Deepest bounce per pixel
+#endif
 
     void initialize() {
-        image_height = static_cast<int>(image_width / aspect_ratio);
-        image_height = (image_height < 1) ? 1 : image_height;
+        image_height = pixel_height();
 
         center = lookfrom;
 
@@ -78,6 +252,7 @@ private:
         // Calculate the horizontal and vertical delta vectors from pixel to pixel.
         pixel_delta_u = viewport_u / image_width;
         pixel_delta_v = viewport_v / image_height;
+        pixel_spread = pixel_delta_u.length() / focus_dist;
 
         // Calculate the location of the upper left pixel.
         auto viewport_upper_left = center - (focus_dist * w) - viewport_u / 2 - viewport_v / 2;
@@ -89,26 +264,903 @@ private:
         defocus_disk_v = v * defocus_radius;
     }
 
-    
-    color ray_color(const ray& r, int depth, const hittable& world) const {
+    // Renders passes of samples until the time budget is nearly spent. Every pass is timed, and
+    // the slowest cost per sample seen so far sizes the next pass to what is left of the budget,
+    // so the last pass does not overrun it. The first pass always runs so there is an image.
+    void render_progressive(const hittable& world, double budget_ms) {
+        using clock = std::chrono::steady_clock;
+        const double headroom = 0.95;      // Leave time to write the image
+        bool log = show_progress && !streaming;
+        auto start = clock::now();
+        auto elapsed_ms = [&]() { return std::chrono::duration<double, std::milli>(clock::now() - start).count(); };
+
+        int pass_samples = 1;
+        double ms_per_sample = 0;
+        for (int pass = 0; ; ++pass) {
+            auto pass_start = elapsed_ms();
+            render_pass(world, pass, pass_samples);
+            auto pass_ms = elapsed_ms() - pass_start;
+            ms_per_sample = std::max(ms_per_sample, pass_ms / pass_samples);
+
+            auto remaining_ms = headroom * budget_ms - elapsed_ms();
+            if (log)
+                std::clog << "\rPass " << pass + 1 << ": " << sample_count << " spp, "
+                          << int(elapsed_ms()) << " ms      " << std::flush;
+            if (ms_per_sample <= 0 || remaining_ms < ms_per_sample)
+                break;
+
+            // Grow passes geometrically so short passes do not dominate, but never beyond
+            // what is predicted to fit.
+            auto fits = int(remaining_ms / ms_per_sample);
+            pass_samples = std::max(1, std::min(2 * pass_samples, fits));
+        }
+
+        if (log)
+            std::clog << "\nReached " << sample_count << " spp in " << elapsed_ms()
+                      << " ms of a " << budget_ms << " ms budget\n";
+    }
+
+    // Adds samples_per_pixel samples to every pixel of the band: in one pass, or when guiding in
+    // passes of 1, 2, 4, ... samples, so each pass samples from what the ones before it learned.
+    void render_samples(const hittable& world) {
+        if (!learning) {
+            render_pass(world, 0, samples_per_pixel);
+            return;
+        }
+        for (int pass = 0, pass_samples = 1; sample_count < samples_per_pixel; ++pass) {
+            render_pass(world, pass, std::min(pass_samples, samples_per_pixel - sample_count));
+            pass_samples = std::min(2 * pass_samples, 1 << 20);
+        }
+    }
+
+    // Adds samples to every pixel of the band. Threads take tiles from a shared counter
+    // in the configured order, so neighbouring tiles are in flight at the same time. With a
+    // pool, its threads take the tiles, one step each, alongside the passes of other renders.
+    //
+    // With NUMA placement the tiles, in that order, are cut into one run per node in proportion
+    // to its threads, so neighbouring tiles, which touch the same parts of the scene, stay on one
+    // node. Each node's threads are pinned to it, trace its replica of the world, and take tiles
+    // from their own node's run until it is empty before stealing from the others'.
+    void render_pass(const hittable& world, int pass, int samples) {
+        auto tiles = make_tiles(region.x1 - region.x0, region.y1 - region.y0, tile_size, order);
+        for (auto& t : tiles) {
+            t.x0 += region.x0;
+            t.x1 += region.x0;
+            t.y0 += region.y0;
+            t.y1 += region.y0;
+        }
+        auto pixel_order = tile_pixel_order(tile_size, order);
+
+        int threads = thread_count > 0 ? thread_count : pool ? pool->size() : int(std::thread::hardware_concurrency());
+        threads = std::max(1, std::min(threads, int(tiles.size())));
+        bool tile_progress = show_progress && time_budget_ms <= 0 && !streaming;
+
+        int nodes = numa && !pool ? numa->node_count() : 1;
+        std::vector<tile_run> runs(static_cast<size_t>(nodes));
+        for (int n = 0, first = 0; n < nodes; ++n) {
+            // Workers 0 .. threads - 1 are dealt to nodes in order, so each node's run gets its share of them.
+            int last = first;
+            while (last < threads && numa && numa->node_of(last, threads) == n)
+                ++last;
+            runs[n].next = tiles.size() * first / threads;
+            runs[n].end = nodes == 1 ? tiles.size() : tiles.size() * last / threads;
+            first = last;
+        }
+
+        std::atomic<uint64_t> total_rays{ 0 };
+        std::atomic<uint64_t> total_sort_ns{ 0 };
+        std::atomic<size_t> tiles_done{ 0 };
+
+#ifdef RT_STATS
+        band_tile_ms.resize(tiles.size());
+#endif
+
+        // Renders the next tile for a thread of the given node; false once there is none or the
+        // render is cancelled.
+        auto render_next = [&](int id, int node, const hittable& scene_world, uint64_t& rays, uint64_t& sorting,
+                               node_statistics& counts) {
+            if (cancelled())
+                return false;
+            size_t t = tiles.size();
+            for (int k = 0; k < nodes && t == tiles.size(); ++k) {
+                auto& run = runs[(node + k) % nodes];
+                auto taken = run.next++;
+                if (taken < run.end) {
+                    t = taken;
+                    counts.stolen += k > 0;
+                }
+            }
+            if (t == tiles.size())
+                return false;
+            if (id == 0 && tile_progress)
+                std::clog << "\rTiles remaining: " << (tiles.size() - tiles_done) << ' ' << std::flush;
+            RT_STAT(auto tile_start = std::chrono::steady_clock::now());
+            if (sort_rays && max_depth > 0)
+                render_tile_sorted(tiles[t], pixel_order, scene_world, pass, samples, rays, sorting);
+            else
+                render_tile(tiles[t], pixel_order, scene_world, pass, samples, rays);
+            RT_STAT(band_tile_ms[t] += std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - tile_start).count());
+            ++counts.tiles;
+            auto done = ++tiles_done;
+            if (on_tile)
+                report_tile(tiles[t], samples, double(done) / tiles.size());
+            return true;
+        };
+
+        auto pass_start = std::chrono::steady_clock::now();
+
+        if (pool) {
+            std::function<bool()> step = [&]() {
+                uint64_t rays = 0, sorting = 0;
+                node_statistics counts;
+                bool more = render_next(-1, 0, world, rays, sorting, counts);
+                total_rays += rays;
+                total_sort_ns += sorting;
+                return more;
+            };
+            pool->run(step, threads);
+        }
+        else {
+            std::mutex counts_mutex;
+            auto worker = [&](int id) {
+                int node = numa ? numa->node_of(id, threads) : 0;
+                if (nodes > 1)
+                    numa->pin_current_thread(node);
+                const hittable& scene_world = size_t(node) < node_worlds.size() && node_worlds[node] ? *node_worlds[node] : world;
+                uint64_t rays = 0, sorting = 0;
+                node_statistics counts;
+                while (render_next(id, node, scene_world, rays, sorting, counts))
+                    ;
+                total_rays += rays;
+                total_sort_ns += sorting;
+                if (numa) {
+                    std::lock_guard<std::mutex> lock(counts_mutex);
+                    auto& n = per_node[size_t(node)];
+                    n.tiles += counts.tiles;
+                    n.stolen += counts.stolen;
+                    n.rays += rays;
+                    n.threads = std::max(n.threads, 1 + id - first_worker_of(node, threads));
+                }
+            };
+
+            // Pinned threads only: the calling thread would stay pinned after the pass.
+            std::vector<std::thread> workers;
+            for (int id = nodes > 1 ? 0 : 1; id < threads; ++id)
+                workers.emplace_back(worker, id);
+            if (nodes == 1)
+                worker(0);
+            for (auto& thread : workers)
+                thread.join();
+        }
+        pass_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - pass_start).count();
+        if (cancelled())
+            throw render_cancelled();
+        ray_count += total_rays;
+        sort_ns += total_sort_ns;
+        sample_count += samples;
+        if (learning)
+            learning->update(samples);
+
+        if (tile_progress)
+            std::clog << "\rDone.                 \n";
+    }
+
+    bool cancelled() const { return cancel && cancel->load(std::memory_order_relaxed); }
+
+    // The tiles of a pass one NUMA node's threads take first: next up to end.
+    struct tile_run {
+        std::atomic<size_t> next{ 0 };
+        size_t end = 0;
+    };
+
+    int first_worker_of(int node, int threads) const {
+        int id = 0;
+        while (id < threads && numa->node_of(id, threads) < node)
+            ++id;
+        return id;
+    }
+
+    void report_nodes(std::ostream& out) const {
+        for (size_t n = 0; n < per_node.size(); ++n) {
+            const auto& s = per_node[n];
+            out << "NUMA node " << numa->nodes()[n].id << ": " << s.threads << " threads"
+                << (per_node.size() == 1 || numa->nodes()[n].cpus.empty() ? " (unpinned)" : "") << ", " << s.tiles << " tiles (" << s.stolen
+                << " stolen), " << s.rays / (1000 * std::max(pass_ms, 1e-3)) << " Mrays/s\n";
+        }
+    }
+
+    // Hands on_tile the pixels of a tile just rendered in a pass adding samples to each.
+    // pass_share is the share of the pass's tiles done.
+    void report_tile(const tile& t, int samples, double pass_share) const {
+        std::vector<color> pixels;
+        pixels.reserve(size_t(t.pixel_count()));
+        auto scale = 1.0 / (sample_count + samples);
+        for (int j = t.y0; j < t.y1; ++j)
+            for (int i = t.x0; i < t.x1; ++i)
+                pixels.push_back(scale * framebuffer[size_t(j - region.y0) * (region.x1 - region.x0) + (i - region.x0)]);
+
+        double done;
+        if (time_budget_ms > 0) {
+            done = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - render_start).count() / time_budget_ms;
+        }
+        else {
+            auto band = (sample_count + samples * pass_share) / samples_per_pixel;
+            done = (region.y0 + (region.y1 - region.y0) * band) / image_height;
+        }
+        on_tile(t, pixels, std::min(done, 1.0));
+    }
+
+    void begin_statistics() {
+        render_start = std::chrono::steady_clock::now();
+        per_node.assign(numa ? size_t(numa->node_count()) : 0, node_statistics());
+        pass_ms = 0;
+        ray_count = 0;
+        sort_ns = 0;
+        fewest_samples = 0;
+#ifdef RT_STATS
+        render_stats::reset();
+        tile_ms.clear();
+        heat_tests.assign(size_t(image_width) * image_height, 0);
+        heat_depth.assign(size_t(image_width) * image_height, 0);
+#endif
+    }
+
+    void begin_region(const tile& area) {
+        region = area;
+        sample_count = 0;
+        framebuffer.assign(size_t(area.pixel_count()), color(0, 0, 0));
+        RT_STAT(band_tile_ms.clear());
+    }
+
+    void end_statistics() {
+#ifdef RT_STATS
+        render_stats::report(std::clog, tile_ms, order == tile_order::scanline ? "scanline" : "tile");
+        if (!heatmap_prefix.empty()) {
+            render_stats::write_heatmap(heatmap_prefix + "_tests.ppm", heat_tests, image_width, image_height);
+            render_stats::write_heatmap(heatmap_prefix + "_depth.ppm", heat_depth, image_width, image_height);
+        }
+#endif
+    }
+
+    void render_tile(const tile& t, const std::vector<pixel_offset>& pixel_order, const hittable& world,
+                     int pass, int samples, uint64_t& rays) {
+        if (pixel_order.empty()) {
+            for (int j = t.y0; j < t.y1; ++j)
+                for (int i = t.x0; i < t.x1; ++i)
+                    render_pixel(i, j, world, pass, samples, rays);
+            return;
+        }
+
+        for (auto offset : pixel_order) {
+            int i = t.x0 + offset.x;
+            int j = t.y0 + offset.y;
+            if (i < t.x1 && j < t.y1)
+                render_pixel(i, j, world, pass, samples, rays);
+        }
+    }
+
+    void render_pixel(int i, int j, const hittable& world, int pass, int samples, uint64_t& rays) {
+        seed_random(pixel_seed(i, j, pass) ^ frame_seed());
+        RT_STAT(auto& stats = render_stats::local());
+        RT_STAT(auto tests_before = stats.primitive_tests + stats.box_tests);
+        RT_STAT(stats.deepest_bounce = 0);
+
+        color pixel_color(0, 0, 0);
+        for (int sample = 0; sample < samples; ++sample) {
+            ray r = get_ray(i, j);
+            pixel_color += ray_color(r, max_depth, world, rays, { 0, vec3(), false, false, false });
+        }
+
+        framebuffer[size_t(j - region.y0) * (region.x1 - region.x0) + (i - region.x0)] += pixel_color;
+        RT_STAT(auto index = size_t(j) * image_width + i);
+        RT_STAT(heat_tests[index] += double(stats.primitive_tests + stats.box_tests - tests_before));
+        RT_STAT(heat_depth[index] = std::max(heat_depth[index], double(stats.deepest_bounce)));
+    }
+
+    // Renders the same samples as render_tile, but instead of following each path to its end
+    // before starting the next, advances every pixel's path by one bounce at a time. The rays of
+    // a bounce, and then its shadow rays, are sorted so rays leaving from near one another in a
+    // similar direction are traced together and walk the same nodes while those are in cache.
+    //
+    // Every pixel keeps its own random sequence and every path adds up its surfaces in the order
+    // ray_color would, so the image is identical to the recursive one.
+    void render_tile_sorted(const tile& t, const std::vector<pixel_offset>& pixel_order, const hittable& world,
+                            int pass, int samples, uint64_t& rays, uint64_t& sorting) {
+        std::vector<path_lane> lanes;
+        lanes.reserve(size_t(t.pixel_count()));
+        auto add_lane = [&](int i, int j) {
+            lanes.emplace_back();
+            lanes.back().i = i;
+            lanes.back().j = j;
+        };
+        if (pixel_order.empty()) {
+            for (int j = t.y0; j < t.y1; ++j)
+                for (int i = t.x0; i < t.x1; ++i)
+                    add_lane(i, j);
+        }
+        else {
+            for (auto offset : pixel_order)
+                if (t.x0 + offset.x < t.x1 && t.y0 + offset.y < t.y1)
+                    add_lane(t.x0 + offset.x, t.y0 + offset.y);
+        }
+
+        // The surfaces along each lane's path
+        std::vector<path_surface> gathered(lanes.size() * size_t(max_depth));
+        RT_STAT(auto& stats = render_stats::local());
+
+        // Starts the lane's next sample, or retires the lane when it has taken them all.
+        auto next_sample = [&](path_lane& lane) {
+            if (lane.sample == samples)
+                return false;
+            rng::local() = lane.generator;
+            lane.r = get_ray(lane.i, lane.j);
+            lane.generator = rng::local();
+            lane.depth = max_depth;
+            lane.from = { 0, vec3(), false, false, false };
+            lane.vertices = 0;
+            return true;
+        };
+
+        std::vector<uint32_t> active, still_active;
+        for (uint32_t k = 0; k < lanes.size(); ++k) {
+            seed_random(pixel_seed(lanes[k].i, lanes[k].j, pass) ^ frame_seed());
+            lanes[k].generator = rng::local();
+            if (next_sample(lanes[k]))
+                active.push_back(k);
+        }
+
+        std::vector<uint64_t> order;
+        std::vector<shadow_ray> shadows;
+        while (!active.empty()) {
+            // Trace this bounce's rays in sorted order and shade each hit at once. Lanes draw
+            // from their own sequences, loaded around everything that draws (media draw inside
+            // hit()), so the order they are traced and shaded in does not matter.
+            shadows.clear();
+            sort_by_ray(order, active.size(), [&](size_t n) -> const ray& { return lanes[active[n]].r; }, sorting);
+            for (auto entry : order) {
+                auto k = active[uint32_t(entry)];
+                auto& lane = lanes[k];
+                ++rays;
+                RT_STAT(stats.count_ray(max_depth - lane.depth));
+                RT_STAT(lane.deepest = std::max(lane.deepest, max_depth - lane.depth));
+                RT_STAT(auto tests_before = stats.primitive_tests + stats.box_tests);
+                hit_record rec;
+                rng::local() = lane.generator;
+                bool hit = world.hit(lane.r, interval(0.001, infinity), rec);
+                RT_STAT(lane.tests += double(stats.primitive_tests + stats.box_tests - tests_before));
+                if (!hit) {
+                    lane.scatters = false;
+                    lane.emitted = escaped(lane.r, lane.from);
+                    lane.direct = color(0, 0, 0);
+                    lane.generator = rng::local();
+                    continue;
+                }
+
+                path_vertex vertex;
+                auto queue_shadow = [&](const ray& shadow, const interval& range, const color& light) {
+                    shadows.push_back({ shadow, range, light, k, false });
+                };
+                lane.scatters = shade(lane.r, lane.depth, rec, lane.from, vertex, queue_shadow);
+                if (vertex.cached)
+                    vertex.direct += vertex.attenuation * cached_light(lane.r, lane.depth, rec, world, rays);
+                lane.generator = rng::local();
+                lane.emitted = vertex.emitted;
+                lane.direct = vertex.direct;
+                if (lane.scatters) {
+                    lane.attenuation = vertex.attenuation;
+                    lane.guide_pdf = vertex.guide_pdf;
+                    lane.guide_at = vertex.guide_at;
+                    lane.r = vertex.scattered;
+                    lane.from = vertex.next;
+                }
+            }
+
+            // A lane queues at most one shadow ray toward the sky and then one toward an
+            // emitter, and adds their light in that order, as ray_color does.
+            sort_by_ray(order, shadows.size(), [&](size_t n) -> const ray& { return shadows[n].r; }, sorting);
+            for (auto entry : order) {
+                auto& shadow = shadows[uint32_t(entry)];
+                ++rays;
+                RT_STAT(auto tests_before = stats.primitive_tests + stats.box_tests);
+                hit_record blocker;
+                rng::local() = lanes[shadow.lane].generator;
+                shadow.visible = !world.hit(shadow.r, shadow.range, blocker);
+                lanes[shadow.lane].generator = rng::local();
+                RT_STAT(lanes[shadow.lane].tests += double(stats.primitive_tests + stats.box_tests - tests_before));
+            }
+            for (const auto& shadow : shadows)
+                if (shadow.visible)
+                    lanes[shadow.lane].direct += shadow.light;
+
+            // Record each surface and follow the path on, or end it and fold its surfaces into
+            // the sample's color, deepest first, as ray_color returns them.
+            still_active.clear();
+            for (auto k : active) {
+                auto& lane = lanes[k];
+                auto value = lane.emitted + lane.direct;
+                if (lane.scatters) {
+                    gathered[k * size_t(max_depth) + lane.vertices++] =
+                        { lane.emitted + lane.direct, lane.attenuation, lane.guide_at, lane.r.direction(), lane.guide_pdf };
+                    if (lane.depth > 1) {
+                        lane.depth--;
+                        still_active.push_back(k);
+                        continue;
+                    }
+                    value = color(0, 0, 0);
+                }
+                for (int v = lane.vertices; v-- > 0;) {
+                    const auto& surface = gathered[k * size_t(max_depth) + v];
+                    if (surface.guide_pdf > 0 && learning)
+                        learning->record(surface.at, surface.direction, value, surface.guide_pdf);
+                    value = surface.light + surface.attenuation * value;
+                }
+                lane.pixel += value;
+                lane.sample++;
+                if (next_sample(lane))
+                    still_active.push_back(k);
+            }
+            active.swap(still_active);
+        }
+
+        for (const auto& lane : lanes) {
+            framebuffer[size_t(lane.j - region.y0) * (region.x1 - region.x0) + (lane.i - region.x0)] += lane.pixel;
+            RT_STAT(auto index = size_t(lane.j) * image_width + lane.i);
+            RT_STAT(heat_tests[index] += lane.tests);
+            RT_STAT(heat_depth[index] = std::max(heat_depth[index], double(lane.deepest)));
+        }
+    }
+
+    // Fills order with the rays 0..count-1 of a batch sorted by a key: the octant of the ray's
+    // direction, then the Z-order of its origin on a 512^3 lattice over the origins of the
+    // batch. Each entry holds the key above the ray's number, which is its low 32 bits. Adds the
+    // time this takes to sorting.
+    template <typename RayAt>
+    static void sort_by_ray(std::vector<uint64_t>& order, size_t count, RayAt ray_at, uint64_t& sorting) {
+        auto start = std::chrono::steady_clock::now();
+        aabb bounds;
+        for (size_t n = 0; n < count; ++n) {
+            const auto& o = ray_at(n).origin();
+            bounds = aabb(bounds, aabb(o, o));
+        }
+        double scale[3];
+        for (int a = 0; a < 3; ++a)
+            scale[a] = bounds.axis(a).size() > 0 ? 511.999 / bounds.axis(a).size() : 0;
+
+        order.resize(count);
+        for (size_t n = 0; n < count; ++n) {
+            const auto& r = ray_at(n);
+            uint64_t octant = (r.direction()[0] < 0 ? 4 : 0) | (r.direction()[1] < 0 ? 2 : 0) | (r.direction()[2] < 0 ? 1 : 0);
+            uint64_t cell = 0;
+            for (int a = 0; a < 3; ++a)
+                cell |= spread_bits(uint64_t((r.origin()[a] - bounds.axis(a).min) * scale[a])) << (2 - a);
+            order[n] = (octant << 59) | (cell << 32) | n;
+        }
+        std::sort(order.begin(), order.end());
+        sorting += uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    // Moves the low 9 bits of v three bits apart, for interleaving three coordinates.
+    static uint64_t spread_bits(uint64_t v) {
+        v &= 0x1ff;
+        v = (v | (v << 16)) & 0x030000ff;
+        v = (v | (v << 8)) & 0x0300f00f;
+        v = (v | (v << 4)) & 0x030c30c3;
+        v = (v | (v << 2)) & 0x09249249;
+        return v;
+    }
+
+    void write_header(std::ostream& out) const {
+        out << (binary_output ? "P6" : "P3") << '\n' << image_width << ' ' << image_height << "\n255\n";
+    }
+
+    void write_band(std::ostream& out) {
+        if (post.enabled()) {
+            post.write(out, framebuffer, region.x1 - region.x0, region.y1 - region.y0, sample_count, binary_output, thread_count,
+                       pool.get());
+        }
+        else if (binary_output) {
+            for (const auto& pixel_color : framebuffer)
+                colorTest::write_color_binary(out, pixel_color, sample_count);
+        }
+        else {
+            for (const auto& pixel_color : framebuffer)
+                colorTest::write_color(out, pixel_color, sample_count);
+        }
+        out.flush();
+    }
+
+    // Every pixel gets its own random sequence in every pass, so the image does not depend on
+    // which thread renders a pixel or when.
+    static uint64_t pixel_seed(int i, int j, int pass) {
+        return (uint64_t(uint32_t(pass)) << 48) ^ (uint64_t(uint32_t(j)) << 24) ^ uint32_t(i);
+    }
+
+    // Zero for frame 0, so stills are unchanged; otherwise noise would stand still across an animation.
+    uint64_t frame_seed() const {
+        return uint64_t(uint32_t(frame)) * 0x9e3779b97f4a7c15ull;
+    }
+
+    // How the ray being traced left the previous surface: pdf is the solid-angle pdf with which
+    // a diffuse material chose it, or 0 for camera rays and specular bounces. Lights the ray then
+    // finds directly are weighted against having been sampled from there (see power_heuristic).
+    //
+    // With a caustic photon map, gathered is set once a diffuse surface has added the map's
+    // caustics, and specular once the ray has since bounced off a mirror or glass (last off a
+    // sphere when sphere is set). Light such a ray reaches is already in the map.
+    //
+    // diffuse is set once the path has bounced off a diffuse surface, and caching on rays that
+    // compute a radiance cache record, which never ask the cache themselves.
+    struct bounce {
+        double pdf;
+        vec3   normal;
+        bool   gathered;
+        bool   specular;
+        bool   sphere;
+        bool   diffuse = false;
+        bool   caching = false;
+    };
+
+    // A guided render learns from nothing, so its first pass samples the materials alone,
+    // unless it renders a region of a frame whose guide was learned already.
+    void prepare_guide(const hittable& world, bool region = false) {
+        learning = guide_paths && !(region && frame_guide) ? make_shared<path_guide>(world.bounding_box()) : nullptr;
+        guide = learning ? learning : guide_paths && region ? frame_guide : nullptr;
+    }
+
+    // Every render starts with an empty cache, filled as its paths miss.
+    void prepare_cache(const hittable& world) {
+        if (!cache_radiance) {
+            cache = nullptr;
+            return;
+        }
+        auto box = world.bounding_box();
+        auto diagonal = vec3(box.x.size(), box.y.size(), box.z.size()).length();
+        cache = make_shared<radiance_cache>(cache_spacing * diagonal);
+    }
+
+    // The photon pass runs once per scene, before the first pixel, whatever renders first; on
+    // the pool's threads when there is one, like the passes.
+    void prepare_caustics(const hittable& world) {
+        if (!caustics)
+            return;
+        bool dark = !environment && !gradient_sky && background.length_squared() == 0;
+        caustics->prepare(world, [this](const vec3& direction) { return sky(direction); },
+                          environment.get(), dark, max_depth, thread_count, interval(shutter_open, shutter_close),
+                          pool.get());
+    }
+
+    // Radiance arriving from infinitely far away along -direction.
+    color sky(const vec3& direction) const {
+        if (environment)
+            return environment->value(direction);
+        if (!gradient_sky)
+            return background;
+
+        vec3 unit_direction = unit_vector(direction);
+        auto a = 0.5 * (unit_direction.y() + 1.0);
+        return (1.0 - a) * color(1.0, 1.0, 1.0) + a * color(0.5, 0.7, 1.0);
+    }
+
+    color ray_color(const ray& r, int depth, const hittable& world, uint64_t& rays, const bounce& from) const {
         hit_record rec;
 
         // If we've exceeded the ray bounce limit, no more light is gathered.
         if (depth <= 0)
             return color(0, 0, 0);
 
+        ++rays;
+        RT_STAT(render_stats::local().count_ray(max_depth - depth));
+
+        if (!world.hit(r, interval(0.001, infinity), rec))
+            return escaped(r, from);
+        return surface_color(r, depth, rec, world, rays, from);
+    }
+
+    // Radiance leaving the surface r hit back along r.
+    color surface_color(const ray& r, int depth, hit_record& rec, const hittable& world, uint64_t& rays, const bounce& from) const {
+        path_vertex vertex;
+        auto trace_shadow = [&](const ray& shadow, const interval& range, const color& light) {
+            ++rays;
+            hit_record blocker;
+            if (!world.hit(shadow, range, blocker))
+                vertex.direct += light;
+        };
+        if (!shade(r, depth, rec, from, vertex, trace_shadow)) {
+            if (vertex.cached)
+                vertex.direct += vertex.attenuation * cached_light(r, depth, rec, world, rays);
+            return vertex.emitted + vertex.direct;
+        }
+        auto incoming = ray_color(vertex.scattered, depth - 1, world, rays, vertex.next);
+        if (vertex.guide_pdf > 0 && learning)
+            learning->record(vertex.guide_at, vertex.scattered.direction(), incoming, vertex.guide_pdf);
+        return vertex.emitted + vertex.direct + vertex.attenuation * incoming;
+    }
+
+    // What a path gathers at one surface: the light leaving it toward the ray, emitted and
+    // sampled directly, and how the path goes on if the surface scatters. While guiding,
+    // guide_pdf is the pdf of the bounce the guide learns from per unit projected solid angle
+    // (its pdf over the cosine), or 0, and guide_at where it learns it. cached is set on a
+    // surface whose path ends there with the light the radiance cache holds for it (cached_light)
+    // passed on through attenuation.
+    struct path_vertex {
+        color  emitted;
+        color  direct;
+        color  attenuation;
+        ray    scattered;
+        bounce next;
+        double guide_pdf = 0;
+        point3 guide_at;
+        bool   cached = false;
+    };
+
+    // One pixel of a tile rendered a bounce at a time: the path of its current sample with its
+    // own random sequence, and the surface it reached last, whose direct light may still wait
+    // on shadow rays.
+    struct path_lane {
+        int    i, j;
+        int    sample = 0;
+        int    depth = 0;
+        int    vertices = 0;      // Surfaces passed so far, their light in the tile's gathered list
+        bool   scatters = false;
+        rng    generator;
+        ray    r;
+        bounce from;
+        color  emitted;           // At the last surface, or what the path brings back if it ends there
+        color  direct;
+        color  attenuation;
+        double guide_pdf = 0;
+        point3 guide_at;
+        color  pixel = color(0, 0, 0);
+        RT_STAT(double tests = 0;)
+        RT_STAT(int deepest = 0;)
+    };
+
+    // One surface of a lane's path: the light leaving it, how much of the light arriving it passes
+    // on, and for the guide, the bounce that light arrived along.
+    struct path_surface {
+        color  light;
+        color  attenuation;
+        point3 at;
+        vec3   direction;
+        double guide_pdf;
+    };
+
+    struct shadow_ray {
+        ray      r;
+        interval range;
+        color    light;
+        uint32_t lane;
+        bool     visible;
+    };
 
-        if (world.hit(r, interval(0.001, infinity), rec)) {
-            ray scattered;
-            color attenuation;
-            if (rec.mat->scatter(r, rec, attenuation, scattered))
-                return attenuation * ray_color(scattered, depth - 1, world);
+    // Shades a hit and returns whether the path scatters on. Every shadow ray goes to
+    // shadow(ray, range, light) with the light it brings unless something blocks it in range;
+    // the callback adds that light to vertex.direct, at once or after tracing it with others.
+    // That light counts whether the path scatters on or not.
+    template <typename Shadow>
+    bool shade(const ray& r, int depth, hit_record& rec, const bounce& from, path_vertex& vertex, Shadow&& shadow) const {
+        auto length = r.direction().length();
+        auto cosine = fabs(dot(r.direction(), rec.normal)) / length;
+        rec.cone_width = r.cone_width() + r.cone_spread() * rec.t * length;
+        rec.uv_footprint = rec.cone_width / (rec.uv_size * fmax(cosine, 0.1));
+
+        vertex.direct = color(0, 0, 0);
+        vertex.emitted = rec.mat->emitted(rec);
+        if (from.pdf > 0 && rec.light >= 0 && lights && light_mode != light_selection::bsdf)
+            vertex.emitted = vertex.emitted * power_heuristic(from.pdf, light_pdf(uint32_t(rec.light), r.origin(), from.normal));
+        if (from.specular && rec.light >= 0 && caustics->covers_emitters())
+            vertex.emitted = color(0, 0, 0);   // Only light-tree emitters shoot photons; the rest stay on the path
+
+        if (!rec.mat->scatter(r, rec, vertex.attenuation, vertex.scattered)) {
+            RT_STAT(render_stats::local().absorbed++);
+            return false;
+        }
+
+        // Lights are only sampled when the bounce could reach them too, so every strategy
+        // converges to the same image.
+        auto scatter_pdf = rec.mat->scattering_pdf(r, rec, vertex.scattered);
+        vertex.next = { 0, vec3(), false, false, false };
+        vertex.next.diffuse = from.diffuse || scatter_pdf > 0;
+        vertex.next.caching = from.caching;
+        if (caustics) {
+            if (scatter_pdf > 0) {
+                vertex.direct += caustics->radiance(rec.p, rec.normal, vertex.attenuation);
+                vertex.next.gathered = true;
+            }
+            else {
+                vertex.next.gathered = vertex.next.specular = from.gathered;
+                vertex.next.sphere = rec.sphere;
+            }
+        }
+
+        // While guiding, a diffuse bounce leaves along the material's direction or, half the
+        // time, along one drawn from the light the guide learned arrives here. Either way it is
+        // weighted, and known to MIS, by the pdf of the mixture of the two.
+        // Past the first diffuse bounce, a diffuse surface takes the light arriving at it from
+        // the radiance cache instead, after sampling lights as the bounce would have.
+        vertex.cached = cache && from.diffuse && !from.caching && scatter_pdf > 0 && depth > 1;
+
+        const direction_tree* learned = nullptr;
+        double guide_weight = 1;
+        if (guide && !vertex.cached && scatter_pdf > 0 && depth > 1) {
+            // Just off the surface, so a wall on a region boundary finds the region on its side.
+            vertex.guide_at = rec.p + 0.001 * rec.normal;
+            learned = guide->distribution_at(vertex.guide_at);
+            if (learned) {
+                double guided_pdf;
+                if (random_double() < path_guide::guided_fraction) {
+                    auto direction = learned->sample(rec.normal, guided_pdf);
+                    vertex.scattered = ray(rec.p, direction, vertex.scattered.cone_width(), vertex.scattered.cone_spread(), r.time());
+                }
+                else {
+                    guided_pdf = learned->pdf(unit_vector(vertex.scattered.direction()), rec.normal);
+                }
+                auto material_pdf = rec.mat->scattering_pdf(r, rec, vertex.scattered);
+                scatter_pdf = mixture_pdf(material_pdf, guided_pdf);
+                guide_weight = material_pdf / scatter_pdf;
+            }
+            auto cosine = dot(unit_vector(vertex.scattered.direction()), rec.normal);
+            vertex.guide_pdf = cosine > 0 ? scatter_pdf / cosine : 0;
+        }
+
+        bool sample_sky = environment && env_sampling != environment_sampling::bsdf;
+        bool sample_lights = lights && lights->size() > 0 && light_mode != light_selection::bsdf;
+        if ((sample_sky || sample_lights) && depth > 1) {
+            vertex.next.pdf = scatter_pdf;
+            vertex.next.normal = rec.normal;
+            if (vertex.next.pdf > 0 && sample_sky)
+                sample_environment(r, rec, vertex.attenuation, learned, shadow);
+            if (vertex.next.pdf > 0 && sample_lights)
+                sample_light(r, rec, vertex.attenuation, learned, shadow);
+        }
+
+        // A guided direction the material cannot scatter into ends the path, with its light.
+        if (learned) {
+            if (guide_weight <= 0)
+                return false;
+            vertex.attenuation = vertex.attenuation * guide_weight;
+        }
+        return !vertex.cached;
+    }
+
+    // Light arriving at a diffuse hit from everywhere but the lights next-event estimation
+    // samples, per unit albedo: irradiance over pi. It comes from the records covering the hit,
+    // or from a new record, whose cache_rays cosine-distributed rays follow paths of their own
+    // (with emitters they find weighted against the lights the hit sampled, as a bounce's are).
+    color cached_light(const ray& r, int depth, const hit_record& rec, const hittable& world, uint64_t& rays) const {
+        RT_STAT(auto& stats = render_stats::local());
+        RT_STAT(stats.cache_lookups++);
+        color irradiance;
+        if (cache->lookup(rec.p, rec.normal, depth, irradiance)) {
+            RT_STAT(stats.cache_hits++);
+            return irradiance / pi;
+        }
+
+        // The gathered paths go on as the path's own bounce would have, with one bounce fewer.
+        bool weighted = (environment && env_sampling != environment_sampling::bsdf)
+                     || (lights && lights->size() > 0 && light_mode != light_selection::bsdf);
+        auto rays_before = rays;
+        color sum(0, 0, 0);
+        double inverse_distances = 0;
+        for (int k = 0; k < cache_rays; ++k) {
+            auto direction = rec.normal + random_unit_vector();
+            if (direction.near_zero())
+                direction = rec.normal;
+            ray gather(rec.p, direction, rec.cone_width, diffuse_cone_spread, r.time());
+            bounce from = { weighted ? dot(rec.normal, unit_vector(direction)) / pi : 0, rec.normal, bool(caustics), false, false };
+            from.diffuse = from.caching = true;
+
+            ++rays;
+            RT_STAT(stats.count_ray(max_depth - depth + 1));
+            hit_record hit;
+            if (!world.hit(gather, interval(0.001, infinity), hit)) {
+                sum += escaped(gather, from);
+                continue;
+            }
+            inverse_distances += 1 / (hit.t * direction.length());
+            sum += surface_color(gather, depth - 1, hit, world, rays, from);
+        }
+        cache->count_rays(rays - rays_before);
+
+        auto radiance = sum / std::max(1, cache_rays);
+        auto harmonic_mean = inverse_distances > 0 ? cache_rays / inverse_distances : infinity;
+        cache->insert(rec.p, rec.normal, depth, pi * radiance, cache_error * harmonic_mean);
+        return radiance;
+    }
+
+    // Pdf of a guided bounce, from the pdfs of the material and the guide drawing it.
+    static double mixture_pdf(double material_pdf, double guide_pdf) {
+        return (1 - path_guide::guided_fraction) * material_pdf + path_guide::guided_fraction * guide_pdf;
+    }
+
+    // Radiance a ray that hit nothing brings back.
+    color escaped(const ray& r, const bounce& from) const {
+        RT_STAT(render_stats::local().escaped++);
+        if (from.specular && from.sphere && caustics->covers_sky())
             return color(0, 0, 0);
+        auto radiance = sky(r.direction());
+        if (environment && from.pdf > 0 && env_sampling != environment_sampling::bsdf)
+            radiance = radiance * power_heuristic(from.pdf, environment_pdf(unit_vector(r.direction())));
+        return radiance;
+    }
+
+    // Next-event estimation: light from the environment along one sampled direction, through a
+    // shadow ray, weighted against the bounce having found the same light (with the guide's
+    // learned distribution in the mix when there is one).
+    template <typename Shadow>
+    void sample_environment(const ray& r, const hit_record& rec, const color& attenuation,
+                            const direction_tree* learned, Shadow&& shadow) const {
+        double light_pdf;
+        vec3 direction;
+        if (env_sampling == environment_sampling::uniform) {
+            direction = random_unit_vector();
+            light_pdf = 1 / (4 * pi);
+        }
+        else {
+            direction = environment->sample(light_pdf);
         }
+        if (light_pdf <= 0 || dot(direction, rec.normal) <= 0)
+            return;
 
-        vec3 unit_direction = unit_vector(r.direction());
-        auto a = 0.5 * (unit_direction.y() + 1.0);
-        return (1.0 - a) * color(1.0, 1.0, 1.0) + a * color(0.5, 0.7, 1.0);
+        ray ray_to_sky(rec.p, direction, r.time());
+        auto scatter_pdf = rec.mat->scattering_pdf(r, rec, ray_to_sky);
+        if (scatter_pdf <= 0)
+            return;
+
+        auto bounce_pdf = learned ? mixture_pdf(scatter_pdf, learned->pdf(unit_vector(direction), rec.normal)) : scatter_pdf;
+        shadow(ray_to_sky, interval(0.001, infinity),
+               attenuation * environment->value(direction) * (scatter_pdf / light_pdf * power_heuristic(light_pdf, bounce_pdf)));
+    }
+
+    // Next-event estimation for emitters: picks one light (through the light tree, or uniformly)
+    // and a direction toward it, and sends a shadow ray that must reach it unblocked.
+    template <typename Shadow>
+    void sample_light(const ray& r, const hit_record& rec, const color& attenuation,
+                      const direction_tree* learned, Shadow&& shadow) const {
+        double pmf;
+        uint32_t index;
+        if (light_mode == light_selection::uniform) {
+            index = std::min(uint32_t(random_double() * lights->size()), uint32_t(lights->size() - 1));
+            pmf = 1.0 / lights->size();
+        }
+        else {
+            index = lights->sample(rec.p, rec.normal, random_double(), pmf);
+        }
+        if (pmf <= 0)
+            return;
+
+        const auto& light = lights->light(index);
+        vec3 direction;
+        double direction_pdf, distance;
+        if (!light.sample(rec.p, direction, direction_pdf, distance) || dot(direction, rec.normal) <= 0)
+            return;
+
+        ray ray_to_light(rec.p, direction, r.time());
+        auto scatter_pdf = rec.mat->scattering_pdf(r, rec, ray_to_light);
+        if (scatter_pdf <= 0)
+            return;
+
+        auto pdf = pmf * direction_pdf;
+        auto bounce_pdf = learned ? mixture_pdf(scatter_pdf, learned->pdf(unit_vector(direction), rec.normal)) : scatter_pdf;
+        shadow(ray_to_light, interval(0.001, distance * (1 - 1e-7)),
+               attenuation * light.emission * (scatter_pdf / pdf * power_heuristic(pdf, bounce_pdf)));
+    }
+
+    // Solid-angle pdf of sample_light choosing a direction toward the given light from p.
+    double light_pdf(uint32_t index, const point3& p, const vec3& normal) const {
+        auto pmf = light_mode == light_selection::uniform ? 1.0 / lights->size() : lights->pmf(index, p, normal);
+        return pmf * lights->light(index).pdf(p);
+    }
+
+    double environment_pdf(const vec3& unit_direction) const {
+        return env_sampling == environment_sampling::uniform ? 1 / (4 * pi) : environment->pdf(unit_direction);
+    }
+
+    // Power heuristic (beta = 2) weight of a sample drawn with pdf_a, when pdf_b could also have drawn it.
+    static double power_heuristic(double pdf_a, double pdf_b) {
+        auto a = pdf_a * pdf_a, b = pdf_b * pdf_b;
+        return a / (a + b);
     }
     
     ray get_ray(int i, int j) const {
@@ -120,8 +1172,9 @@ private:
 
         auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample();
         auto ray_direction = pixel_sample - ray_origin;
+        auto ray_time = shutter_close > shutter_open ? random_double(shutter_open, shutter_close) : shutter_open;
 
-        return ray(ray_origin, ray_direction);
+        return ray(ray_origin, ray_direction, 0, pixel_spread, ray_time);
     }
 
     point3 defocus_disk_sample() const {
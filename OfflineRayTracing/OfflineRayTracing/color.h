@@ -12,10 +12,28 @@ inline double linear_to_gamma(double linear_component)
 {
     return sqrt(linear_component);
 }
+
+// Perceived brightness of a linear colour (Rec. 709 weights).
+inline double luminance(const color& c) {
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
 class colorTest {
 public:
 
     static void write_color(std::ostream& out, color pixel_color, int samples_per_pixel) {
+        unsigned char rgb[3];
+        to_bytes(pixel_color, samples_per_pixel, rgb);
+        out << int(rgb[0]) << ' ' << int(rgb[1]) << ' ' << int(rgb[2]) << '\n';
+    }
+
+    // Same as write_color, as the three raw bytes of a binary (P6) PPM.
+    static void write_color_binary(std::ostream& out, color pixel_color, int samples_per_pixel) {
+        unsigned char rgb[3];
+        to_bytes(pixel_color, samples_per_pixel, rgb);
+        out.write(reinterpret_cast<const char*>(rgb), 3);
+    }
+
+    static void to_bytes(color pixel_color, int samples_per_pixel, unsigned char rgb[3]) {
         auto r = pixel_color.x();
         auto g = pixel_color.y();
         auto b = pixel_color.z();
@@ -31,11 +49,11 @@ public:
         g = linear_to_gamma(g);
         b = linear_to_gamma(b);
 
-        // Write the translated [0,255] value of each color component.
+        // Translate to [0,255] values of each color component.
         static const interval intensity(0.000, 0.999);
-        out << static_cast<int>(256 * intensity.clamp(r)) << ' '
-            << static_cast<int>(256 * intensity.clamp(g)) << ' '
-            << static_cast<int>(256 * intensity.clamp(b)) << '\n';
+        rgb[0] = static_cast<unsigned char>(256 * intensity.clamp(r));
+        rgb[1] = static_cast<unsigned char>(256 * intensity.clamp(g));
+        rgb[2] = static_cast<unsigned char>(256 * intensity.clamp(b));
     }
 
 };
@@ -0,0 +1,424 @@
+#pragma once
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include "rtweekend.h"
+#include "bvh.h"
+#include "camera.h"
+#include "color.h"
+#include "hittable_list.h"
+#include "scene.h"
+#include "tiles.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Renders one frame with many processes, possibly on many hosts, that share a directory. The
+// directory is the only transport:
+//
+//   <dir>/job.rtsb          the scene, camera settings included
+//   <dir>/job.settings      render settings the scene format leaves out, see write_job_settings()
+//   <dir>/todo/<n>          tile n waiting for a worker, holding "x0 y0 x1 y1"
+//   <dir>/leased/<n>.<id>   tile n claimed by worker <id>
+//   <dir>/done/<n>          the result of tile n, see write_tile_result()
+//   <dir>/alive/<id>        touched by worker <id> every second while it runs
+//   <dir>/stop              written by the coordinator once the frame is complete
+//
+// Claiming and returning a tile are single renames, which are atomic within a filesystem, so
+// a tile is leased to one worker at a time. A lease whose worker stops touching its heartbeat
+// file is renamed back into todo/ and leased again.
+
+namespace fs = std::filesystem;
+
+struct distributed_options {
+    std::string work_dir;
+    std::string executable;        // Program started for local workers, normally argv[0]
+    int    local_workers = 0;      // Worker processes to start here; 0 waits for external ones
+    int    worker_threads = 1;     // Render threads of each local worker
+    int    tile_size = 64;         // Edge length of a leased tile
+    double lease_timeout_s = 10;   // Heartbeat age after which a worker's tiles are re-leased
+};
+
+// Result files hold the sum of each pixel's samples in doubles, the camera's own precision,
+// so the merged image is bit-identical to one rendered in a single process.
+inline void write_tile_result(const fs::path& path, const tile& area, int samples, const std::vector<color>& sums) {
+    std::ofstream out(path, std::ios::binary);
+    int32_t header[5] = { area.x0, area.y0, area.x1, area.y1, samples };
+    out.write("RTTL", 4);
+    out.write(reinterpret_cast<const char*>(header), sizeof(header));
+    for (const auto& c : sums) {
+        double rgb[3] = { c.x(), c.y(), c.z() };
+        out.write(reinterpret_cast<const char*>(rgb), sizeof(rgb));
+    }
+    if (!out)
+        throw std::runtime_error("cannot write tile result '" + path.string() + "'");
+}
+
+inline bool read_tile_result(const fs::path& path, tile& area, int& samples, std::vector<color>& sums) {
+    std::ifstream in(path, std::ios::binary);
+    char magic[4];
+    int32_t header[5];
+    if (!in.read(magic, 4) || std::string(magic, 4) != "RTTL" ||
+        !in.read(reinterpret_cast<char*>(header), sizeof(header)))
+        return false;
+
+    area = { header[0], header[1], header[2], header[3] };
+    samples = header[4];
+    sums.resize(size_t(area.pixel_count()));
+    for (auto& c : sums) {
+        double rgb[3];
+        if (!in.read(reinterpret_cast<char*>(rgb), sizeof(rgb)))
+            return false;
+        c = color(rgb[0], rgb[1], rgb[2]);
+    }
+    return true;
+}
+
+// The camera settings that change how a worker renders its tiles but that the binary scene
+// format does not store, one "<name> <value>" per line. Post-processing and the output format
+// are not among them: the coordinator applies those to the merged image.
+inline void write_job_settings(const fs::path& path, const camera& cam) {
+    std::ofstream out(path);
+    out << std::setprecision(17)
+        << "tile_size " << cam.tile_size << '\n'
+        << "tile_order " << tile_order_name(cam.order) << '\n'
+        << "sort_rays " << cam.sort_rays << '\n'
+        << "guide_paths " << cam.guide_paths << '\n'
+        << "cache_radiance " << cam.cache_radiance << '\n'
+        << "cache_rays " << cam.cache_rays << '\n'
+        << "cache_error " << cam.cache_error << '\n'
+        << "cache_spacing " << cam.cache_spacing << '\n';
+    if (!out)
+        throw std::runtime_error("cannot write job settings '" + path.string() + "'");
+}
+
+inline void read_job_settings(const fs::path& path, camera& cam) {
+    std::ifstream in(path);
+    if (!in)
+        throw std::runtime_error("cannot open job settings '" + path.string() + "'");
+
+    std::string name, value;
+    while (in >> name >> value) {
+        if      (name == "tile_size")      cam.tile_size = std::stoi(value);
+        else if (name == "tile_order")     cam.order = parse_tile_order(value);
+        else if (name == "sort_rays")      cam.sort_rays = value != "0";
+        else if (name == "guide_paths")    cam.guide_paths = value != "0";
+        else if (name == "cache_radiance") cam.cache_radiance = value != "0";
+        else if (name == "cache_rays")     cam.cache_rays = std::stoi(value);
+        else if (name == "cache_error")    cam.cache_error = std::stod(value);
+        else if (name == "cache_spacing")  cam.cache_spacing = std::stod(value);
+        else throw std::runtime_error(path.string() + ": unknown setting '" + name + "'");
+    }
+}
+
+// Takes tiles from the work directory until the coordinator says the frame is complete.
+class render_worker {
+public:
+    render_worker(const std::string& work_dir, const std::string& worker_id, int threads)
+        : dir(work_dir), id(worker_id.empty() ? random_id() : worker_id), thread_count(threads) {}
+
+    void run() {
+        while (!fs::exists(dir / "job.rtsb")) {
+            if (fs::exists(dir / "stop"))
+                return;
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        }
+
+        auto s = scene::load((dir / "job.rtsb").string());
+        hittable_list world;
+        s.build_world(world);
+        bvh accelerated(world, interval(s.cam.shutter_open, s.cam.shutter_close));
+
+        camera cam = s.cam;
+        read_job_settings(dir / "job.settings", cam);
+        cam.thread_count = thread_count;
+        cam.show_progress = false;
+        if (cam.guide_paths)
+            cam.frame_guide = cam.learn_guide(accelerated);   // One guide for every tile this worker renders
+
+        std::atomic<bool> running{ true };
+        touch_heartbeat();
+        std::thread heartbeat([&]() {
+            while (running) {
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+                touch_heartbeat();
+            }
+        });
+
+        int rendered = 0;
+        try {
+            while (!fs::exists(dir / "stop")) {
+                std::string name;
+                fs::path lease;
+                if (!claim_tile(name, lease)) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                    continue;
+                }
+
+                tile area;
+                std::ifstream rect(lease);
+                if (!(rect >> area.x0 >> area.y0 >> area.x1 >> area.y1))
+                    throw std::runtime_error("malformed tile lease '" + lease.string() + "'");
+                rect.close();
+
+                auto sums = cam.render_region(accelerated, area);
+                auto staged = dir / "done" / (name + ".tmp." + id);
+                write_tile_result(staged, area, cam.samples_taken(), sums);
+
+                std::error_code ec;
+                fs::rename(staged, dir / "done" / name, ec);
+                fs::remove(lease, ec);
+                ++rendered;
+            }
+        }
+        catch (...) {
+            running = false;
+            heartbeat.join();
+            throw;
+        }
+
+        running = false;
+        heartbeat.join();
+        std::clog << "Worker " << id << " rendered " << rendered << " tiles\n";
+    }
+
+private:
+    fs::path dir;
+    std::string id;
+    int thread_count;
+
+    // Renames the first tile that is still waiting into leased/; losing a race to another
+    // worker just moves on to the next one.
+    bool claim_tile(std::string& name, fs::path& lease) {
+        std::error_code ec;
+        for (fs::directory_iterator it(dir / "todo", ec), end; !ec && it != end; it.increment(ec)) {
+            name = it->path().filename().string();
+            lease = dir / "leased" / (name + "." + id);
+            std::error_code rename_error;
+            fs::rename(it->path(), lease, rename_error);
+            if (!rename_error)
+                return true;
+        }
+        return false;
+    }
+
+    void touch_heartbeat() {
+        auto path = dir / "alive" / id;
+        std::error_code ec;
+        if (!fs::exists(path, ec))
+            std::ofstream(path) << id << '\n';
+        fs::last_write_time(path, fs::file_time_type::clock::now(), ec);
+    }
+
+    static std::string random_id() {
+        std::random_device device;
+        std::ostringstream out;
+        out << std::hex << device() << device();
+        return out.str();
+    }
+};
+
+// Splits a frame into tiles, hands them out through the work directory, re-leases the tiles
+// of dead workers and merges the results into the final image.
+class render_coordinator {
+public:
+    render_coordinator(const distributed_options& _options) : options(_options), dir(_options.work_dir) {}
+
+    void render(const scene& s, std::ostream& out) {
+        if (s.cam.time_budget_ms > 0)
+            throw std::runtime_error("a time budget cannot be split between distributed workers; set the samples per pixel instead");
+        if (s.cam.band_height > 0)
+            throw std::runtime_error("distributed renders merge the whole image at once and cannot stream it in bands");
+        if (!s.cam.heatmap_prefix.empty())
+            throw std::runtime_error("distributed workers do not collect cost heatmaps");
+
+        using clock = std::chrono::steady_clock;
+        auto start = clock::now();
+
+        prepare_directory();
+        const int width = s.cam.image_width;
+        const int height = s.cam.pixel_height();
+        auto tiles = make_tiles(width, height, options.tile_size, s.cam.order);
+        for (size_t n = 0; n < tiles.size(); ++n) {
+            const auto& t = tiles[n];
+            std::ofstream(dir / "todo" / std::to_string(n)) << t.x0 << ' ' << t.y0 << ' ' << t.x1 << ' ' << t.y1 << '\n';
+        }
+
+        // Publish the job last, so workers that are already waiting see a complete one.
+        write_job_settings(dir / "job.settings", s.cam);
+        s.save((dir / "job.tmp.rtsb").string());
+        fs::rename(dir / "job.tmp.rtsb", dir / "job.rtsb");
+
+        std::atomic<int> running_workers{ options.local_workers };
+        std::atomic<int> re_leased{ 0 };
+        std::vector<std::thread> workers;
+        for (int k = 0; k < options.local_workers; ++k) {
+            workers.emplace_back([&, k]() {
+                auto worker_id = "local" + std::to_string(k);
+                std::system(worker_command(worker_id).c_str());
+                re_leased += release_leases(worker_id);   // Whatever it still held, it will never finish
+                --running_workers;
+            });
+        }
+
+        std::vector<color> image(size_t(width) * height, color(0, 0, 0));
+        std::vector<bool> merged(tiles.size(), false);
+        size_t merged_count = 0;
+        try {
+            while (merged_count < tiles.size()) {
+                merged_count += merge_results(image, width, merged);
+                if (merged_count == tiles.size())
+                    break;
+
+                re_leased += release_stale_leases();
+                if (options.local_workers > 0 && running_workers == 0)
+                    throw std::runtime_error("every worker exited before the frame was complete");
+                std::clog << "\rTiles remaining: " << (tiles.size() - merged_count) << ' ' << std::flush;
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            }
+        }
+        catch (...) {
+            std::ofstream(dir / "stop") << "failed\n";
+            for (auto& worker : workers)
+                worker.join();
+            throw;
+        }
+
+        std::ofstream(dir / "stop") << "done\n";
+        for (auto& worker : workers)
+            worker.join();
+
+        // The image is already averaged, tile by tile, so it is written as one sample per pixel.
+        const bool binary = s.cam.binary_output;
+        out << (binary ? "P6" : "P3") << '\n' << width << ' ' << height << "\n255\n";
+        if (s.cam.post.enabled()) {
+            auto post = s.cam.post;
+            post.write(out, image, width, height, 1, binary, options.worker_threads);
+        }
+        else {
+            for (const auto& pixel_color : image) {
+                if (binary)
+                    colorTest::write_color_binary(out, pixel_color, 1);
+                else
+                    colorTest::write_color(out, pixel_color, 1);
+            }
+        }
+
+        std::chrono::duration<double, std::milli> elapsed = clock::now() - start;
+        std::clog << "\rMerged " << tiles.size() << " tiles from " << options.local_workers
+                  << " local workers in " << elapsed.count() << " ms (" << re_leased << " re-leased)\n";
+    }
+
+private:
+    distributed_options options;
+    fs::path dir;
+
+    void prepare_directory() {
+        fs::create_directories(dir);
+        for (const char* entry : { "todo", "leased", "done", "alive", "stop", "job.rtsb", "job.tmp.rtsb", "job.settings" })
+            fs::remove_all(dir / entry);
+        for (const char* sub : { "todo", "leased", "done", "alive" })
+            fs::create_directory(dir / sub);
+    }
+
+    std::string worker_command(const std::string& worker_id) const {
+        auto command = quote(options.executable) + " --worker " + quote(dir.string()) +
+                       " --worker-id " + worker_id + " --threads " + std::to_string(options.worker_threads);
+#ifdef _WIN32
+        command = "\"" + command + "\"";    // cmd /c strips one level of outer quotes
+#endif
+        return command;
+    }
+
+    static std::string quote(const std::string& text) {
+        return "\"" + text + "\"";
+    }
+
+    // Adds every finished tile not merged yet to the image, averaged over the samples that tile
+    // took, and returns how many there were. Tiles may take different sample counts (a time
+    // budget, or a retry on another worker), so each is divided by its own.
+    size_t merge_results(std::vector<color>& image, int width, std::vector<bool>& merged) {
+        size_t count = 0;
+        std::error_code ec;
+        std::vector<fs::path> finished;
+        for (fs::directory_iterator it(dir / "done", ec), end; !ec && it != end; it.increment(ec)) {
+            auto name = it->path().filename().string();
+            if (name.find('.') == std::string::npos)    // Skip results still being written
+                finished.push_back(it->path());
+        }
+
+        for (const auto& path : finished) {
+            auto n = size_t(std::stoul(path.filename().string()));
+            tile area;
+            int tile_samples;
+            std::vector<color> sums;
+            if (n < merged.size() && !merged[n] && read_tile_result(path, area, tile_samples, sums)) {
+                auto scale = tile_samples > 0 ? 1.0 / tile_samples : 0.0;
+                for (int j = area.y0; j < area.y1; ++j)
+                    for (int i = area.x0; i < area.x1; ++i)
+                        image[size_t(j) * width + i] = sums[size_t(j - area.y0) * (area.x1 - area.x0) + (i - area.x0)] * scale;
+                merged[n] = true;
+                ++count;
+            }
+            fs::remove(path, ec);
+        }
+        return count;
+    }
+
+    // Moves the leases of workers whose heartbeat is older than the timeout back to todo/.
+    int release_stale_leases() {
+        int released = 0;
+        auto now = fs::file_time_type::clock::now();
+        auto timeout = std::chrono::duration<double>(options.lease_timeout_s);
+        std::error_code ec;
+        std::vector<fs::path> stale;
+        for (fs::directory_iterator it(dir / "leased", ec), end; !ec && it != end; it.increment(ec)) {
+            auto name = it->path().filename().string();
+            auto worker_id = name.substr(name.find('.') + 1);
+            std::error_code time_error;
+            auto beat = fs::last_write_time(dir / "alive" / worker_id, time_error);
+            if (time_error || now - beat > timeout)
+                stale.push_back(it->path());
+        }
+
+        for (const auto& lease : stale) {
+            auto name = lease.filename().string();
+            fs::rename(lease, dir / "todo" / name.substr(0, name.find('.')), ec);
+            if (!ec)
+                ++released;
+        }
+        return released;
+    }
+
+    int release_leases(const std::string& worker_id) {
+        int released = 0;
+        std::error_code ec;
+        std::vector<fs::path> held;
+        for (fs::directory_iterator it(dir / "leased", ec), end; !ec && it != end; it.increment(ec)) {
+            auto name = it->path().filename().string();
+            if (name.substr(name.find('.') + 1) == worker_id)
+                held.push_back(it->path());
+        }
+        for (const auto& lease : held) {
+            auto name = lease.filename().string();
+            fs::rename(lease, dir / "todo" / name.substr(0, name.find('.')), ec);
+            if (!ec)
+                ++released;
+        }
+        return released;
+    }
+};
+
+#endif
@@ -0,0 +1 @@
+#include "environment.h"
@@ -0,0 +1,275 @@
+#pragma once
+#ifndef ENVIRONMENT_H
+#define ENVIRONMENT_H
+
+#include "rtweekend.h"
+#include "alias_table.h"
+#include "color.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// How rays that leave the scene find the environment map.
+enum class environment_sampling {
+    bsdf,        // Only by bouncing off materials, as the gradient sky always has
+    uniform,     // Diffuse hits also send a shadow ray in a uniformly chosen direction (MIS with the bounce)
+    importance   // Diffuse hits also send a shadow ray toward a direction drawn by luminance (MIS with the bounce)
+};
+
+inline environment_sampling parse_environment_sampling(const std::string& name) {
+    if (name == "bsdf") return environment_sampling::bsdf;
+    if (name == "uniform") return environment_sampling::uniform;
+    if (name == "importance") return environment_sampling::importance;
+    throw std::runtime_error("unknown environment sampling '" + name + "' (bsdf, uniform or importance)");
+}
+
+inline const char* environment_sampling_name(environment_sampling sampling) {
+    switch (sampling) {
+    case environment_sampling::bsdf:    return "bsdf";
+    case environment_sampling::uniform: return "uniform";
+    default:                            return "importance";
+    }
+}
+
+// Reads a Radiance .hdr (RGBE) image, flat or with the usual per-channel run-length encoding,
+// into linear float RGB, top row first. Only the standard "-Y <height> +X <width>" layout is read.
+inline std::vector<float> read_hdr(const std::string& path, uint32_t& width, uint32_t& height) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+        throw std::runtime_error("cannot open image '" + path + "'");
+
+    std::string line;
+    std::getline(in, line);
+    if (line.compare(0, 2, "#?") != 0)
+        throw std::runtime_error(path + ": not a Radiance HDR image");
+    while (std::getline(in, line) && !line.empty()) {
+        if (line.compare(0, 7, "FORMAT=") == 0 && line != "FORMAT=32-bit_rle_rgbe")
+            throw std::runtime_error(path + ": only RGBE HDR images are supported");
+    }
+    std::string y_axis, x_axis;
+    in >> y_axis >> height >> x_axis >> width;
+    in.get();
+    if (!in || y_axis != "-Y" || x_axis != "+X" || width == 0 || height == 0)
+        throw std::runtime_error(path + ": unsupported HDR image layout");
+
+    std::vector<float> rgb(size_t(width) * height * 3);
+    std::vector<unsigned char> scanline(size_t(width) * 4);
+    auto fail = [&]() { throw std::runtime_error(path + ": truncated or corrupt HDR image"); };
+
+    for (uint32_t y = 0; y < height; ++y) {
+        unsigned char start[4];
+        if (!in.read(reinterpret_cast<char*>(start), 4)) fail();
+
+        bool encoded = width >= 8 && width < 32768 && start[0] == 2 && start[1] == 2 && start[2] < 128;
+        if (encoded) {
+            if ((uint32_t(start[2]) << 8 | start[3]) != width) fail();
+            // Each channel of the scanline separately: runs (count > 128) and literal spans.
+            for (int channel = 0; channel < 4; ++channel) {
+                uint32_t x = 0;
+                while (x < width) {
+                    int count = in.get();
+                    if (count == EOF) fail();
+                    if (count > 128) {
+                        count -= 128;
+                        int value = in.get();
+                        if (value == EOF || x + count > width) fail();
+                        for (int k = 0; k < count; ++k)
+                            scanline[size_t(x++) * 4 + channel] = static_cast<unsigned char>(value);
+                    }
+                    else {
+                        if (count == 0 || x + count > width) fail();
+                        for (int k = 0; k < count; ++k) {
+                            int value = in.get();
+                            if (value == EOF) fail();
+                            scanline[size_t(x++) * 4 + channel] = static_cast<unsigned char>(value);
+                        }
+                    }
+                }
+            }
+        }
+        else {
+            std::memcpy(scanline.data(), start, 4);
+            if (!in.read(reinterpret_cast<char*>(scanline.data()) + 4, std::streamsize(scanline.size() - 4))) fail();
+        }
+
+        for (uint32_t x = 0; x < width; ++x) {
+            const auto* rgbe = &scanline[size_t(x) * 4];
+            auto scale = rgbe[3] ? float(std::ldexp(1.0, int(rgbe[3]) - (128 + 8))) : 0.0f;
+            auto* out = &rgb[(size_t(y) * width + x) * 3];
+            for (int c = 0; c < 3; ++c)
+                out[c] = rgbe[c] * scale;
+        }
+    }
+    return rgb;
+}
+
+// Reads a PFM image ("PF" colour or "Pf" grey) into linear float RGB, top row first.
+inline std::vector<float> read_pfm(const std::string& path, uint32_t& width, uint32_t& height) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+        throw std::runtime_error("cannot open image '" + path + "'");
+
+    std::string format;
+    double scale = 0;
+    in >> format >> width >> height >> scale;
+    in.get();     // The single whitespace byte after the header
+    if (!in || (format != "PF" && format != "Pf") || width == 0 || height == 0 || scale == 0)
+        throw std::runtime_error(path + ": not a PFM image");
+
+    int channels = format == "PF" ? 3 : 1;
+    std::vector<float> values(size_t(width) * height * channels);
+    if (!in.read(reinterpret_cast<char*>(values.data()), std::streamsize(values.size() * sizeof(float))))
+        throw std::runtime_error(path + ": truncated image");
+
+    // A positive scale means big-endian samples.
+    const uint32_t one = 1;
+    bool little_endian_host = *reinterpret_cast<const unsigned char*>(&one) == 1;
+    if ((scale > 0) == little_endian_host) {
+        for (auto& v : values) {
+            unsigned char bytes[4];
+            std::memcpy(bytes, &v, 4);
+            std::swap(bytes[0], bytes[3]);
+            std::swap(bytes[1], bytes[2]);
+            std::memcpy(&v, bytes, 4);
+        }
+    }
+
+    // PFM rows run bottom to top.
+    std::vector<float> rgb(size_t(width) * height * 3);
+    for (uint32_t y = 0; y < height; ++y) {
+        const auto* row = &values[size_t(height - 1 - y) * width * channels];
+        for (uint32_t x = 0; x < width; ++x)
+            for (int c = 0; c < 3; ++c)
+                rgb[(size_t(y) * width + x) * 3 + c] = row[size_t(x) * channels + (channels == 3 ? c : 0)];
+    }
+    return rgb;
+}
+
+// An equirectangular (latitude-longitude) HDR image lighting the scene from infinitely far away.
+// Directions map to the image the way get_sphere_uv maps points on a sphere, with the top row
+// straight up.
+//
+// For importance sampling the image is divided into cells, each weighted by the light it
+// contributes (luminance times solid angle), and an alias table picks a cell in O(1); a direction
+// is then uniform in solid angle within the cell, so its pdf is exact. Large maps use cells of
+// several texels, at most 512 across, so the tables stay under about 1.5 MB (12 bytes a cell).
+class environment_map {
+public:
+    environment_map(const std::string& path, double _intensity = 1) : intensity(_intensity) {
+        char magic[2] = {};
+        {
+            std::ifstream in(path, std::ios::binary);
+            if (!in)
+                throw std::runtime_error("cannot open environment map '" + path + "'");
+            in.read(magic, 2);
+        }
+        radiance = magic[0] == 'P' ? read_pfm(path, image_width, image_height)
+                                   : read_hdr(path, image_width, image_height);
+        for (auto& v : radiance)
+            if (!(v > 0)) v = 0;     // Also clears NaNs
+        build_distribution();
+    }
+
+    uint32_t width() const { return image_width; }
+    uint32_t height() const { return image_height; }
+
+    // Radiance arriving along -direction, i.e. seen looking toward direction.
+    color value(const vec3& direction) const {
+        const float* c = &radiance[texel(unit_vector(direction)) * 3];
+        return intensity * color(c[0], c[1], c[2]);
+    }
+
+    // A unit direction drawn in proportion to the map's luminance, and its solid-angle pdf.
+    vec3 sample(double& pdf) const {
+        auto c = cells.sample(random_double());
+        uint32_t x0 = (c % cells_x) * cell_size, y0 = (c / cells_x) * cell_size;
+        uint32_t x1 = std::min(x0 + cell_size, image_width), y1 = std::min(y0 + cell_size, image_height);
+
+        auto phi = 2 * pi * (x0 + random_double() * (x1 - x0)) / image_width;
+        auto z0 = row_cos(y0), z1 = row_cos(y1);
+        auto cos_theta = z0 + random_double() * (z1 - z0);
+        auto sin_theta = sqrt(fmax(0.0, 1 - cos_theta * cos_theta));
+        pdf = cell_density(c);
+        return vec3(-cos(phi) * sin_theta, -cos_theta, sin(phi) * sin_theta);
+    }
+
+    // Solid-angle pdf of sample() returning the given direction.
+    double pdf(const vec3& direction) const {
+        auto t = texel(unit_vector(direction));
+        auto x = uint32_t(t % image_width), y = uint32_t(t / image_width);
+        return cell_density((y / cell_size) * cells_x + x / cell_size);
+    }
+
+    size_t memory_bytes() const {
+        return radiance.size() * sizeof(float) + distribution_bytes();
+    }
+
+    size_t distribution_bytes() const {
+        return cells.memory_bytes() + row_solid_angle.size() * sizeof(float);
+    }
+
+private:
+    static const uint32_t max_cells_across = 512;
+
+    double intensity;
+    uint32_t image_width = 0, image_height = 0;
+    std::vector<float> radiance;   // Linear RGB, top row first
+    uint32_t cell_size = 1;        // Cells are cell_size x cell_size texels (smaller at the edges)
+    uint32_t cells_x = 0, cells_y = 0;
+    alias_table cells;
+    std::vector<float> row_solid_angle;  // Solid angle of one texel column of each row of cells
+
+    // cos(theta) at the top edge of row y, with theta measured from straight down as in
+    // get_sphere_uv: -1 at the top of the image, 1 at the bottom.
+    double row_cos(uint32_t y) const {
+        return cos(pi * (1 - double(y) / image_height));
+    }
+
+    // Solid-angle pdf of the directions in cell c: uniform over the cell.
+    double cell_density(uint32_t c) const {
+        auto x0 = (c % cells_x) * cell_size;
+        auto columns = std::min(x0 + cell_size, image_width) - x0;
+        auto solid_angle = row_solid_angle[c / cells_x] * columns;
+        return solid_angle > 0 ? cells.probability(c) / solid_angle : 0;
+    }
+
+    size_t texel(const vec3& d) const {
+        auto theta = acos(fmin(1.0, fmax(-1.0, -d.y())));
+        auto phi = atan2(-d.z(), d.x()) + pi;
+        auto x = std::min(uint32_t(phi / (2 * pi) * image_width), image_width - 1);
+        auto y = std::min(uint32_t((1 - theta / pi) * image_height), image_height - 1);
+        return size_t(y) * image_width + x;
+    }
+
+    void build_distribution() {
+        cell_size = std::max(1u, (image_width + max_cells_across - 1) / max_cells_across);
+        cells_x = (image_width + cell_size - 1) / cell_size;
+        cells_y = (image_height + cell_size - 1) / cell_size;
+
+        // Light through each cell: luminance times each texel row's solid angle.
+        std::vector<double> weights(size_t(cells_x) * cells_y, 0.0);
+        auto texel_phi = 2 * pi / image_width;
+        for (uint32_t y = 0; y < image_height; ++y) {
+            auto row_solid_angle = texel_phi * fabs(row_cos(y) - row_cos(y + 1));
+            auto* cell_row = &weights[size_t(y / cell_size) * cells_x];
+            for (uint32_t x = 0; x < image_width; ++x) {
+                const float* c = &radiance[(size_t(y) * image_width + x) * 3];
+                cell_row[x / cell_size] += luminance(color(c[0], c[1], c[2])) * row_solid_angle;
+            }
+        }
+
+        cells = alias_table(weights);
+        row_solid_angle.resize(cells_y);
+        for (uint32_t cy = 0; cy < cells_y; ++cy) {
+            auto y0 = cy * cell_size, y1 = std::min(y0 + cell_size, image_height);
+            row_solid_angle[cy] = float(texel_phi * fabs(row_cos(y0) - row_cos(y1)));
+        }
+    }
+};
+
+#endif
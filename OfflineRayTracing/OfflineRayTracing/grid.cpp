@@ -0,0 +1 @@
+#include "grid.h"
@@ -0,0 +1,372 @@
+#pragma once
+#ifndef GRID_H
+#define GRID_H
+
+#include "rtweekend.h"
+#include "aabb.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Regular grid over a list of objects, traversed cell by cell along the ray with a 3D-DDA
+// (Amanatides and Woo). Every object is listed in each cell its box overlaps, all lists packed
+// into one array. Building is two linear passes, counting and then filling, with no sorting, so
+// it beats a tree on build time; on many small objects of about the same size spread evenly, as
+// in the generated sphere fields, it can beat one on trace time too.
+//
+// The resolution is picked from the object count: about `density` cells per object, as close to
+// cubic as the bounds allow, so flat scenes get flat grids. Objects far larger than the typical
+// one (the ground sphere) would land in every cell; they are kept out of the grid and tested by
+// every ray before it walks the cells. So are stochastic objects (media): the mailbox forgets
+// objects once more than its size have been tested since, and a medium tested twice by one ray
+// gets two chances to stop it, which would bias its transmittance low.
+//
+// Where objects crowd, a uniform grid either puts many in a cell or wastes memory on empty cells
+// elsewhere. The two-level grid starts coarse and gives each crowded cell a grid of its own,
+// sized for the objects in it.
+class grid : public hittable {
+public:
+    grid(const hittable_list& list, bool two_level = false) : grid(list.objects, nullptr, two_level) {}
+
+    grid(const hittable_list& list, const interval& time, bool two_level = false) : grid(list.objects, &time, two_level) {}
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        RT_STAT(render_stats::local().primitive_tests += large.size());
+        bool hit_anything = false;
+        for (auto index : large) {
+            if (objects[index]->hit(r, ray_t, rec)) {
+                hit_anything = true;
+                ray_t.max = rec.t;
+            }
+        }
+
+        mailbox tested;
+        if (traverse(top, r, ray_t, rec, tested))
+            hit_anything = true;
+        return hit_anything;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    bool stochastic() const override {
+        for (auto index : large)
+            if (objects[index]->stochastic())
+                return true;
+        return false;
+    }
+
+    // Cells over both levels, and how many of them hold their own grid.
+    size_t cell_count() const {
+        size_t count = top.cell_start.size() - 1;
+        for (const auto& child : children)
+            count += child.cell_start.size() - 1;
+        return count;
+    }
+
+    size_t child_count() const { return children.size(); }
+
+    size_t memory_bytes() const {
+        auto bytes = level_bytes(top) + cell_child.capacity() * sizeof(uint32_t) + large.capacity() * sizeof(uint32_t)
+                     + objects.capacity() * sizeof(shared_ptr<hittable>) + children.capacity() * sizeof(level);
+        for (const auto& child : children)
+            bytes += level_bytes(child);
+        return bytes;
+    }
+
+private:
+    // One grid: its bounds, resolution and each cell's list of object indices.
+    struct level {
+        aabb     bounds;
+        int      res[3] = { 1, 1, 1 };
+        vec3     cell_size;
+        vec3     inv_cell_size;
+        std::vector<uint32_t> cell_start;     // Cell c lists cell_objects[cell_start[c], cell_start[c + 1])
+        std::vector<uint32_t> cell_objects;
+    };
+
+    // The last few objects this ray tested, so an object spanning several cells is usually
+    // intersected once rather than once per cell.
+    struct mailbox {
+        static const int size = 8;
+        uint32_t recent[size] = { UINT32_MAX, UINT32_MAX, UINT32_MAX, UINT32_MAX,
+                                  UINT32_MAX, UINT32_MAX, UINT32_MAX, UINT32_MAX };
+        int next = 0;
+
+        // True if the object was tested already; otherwise remembers it.
+        bool seen(uint32_t index) {
+            for (auto r : recent)
+                if (r == index)
+                    return true;
+            recent[next] = index;
+            next = (next + 1) % size;
+            return false;
+        }
+    };
+
+    static constexpr double density = 4;              // Cells per object in a uniform grid
+    static constexpr double top_density = 0.125;      // Cells per object in the top level of a two-level grid
+    static constexpr double child_density = 2;        // Cells per object in a crowded cell's own grid
+    static const uint32_t child_threshold = 4;        // Objects that make a top-level cell crowded
+    static constexpr double large_factor = 32;        // Objects this many times the median extent skip the grid
+    static const int max_resolution = 1024;           // Cells along one axis
+
+    level top;
+    std::vector<level> children;
+    std::vector<uint32_t> cell_child;    // Per top-level cell: one more than the index of its grid, or 0
+    std::vector<uint32_t> large;         // Objects tested by every ray: the large ones and the stochastic ones
+    std::vector<shared_ptr<hittable>> objects;
+    aabb bbox;
+
+    // Builds over each object's whole bounding box, or over its bounds during time if given.
+    grid(const std::vector<shared_ptr<hittable>>& src_objects, const interval* time, bool two_level)
+        : objects(src_objects)
+    {
+        std::vector<aabb> boxes;
+        boxes.reserve(objects.size());
+        for (const auto& object : objects) {
+            boxes.push_back(time ? object->motion_bounds(*time) : object->bounding_box());
+            bbox = aabb(bbox, boxes.back());
+        }
+
+        std::vector<uint32_t> gridded;
+        split_large(boxes, gridded);
+        if (gridded.empty()) {
+            top.cell_start.assign(2, 0);
+            return;
+        }
+
+        aabb bounds;
+        for (auto index : gridded)
+            bounds = aabb(bounds, boxes[index]);
+        build_level(top, bounds.pad(), gridded, boxes, two_level ? top_density : density);
+        if (!two_level)
+            return;
+
+        // Give every crowded cell a grid clipped to the cell and to what is in it.
+        std::vector<uint32_t> members;
+        cell_child.assign(top.cell_start.size() - 1, 0);
+        for (size_t c = 0; c + 1 < top.cell_start.size(); ++c) {
+            auto begin = top.cell_start[c], end = top.cell_start[c + 1];
+            if (end - begin <= child_threshold)
+                continue;
+            auto cell = cell_box(top, c);
+            aabb content;
+            members.assign(top.cell_objects.begin() + begin, top.cell_objects.begin() + end);
+            for (auto index : members)
+                content = aabb(content, boxes[index]);
+            auto clipped = aabb(interval(fmax(cell.x.min, content.x.min), fmin(cell.x.max, content.x.max)),
+                                interval(fmax(cell.y.min, content.y.min), fmin(cell.y.max, content.y.max)),
+                                interval(fmax(cell.z.min, content.z.min), fmin(cell.z.max, content.z.max)));
+            children.emplace_back();
+            build_level(children.back(), clipped.pad(), members, boxes, child_density);
+            cell_child[c] = static_cast<uint32_t>(children.size());
+        }
+        children.shrink_to_fit();
+        if (children.empty())
+            cell_child.clear();
+    }
+
+    // Moves the indices of objects much larger than the median one, and of stochastic ones, to
+    // `large`, the rest to gridded.
+    void split_large(const std::vector<aabb>& boxes, std::vector<uint32_t>& gridded) {
+        std::vector<double> extents(boxes.size());
+        for (size_t i = 0; i < boxes.size(); ++i)
+            extents[i] = longest_extent(boxes[i]);
+        double limit = infinity;
+        if (!extents.empty()) {
+            auto median = extents;
+            std::nth_element(median.begin(), median.begin() + median.size() / 2, median.end());
+            if (median[median.size() / 2] > 0)
+                limit = large_factor * median[median.size() / 2];
+        }
+
+        gridded.reserve(boxes.size());
+        for (size_t i = 0; i < boxes.size(); ++i) {
+            if (boxes[i].empty())
+                continue;
+            (extents[i] > limit || objects[i]->stochastic() ? large : gridded).push_back(static_cast<uint32_t>(i));
+        }
+        large.shrink_to_fit();
+    }
+
+    // Fills in a grid over the given objects, with about cells_per_object cells for each.
+    static void build_level(level& g, const aabb& bounds, const std::vector<uint32_t>& members,
+                            const std::vector<aabb>& boxes, double cells_per_object) {
+        g.bounds = bounds;
+        choose_resolution(bounds, fmax(1.0, cells_per_object * members.size()), g.res);
+        for (int a = 0; a < 3; ++a) {
+            g.cell_size[a] = bounds.axis(a).size() / g.res[a];
+            g.inv_cell_size[a] = 1 / g.cell_size[a];
+        }
+
+        // Count each cell's objects, turn the counts into offsets, then drop every object in.
+        size_t cells = size_t(g.res[0]) * g.res[1] * g.res[2];
+        g.cell_start.assign(cells + 1, 0);
+        for (auto index : members)
+            for_each_cell(g, boxes[index], [&](size_t c) { g.cell_start[c + 1]++; });
+        for (size_t c = 0; c < cells; ++c)
+            g.cell_start[c + 1] += g.cell_start[c];
+        g.cell_objects.resize(g.cell_start[cells]);
+        std::vector<uint32_t> fill(g.cell_start.begin(), g.cell_start.end() - 1);
+        for (auto index : members)
+            for_each_cell(g, boxes[index], [&](size_t c) { g.cell_objects[fill[c]++] = index; });
+    }
+
+    // Cells along each axis so the grid has about `cells` cubic cells. An axis narrower than a
+    // cell gets a single one and the others share the count.
+    static void choose_resolution(const aabb& bounds, double cells, int res[3]) {
+        bool thin[3] = { false, false, false };
+        double side = 0;
+        for (int pass = 0; pass < 3; ++pass) {
+            double volume = 1;
+            int axes = 0;
+            for (int a = 0; a < 3; ++a) {
+                if (thin[a]) continue;
+                volume *= bounds.axis(a).size();
+                ++axes;
+            }
+            if (axes == 0)
+                break;
+            side = pow(volume / cells, 1.0 / axes);
+            bool changed = false;
+            for (int a = 0; a < 3; ++a) {
+                if (!thin[a] && bounds.axis(a).size() < side) {
+                    thin[a] = true;
+                    changed = true;
+                }
+            }
+            if (!changed)
+                break;
+        }
+        for (int a = 0; a < 3; ++a) {
+            auto n = thin[a] || side <= 0 ? 1.0 : std::round(bounds.axis(a).size() / side);
+            res[a] = static_cast<int>(fmin(fmax(n, 1.0), double(max_resolution)));
+        }
+    }
+
+    template <typename Visit>
+    static void for_each_cell(const level& g, const aabb& box, Visit visit) {
+        int lo[3], hi[3];
+        for (int a = 0; a < 3; ++a) {
+            lo[a] = cell_coordinate(g, a, box.axis(a).min);
+            hi[a] = cell_coordinate(g, a, box.axis(a).max);
+        }
+        for (int z = lo[2]; z <= hi[2]; ++z)
+            for (int y = lo[1]; y <= hi[1]; ++y)
+                for (int x = lo[0]; x <= hi[0]; ++x)
+                    visit(cell_index(g, x, y, z));
+    }
+
+    static int cell_coordinate(const level& g, int a, double value) {
+        auto c = static_cast<int>((value - g.bounds.axis(a).min) * g.inv_cell_size[a]);
+        return c < 0 ? 0 : (c >= g.res[a] ? g.res[a] - 1 : c);
+    }
+
+    static size_t cell_index(const level& g, int x, int y, int z) {
+        return size_t(x) + size_t(g.res[0]) * (size_t(y) + size_t(g.res[1]) * size_t(z));
+    }
+
+    static aabb cell_box(const level& g, size_t c) {
+        int coordinate[3] = { int(c % g.res[0]), int(c / g.res[0] % g.res[1]), int(c / (size_t(g.res[0]) * g.res[1])) };
+        interval span[3];
+        for (int a = 0; a < 3; ++a) {
+            auto min = g.bounds.axis(a).min + coordinate[a] * g.cell_size[a];
+            span[a] = interval(min, coordinate[a] + 1 == g.res[a] ? g.bounds.axis(a).max : min + g.cell_size[a]);
+        }
+        return aabb(span[0], span[1], span[2]);
+    }
+
+    // Walks the cells of g the ray passes through, nearest first, testing their objects and
+    // descending into their grids, until a hit lies before the next cell or the ray leaves.
+    bool traverse(const level& g, const ray& r, interval& ray_t, hit_record& rec, mailbox& tested) const {
+        const point3 orig = r.origin();
+        const vec3 dir = r.direction();
+        const vec3 inv_dir(1 / dir[0], 1 / dir[1], 1 / dir[2]);
+
+        // Clip the ray to the grid.
+        auto t_enter = ray_t.min, t_exit = ray_t.max;
+        for (int a = 0; a < 3; ++a) {
+            auto t0 = (g.bounds.axis(a).min - orig[a]) * inv_dir[a];
+            auto t1 = (g.bounds.axis(a).max - orig[a]) * inv_dir[a];
+            if (inv_dir[a] < 0)
+                std::swap(t0, t1);
+            if (t0 > t_enter) t_enter = t0;
+            if (t1 < t_exit) t_exit = t1;
+            if (t_exit <= t_enter)
+                return false;
+        }
+
+        int cell[3], step[3], out[3];
+        double next_t[3], delta_t[3];
+        auto entry = r.at(t_enter);
+        for (int a = 0; a < 3; ++a) {
+            cell[a] = cell_coordinate(g, a, entry[a]);
+            if (dir[a] > 0) {
+                step[a] = 1;
+                out[a] = g.res[a];
+                next_t[a] = (g.bounds.axis(a).min + (cell[a] + 1) * g.cell_size[a] - orig[a]) * inv_dir[a];
+                delta_t[a] = g.cell_size[a] * inv_dir[a];
+            }
+            else if (dir[a] < 0) {
+                step[a] = -1;
+                out[a] = -1;
+                next_t[a] = (g.bounds.axis(a).min + cell[a] * g.cell_size[a] - orig[a]) * inv_dir[a];
+                delta_t[a] = -g.cell_size[a] * inv_dir[a];
+            }
+            else {
+                step[a] = 0;
+                out[a] = -1;
+                next_t[a] = infinity;
+                delta_t[a] = infinity;
+            }
+        }
+
+        RT_STAT(auto& stats = render_stats::local());
+        bool hit_anything = false;
+        while (true) {
+            auto c = cell_index(g, cell[0], cell[1], cell[2]);
+            RT_STAT(++stats.box_tests);
+            if (&g == &top && !cell_child.empty() && cell_child[c] != 0) {
+                if (traverse(children[cell_child[c] - 1], r, ray_t, rec, tested))
+                    hit_anything = true;
+            }
+            else {
+                for (auto i = g.cell_start[c]; i < g.cell_start[c + 1]; ++i) {
+                    auto index = g.cell_objects[i];
+                    if (tested.seen(index))
+                        continue;
+                    RT_STAT(++stats.primitive_tests);
+                    if (objects[index]->hit(r, ray_t, rec)) {
+                        hit_anything = true;
+                        ray_t.max = rec.t;
+                    }
+                }
+            }
+
+            // Step into whichever neighbor the ray reaches first, unless the closest hit so far
+            // comes before it.
+            int a = next_t[0] < next_t[1] ? (next_t[0] < next_t[2] ? 0 : 2) : (next_t[1] < next_t[2] ? 1 : 2);
+            if (next_t[a] > ray_t.max || next_t[a] > t_exit)
+                break;
+            cell[a] += step[a];
+            if (cell[a] == out[a])
+                break;
+            next_t[a] += delta_t[a];
+        }
+        return hit_anything;
+    }
+
+    static double longest_extent(const aabb& box) {
+        return box.empty() ? 0 : fmax(box.x.size(), fmax(box.y.size(), box.z.size()));
+    }
+
+    static size_t level_bytes(const level& g) {
+        return (g.cell_start.capacity() + g.cell_objects.capacity()) * sizeof(uint32_t);
+    }
+};
+
+#endif
@@ -4,6 +4,7 @@
 
 #include "ray.h"
 #include "rtweekend.h"
+#include "aabb.h"
 
 class material;
 
@@ -13,6 +14,12 @@ public:
     vec3 normal;
     shared_ptr<material> mat;
     double t;
+    double u, v;           // Surface coordinates of the hit, for textures
+    double uv_size;        // World-space length of one unit of u or v around the hit
+    double cone_width;     // Width of the ray cone at the hit, set by the camera
+    double uv_footprint;   // The same, in uv units as seen along the ray
+    int light;             // Index of the emitter hit in the scene's light list, or -1
+    bool sphere;           // The hit is on a sphere that stays put, rather than a triangle or a moving sphere
 
     bool front_face;
 
@@ -31,6 +38,17 @@ public:
     virtual ~hittable() = default;
 
     virtual bool hit(const ray& r, interval ray_t, hit_record& rec) const = 0;
+
+    virtual aabb bounding_box() const = 0;
+
+    // Bounds of the object over the times in the interval. Only moving objects need to override
+    // it; acceleration structures use it to enclose one frame's motion rather than all of it.
+    virtual aabb motion_bounds(const interval& time) const { return bounding_box(); }
+
+    // True if hit() draws random numbers (a participating medium), so testing the object twice
+    // with one ray is not the same as testing it once. Structures that may test an object more
+    // than once per ray must test these exactly once.
+    virtual bool stochastic() const { return false; }
 };
 
 #endif
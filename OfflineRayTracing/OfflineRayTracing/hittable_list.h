@@ -3,6 +3,7 @@
 #define HITTABLE_LIST_H
 
 #include "hittable.h"
+#include "stats.h"
 
 #include <memory>
 #include <vector>
@@ -17,16 +18,23 @@ public:
     hittable_list() {}
     hittable_list(shared_ptr<hittable> object) { add(object); }
 
-    void clear() { objects.clear(); }
+    void clear() {
+        objects.clear();
+        bbox = aabb();
+    }
+
+    void reserve(size_t count) { objects.reserve(count); }
 
     void add(shared_ptr<hittable> object) {
         objects.push_back(object);
+        bbox = aabb(bbox, object->bounding_box());
     }
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
         hit_record temp_rec;
         bool hit_anything = false;
         auto closest_so_far = ray_t.max;
+        RT_STAT(render_stats::local().primitive_tests += objects.size());
 
         for (const auto& object : objects) {
             if (object->hit(r, interval(ray_t.min, closest_so_far), temp_rec)) {
@@ -38,6 +46,18 @@ public:
 
         return hit_anything;
     }
+
+    aabb bounding_box() const override { return bbox; }
+
+    bool stochastic() const override {
+        for (const auto& object : objects)
+            if (object->stochastic())
+                return true;
+        return false;
+    }
+
+private:
+    aabb bbox;
 };
 
 #endif
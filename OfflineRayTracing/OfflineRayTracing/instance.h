@@ -0,0 +1,187 @@
+#pragma once
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "hittable.h"
+#include "vec3.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+// Places a shared piece of geometry (usually a mesh) into the world with its own
+// scale, rotation about the y axis and translation, applied in that order.
+//
+// A moving instance follows a path of placements at given times, each of offset, angle and scale
+// changing linearly from one to the next, and rests at the first and last outside their times.
+class instance : public hittable {
+public:
+    // A placement a moving instance passes through.
+    struct key {
+        double time;
+        vec3   offset;
+        double rotate_y;   // Degrees
+        double scale;
+    };
+
+    instance(shared_ptr<hittable> _object, vec3 _offset, double _rotate_y, double _scale)
+        : object(_object), start(placement_of(_offset, _rotate_y, _scale))
+    {
+        bbox = box_at(start);
+    }
+
+    instance(shared_ptr<hittable> _object, vec3 offset0, double rotate_y0, double scale0,
+             vec3 offset1, double rotate_y1, double scale1, double time0, double time1)
+        : instance(_object, { { time0, offset0, rotate_y0, scale0 }, { time1, offset1, rotate_y1, scale1 } }) {}
+
+    // Keys must be in time order, and there must be at least two; throws std::invalid_argument if not.
+    instance(shared_ptr<hittable> _object, const std::vector<key>& keys)
+        : object(_object), moving(true)
+    {
+        const auto& first = checked(keys).front();
+        start = placement_of(first.offset, first.rotate_y, first.scale);
+        for (const auto& k : keys)
+            path.push_back({ k.time, k.offset, degrees_to_radians(k.rotate_y), k.scale });
+
+        // How fast a corner of the object's box can move on the fastest stretch of the path:
+        // turning, growing and translating.
+        auto object_box = object->bounding_box();
+        double around_axis = 0, from_origin = 0;
+        for (int i = 0; i < 8; i++) {
+            vec3 corner = box_corner(object_box, i);
+            around_axis = fmax(around_axis, sqrt(corner[0] * corner[0] + corner[2] * corner[2]));
+            from_origin = fmax(from_origin, corner.length());
+        }
+        for (size_t i = 1; i < path.size(); ++i) {
+            const auto& a = path[i - 1];
+            const auto& b = path[i];
+            if (b.time <= a.time)
+                continue;
+            auto speed = (fabs(b.angle - a.angle) * fmax(fabs(a.scale), fabs(b.scale)) * around_axis
+                          + fabs(b.scale - a.scale) * from_origin + (b.offset - a.offset).length()) / (b.time - a.time);
+            max_speed = fmax(max_speed, speed);
+        }
+        bbox = motion_bounds(interval(path.front().time, path.back().time));
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        const placement& at = moving ? placement_at(r.time()) : start;
+
+        // Move the ray into object space. The transform is affine, so t is the same in both spaces.
+        ray object_r(to_object(at, r.origin() - at.offset), to_object(at, r.direction()), r.time());
+
+        if (!object->hit(object_r, ray_t, rec))
+            return false;
+
+        // Move the intersection back into world space.
+        rec.p = r.at(rec.t);
+        rec.normal = rotate(at, rec.normal);
+        rec.uv_size *= at.scale;
+
+        return true;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    bool stochastic() const override { return object->stochastic(); }
+
+    // The corners of the object's box at evenly spaced times, padded by how far a corner can
+    // stray from the nearer sample between two of them.
+    aabb motion_bounds(const interval& time) const override {
+        if (!moving)
+            return bbox;
+        const int steps = 16;
+        auto a = time.min, b = fmax(time.min, time.max);
+        aabb box;
+        for (int i = 0; i <= steps; ++i)
+            box = aabb(box, box_at(placement_at(a + (b - a) * i / steps)));
+        auto pad = max_speed * (b - a) / steps;   // expand() adds half of this on each side
+        return aabb(box.x.expand(pad), box.y.expand(pad), box.z.expand(pad));
+    }
+
+private:
+    struct placement {
+        vec3   offset;
+        double sin_theta;
+        double cos_theta;
+        double scale;
+    };
+
+    shared_ptr<hittable> object;
+    placement start;
+    aabb bbox;
+
+    struct pose {
+        double time;
+        vec3   offset;
+        double angle;      // Radians
+        double scale;
+    };
+
+    bool   moving = false;
+    std::vector<pose> path;    // Moving instances only
+    double max_speed = 0;      // Fastest any corner of the object's box moves, per unit time
+
+    static const std::vector<key>& checked(const std::vector<key>& keys) {
+        if (keys.size() < 2)
+            throw std::invalid_argument("an instance path needs at least two keys");
+        for (size_t i = 1; i < keys.size(); ++i)
+            if (keys[i].time < keys[i - 1].time)
+                throw std::invalid_argument("instance path keys are out of time order");
+        return keys;
+    }
+
+    static placement placement_of(const vec3& offset, double rotate_y, double scale) {
+        auto radians = degrees_to_radians(rotate_y);
+        return { offset, sin(radians), cos(radians), scale };
+    }
+
+    placement placement_at(double time) const {
+        auto next = std::upper_bound(path.begin(), path.end(), time,
+                                     [](double t, const pose& p) { return t < p.time; });
+        if (next == path.begin())
+            return placement_of(path.front());
+        if (next == path.end())
+            return placement_of(path.back());
+        const auto& a = *(next - 1);
+        const auto& b = *next;
+        auto s = (time - a.time) / (b.time - a.time);
+        return placement_of({ time, a.offset + s * (b.offset - a.offset), a.angle + s * (b.angle - a.angle),
+                              a.scale + s * (b.scale - a.scale) });
+    }
+
+    static placement placement_of(const pose& p) {
+        return { p.offset, sin(p.angle), cos(p.angle), p.scale };
+    }
+
+    static vec3 box_corner(const aabb& box, int i) {
+        return vec3(i & 1 ? box.x.max : box.x.min,
+                    i & 2 ? box.y.max : box.y.min,
+                    i & 4 ? box.z.max : box.z.min);
+    }
+
+    // Transform the corners of the object's box and take the box around them.
+    aabb box_at(const placement& at) const {
+        auto object_box = object->bounding_box();
+        aabb box;
+        for (int i = 0; i < 8; i++) {
+            auto p = rotate(at, at.scale * box_corner(object_box, i)) + at.offset;
+            box = aabb(box, aabb(p, p));
+        }
+        return box;
+    }
+
+    static vec3 to_object(const placement& at, const vec3& v) {
+        return vec3(at.cos_theta * v[0] - at.sin_theta * v[2],
+                    v[1],
+                    at.sin_theta * v[0] + at.cos_theta * v[2]) / at.scale;
+    }
+
+    static vec3 rotate(const placement& at, const vec3& v) {
+        return vec3(at.cos_theta * v[0] + at.sin_theta * v[2],
+                    v[1],
+                    -at.sin_theta * v[0] + at.cos_theta * v[2]);
+    }
+};
+
+#endif
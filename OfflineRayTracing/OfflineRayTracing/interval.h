@@ -12,6 +12,20 @@ public:
 
     interval(double _min, double _max) : min(_min), max(_max) {}
 
+    // Smallest interval enclosing both. Plain comparisons rather than fmin/fmax, which are
+    // library calls on some compilers and this sits in the inner loop of BVH builds.
+    interval(const interval& a, const interval& b)
+        : min(a.min <= b.min ? a.min : b.min), max(a.max >= b.max ? a.max : b.max) {}
+
+    double size() const {
+        return max - min;
+    }
+
+    interval expand(double delta) const {
+        auto padding = delta / 2;
+        return interval(min - padding, max + padding);
+    }
+
     bool contains(double x) const {
         return min <= x && x <= max;
     }
@@ -0,0 +1 @@
+#include "light_tree.h"
@@ -0,0 +1,471 @@
+#pragma once
+#ifndef LIGHT_TREE_H
+#define LIGHT_TREE_H
+
+#include "rtweekend.h"
+#include "aabb.h"
+#include "color.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <future>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// How diffuse hits choose an emitter to send a shadow ray toward.
+enum class light_selection {
+    bsdf,      // None: emitters are only found by bouncing off materials
+    uniform,   // Every emitter equally likely
+    tree       // Stochastic descent of the light tree, by estimated contribution
+};
+
+inline light_selection parse_light_selection(const std::string& name) {
+    if (name == "bsdf") return light_selection::bsdf;
+    if (name == "uniform") return light_selection::uniform;
+    if (name == "tree") return light_selection::tree;
+    throw std::runtime_error("unknown light selection '" + name + "' (bsdf, uniform or tree)");
+}
+
+inline const char* light_selection_name(light_selection selection) {
+    switch (selection) {
+    case light_selection::bsdf:    return "bsdf";
+    case light_selection::uniform: return "uniform";
+    default:                       return "tree";
+    }
+}
+
+// An emissive sphere, sampled through the cone of directions it subtends.
+struct sphere_light {
+    point3 center;
+    double radius;
+    color  emission;   // Radiance leaving the surface
+
+    double power() const {
+        return luminance(emission) * pi * 4 * pi * radius * radius;
+    }
+
+    // A direction from p toward the sphere, uniform within the cone it subtends, with its
+    // solid-angle pdf and the distance to the sphere's surface along it. False from inside.
+    bool sample(const point3& p, vec3& direction, double& pdf, double& distance) const {
+        auto to_center = center - p;
+        auto d2 = to_center.length_squared();
+        if (d2 <= radius * radius)
+            return false;
+
+        auto cos_max = sqrt(1 - radius * radius / d2);
+        auto cos_theta = 1 + random_double() * (cos_max - 1);
+        auto sin_theta = sqrt(fmax(0.0, 1 - cos_theta * cos_theta));
+        auto phi = 2 * pi * random_double();
+
+        auto w = to_center / sqrt(d2);
+        auto a = fabs(w.x()) > 0.9 ? vec3(0, 1, 0) : vec3(1, 0, 0);
+        auto u = unit_vector(cross(a, w));
+        auto v = cross(w, u);
+        direction = cos(phi) * sin_theta * u + sin(phi) * sin_theta * v + cos_theta * w;
+
+        // Nearer root of |p + t direction - center| = radius.
+        auto b = dot(to_center, direction);
+        distance = b - sqrt(fmax(0.0, b * b - (d2 - radius * radius)));
+        pdf = 1 / (2 * pi * (1 - cos_max));
+        return true;
+    }
+
+    // Solid-angle pdf of sample() from p choosing any one direction that hits the sphere.
+    double pdf(const point3& p) const {
+        auto d2 = (center - p).length_squared();
+        if (d2 <= radius * radius)
+            return 0;
+        return 1 / (2 * pi * (1 - sqrt(1 - radius * radius / d2)));
+    }
+};
+
+// A bounding volume hierarchy over emitters (Conty Estevez and Kulla, "Importance Sampling of
+// Many Lights with Adaptive Tree Splitting"). Each node bounds its lights' positions with a box,
+// their emission directions with a cone, and sums their power. From a shading point the tree is
+// descended stochastically, choosing each child in proportion to an estimate of its contribution,
+// so bright, near lights facing the point are picked far more often than the rest; the
+// probability of the light picked is the product of the choices, and any light's probability can
+// be recomputed along its stored path for MIS.
+//
+// Built top-down with binned splits that minimise power times box area times cone measure; the
+// two halves of large ranges are built on separate threads.
+class light_tree {
+public:
+    light_tree() = default;
+
+    explicit light_tree(std::vector<sphere_light> _lights) : lights(std::move(_lights)) {
+        if (lights.empty())
+            return;
+
+        std::vector<build_light> data;
+        data.reserve(lights.size());
+        for (size_t i = 0; i < lights.size(); ++i) {
+            const auto& l = lights[i];
+            auto r = vec3(l.radius, l.radius, l.radius);
+            data.push_back({ aabb(l.center - r, l.center + r), l.center, l.power(), uint32_t(i) });
+        }
+
+        int parallel_depth = 0;
+        for (unsigned threads = std::max(1u, std::thread::hardware_concurrency()); threads > 1; threads /= 2)
+            ++parallel_depth;
+        nodes = build(data, 0, data.size(), 0, parallel_depth);
+
+        paths.resize(lights.size());
+        record_paths(0, 0, 0);
+    }
+
+    size_t size() const { return lights.size(); }
+    const sphere_light& light(uint32_t index) const { return lights[index]; }
+
+    size_t node_count() const { return nodes.size(); }
+
+    // Picks a light for a shading point p with normal n (zero for none) from a uniform random
+    // number u, and returns its index with its probability in pmf; pmf is 0 when no light can
+    // contribute.
+    uint32_t sample(const point3& p, const vec3& n, double u, double& pmf) const {
+        pmf = 0;
+        if (nodes.empty())
+            return 0;
+
+        uint32_t current = 0;
+        double probability = 1;
+        while (!nodes[current].leaf) {
+            auto left = importance(nodes[current + 1], p, n);
+            auto right = importance(nodes[nodes[current].offset], p, n);
+            if (left + right <= 0)
+                return 0;
+
+            // Reuse u for every choice: rescale what is left of it to [0, 1).
+            auto p_left = left / (left + right);
+            if (u < p_left) {
+                u = fmin(u / p_left, 1 - 1e-12);
+                probability *= p_left;
+                current = current + 1;
+            }
+            else {
+                u = fmin((u - p_left) / (1 - p_left), 1 - 1e-12);
+                probability *= 1 - p_left;
+                current = nodes[current].offset;
+            }
+        }
+        pmf = probability;
+        return nodes[current].offset;
+    }
+
+    // Probability of sample() picking the given light from p and n.
+    double pmf(uint32_t index, const point3& p, const vec3& n) const {
+        auto path = paths[index];
+        uint32_t current = 0;
+        double probability = 1;
+        for (uint32_t level = 0; !nodes[current].leaf; ++level) {
+            auto left = importance(nodes[current + 1], p, n);
+            auto right = importance(nodes[nodes[current].offset], p, n);
+            if (left + right <= 0)
+                return 0;
+            bool go_right = (path >> level) & 1;
+            probability *= (go_right ? right : left) / (left + right);
+            current = go_right ? nodes[current].offset : current + 1;
+        }
+        return probability;
+    }
+
+    size_t memory_bytes() const {
+        return nodes.capacity() * sizeof(node) + lights.capacity() * sizeof(sphere_light) + paths.capacity() * sizeof(uint64_t);
+    }
+
+private:
+    // Bounds of a group of emitters: where they are, which way they emit (every direction within
+    // cos_theta_e of a cone of half-angle theta_o around axis) and their total power.
+    struct light_bounds {
+        aabb   box;
+        vec3   axis;
+        double cos_theta_o;
+        double cos_theta_e;
+        double power;
+    };
+
+    // What traversal reads of a node's bounds, in floats: the box as its bounding sphere, the
+    // cones and the power. 48 bytes, so a pair of siblings shares two cache lines at most.
+    struct node {
+        float    center[3];
+        float    radius2;       // Squared radius of the sphere around the box
+        float    axis[3];
+        float    cos_theta_o;
+        float    cos_theta_e;
+        float    power;
+        uint32_t offset;   // The light for leaves, the second child for interior nodes
+        uint32_t leaf;
+
+        node() = default;
+        node(const light_bounds& b, uint32_t _offset, uint32_t _leaf) : offset(_offset), leaf(_leaf) {
+            auto c = b.box.centroid();
+            for (int i = 0; i < 3; ++i) {
+                center[i] = float(c[i]);
+                axis[i] = float(b.axis[i]);
+            }
+            radius2 = float(0.25 * vec3(b.box.x.size(), b.box.y.size(), b.box.z.size()).length_squared());
+            cos_theta_o = float(b.cos_theta_o);
+            cos_theta_e = float(b.cos_theta_e);
+            power = float(b.power);
+        }
+    };
+
+    struct build_light {
+        aabb     box;
+        point3   centroid;
+        double   power;
+        uint32_t index;
+    };
+
+    static const int bin_count = 12;
+    static const size_t parallel_minimum = 4096;   // Smaller ranges are built on one thread
+    static const uint32_t balanced_depth = 28;     // Deeper than this, split at the median so paths fit 64 bits
+
+    std::vector<sphere_light> lights;
+    std::vector<node> nodes;
+    std::vector<uint64_t> paths;   // Each light's turns from the root, lowest bit first: 0 left, 1 right
+
+    // Spheres emit in every direction, so their cones are the whole sphere.
+    static light_bounds bounds_of(const build_light& l) {
+        return { l.box, vec3(0, 0, 1), -1, 0, l.power };
+    }
+
+    static light_bounds merge(const light_bounds& a, const light_bounds& b) {
+        if (a.power <= 0) return b;
+        if (b.power <= 0) return a;
+        light_bounds result;
+        result.box = aabb(a.box, b.box);
+        result.power = a.power + b.power;
+        result.cos_theta_e = fmin(a.cos_theta_e, b.cos_theta_e);
+        merge_cones(a, b, result.axis, result.cos_theta_o);
+        return result;
+    }
+
+    // The smallest cone around both cones of directions.
+    static void merge_cones(const light_bounds& a, const light_bounds& b, vec3& axis, double& cos_theta) {
+        auto theta_a = acos(clamp_cos(a.cos_theta_o)), theta_b = acos(clamp_cos(b.cos_theta_o));
+        if (theta_a >= pi || theta_b >= pi) {
+            axis = a.axis;
+            cos_theta = -1;
+            return;
+        }
+        auto theta_d = acos(clamp_cos(dot(a.axis, b.axis)));
+        if (fmin(theta_d + theta_b, pi) <= theta_a) { axis = a.axis; cos_theta = a.cos_theta_o; return; }
+        if (fmin(theta_d + theta_a, pi) <= theta_b) { axis = b.axis; cos_theta = b.cos_theta_o; return; }
+
+        auto theta_o = (theta_a + theta_d + theta_b) / 2;
+        if (theta_o >= pi) {
+            axis = a.axis;
+            cos_theta = -1;
+            return;
+        }
+        // Rotate a's axis toward b's by the angle that centres the new cone.
+        auto rotation = theta_o - theta_a;
+        auto perpendicular = cross(a.axis, b.axis);
+        if (perpendicular.length_squared() < 1e-20) {
+            axis = a.axis;
+            cos_theta = -1;
+            return;
+        }
+        auto k = unit_vector(perpendicular);
+        axis = cos(rotation) * a.axis + sin(rotation) * cross(k, a.axis);
+        cos_theta = cos(theta_o);
+    }
+
+    static double clamp_cos(double c) {
+        return c < -1 ? -1 : (c > 1 ? 1 : c);
+    }
+
+    // cos(max(0, a - b)) from cos a, cos b and sin b, with a and b in [0, pi].
+    static double cos_subtract_clamped(double cos_a, double cos_b, double sin_b) {
+        if (cos_a >= cos_b)
+            return 1;
+        auto sin_a = sqrt(fmax(0.0, 1 - cos_a * cos_a));
+        return cos_a * cos_b + sin_a * sin_b;
+    }
+
+    static double cos_subtract_clamped(double cos_a, double cos_b) {
+        return cos_subtract_clamped(cos_a, cos_b, sqrt(fmax(0.0, 1 - cos_b * cos_b)));
+    }
+
+    // Orientation measure of a cone of emission (the M_Omega term of the split cost).
+    static double cone_measure(const light_bounds& b) {
+        auto theta_o = acos(clamp_cos(b.cos_theta_o));
+        auto theta_w = fmin(theta_o + acos(clamp_cos(b.cos_theta_e)), pi);
+        auto sin_o = sin(theta_o);
+        return 2 * pi * (1 - b.cos_theta_o)
+             + pi / 2 * (2 * theta_w * sin_o - cos(theta_o - 2 * theta_w) - 2 * theta_o * sin_o + b.cos_theta_o);
+    }
+
+    // Estimated contribution of a node's lights to point p with normal n: power over squared
+    // distance, reduced by the smallest angle any of its lights could face p at and by the
+    // smallest angle to the normal, each allowing for the box's angular size. Angles are
+    // subtracted through their cosines and sines (cos(a - b) = cos a cos b + sin a sin b), as
+    // this runs twice per level of every traversal.
+    static double importance(const node& nd, const point3& p, const vec3& n) {
+        if (nd.power <= 0)
+            return 0;
+
+        auto offset = p - point3(nd.center[0], nd.center[1], nd.center[2]);
+        auto d2 = offset.length_squared();
+        double half_diagonal2 = nd.radius2;
+        auto result = nd.power / fmax(d2, half_diagonal2);
+        if (d2 <= half_diagonal2)
+            return result;     // p is inside the bounding sphere: any direction is possible
+
+        // Half-angle of the box's bounding sphere seen from p.
+        auto sin2_b = half_diagonal2 / d2;
+        auto cos_b = sqrt(1 - sin2_b), sin_b = sqrt(sin2_b);
+        vec3 wi = offset / sqrt(d2);
+
+        if (nd.cos_theta_o > -1) {
+            // theta_p = max(0, theta_w - theta_o - theta_b), against the emission falloff cone.
+            auto cos_w = clamp_cos(dot(vec3(nd.axis[0], nd.axis[1], nd.axis[2]), wi));
+            auto cos_x = cos_subtract_clamped(cos_w, nd.cos_theta_o);
+            auto cos_p = cos_subtract_clamped(cos_x, cos_b, sin_b);
+            if (cos_p <= nd.cos_theta_e)
+                return 0;
+            result *= cos_p;
+        }
+        if (n.length_squared() > 0) {
+            // theta_ip = max(0, theta_i - theta_b), against the surface's hemisphere.
+            auto cos_i = clamp_cos(dot(-wi, n));
+            auto cos_ip = cos_subtract_clamped(cos_i, cos_b, sin_b);
+            if (cos_ip <= 0)
+                return 0;
+            result *= cos_ip;
+        }
+        return result;
+    }
+
+    // Builds the subtree over lights [begin, end) with its root first and returns its nodes.
+    // Interior nodes' offsets are relative to the returned array.
+    std::vector<node> build(std::vector<build_light>& data, size_t begin, size_t end, uint32_t depth,
+                            int parallel_depth) const {
+        light_bounds bounds = bounds_of(data[begin]);
+        aabb centroid_bounds;
+        for (size_t i = begin; i < end; ++i) {
+            if (i > begin)
+                bounds = merge(bounds, bounds_of(data[i]));
+            const auto& c = data[i].centroid;
+            centroid_bounds = aabb(centroid_bounds, aabb(c, c));
+        }
+
+        if (end - begin == 1)
+            return { node{ bounds, data[begin].index, 1 } };
+
+        auto mid = depth < balanced_depth ? split(data, begin, end, centroid_bounds) : begin;
+        if (mid == begin || mid == end) {
+            mid = begin + (end - begin) / 2;
+            int axis = widest_axis(centroid_bounds);
+            std::nth_element(data.begin() + begin, data.begin() + mid, data.begin() + end,
+                [axis](const build_light& a, const build_light& b) { return a.centroid[axis] < b.centroid[axis]; });
+        }
+
+        std::vector<node> left, right;
+        if (parallel_depth > 0 && end - begin >= parallel_minimum) {
+            auto pending = std::async(std::launch::async, [&]() { return build(data, begin, mid, depth + 1, parallel_depth - 1); });
+            right = build(data, mid, end, depth + 1, parallel_depth - 1);
+            left = pending.get();
+        }
+        else {
+            left = build(data, begin, mid, depth + 1, 0);
+            right = build(data, mid, end, depth + 1, 0);
+        }
+
+        std::vector<node> result;
+        result.reserve(1 + left.size() + right.size());
+        result.push_back({ bounds, uint32_t(1 + left.size()), 0 });
+        append(result, left);
+        append(result, right);
+        return result;
+    }
+
+    static void append(std::vector<node>& to, const std::vector<node>& subtree) {
+        auto base = uint32_t(to.size());
+        for (auto n : subtree) {
+            if (!n.leaf)
+                n.offset += base;
+            to.push_back(n);
+        }
+    }
+
+    static int widest_axis(const aabb& box) {
+        int axis = 0;
+        if (box.y.size() > box.axis(axis).size()) axis = 1;
+        if (box.z.size() > box.axis(axis).size()) axis = 2;
+        return axis;
+    }
+
+    // Partitions lights [begin, end) at the cheapest binned split and returns the partition
+    // point, or begin when the centroids cannot be separated.
+    static size_t split(std::vector<build_light>& data, size_t begin, size_t end, const aabb& centroid_bounds) {
+        double best_cost = infinity;
+        int best_axis = -1, best_bin = -1;
+
+        for (int axis = 0; axis < 3; ++axis) {
+            const auto& extent = centroid_bounds.axis(axis);
+            if (extent.size() <= 0) continue;
+
+            light_bounds bins[bin_count];
+            for (auto& b : bins) b.power = 0;
+            auto scale = bin_count / extent.size();
+            for (size_t i = begin; i < end; ++i) {
+                auto b = bin_index(data[i].centroid[axis], extent.min, scale);
+                bins[b] = merge(bins[b], bounds_of(data[i]));
+            }
+
+            auto cost_of = [](const light_bounds& b) {
+                return b.power > 0 ? b.power * b.box.surface_area() * cone_measure(b) : 0.0;
+            };
+
+            double right_cost[bin_count];
+            light_bounds right;
+            right.power = 0;
+            for (int b = bin_count - 1; b > 0; --b) {
+                right = merge(right, bins[b]);
+                right_cost[b] = cost_of(right);
+            }
+
+            light_bounds left;
+            left.power = 0;
+            for (int b = 0; b < bin_count - 1; ++b) {
+                left = merge(left, bins[b]);
+                auto cost = cost_of(left) + right_cost[b + 1];
+                if (left.power > 0 && right_cost[b + 1] > 0 && cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_bin = b;
+                }
+            }
+        }
+
+        if (best_axis < 0)
+            return begin;
+        const auto& extent = centroid_bounds.axis(best_axis);
+        auto scale = bin_count / extent.size();
+        auto mid = std::partition(data.begin() + begin, data.begin() + end, [&](const build_light& l) {
+            return bin_index(l.centroid[best_axis], extent.min, scale) <= best_bin;
+        });
+        return size_t(mid - data.begin());
+    }
+
+    static int bin_index(double value, double min, double scale) {
+        auto b = static_cast<int>((value - min) * scale);
+        return b < 0 ? 0 : (b >= bin_count ? bin_count - 1 : b);
+    }
+
+    void record_paths(uint32_t current, uint64_t bits, uint32_t depth) {
+        const auto& nd = nodes[current];
+        if (nd.leaf) {
+            paths[nd.offset] = bits;
+            return;
+        }
+        record_paths(current + 1, bits, depth + 1);
+        record_paths(nd.offset, bits | (uint64_t(1) << depth), depth + 1);
+    }
+};
+
+#endif
@@ -5,6 +5,8 @@
 #include "rtweekend.h"
 #include "hittable.h"
 #include "color.h"
+#include "stats.h"
+#include "texture.h"
 
 class hit_record;
 
@@ -14,12 +16,29 @@ public:
 
     virtual bool scatter(
         const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const = 0;
+
+    // Solid-angle pdf of scatter() choosing the given scattered direction. Zero for materials
+    // that scatter into a single direction (mirrors, glass), which lights cannot be sampled for.
+    // Where it is non-zero, attenuation * scattering_pdf is the BSDF times the cosine term.
+    virtual double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const {
+        return 0;
+    }
+
+    // Radiance the surface gives off toward the incoming ray.
+    virtual color emitted(const hit_record& rec) const {
+        return color(0, 0, 0);
+    }
 };
 
 
+// Diffuse bounces scatter over the whole hemisphere, so the cones of their rays are made wide;
+// textures seen through them are then read from coarse MIP levels.
+const double diffuse_cone_spread = 0.5;
+
 class lambertian : public material {
 public:
-    lambertian(const color& a) : albedo(a) {}
+    lambertian(const color& a) : albedo(make_shared<solid_color>(a)) {}
+    lambertian(shared_ptr<texture> a) : albedo(a) {}
 
     bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
         const override {
@@ -29,32 +48,60 @@ public:
         if (scatter_direction.near_zero())
             scatter_direction = rec.normal;
 
-        scattered = ray(rec.p, scatter_direction);
-        attenuation = albedo;
+        scattered = ray(rec.p, scatter_direction, rec.cone_width, diffuse_cone_spread, r_in.time());
+        attenuation = albedo->value(rec.u, rec.v, rec.p, rec.uv_footprint);
+        RT_STAT(render_stats::local().scatters[stat_lambertian]++);
         return true;
     }
 
+    // normal + random_unit_vector() is cosine-distributed about the normal.
+    double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const override {
+        auto cosine = dot(rec.normal, unit_vector(scattered.direction()));
+        return cosine < 0 ? 0 : cosine / pi;
+    }
+
 private:
-    color albedo;
+    shared_ptr<texture> albedo;
 };
 
 class metal : public material {
 public:
-    metal(const color& a, double f) : albedo(a), fuzz(f < 1 ? f : 1) {}
+    metal(const color& a, double f) : albedo(make_shared<solid_color>(a)), fuzz(f < 1 ? f : 1) {}
+    metal(shared_ptr<texture> a, double f) : albedo(a), fuzz(f < 1 ? f : 1) {}
 
     bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
         const override {
         vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-        scattered = ray(rec.p, reflected + fuzz * random_unit_vector());
-        attenuation = albedo;
+        scattered = ray(rec.p, reflected + fuzz * random_unit_vector(), rec.cone_width, r_in.cone_spread() + fuzz, r_in.time());
+        attenuation = albedo->value(rec.u, rec.v, rec.p, rec.uv_footprint);
+        RT_STAT(render_stats::local().scatters[stat_metal]++);
         return (dot(scattered.direction(), rec.normal) > 0);
     }
 
 private:
-    color albedo;
+    shared_ptr<texture> albedo;
     double fuzz;
 };
 
+// An emitter: gives off the same radiance in every direction from its front face and
+// reflects nothing.
+class diffuse_light : public material {
+public:
+    diffuse_light(const color& c) : emit(c) {}
+
+    bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
+        const override {
+        return false;
+    }
+
+    color emitted(const hit_record& rec) const override {
+        return rec.front_face ? emit : color(0, 0, 0);
+    }
+
+private:
+    color emit;
+};
+
 class dielectric : public material {
 public:
     dielectric(double index_of_refraction) : ir(index_of_refraction) {}
@@ -76,7 +123,8 @@ public:
         else
             direction = refract(unit_direction, rec.normal, refraction_ratio);
 
-        scattered = ray(rec.p, direction);
+        scattered = ray(rec.p, direction, rec.cone_width, r_in.cone_spread(), r_in.time());
+        RT_STAT(render_stats::local().scatters[stat_dielectric]++);
         return true;
     }
 
@@ -91,5 +139,24 @@ private:
     }
 };
 
+// The phase function of a participating medium: scatters into every direction alike, keeping
+// albedo (the share of extinction that scatters rather than absorbs) of the light. Its pdf stays
+// zero, so light sampling, which samples above a surface's normal, leaves it alone, and light
+// reaches points in a medium through the paths that scatter there.
+class isotropic : public material {
+public:
+    isotropic(const color& albedo) : albedo(albedo) {}
+
+    bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
+        const override {
+        scattered = ray(rec.p, random_unit_vector(), rec.cone_width, diffuse_cone_spread, r_in.time());
+        attenuation = albedo;
+        return true;
+    }
+
+private:
+    color albedo;
+};
+
 #endif
 
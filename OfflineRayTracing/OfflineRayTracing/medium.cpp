@@ -0,0 +1 @@
+#include "medium.h"
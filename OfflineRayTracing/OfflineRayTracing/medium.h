@@ -0,0 +1,297 @@
+#pragma once
+#ifndef MEDIUM_H
+#define MEDIUM_H
+
+#include "rtweekend.h"
+#include "aabb.h"
+#include "hittable.h"
+#include "material.h"
+#include "perlin.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Voxel densities in [0, 1], stored in bricks of 8x8x8 voxels. A brick whose voxels all hold the
+// same value (most often the empty space around smoke) is stored as that value alone. The others
+// keep their voxels as 8 bits between the brick's smallest and largest value, 512 bytes instead
+// of the 2 KB of floats. The largest value of each brick doubles as the majorant of its cell in
+// a coarse grid that delta tracking steps through.
+class brick_grid {
+public:
+    static const int brick_size = 8;
+
+    // Samples density(i, j, k) at every voxel of an nx by ny by nz grid.
+    template <typename Density>
+    brick_grid(int nx, int ny, int nz, Density&& density)
+      : nx(nx), ny(ny), nz(nz), bx((nx + brick_size - 1) / brick_size),
+        by((ny + brick_size - 1) / brick_size), bz((nz + brick_size - 1) / brick_size) {
+        bricks.resize(size_t(bx) * by * bz);
+        float values[brick_size * brick_size * brick_size];
+        for (int k = 0; k < bz; ++k)
+            for (int j = 0; j < by; ++j)
+                for (int i = 0; i < bx; ++i) {
+                    // Voxels past the grid's edge repeat its last ones, so they widen no range.
+                    float low = 1, high = 0;
+                    for (int v = 0; v < brick_voxels; ++v) {
+                        auto x = std::min(i * brick_size + v % brick_size, nx - 1);
+                        auto y = std::min(j * brick_size + v / brick_size % brick_size, ny - 1);
+                        auto z = std::min(k * brick_size + v / (brick_size * brick_size), nz - 1);
+                        values[v] = std::min(std::max(float(density(x, y, z)), 0.0f), 1.0f);
+                        low = std::min(low, values[v]);
+                        high = std::max(high, values[v]);
+                    }
+                    auto& b = bricks[(size_t(k) * by + j) * bx + i];
+                    b.low = low;
+                    b.high = high;
+                    b.step = (high - low) / 255;
+                    if (high == low)
+                        continue;
+                    b.voxels = uint32_t(pool.size() / brick_voxels);
+                    for (int v = 0; v < brick_voxels; ++v)
+                        pool.push_back(uint8_t(std::lround((values[v] - low) / b.step)));
+                }
+    }
+
+    int size_x() const { return nx; }
+    int size_y() const { return ny; }
+    int size_z() const { return nz; }
+    int bricks_x() const { return bx; }
+    int bricks_y() const { return by; }
+    int bricks_z() const { return bz; }
+
+    float value(int i, int j, int k) const {
+        const auto& b = bricks[(size_t(k / brick_size) * by + j / brick_size) * bx + i / brick_size];
+        if (b.voxels == uniform)
+            return b.low;
+        auto v = (k % brick_size * brick_size + j % brick_size) * brick_size + i % brick_size;
+        return b.low + b.step * pool[size_t(b.voxels) * brick_voxels + v];
+    }
+
+    // The largest value in the brick.
+    float brick_max(int i, int j, int k) const { return bricks[(size_t(k) * by + j) * bx + i].high; }
+
+    float max_value() const {
+        float m = 0;
+        for (const auto& b : bricks)
+            m = std::max(m, b.high);
+        return m;
+    }
+
+    size_t memory_bytes() const { return bricks.size() * sizeof(brick) + pool.size(); }
+    size_t dense_bytes() const { return size_t(nx) * ny * nz * sizeof(float); }
+    size_t stored_bricks() const { return pool.size() / brick_voxels; }
+
+private:
+    static const int brick_voxels = brick_size * brick_size * brick_size;
+    static const uint32_t uniform = 0xffffffff;
+
+    struct brick {
+        float    low = 0;
+        float    high = 0;
+        float    step = 0;                 // Value of one quantization step
+        uint32_t voxels = uniform;         // Index of the brick's voxels in the pool, or uniform
+    };
+
+    int nx, ny, nz;
+    int bx, by, bz;
+    std::vector<brick> bricks;
+    std::vector<uint8_t> pool;
+};
+
+// Smoke filling a box: turbulence that fades out toward the box's inscribed ellipsoid, scaled so
+// its densest voxel is 1. resolution voxels span the longest side of the box.
+inline shared_ptr<brick_grid> smoke_grid(const aabb& box, int resolution, double scale, int octaves) {
+    auto longest = std::max({ box.x.size(), box.y.size(), box.z.size() });
+    auto voxels = [&](const interval& side) { return std::max(1, int(std::ceil(resolution * side.size() / longest))); };
+    int nx = voxels(box.x), ny = voxels(box.y), nz = voxels(box.z);
+
+    perlin noise;
+    std::vector<float> values(size_t(nx) * ny * nz);
+    float densest = 0;
+    for (int k = 0; k < nz; ++k)
+        for (int j = 0; j < ny; ++j)
+            for (int i = 0; i < nx; ++i) {
+                // Position in [-1, 1] across the box
+                point3 q(2 * (i + 0.5) / nx - 1, 2 * (j + 0.5) / ny - 1, 2 * (k + 0.5) / nz - 1);
+                auto falloff = 1 - q.length_squared();
+                auto v = falloff <= 0 ? 0.0 : falloff * noise.turb(scale * q, octaves);
+                values[(size_t(k) * ny + j) * nx + i] = float(v);
+                densest = std::max(densest, float(v));
+            }
+    auto normalize = densest > 0 ? 1 / densest : 0.0f;
+    return make_shared<brick_grid>(nx, ny, nz, [&](int i, int j, int k) {
+        return values[(size_t(k) * ny + j) * nx + i] * normalize;
+    });
+}
+
+// A participating medium filling a box, with a constant extinction coefficient or one that is
+// density times the voxels of a brick grid spanning the box. hit() finds where a ray first
+// collides with the medium by delta tracking (Woodcock tracking): it takes free-flight steps
+// against a majorant, an extinction at least as large as the real one, and accepts each
+// tentative collision with probability real over majorant. The majorant comes from the coarse
+// grid of brick maxima, stepped through like a uniform grid, so empty bricks are crossed in one
+// step and thin ones in a few long ones.
+//
+// A collision is a hit whose material is an isotropic phase function, so paths scatter there
+// like off a surface. A shadow ray through the medium is blocked when it collides, which
+// estimates the transmittance along it without bias.
+class medium : public hittable {
+public:
+    bool per_brick_majorants = true;   // false bounds the whole box by its densest voxel, as plain delta tracking would
+
+    medium(const aabb& box, double density, const color& albedo)
+      : box(box), density(density), phase(make_shared<isotropic>(albedo)) {}
+
+    medium(const aabb& box, double density, const color& albedo, shared_ptr<const brick_grid> grid)
+      : box(box), density(density), phase(make_shared<isotropic>(albedo)), grid(std::move(grid)) {
+        densest = density * this->grid->max_value();
+        voxel = vec3(box.x.size() / this->grid->size_x(), box.y.size() / this->grid->size_y(),
+                     box.z.size() / this->grid->size_z());
+    }
+
+    bool stochastic() const override { return true; }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        double t0, t1;
+        if (!clip(r, ray_t, t0, t1))
+            return false;
+
+        auto length = r.direction().length();
+        double t;
+        if (!grid) {
+            t = t0 - std::log(1 - random_double()) / (density * length);
+            if (t >= t1)
+                return false;
+        }
+        else if (!track(r, t0, t1, length, t)) {
+            return false;
+        }
+
+        rec.t = t;
+        rec.p = r.at(t);
+        rec.normal = -r.direction() / length;   // Arbitrary; the phase function ignores it
+        rec.front_face = true;
+        rec.mat = phase;
+        rec.u = rec.v = 0;
+        rec.uv_size = 1;
+        rec.light = -1;
+        rec.sphere = false;
+        return true;
+    }
+
+    aabb bounding_box() const override { return box; }
+
+    const brick_grid* voxels() const { return grid.get(); }
+
+private:
+    aabb box;
+    double density;
+    shared_ptr<material> phase;
+    shared_ptr<const brick_grid> grid;
+    double densest = 0;   // Largest extinction in the grid
+    vec3 voxel;           // Size of one voxel
+
+    // The part of ray_t inside the box.
+    bool clip(const ray& r, const interval& ray_t, double& t0, double& t1) const {
+        t0 = ray_t.min;
+        t1 = ray_t.max;
+        for (int a = 0; a < 3; ++a) {
+            auto inverse = 1 / r.direction()[a];
+            auto near = (box.axis(a).min - r.origin()[a]) * inverse;
+            auto far = (box.axis(a).max - r.origin()[a]) * inverse;
+            if (inverse < 0)
+                std::swap(near, far);
+            t0 = std::max(t0, near);
+            t1 = std::min(t1, far);
+            if (t1 <= t0)
+                return false;
+        }
+        return true;
+    }
+
+    // Extinction at p, from a voxel of the given brick (or, without one, anywhere in the grid),
+    // so rounding at a brick's faces never reads past the majorant of the brick being crossed.
+    double extinction(const point3& p, const int* brick = nullptr) const {
+        int index[3];
+        int size[3] = { grid->size_x(), grid->size_y(), grid->size_z() };
+        for (int a = 0; a < 3; ++a) {
+            int lo = 0, hi = size[a] - 1;
+            if (brick) {
+                lo = brick[a] * brick_grid::brick_size;
+                hi = std::min(hi, lo + brick_grid::brick_size - 1);
+            }
+            index[a] = std::min(std::max(int((p[a] - box.axis(a).min) / voxel[a]), lo), hi);
+        }
+        return density * grid->value(index[0], index[1], index[2]);
+    }
+
+    // Delta tracking from t0 to t1 through the grid; sets t to the first collision.
+    bool track(const ray& r, double t0, double t1, double length, double& t) const {
+        if (!per_brick_majorants) {
+            if (densest <= 0)
+                return false;
+            for (t = t0;;) {
+                t -= std::log(1 - random_double()) / (densest * length);
+                if (t >= t1)
+                    return false;
+                if (random_double() * densest < extinction(r.at(t)))
+                    return true;
+            }
+        }
+
+        // Walk the bricks the ray crosses as cells of a uniform grid (Amanatides and Woo).
+        int cells[3] = { grid->bricks_x(), grid->bricks_y(), grid->bricks_z() };
+        int cell[3], step[3];
+        double next[3], delta[3];
+        auto entry = r.at(t0);
+        for (int a = 0; a < 3; ++a) {
+            auto size = voxel[a] * brick_grid::brick_size;
+            auto offset = (entry[a] - box.axis(a).min) / size;
+            cell[a] = std::min(std::max(int(offset), 0), cells[a] - 1);
+            auto d = r.direction()[a];
+            if (d > 0) {
+                step[a] = 1;
+                delta[a] = size / d;
+                next[a] = t0 + (box.axis(a).min + (cell[a] + 1) * size - entry[a]) / d;
+            }
+            else if (d < 0) {
+                step[a] = -1;
+                delta[a] = -size / d;
+                next[a] = t0 + (box.axis(a).min + cell[a] * size - entry[a]) / d;
+            }
+            else {
+                step[a] = 0;
+                delta[a] = next[a] = infinity;
+            }
+        }
+
+        t = t0;
+        while (true) {
+            int a = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+            auto exit = std::min(next[a], t1);
+            auto majorant = density * grid->brick_max(cell[0], cell[1], cell[2]);
+            if (majorant > 0) {
+                // Free flights are memoryless, so one that leaves the cell restarts at its edge.
+                while (true) {
+                    auto flight = t - std::log(1 - random_double()) / (majorant * length);
+                    if (flight >= exit)
+                        break;
+                    t = flight;
+                    if (random_double() * majorant < extinction(r.at(t), cell))
+                        return true;
+                }
+            }
+            if (exit >= t1)
+                return false;
+            t = exit;
+            cell[a] += step[a];
+            if (cell[a] < 0 || cell[a] >= cells[a])
+                return false;
+            next[a] += delta[a];
+        }
+    }
+};
+
+#endif
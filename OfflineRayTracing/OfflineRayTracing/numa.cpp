@@ -0,0 +1 @@
+#include "numa.h"
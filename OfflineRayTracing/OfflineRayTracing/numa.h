@@ -0,0 +1,193 @@
+#pragma once
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// One NUMA node: the hardware threads of one socket (or of one die on some parts), which share
+// the memory attached to it and reach every other node's memory over a slower link.
+struct numa_node {
+    int id = 0;                 // The operating system's number for the node
+    std::vector<int> cpus;      // Its hardware threads this process may run on; empty if unknown
+    int thread_count = 1;
+};
+
+// The NUMA nodes of the machine, as far as this process may use them. On Linux they are read
+// from /sys/devices/system/node and trimmed to the process's CPU affinity; on Windows they come
+// from the NUMA API. A machine without NUMA, or where neither is available, is one node holding
+// every hardware thread, whose threads are not pinned; everything built on it then behaves as
+// it would without NUMA placement.
+//
+// Pinning a thread to a node keeps it, and the memory it touches first, on that node: both
+// Linux and Windows place a page on the node of the thread that first writes it.
+class numa_topology {
+public:
+    static numa_topology detect() {
+        numa_topology t;
+#ifdef _WIN32
+        ULONG highest = 0;
+        if (GetNumaHighestNodeNumber(&highest)) {
+            for (ULONG n = 0; n <= highest; ++n) {
+                GROUP_AFFINITY affinity = {};
+                if (!GetNumaNodeProcessorMaskEx(USHORT(n), &affinity) || affinity.Mask == 0)
+                    continue;
+                numa_node node;
+                node.id = int(n);
+                for (int bit = 0; bit < int(8 * sizeof(affinity.Mask)); ++bit)
+                    if (affinity.Mask & (KAFFINITY(1) << bit))
+                        node.cpus.push_back(64 * affinity.Group + bit);
+                node.thread_count = int(node.cpus.size());
+                t.node_list.push_back(node);
+            }
+        }
+#elif defined(__linux__)
+        cpu_set_t allowed;
+        bool restricted = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+        std::ifstream online("/sys/devices/system/node/online");
+        std::string nodes;
+        std::getline(online, nodes);
+        for (int n : parse_cpu_list(nodes)) {
+            std::ifstream in("/sys/devices/system/node/node" + std::to_string(n) + "/cpulist");
+            std::string list;
+            std::getline(in, list);
+            numa_node node;
+            node.id = n;
+            for (int cpu : parse_cpu_list(list))
+                if (!restricted || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)))
+                    node.cpus.push_back(cpu);
+            node.thread_count = int(node.cpus.size());
+            if (node.thread_count > 0)
+                t.node_list.push_back(node);
+        }
+#endif
+        if (t.node_list.size() <= 1)
+            return single_node();
+        return t;
+    }
+
+    // Every hardware thread as one node. Its threads are never pinned, but on Linux it lists the
+    // process's CPUs so that split() can pin the nodes it makes.
+    static numa_topology single_node() {
+        numa_topology t;
+        numa_node node;
+#ifdef __linux__
+        cpu_set_t allowed;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+                if (CPU_ISSET(cpu, &allowed))
+                    node.cpus.push_back(cpu);
+#endif
+        node.thread_count = node.cpus.empty() ? std::max(1, int(std::thread::hardware_concurrency())) : int(node.cpus.size());
+        t.node_list.push_back(node);
+        return t;
+    }
+
+    // The hardware threads of this topology dealt out into count nodes of about equal size, to
+    // try NUMA placement on a machine without NUMA. With fewer threads than nodes, nodes share them.
+    numa_topology split(int count) const {
+        std::vector<int> cpus;
+        int threads = 0;
+        for (const auto& node : node_list) {
+            cpus.insert(cpus.end(), node.cpus.begin(), node.cpus.end());
+            threads += node.thread_count;
+        }
+        count = std::max(1, count);
+        numa_topology t;
+        for (int n = 0; n < count; ++n) {
+            auto first = threads * n / count;
+            auto last = std::max(first + 1, threads * (n + 1) / count);
+            numa_node node;
+            node.id = n;
+            node.thread_count = last - first;
+            if (!cpus.empty())
+                node.cpus.assign(cpus.begin() + first, cpus.begin() + last);
+            t.node_list.push_back(node);
+        }
+        return t;
+    }
+
+    const std::vector<numa_node>& nodes() const { return node_list; }
+    int node_count() const { return int(node_list.size()); }
+
+    // The node of worker thread worker out of count: workers are dealt to nodes in proportion to
+    // their hardware threads, the first ones to node 0.
+    int node_of(int worker, int count) const {
+        int total = 0;
+        for (const auto& node : node_list)
+            total += node.thread_count;
+        auto slot = int64_t(worker) * total / std::max(1, count);
+        for (int n = 0; n < node_count(); ++n) {
+            if (slot < node_list[n].thread_count)
+                return n;
+            slot -= node_list[n].thread_count;
+        }
+        return node_count() - 1;
+    }
+
+    // Keeps the calling thread on the hardware threads of node n. False if it could not, or the
+    // node lists no hardware threads.
+    bool pin_current_thread(int n) const {
+        const auto& node = node_list[n];
+        if (node.cpus.empty())
+            return false;
+#ifdef _WIN32
+        // A thread runs in one processor group; a node lies within one.
+        GROUP_AFFINITY affinity = {};
+        affinity.Group = WORD(node.cpus[0] / 64);
+        for (int cpu : node.cpus)
+            if (cpu / 64 == affinity.Group)
+                affinity.Mask |= KAFFINITY(1) << (cpu % 64);
+        return SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr) != 0;
+#elif defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : node.cpus)
+            if (cpu < CPU_SETSIZE)
+                CPU_SET(cpu, &set);
+        return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+        return false;
+#endif
+    }
+
+private:
+    std::vector<numa_node> node_list;
+
+    // "0-3,8,10-11" to 0 1 2 3 8 10 11, as Linux lists nodes and CPUs.
+    static std::vector<int> parse_cpu_list(const std::string& list) {
+        std::vector<int> cpus;
+        std::istringstream ranges(list);
+        std::string range;
+        while (std::getline(ranges, range, ',')) {
+            if (range.empty())
+                continue;
+            auto dash = range.find('-');
+            int first = std::stoi(range.substr(0, dash));
+            int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+            for (int cpu = first; cpu <= last; ++cpu)
+                cpus.push_back(cpu);
+        }
+        return cpus;
+    }
+};
+
+#endif
@@ -0,0 +1 @@
+#include "numa_replicas.h"
@@ -0,0 +1,66 @@
+#pragma once
+#ifndef NUMA_REPLICAS_H
+#define NUMA_REPLICAS_H
+
+#include "rtweekend.h"
+#include "accelerator.h"
+#include "hittable_list.h"
+#include "numa.h"
+#include "scene.h"
+
+#include <exception>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// A copy of a scene's primitives, materials and acceleration structure for every NUMA node,
+// for camera::node_worlds. Each copy is built by a thread pinned to its node, so its memory is
+// first touched, and therefore placed, there; the node's render threads then read only local
+// memory while tracing. Everything a render reads rather than traces (the camera, light tree,
+// environment map, photon map and texture tile cache) stays shared.
+class numa_replicas {
+public:
+    numa_replicas(const scene& s, const numa_topology& topology, accelerator structure, const interval& time) {
+        replicas.resize(size_t(topology.node_count()));
+        std::vector<std::exception_ptr> errors(replicas.size());
+        std::vector<std::thread> builders;
+        for (int n = 0; n < topology.node_count(); ++n) {
+            builders.emplace_back([&, n]() {
+                try {
+                    topology.pin_current_thread(n);
+                    std::unique_ptr<replica> r(new replica{ s, {}, nullptr });
+                    r->description.photon_count = 0;   // The camera's photon map serves every node
+                    r->description.build_world(r->objects);
+                    r->accelerated = build_accelerator(structure, r->objects, time);
+                    replicas[n] = std::move(r);
+                }
+                catch (...) {
+                    errors[n] = std::current_exception();
+                }
+            });
+        }
+        for (auto& builder : builders)
+            builder.join();
+        for (const auto& error : errors)
+            if (error)
+                std::rethrow_exception(error);
+    }
+
+    std::vector<const hittable*> worlds() const {
+        std::vector<const hittable*> result;
+        for (const auto& r : replicas)
+            result.push_back(r->accelerated.get());
+        return result;
+    }
+
+private:
+    struct replica {
+        scene description;
+        hittable_list objects;
+        std::unique_ptr<hittable> accelerated;
+    };
+
+    std::vector<std::unique_ptr<replica>> replicas;
+};
+
+#endif
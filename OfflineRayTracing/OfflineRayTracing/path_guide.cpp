@@ -0,0 +1 @@
+#include "path_guide.h"
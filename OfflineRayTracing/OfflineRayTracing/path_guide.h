@@ -0,0 +1,364 @@
+#pragma once
+#ifndef PATH_GUIDE_H
+#define PATH_GUIDE_H
+
+#include "rtweekend.h"
+#include "aabb.h"
+#include "color.h"
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// A distribution over all directions, stored as a quadtree over the unit square that
+// (cos theta, phi) covers under the cylindrical projection. The projection preserves area,
+// so a cell's share of the square is its share of the sphere. Each node holds the energy of its
+// four quadrants, and is refined where energy concentrates. Trees that are sampled have each node
+// normalized to the densities of its quadrants relative to the node (four times their share of
+// its energy), so sampling and pdfs multiply their way down without summing or dividing.
+class direction_tree {
+public:
+    direction_tree() : nodes(1) {}
+
+    double total() const {
+        const auto& e = nodes[0].energy;
+        return double(e[0]) + e[1] + e[2] + e[3];
+    }
+
+    // Draws a direction in proportion to the energy of a normalized tree, and returns its
+    // solid-angle pdf.
+    vec3 sample(double& pdf) const {
+        double u = 0, v = 0, size = 1, square_pdf = 1;
+        uint32_t n = 0;
+        while (true) {
+            const auto& e = nodes[n].energy;
+            double pick = random_double() * 4;
+            int q = 0;
+            while (q < 3 && (pick -= e[q]) >= 0)
+                ++q;
+            while (e[q] <= 0)   // Rounding can land on an empty quadrant at the end
+                --q;
+            square_pdf *= e[q];
+            size /= 2;
+            u += (q & 1) * size;
+            v += (q >> 1) * size;
+            if (nodes[n].child[q] == 0)
+                break;
+            n = nodes[n].child[q];
+        }
+        pdf = square_pdf / (4 * pi);
+        return direction_of(u + size * random_double(), v + size * random_double());
+    }
+
+    // Solid-angle pdf of sample() drawing the unit direction, for a normalized tree.
+    double pdf(const vec3& direction) const {
+        double u, v;
+        square_of(direction, u, v);
+        double square_pdf = 1;
+        uint32_t n = 0;
+        while (true) {
+            int q = quadrant(u, v);
+            square_pdf *= nodes[n].energy[q];
+            if (nodes[n].child[q] == 0 || square_pdf == 0)
+                break;
+            n = nodes[n].child[q];
+        }
+        return square_pdf / (4 * pi);
+    }
+
+    // The same distribution folded onto the hemisphere around a surface's unit normal: a
+    // direction drawn below the surface is mirrored in it. A region can hold surfaces facing
+    // several ways, and what its other surfaces learned would otherwise send bounces into this one.
+    vec3 sample(const vec3& normal, double& pdf) const {
+        auto direction = sample(pdf);
+        auto height = dot(direction, normal);
+        auto mirrored = direction - 2 * height * normal;
+        pdf += this->pdf(mirrored);
+        return height < 0 ? mirrored : direction;
+    }
+
+    double pdf(const vec3& direction, const vec3& normal) const {
+        auto height = dot(direction, normal);
+        if (height < 0)
+            return 0;
+        return pdf(direction) + pdf(direction - 2 * height * normal);
+    }
+
+    size_t node_count() const { return nodes.size(); }
+
+private:
+    friend class path_guide;
+
+    struct node {
+        uint32_t child[4] = { 0, 0, 0, 0 };   // Node refining each quadrant, or 0 (the root is never a child)
+        float    energy[4] = { 0, 0, 0, 0 };
+    };
+
+    std::vector<node> nodes;
+
+    // Turns every node's energies into densities for sampling.
+    void normalize() {
+        for (auto& n : nodes) {
+            double sum = double(n.energy[0]) + n.energy[1] + n.energy[2] + n.energy[3];
+            for (auto& e : n.energy)
+                e = sum > 0 ? float(4 * e / sum) : 0;
+        }
+    }
+
+    static void square_of(const vec3& direction, double& u, double& v) {
+        u = fmin(fmax(0.5 * (direction.z() + 1), 0.0), 1.0);
+        auto phi = atan2(direction.y(), direction.x());
+        v = (phi < 0 ? phi + 2 * pi : phi) / (2 * pi);
+        if (v >= 1) v = 0;
+    }
+
+    static vec3 direction_of(double u, double v) {
+        auto cos_theta = 2 * u - 1;
+        auto sin_theta = sqrt(fmax(0.0, 1 - cos_theta * cos_theta));
+        auto phi = 2 * pi * v;
+        return vec3(sin_theta * cos(phi), sin_theta * sin(phi), cos_theta);
+    }
+
+    // Which quadrant of the current cell (u, v) lies in, rescaling them to that quadrant.
+    static int quadrant(double& u, double& v) {
+        int q = 0;
+        u *= 2;
+        v *= 2;
+        if (u >= 1) { q |= 1; u -= 1; }
+        if (v >= 1) { q |= 2; v -= 1; }
+        return q;
+    }
+};
+
+// Online path guiding after Müller, Gross and Novák, "Practical Path Guiding for Efficient
+// Light-Transport Simulation" (2017). A binary tree splits the scene into regions, and each
+// region learns the light arriving at it in a direction_tree.
+//
+// Rendering happens in passes. During a pass, every diffuse bounce records the radiance it
+// brought back times the cosine at the surface, divided by the pdf of its direction: what a
+// diffuse surface scatters is in proportion to that, and unlike the bare radiance it does not
+// blow up for the rare bounces that graze the surface. Records go into the region's learning
+// tree through atomic adds, so render threads never lock. Between passes, update() does three
+// things:
+// - the learned trees become the distributions the next pass samples from;
+// - the learning trees are refined where energy concentrates;
+// - regions that received many records are split.
+// The camera draws diffuse bounces from a mix of the material and the learned distribution.
+//
+// The adds from different threads land in any order, so guided images vary in the last bits
+// from run to run.
+class path_guide {
+public:
+    // Share of guided bounces drawn from the learned distribution rather than the material.
+    static constexpr double guided_fraction = 0.5;
+
+    path_guide(const aabb& bounds) {
+        spatial.push_back({ bounds, 0, 0, 0, 0 });
+        regions.emplace_back(new region());
+        regions.back()->reset();
+    }
+
+    // The distribution learned for the region holding p, or null before anything was learned there.
+    const direction_tree* distribution_at(const point3& p) const {
+        const auto& r = *regions[region_at(p)];
+        return r.sampling.total() > 0 ? &r.sampling : nullptr;
+    }
+
+    // Records that radiance arrived at p along -direction, through a bounce drawn with the given
+    // pdf per unit projected solid angle.
+    void record(const point3& p, const vec3& direction, const color& radiance, double pdf) {
+        auto& r = *regions[region_at(p)];
+        r.records.fetch_add(1, std::memory_order_relaxed);
+        auto value = (0.2126 * radiance.x() + 0.7152 * radiance.y() + 0.0722 * radiance.z()) / pdf;
+        if (!(value > 0) || !std::isfinite(value))
+            return;
+
+        double u, v;
+        direction_tree::square_of(unit_vector(direction), u, v);
+        uint32_t n = 0;
+        while (true) {
+            int q = direction_tree::quadrant(u, v);
+            auto child = r.learning.nodes[n].child[q];
+            if (child == 0) {
+                add(r.splats[4 * size_t(n) + q], float(value));
+                return;
+            }
+            n = child;
+        }
+    }
+
+    // Ends a pass of the given samples per pixel: what each region learned becomes what it
+    // samples, its learning tree is refined, and busy regions are split in two. A region that
+    // learned nothing keeps both its trees.
+    void update(int pass_samples) {
+        auto split_records = split_factor * sqrt(double(pass_samples));
+        for (size_t s = 0, count = spatial.size(); s < count; ++s) {
+            if (spatial[s].children != 0)
+                continue;
+            auto& r = *regions[spatial[s].region];
+            auto learned = sum_splats(r);
+            if (learned.total() > 0) {
+                r.learning = refine(learned);
+                learned.normalize();
+                r.sampling = std::move(learned);
+            }
+            auto records = double(r.records.load());
+            r.reset();
+            split_region(s, records, split_records);
+        }
+        ++passes;
+    }
+
+    size_t region_count() const { return regions.size(); }
+    int passes_learned() const { return passes; }
+
+    size_t direction_node_count() const {
+        size_t count = 0;
+        for (const auto& r : regions)
+            count += r->sampling.node_count();
+        return count;
+    }
+
+private:
+    struct spatial_node {
+        aabb     box;
+        uint32_t children;   // First of two children, or 0 for a leaf (the root is never a child)
+        uint32_t region;     // Leaves only
+        int      axis;       // Interior nodes: the split axis, halved at its middle
+        int      depth;
+    };
+
+    // One leaf of the spatial tree: the distribution being sampled and the tree being learned,
+    // whose energies are the splats, four per node.
+    struct region {
+        direction_tree sampling;
+        direction_tree learning;
+        std::unique_ptr<std::atomic<float>[]> splats;
+        std::atomic<uint32_t> records{ 0 };
+
+        void reset() {
+            splats.reset(new std::atomic<float>[4 * learning.nodes.size()]);
+            for (size_t i = 0; i < 4 * learning.nodes.size(); ++i)
+                splats[i].store(0, std::memory_order_relaxed);
+            records.store(0, std::memory_order_relaxed);
+        }
+    };
+
+    static constexpr double split_factor = 4000;     // Records that split a region, times sqrt(pass samples)
+    static constexpr double refine_fraction = 0.01;  // Share of a tree's energy that makes a cell subdivide
+    static const int max_spatial_depth = 48;
+    static const int max_direction_depth = 10;
+
+    std::vector<spatial_node> spatial;
+    std::vector<std::unique_ptr<region>> regions;
+    int passes = 0;
+
+    uint32_t region_at(const point3& p) const {
+        uint32_t s = 0;
+        while (spatial[s].children != 0) {
+            const auto& n = spatial[s];
+            s = n.children + (p[n.axis] < n.box.axis(n.axis).min + 0.5 * n.box.axis(n.axis).size() ? 0 : 1);
+        }
+        return spatial[s].region;
+    }
+
+    static void add(std::atomic<float>& target, float value) {
+        auto current = target.load(std::memory_order_relaxed);
+        while (!target.compare_exchange_weak(current, current + value, std::memory_order_relaxed))
+            ;
+    }
+
+    // The learning tree with its splats summed up from the leaves, so every quadrant holds the
+    // energy of all the cells below it.
+    static direction_tree sum_splats(const region& r) {
+        direction_tree learned = r.learning;
+        for (size_t n = 0; n < learned.nodes.size(); ++n)
+            for (int q = 0; q < 4; ++q)
+                learned.nodes[n].energy[q] = r.splats[4 * n + q].load(std::memory_order_relaxed);
+        // Children are always added after their parents, so a backward sweep sums bottom-up.
+        for (size_t n = learned.nodes.size(); n-- > 0;) {
+            for (int q = 0; q < 4; ++q) {
+                auto child = learned.nodes[n].child[q];
+                if (child != 0) {
+                    const auto& e = learned.nodes[child].energy;
+                    learned.nodes[n].energy[q] = e[0] + e[1] + e[2] + e[3];
+                }
+            }
+        }
+        return learned;
+    }
+
+    // A tree with the cells of the learned one subdivided where they hold more than
+    // refine_fraction of the energy and merged where they hold less, with zero energy.
+    static direction_tree refine(const direction_tree& learned) {
+        direction_tree refined;
+        auto total = learned.total();
+        if (total <= 0)
+            return refined;
+        float energy[4];
+        for (int q = 0; q < 4; ++q)
+            energy[q] = learned.nodes[0].energy[q];
+        refine_node(learned, 0, energy, total, refined, 0, 1);
+        return refined;
+    }
+
+    // Fills node into of refined from node from of learned (or, when from is not a node, a cell
+    // whose quadrants hold the given energy evenly spread below them).
+    static void refine_node(const direction_tree& learned, int64_t from, const float energy[4], double total,
+                            direction_tree& refined, uint32_t into, int depth) {
+        for (int q = 0; q < 4; ++q) {
+            if (energy[q] <= refine_fraction * total || depth >= max_direction_depth)
+                continue;
+            auto child = uint32_t(refined.nodes.size());
+            refined.nodes.emplace_back();
+            refined.nodes[into].child[q] = child;
+            float below[4];
+            int64_t source = -1;
+            if (from >= 0 && learned.nodes[size_t(from)].child[q] != 0)
+                source = learned.nodes[size_t(from)].child[q];
+            for (int c = 0; c < 4; ++c)
+                below[c] = source >= 0 ? learned.nodes[size_t(source)].energy[c] : energy[q] / 4;
+            refine_node(learned, source, below, total, refined, child, depth + 1);
+        }
+    }
+
+    // Halves a leaf region that received more records than split_records along its longest axis,
+    // and goes on halving the halves, taking each to receive half the records, until none would
+    // have more. Every part starts from what the region knew.
+    void split_region(size_t s, double records, double split_records) {
+        if (records <= split_records || spatial[s].depth >= max_spatial_depth)
+            return;
+        auto box = spatial[s].box;
+        int axis = 0;
+        if (box.y.size() > box.axis(axis).size()) axis = 1;
+        if (box.z.size() > box.axis(axis).size()) axis = 2;
+        auto middle = box.axis(axis).min + 0.5 * box.axis(axis).size();
+        aabb halves[2] = { box, box };
+        interval lower(box.axis(axis).min, middle), upper(middle, box.axis(axis).max);
+        if (axis == 0) { halves[0].x = lower; halves[1].x = upper; }
+        if (axis == 1) { halves[0].y = lower; halves[1].y = upper; }
+        if (axis == 2) { halves[0].z = lower; halves[1].z = upper; }
+
+        auto first = uint32_t(spatial.size());
+        auto old_region = spatial[s].region;
+        for (int half = 0; half < 2; ++half) {
+            uint32_t index = old_region;
+            if (half == 1) {
+                index = uint32_t(regions.size());
+                regions.emplace_back(new region());
+                regions.back()->sampling = regions[old_region]->sampling;
+                regions.back()->learning = regions[old_region]->learning;
+                regions.back()->reset();
+            }
+            spatial.push_back({ halves[half], 0, index, 0, spatial[s].depth + 1 });
+        }
+        spatial[s].children = first;
+        spatial[s].axis = axis;
+        split_region(first, records / 2, split_records);
+        split_region(first + 1, records / 2, split_records);
+    }
+};
+
+#endif
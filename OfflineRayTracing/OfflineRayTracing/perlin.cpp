@@ -0,0 +1 @@
+#include "perlin.h"
@@ -0,0 +1,226 @@
+#pragma once
+#ifndef PERLIN_H
+#define PERLIN_H
+
+#include "rtweekend.h"
+
+#include <cmath>
+#include <cstdint>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PERLIN_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// Gradient noise in the style of Perlin's "improved noise": a hashed lattice of gradients
+// blended with a quintic fade. The permutation table (512 bytes) and gradient table (192
+// bytes) together fit comfortably in L1.
+//
+// fbm() and turb() sum several octaves. With SSE2 they evaluate four octaves at once, one per
+// lane: the table lookups stay scalar, and the corner dot products, fades and blends run in
+// vector registers.
+class perlin {
+public:
+    perlin() {
+        // A fixed seed keeps procedural textures identical between runs and machines.
+        rng generator(0x5eed);
+        for (int i = 0; i < 256; ++i)
+            perm[i] = uint8_t(i);
+        for (int i = 255; i > 0; --i) {
+            int j = int(generator.next() % uint64_t(i + 1));
+            auto t = perm[i];
+            perm[i] = perm[j];
+            perm[j] = t;
+        }
+        for (int i = 0; i < 256; ++i)
+            perm[256 + i] = perm[i];
+    }
+
+    // Noise in roughly [-1, 1] at p.
+    double noise(const point3& p) const {
+        return noise(float(p.x()), float(p.y()), float(p.z()));
+    }
+
+    // Fractal sum of `depth` octaves of noise, each twice the frequency and half the weight.
+    double fbm(const point3& p, int depth = 7) const {
+        return octaves(p, depth, false);
+    }
+
+    // The same sum of the absolute value of each octave, for marble and turbulence.
+    double turb(const point3& p, int depth = 7) const {
+        return octaves(p, depth, true);
+    }
+
+    // The scalar path, always available, for comparison in benchmarks.
+    double octaves_scalar(const point3& p, int depth, bool absolute) const {
+        double accum = 0;
+        float x = float(p.x()), y = float(p.y()), z = float(p.z());
+        float weight = 1;
+        for (int i = 0; i < depth; ++i) {
+            float n = noise(x, y, z);
+            accum += weight * (absolute ? std::fabs(n) : n);
+            weight *= 0.5f;
+            x *= 2;
+            y *= 2;
+            z *= 2;
+        }
+        return accum;
+    }
+
+private:
+    uint8_t perm[512];
+
+    // The twelve edge directions of a cube, padded to sixteen so a hash picks one with & 15.
+    static const float* gradient(int hash) {
+        static const float table[16][3] = {
+            { 1, 1, 0 }, { -1, 1, 0 }, { 1, -1, 0 }, { -1, -1, 0 },
+            { 1, 0, 1 }, { -1, 0, 1 }, { 1, 0, -1 }, { -1, 0, -1 },
+            { 0, 1, 1 }, { 0, -1, 1 }, { 0, 1, -1 }, { 0, -1, -1 },
+            { 1, 1, 0 }, { 0, -1, 1 }, { -1, 1, 0 }, { 0, -1, -1 },
+        };
+        return table[hash & 15];
+    }
+
+    static float fade(float t) {
+        return t * t * t * (t * (t * 6 - 15) + 10);
+    }
+
+    static float lerp(float t, float a, float b) {
+        return a + t * (b - a);
+    }
+
+    static float dot_gradient(int hash, float x, float y, float z) {
+        auto g = gradient(hash);
+        return g[0] * x + g[1] * y + g[2] * z;
+    }
+
+    float noise(float x, float y, float z) const {
+        float fx = std::floor(x), fy = std::floor(y), fz = std::floor(z);
+        int X = int(fx) & 255, Y = int(fy) & 255, Z = int(fz) & 255;
+        x -= fx;
+        y -= fy;
+        z -= fz;
+        float u = fade(x), v = fade(y), w = fade(z);
+
+        int A = perm[X] + Y, AA = perm[A] + Z, AB = perm[A + 1] + Z;
+        int B = perm[X + 1] + Y, BA = perm[B] + Z, BB = perm[B + 1] + Z;
+
+        return lerp(w, lerp(v, lerp(u, dot_gradient(perm[AA], x, y, z), dot_gradient(perm[BA], x - 1, y, z)),
+                               lerp(u, dot_gradient(perm[AB], x, y - 1, z), dot_gradient(perm[BB], x - 1, y - 1, z))),
+                       lerp(v, lerp(u, dot_gradient(perm[AA + 1], x, y, z - 1), dot_gradient(perm[BA + 1], x - 1, y, z - 1)),
+                               lerp(u, dot_gradient(perm[AB + 1], x, y - 1, z - 1), dot_gradient(perm[BB + 1], x - 1, y - 1, z - 1))));
+    }
+
+#ifdef PERLIN_SSE2
+    static __m128 fade4(__m128 t) {
+        auto t3 = _mm_mul_ps(_mm_mul_ps(t, t), t);
+        auto inner = _mm_add_ps(_mm_mul_ps(t, _mm_sub_ps(_mm_mul_ps(t, _mm_set1_ps(6)), _mm_set1_ps(15))), _mm_set1_ps(10));
+        return _mm_mul_ps(t3, inner);
+    }
+
+    static __m128 lerp4(__m128 t, __m128 a, __m128 b) {
+        return _mm_add_ps(a, _mm_mul_ps(t, _mm_sub_ps(b, a)));
+    }
+
+    // Rounds down; SSE2 only truncates toward zero.
+    static __m128 floor4(__m128 v) {
+        auto truncated = _mm_cvtepi32_ps(_mm_cvttps_epi32(v));
+        return _mm_sub_ps(truncated, _mm_and_ps(_mm_cmpgt_ps(truncated, v), _mm_set1_ps(1)));
+    }
+
+    // Dot product of each lane's hashed gradient with (x, y, z), selecting the gradient
+    // components with masks rather than a table; matches gradient() exactly.
+    static __m128 gradient4(__m128i hash, __m128 x, __m128 y, __m128 z) {
+        auto h = _mm_and_si128(hash, _mm_set1_epi32(15));
+        auto below8 = _mm_castsi128_ps(_mm_cmplt_epi32(h, _mm_set1_epi32(8)));
+        auto below4 = _mm_castsi128_ps(_mm_cmplt_epi32(h, _mm_set1_epi32(4)));
+        auto x_for_v = _mm_castsi128_ps(_mm_or_si128(_mm_cmpeq_epi32(h, _mm_set1_epi32(12)),
+                                                     _mm_cmpeq_epi32(h, _mm_set1_epi32(14))));
+
+        auto u = _mm_or_ps(_mm_and_ps(below8, x), _mm_andnot_ps(below8, y));
+        auto xz = _mm_or_ps(_mm_and_ps(x_for_v, x), _mm_andnot_ps(x_for_v, z));
+        auto v = _mm_or_ps(_mm_and_ps(below4, y), _mm_andnot_ps(below4, xz));
+
+        // Bit 0 of the hash negates u, bit 1 negates v: move each into the float sign bit.
+        auto u_sign = _mm_castsi128_ps(_mm_slli_epi32(h, 31));
+        auto v_sign = _mm_castsi128_ps(_mm_slli_epi32(_mm_srli_epi32(h, 1), 31));
+        return _mm_add_ps(_mm_xor_ps(u, u_sign), _mm_xor_ps(v, v_sign));
+    }
+
+    // Noise at four points at once, one per lane.
+    __m128 noise4(__m128 x, __m128 y, __m128 z) const {
+        auto fx = floor4(x), fy = floor4(y), fz = floor4(z);
+        alignas(16) int32_t cx[4], cy[4], cz[4];
+        _mm_store_si128(reinterpret_cast<__m128i*>(cx), _mm_cvttps_epi32(fx));
+        _mm_store_si128(reinterpret_cast<__m128i*>(cy), _mm_cvttps_epi32(fy));
+        _mm_store_si128(reinterpret_cast<__m128i*>(cz), _mm_cvttps_epi32(fz));
+        x = _mm_sub_ps(x, fx);
+        y = _mm_sub_ps(y, fy);
+        z = _mm_sub_ps(z, fz);
+
+        // Hash the eight lattice corners of each lane; corner c is offset by
+        // (c & 1, c >> 1 & 1, c >> 2 & 1). Only these table lookups are scalar.
+        alignas(16) int32_t hashes[8][4];
+        for (int lane = 0; lane < 4; ++lane) {
+            int X = cx[lane] & 255, Y = cy[lane] & 255, Z = cz[lane] & 255;
+            int A = perm[X] + Y, AA = perm[A] + Z, AB = perm[A + 1] + Z;
+            int B = perm[X + 1] + Y, BA = perm[B] + Z, BB = perm[B + 1] + Z;
+            hashes[0][lane] = perm[AA];
+            hashes[1][lane] = perm[BA];
+            hashes[2][lane] = perm[AB];
+            hashes[3][lane] = perm[BB];
+            hashes[4][lane] = perm[AA + 1];
+            hashes[5][lane] = perm[BA + 1];
+            hashes[6][lane] = perm[AB + 1];
+            hashes[7][lane] = perm[BB + 1];
+        }
+
+        const auto one = _mm_set1_ps(1);
+        __m128 dots[8];
+        for (int c = 0; c < 8; ++c) {
+            auto dx = (c & 1) ? _mm_sub_ps(x, one) : x;
+            auto dy = (c & 2) ? _mm_sub_ps(y, one) : y;
+            auto dz = (c & 4) ? _mm_sub_ps(z, one) : z;
+            dots[c] = gradient4(_mm_load_si128(reinterpret_cast<const __m128i*>(hashes[c])), dx, dy, dz);
+        }
+
+        auto u = fade4(x), v = fade4(y), w = fade4(z);
+        return lerp4(w, lerp4(v, lerp4(u, dots[0], dots[1]), lerp4(u, dots[2], dots[3])),
+                        lerp4(v, lerp4(u, dots[4], dots[5]), lerp4(u, dots[6], dots[7])));
+    }
+
+    double octaves(const point3& p, int depth, bool absolute) const {
+        const auto sign_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+        auto base = _mm_set_ps(8, 4, 2, 1);           // Frequencies of four consecutive octaves
+        auto weights = _mm_set_ps(0.125f, 0.25f, 0.5f, 1);
+        auto px = _mm_set1_ps(float(p.x())), py = _mm_set1_ps(float(p.y())), pz = _mm_set1_ps(float(p.z()));
+        auto sum = _mm_setzero_ps();
+
+        for (int octave = 0; octave < depth; octave += 4) {
+            auto n = noise4(_mm_mul_ps(px, base), _mm_mul_ps(py, base), _mm_mul_ps(pz, base));
+            if (absolute)
+                n = _mm_and_ps(n, sign_mask);
+            if (depth - octave < 4) {
+                // Drop the lanes past the last octave.
+                alignas(16) float keep[4] = { 0, 0, 0, 0 };
+                for (int lane = 0; lane < depth - octave; ++lane)
+                    keep[lane] = 1;
+                n = _mm_mul_ps(n, _mm_load_ps(keep));
+            }
+            sum = _mm_add_ps(sum, _mm_mul_ps(n, weights));
+            base = _mm_mul_ps(base, _mm_set1_ps(16));
+            weights = _mm_mul_ps(weights, _mm_set1_ps(1.0f / 16));
+        }
+
+        alignas(16) float lanes[4];
+        _mm_store_ps(lanes, sum);
+        return double(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+    }
+#else
+    double octaves(const point3& p, int depth, bool absolute) const {
+        return octaves_scalar(p, depth, absolute);
+    }
+#endif
+};
+
+#endif
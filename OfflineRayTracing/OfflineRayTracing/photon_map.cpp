@@ -0,0 +1 @@
+#include "photon_map.h"
@@ -0,0 +1,445 @@
+#pragma once
+#ifndef PHOTON_MAP_H
+#define PHOTON_MAP_H
+
+#include "rtweekend.h"
+#include "alias_table.h"
+#include "color.h"
+#include "environment.h"
+#include "hittable.h"
+#include "light_tree.h"
+#include "material.h"
+#include "render_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A photon left on a diffuse surface: where it landed, the flux it carries, and which way the
+// surface faced. 28 bytes.
+struct photon {
+    float   position[3];
+    float   power[3];
+    int8_t  normal[3];   // Unit normal times 127
+    uint8_t axis;        // Split axis of its kd-tree node
+};
+
+// A balanced kd-tree over photons (Jensen, "Realistic Image Synthesis Using Photon Mapping"),
+// stored as an implicit binary heap: node i's children are nodes 2i and 2i + 1. The tree is
+// left-balanced, so n photons fill indices 1 to n exactly and need no pointers, and the top
+// levels every lookup starts with sit together at the front of the array.
+class photon_map {
+public:
+    photon_map() = default;
+
+    // Builds the tree, splitting the two halves of large ranges across threads down to
+    // parallel_depth levels.
+    photon_map(std::vector<photon> photons, int parallel_depth) {
+        heap.resize(photons.size() + 1);
+        if (!photons.empty())
+            build(photons, 0, photons.size(), 1, parallel_depth);
+    }
+
+    size_t size() const { return heap.empty() ? 0 : heap.size() - 1; }
+
+    size_t memory_bytes() const { return heap.capacity() * sizeof(photon); }
+
+    // Irradiance at p on a surface facing n, from the k nearest photons within max_radius that
+    // landed on a surface facing roughly the same way. A cone filter (Jensen's k = 1.1) weights
+    // near photons more, which keeps the edges of caustics sharp.
+    color irradiance(const point3& p, const vec3& n, int k, double max_radius) const {
+        if (size() == 0)
+            return color(0, 0, 0);
+
+        query q;
+        q.p[0] = p.x(); q.p[1] = p.y(); q.p[2] = p.z();
+        q.n = n;
+        q.k = std::max(1, std::min(k, max_gather));
+        q.radius2 = max_radius * max_radius;
+        locate(q, 1);
+        if (q.found == 0)
+            return color(0, 0, 0);
+
+        // With fewer than k photons in reach the estimate covers the whole search disc.
+        auto radius2 = q.found == q.k ? q.radius2 : max_radius * max_radius;
+        auto radius = sqrt(radius2);
+        const double cone = 1.1;
+        color sum(0, 0, 0);
+        for (int i = 0; i < q.found; ++i) {
+            const auto& ph = heap[q.nearest[i].index];
+            auto weight = 1 - sqrt(q.nearest[i].distance2) / (cone * radius);
+            sum += weight * color(ph.power[0], ph.power[1], ph.power[2]);
+        }
+        return sum / ((1 - 2 / (3 * cone)) * pi * radius2);
+    }
+
+private:
+    static constexpr int max_gather = 256;
+    static const size_t parallel_minimum = 1 << 16;   // Smaller ranges are built on one thread
+
+    std::vector<photon> heap;   // heap[0] is unused
+
+    struct neighbour {
+        double   distance2;
+        uint32_t index;
+        bool operator<(const neighbour& other) const { return distance2 < other.distance2; }
+    };
+
+    // A k-nearest lookup in progress: the photons found so far as a max-heap on distance, and
+    // the squared radius still worth searching, which shrinks once k are found.
+    struct query {
+        double    p[3];
+        vec3      n;
+        int       k;
+        double    radius2;
+        int       found = 0;
+        neighbour nearest[max_gather];
+    };
+
+    void locate(query& q, size_t i) const {
+        const auto& ph = heap[i];
+        auto left = 2 * i;
+        if (left < heap.size()) {
+            auto delta = q.p[ph.axis] - ph.position[ph.axis];
+            // The side p is on first, the other only if the splitting plane is in reach.
+            auto near_child = delta > 0 ? left + 1 : left;
+            auto far_child = delta > 0 ? left : left + 1;
+            if (near_child < heap.size())
+                locate(q, near_child);
+            if (delta * delta < q.radius2 && far_child < heap.size())
+                locate(q, far_child);
+        }
+
+        auto dx = ph.position[0] - q.p[0], dy = ph.position[1] - q.p[1], dz = ph.position[2] - q.p[2];
+        auto d2 = dx * dx + dy * dy + dz * dz;
+        if (d2 >= q.radius2)
+            return;
+        // Photons on the far side of a thin object or on a surface meeting p's at an angle
+        // lit something else.
+        if (ph.normal[0] * q.n.x() + ph.normal[1] * q.n.y() + ph.normal[2] * q.n.z() < 0.5 * 127)
+            return;
+
+        if (q.found < q.k) {
+            q.nearest[q.found++] = { d2, uint32_t(i) };
+            std::push_heap(q.nearest, q.nearest + q.found);
+            if (q.found == q.k)
+                q.radius2 = q.nearest[0].distance2;
+        }
+        else {
+            std::pop_heap(q.nearest, q.nearest + q.k);
+            q.nearest[q.k - 1] = { d2, uint32_t(i) };
+            std::push_heap(q.nearest, q.nearest + q.k);
+            q.radius2 = q.nearest[0].distance2;
+        }
+    }
+
+    // Size of the left subtree of a left-balanced tree of n nodes: every level full except the
+    // last, which fills from the left.
+    static size_t left_size(size_t n) {
+        if (n <= 1)
+            return 0;
+        size_t full = 1;     // Largest power of two not above n: the width of the last level
+        while (full * 2 <= n)
+            full *= 2;
+        auto last = n - (full - 1);
+        auto half = full / 2;
+        return (half - 1) + std::min(last, half);
+    }
+
+    // Stores photons [begin, end) as the subtree rooted at heap index i: the median along the
+    // widest axis goes at i, the photons before it to the left, the rest to the right.
+    void build(std::vector<photon>& photons, size_t begin, size_t end, size_t i, int parallel_depth) {
+        if (begin == end)
+            return;
+
+        const float inf = std::numeric_limits<float>::infinity();
+        float low[3] = { inf, inf, inf }, high[3] = { -inf, -inf, -inf };
+        for (size_t j = begin; j < end; ++j) {
+            for (int a = 0; a < 3; ++a) {
+                low[a] = std::min(low[a], photons[j].position[a]);
+                high[a] = std::max(high[a], photons[j].position[a]);
+            }
+        }
+        uint8_t axis = 0;
+        if (high[1] - low[1] > high[axis] - low[axis]) axis = 1;
+        if (high[2] - low[2] > high[axis] - low[axis]) axis = 2;
+
+        auto mid = begin + left_size(end - begin);
+        std::nth_element(photons.begin() + begin, photons.begin() + mid, photons.begin() + end,
+            [axis](const photon& a, const photon& b) { return a.position[axis] < b.position[axis]; });
+        heap[i] = photons[mid];
+        heap[i].axis = axis;
+
+        // The subtrees write disjoint heap slots and photon ranges.
+        if (parallel_depth > 0 && end - begin >= parallel_minimum) {
+            auto pending = std::async(std::launch::async, [&]() { build(photons, begin, mid, 2 * i, parallel_depth - 1); });
+            build(photons, mid + 1, end, 2 * i + 1, parallel_depth - 1);
+            pending.get();
+        }
+        else {
+            build(photons, begin, mid, 2 * i, 0);
+            build(photons, mid + 1, end, 2 * i + 1, 0);
+        }
+    }
+};
+
+// A specular sphere that sky photons are aimed at.
+struct photon_target {
+    point3 center;
+    double radius;
+};
+
+// Caustics (light reaching a diffuse surface through one or more mirror or glass bounces) from a
+// photon pass. Photons leave the sky aimed at the specular spheres, and leave the emissive
+// spheres in every direction. Only those whose first hit is specular are followed, and they
+// are stored where they first reach a diffuse surface. Eye paths gather the map at diffuse hits
+// and leave out the light the map already holds (see camera::ray_color).
+//
+// Each photon is seeded from its index, and the threads' batches are joined in order, so the
+// map is the same whatever the thread count. Memory is 28 bytes per stored photon.
+class caustic_photons {
+public:
+    caustic_photons(size_t _photon_count, int _gather_count, double _gather_radius,
+                    std::vector<photon_target> _targets, shared_ptr<const light_tree> _lights)
+        : photon_count(_photon_count), gather_count(_gather_count), gather_radius(_gather_radius),
+          targets(std::move(_targets)), lights(std::move(_lights)) {}
+
+    // Traces the photons through world and builds the map on the first call; later calls, from
+    // any thread, wait for that one and return. sky is the radiance arriving along a direction;
+    // sky photon directions are drawn from env when it is set, and uniformly otherwise. Photons
+    // leave at times spread over the shutter, so moving objects cast blurred caustics. With a
+    // pool, its threads trace the photons, a batch per step, and no threads are started.
+    void prepare(const hittable& world, const std::function<color(const vec3&)>& sky,
+                 const environment_map* env, bool sky_is_dark, int max_depth, int thread_count,
+                 const interval& shutter, render_pool* pool = nullptr) {
+        std::call_once(built, [&]() {
+            this->shutter = shutter;
+            trace(world, sky, env, sky_is_dark, max_depth, thread_count, pool);
+        });
+    }
+
+    // Caustic radiance a diffuse surface of the given albedo reflects at p.
+    color radiance(const point3& p, const vec3& n, const color& albedo) const {
+        return albedo / pi * map.irradiance(p, n, gather_count, gather_radius);
+    }
+
+    // Whether the map holds the caustics of sky light seen through specular spheres, and of
+    // the light tree's emitters seen through any specular surface.
+    bool covers_sky() const { return sky_photons > 0; }
+    bool covers_emitters() const { return emitter_photons > 0; }
+
+    size_t stored() const { return map.size(); }
+    size_t memory_bytes() const { return map.memory_bytes(); }
+
+private:
+    static const size_t batch_size = 4096;
+
+    size_t photon_count;
+    int    gather_count;
+    double gather_radius;
+    std::vector<photon_target> targets;
+    shared_ptr<const light_tree> lights;
+    size_t sky_photons = 0;
+    size_t emitter_photons = 0;
+    alias_table target_choice;   // By projected area
+    alias_table light_choice;    // By power
+    interval shutter;
+    std::once_flag built;
+    photon_map map;
+
+    static uint64_t photon_seed(size_t index) {
+        return (uint64_t(1) << 63) | index;
+    }
+
+    void trace(const hittable& world, const std::function<color(const vec3&)>& sky,
+               const environment_map* env, bool sky_is_dark, int max_depth, int thread_count, render_pool* pool) {
+        auto start = std::chrono::steady_clock::now();
+
+        bool from_sky = !sky_is_dark && !targets.empty();
+        bool from_emitters = lights && lights->size() > 0;
+        sky_photons = from_sky ? (from_emitters ? photon_count / 2 : photon_count) : 0;
+        emitter_photons = from_emitters ? photon_count - sky_photons : 0;
+
+        std::vector<double> weights;
+        for (const auto& t : targets)
+            weights.push_back(t.radius * t.radius);
+        target_choice = alias_table(weights);
+        weights.clear();
+        if (from_emitters) {
+            for (uint32_t i = 0; i < lights->size(); ++i)
+                weights.push_back(lights->light(i).power());
+        }
+        light_choice = alias_table(weights);
+
+        auto box = world.bounding_box();
+        auto far = vec3(box.x.size(), box.y.size(), box.z.size()).length() + 1;
+
+        // Workers take batches of photon indices from a shared counter; each batch keeps its
+        // photons in index order.
+        auto total = sky_photons + emitter_photons;
+        auto batch_count = (total + batch_size - 1) / batch_size;
+        std::vector<std::vector<photon>> batches(batch_count);
+        std::atomic<size_t> next_batch{ 0 };
+        auto trace_batch = [&](size_t b) {
+            for (size_t i = b * batch_size; i < std::min(total, (b + 1) * batch_size); ++i) {
+                seed_random(photon_seed(i));
+                if (i < sky_photons)
+                    emit_from_sky(world, sky, env, far, max_depth, batches[b]);
+                else
+                    emit_from_emitter(world, max_depth, batches[b]);
+            }
+        };
+
+        int threads = thread_count > 0 ? thread_count : pool ? pool->size() : int(std::thread::hardware_concurrency());
+        threads = std::max(1, std::min(threads, int(batch_count)));
+        if (pool) {
+            std::function<bool()> step = [&]() {
+                auto b = next_batch++;
+                if (b >= batch_count)
+                    return false;
+                trace_batch(b);
+                return true;
+            };
+            pool->run(step, threads);
+        }
+        else {
+            auto worker = [&]() {
+                for (size_t b = next_batch++; b < batch_count; b = next_batch++)
+                    trace_batch(b);
+            };
+            std::vector<std::thread> workers;
+            for (int t = 1; t < threads; ++t)
+                workers.emplace_back(worker);
+            worker();
+            for (auto& t : workers)
+                t.join();
+        }
+
+        std::vector<photon> photons;
+        size_t count = 0;
+        for (const auto& b : batches)
+            count += b.size();
+        photons.reserve(count);
+        for (auto& b : batches) {
+            photons.insert(photons.end(), b.begin(), b.end());
+            std::vector<photon>().swap(b);
+        }
+
+        // The tree's halves are built on threads of their own, so with a pool it is built on this one.
+        int parallel_depth = 0;
+        for (int t = pool ? 1 : threads; t > 1; t /= 2)
+            ++parallel_depth;
+        map = photon_map(std::move(photons), parallel_depth);
+
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        std::clog << "Traced " << total << " photons (" << sky_photons << " from the sky), stored "
+                  << map.size() << " caustic photons (" << map.memory_bytes() / (1 << 20) << " MB) in "
+                  << elapsed.count() << " ms\n";
+    }
+
+    // A photon from the sky toward a specular sphere: a direction from the sky, and a point on the
+    // disc across the sphere facing it, far outside the scene. Only photons whose first hit is
+    // that sphere are kept, so a photon aimed at one sphere that hits another first is not counted
+    // twice.
+    void emit_from_sky(const hittable& world, const std::function<color(const vec3&)>& sky,
+                       const environment_map* env, double far, int max_depth, std::vector<photon>& out) const {
+        auto t = target_choice.sample(random_double());
+        const auto& target = targets[t];
+
+        double direction_pdf;
+        vec3 toward_sky;
+        if (env) {
+            toward_sky = env->sample(direction_pdf);
+        }
+        else {
+            toward_sky = random_unit_vector();
+            direction_pdf = 1 / (4 * pi);
+        }
+        if (direction_pdf <= 0)
+            return;
+        auto radiance = sky(toward_sky);
+        if (radiance.length_squared() == 0)
+            return;
+
+        auto a = fabs(toward_sky.x()) > 0.9 ? vec3(0, 1, 0) : vec3(1, 0, 0);
+        auto e1 = unit_vector(cross(a, toward_sky));
+        auto e2 = cross(toward_sky, e1);
+        auto disc = random_in_unit_disk();
+        auto origin = target.center + far * toward_sky + target.radius * (disc.x() * e1 + disc.y() * e2);
+
+        auto area = pi * target.radius * target.radius;
+        auto power = radiance * (area / (target_choice.probability(t) * direction_pdf * double(sky_photons)));
+        follow(world, ray(origin, -toward_sky, emission_time()), power, max_depth, &target, out);
+    }
+
+    // A photon from an emissive sphere: a point uniform over its surface and a cosine-weighted
+    // direction out of it, carrying an equal share of the emitters' total power.
+    void emit_from_emitter(const hittable& world, int max_depth, std::vector<photon>& out) const {
+        auto l = light_choice.sample(random_double());
+        const auto& light = lights->light(l);
+
+        auto normal = random_unit_vector();
+        auto direction = normal + random_unit_vector();
+        if (direction.near_zero())
+            direction = normal;
+        auto origin = light.center + light.radius * normal;
+
+        auto area = 4 * pi * light.radius * light.radius;
+        auto power = light.emission * (pi * area / (light_choice.probability(l) * double(emitter_photons)));
+        follow(world, ray(origin, direction, emission_time()), power, max_depth, nullptr, out);
+    }
+
+    // Drawn last, and only for an open shutter, so static scenes keep the same photons.
+    double emission_time() const {
+        return shutter.max > shutter.min ? random_double(shutter.min, shutter.max) : shutter.min;
+    }
+
+    // Bounces a photon off specular surfaces until it reaches a diffuse one, and stores it there
+    // if it was reflected or refracted at least once. With a target, the first hit must be on it.
+    static void follow(const hittable& world, ray r, color power, int max_depth,
+                       const photon_target* target, std::vector<photon>& out) {
+        for (int depth = 0; depth < max_depth; ++depth) {
+            hit_record rec;
+            if (!world.hit(r, interval(0.001, infinity), rec))
+                return;
+            rec.cone_width = 0;
+            rec.uv_footprint = 0;
+
+            if (depth == 0 && target && fabs((rec.p - target->center).length() - target->radius) > 1e-6 * (1 + target->radius))
+                return;
+
+            ray scattered;
+            color attenuation;
+            if (!rec.mat->scatter(r, rec, attenuation, scattered))
+                return;
+            if (rec.mat->scattering_pdf(r, rec, scattered) > 0) {
+                if (depth > 0)
+                    out.push_back(make_photon(rec, power));
+                return;
+            }
+            power = power * attenuation;
+            r = scattered;
+        }
+    }
+
+    static photon make_photon(const hit_record& rec, const color& power) {
+        photon ph;
+        for (int a = 0; a < 3; ++a) {
+            ph.position[a] = float(rec.p[a]);
+            ph.power[a] = float(power[a]);
+            ph.normal[a] = int8_t(std::lround(127 * rec.normal[a]));
+        }
+        ph.axis = 0;
+        return ph;
+    }
+};
+
+#endif
@@ -0,0 +1 @@
+#include "post_process.h"
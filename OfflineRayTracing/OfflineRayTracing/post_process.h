@@ -0,0 +1,373 @@
+#pragma once
+#ifndef POST_PROCESS_H
+#define POST_PROCESS_H
+
+#include "rtweekend.h"
+#include "color.h"
+#include "render_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define POST_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// Time spent in each stage of post_process, summed over every image it has processed.
+struct post_timings {
+    double resolve_ms = 0;    // Sample sums to the linear float framebuffer
+    double exposure_ms = 0;
+    double bloom_ms = 0;
+    double tonemap_ms = 0;
+    double encode_ms = 0;     // Gamma and quantization to bytes
+};
+
+// Turns the sample sums of a render into display bytes through a linear float framebuffer:
+// exposure, bloom, filmic tonemapping, then the same square-root gamma and clamp as
+// colorTest::to_bytes. Each stage can be switched off and is timed on its own; with all of them
+// off, enabled() is false and images are written by colorTest as before.
+//
+// The framebuffer holds four floats per pixel, the fourth unused, so one pixel fills an SSE
+// register and every colour transform is a handful of vector instructions. Stages run over rows
+// in parallel, threads taking blocks of rows from a shared counter: threads of their own, or a
+// render pool's when given one.
+//
+// Bloom keeps the light above a luminance threshold, averages it down a pyramid of half-size
+// levels and blurs each with a separable 5-tap binomial filter, then adds the levels back up from
+// the smallest with bilinear upsampling. A level's blur is a few pixels wide, but at the
+// smallest levels those pixels cover much of the image, so the glow has a sharp core and wide
+// tails for the cost of blurring about a third of the image's pixels.
+class post_process {
+public:
+    double exposure = 0;           // Stops to scale the linear image by; 0 skips the stage
+    bool   bloom = false;          // Spread light above bloom_threshold over its surroundings
+    double bloom_threshold = 1;    // Luminance above which pixels bloom
+    double bloom_strength = 0.1;   // Share of the light above the threshold that is spread
+    int    bloom_levels = 6;       // Half-size levels of the blur pyramid
+    bool   tonemap = false;        // Roll highlights off with the ACES filmic curve instead of clipping them
+
+    bool enabled() const { return exposure != 0 || bloom || tonemap; }
+
+    const post_timings& timings() const { return times; }
+    void reset_timings() { times = {}; }
+
+    // Runs every enabled stage over width by height sums of samples samples each, row by row,
+    // and returns three bytes per pixel.
+    const std::vector<uint8_t>& process(const std::vector<color>& sums, int width, int height, int samples,
+                                        int thread_count = 0, render_pool* pool = nullptr) {
+        w = width;
+        h = height;
+        runner = pool;
+        threads = thread_count > 0 ? thread_count : pool ? pool->size() : int(std::thread::hardware_concurrency());
+        threads = std::max(1, threads);
+
+        timed(times.resolve_ms, [&] { resolve(sums, samples); });
+        if (exposure != 0)
+            timed(times.exposure_ms, [&] { scale(float(std::pow(2.0, exposure))); });
+        if (bloom)
+            timed(times.bloom_ms, [&] { apply_bloom(); });
+        if (tonemap)
+            timed(times.tonemap_ms, [&] { apply_tonemap(); });
+        timed(times.encode_ms, [&] { encode(); });
+        return bytes;
+    }
+
+    // Processes the sums and writes the pixels as a binary (P6) or text (P3) PPM body.
+    void write(std::ostream& out, const std::vector<color>& sums, int width, int height, int samples, bool binary,
+               int thread_count = 0, render_pool* pool = nullptr) {
+        process(sums, width, height, samples, thread_count, pool);
+        if (binary) {
+            out.write(reinterpret_cast<const char*>(bytes.data()), std::streamsize(bytes.size()));
+            return;
+        }
+        for (size_t i = 0; i < bytes.size(); i += 3)
+            out << int(bytes[i]) << ' ' << int(bytes[i + 1]) << ' ' << int(bytes[i + 2]) << '\n';
+    }
+
+    void report(std::ostream& out) const {
+        out << "Post-process: resolve " << times.resolve_ms << " ms";
+        if (exposure != 0)
+            out << ", exposure " << times.exposure_ms << " ms";
+        if (bloom)
+            out << ", bloom " << times.bloom_ms << " ms";
+        if (tonemap)
+            out << ", tonemap " << times.tonemap_ms << " ms";
+        out << ", encode " << times.encode_ms << " ms\n";
+    }
+
+private:
+    struct level {
+        int width = 0;
+        int height = 0;
+        std::vector<float> pixels;
+        float* row(int y) { return pixels.data() + size_t(y) * width * 4; }
+    };
+
+    int w = 0, h = 0;
+    int threads = 1;
+    render_pool* runner = nullptr;     // Runs the stages when set, rather than threads of their own
+    std::vector<float> image;          // Linear RGB plus padding, row by row
+    std::vector<level> pyramid;        // Bloom levels, kept between images to reuse their memory
+    std::vector<float> scratch;        // Horizontal blur of the level being blurred
+    std::vector<uint8_t> bytes;
+    post_timings times;
+
+#ifdef POST_SSE2
+    using lanes = __m128;
+    static lanes load(const float* p) { return _mm_loadu_ps(p); }
+    static void store(float* p, lanes v) { _mm_storeu_ps(p, v); }
+    static lanes splat(float x) { return _mm_set1_ps(x); }
+    static lanes add(lanes a, lanes b) { return _mm_add_ps(a, b); }
+    static lanes sub(lanes a, lanes b) { return _mm_sub_ps(a, b); }
+    static lanes mul(lanes a, lanes b) { return _mm_mul_ps(a, b); }
+    static lanes div(lanes a, lanes b) { return _mm_div_ps(a, b); }
+    static lanes max(lanes a, lanes b) { return _mm_max_ps(a, b); }
+    static lanes min(lanes a, lanes b) { return _mm_min_ps(a, b); }
+    static lanes sqrt(lanes a) { return _mm_sqrt_ps(a); }
+
+    // Rec. 709 luminance, as luminance() in color.h.
+    static float luma(lanes v) {
+        auto weighted = _mm_mul_ps(v, _mm_setr_ps(0.2126f, 0.7152f, 0.0722f, 0));
+        auto pairs = _mm_add_ps(weighted, _mm_movehl_ps(weighted, weighted));
+        return _mm_cvtss_f32(_mm_add_ss(pairs, _mm_shuffle_ps(pairs, pairs, 1)));
+    }
+
+    // Truncates the first three lanes, already in [0, 255], to bytes.
+    static void store_bytes(uint8_t* out, lanes v) {
+        auto words = _mm_cvttps_epi32(v);
+        words = _mm_packs_epi32(words, words);
+        auto packed = uint32_t(_mm_cvtsi128_si32(_mm_packus_epi16(words, words)));
+        out[0] = uint8_t(packed);
+        out[1] = uint8_t(packed >> 8);
+        out[2] = uint8_t(packed >> 16);
+    }
+#else
+    struct lanes { float v[4]; };
+    template <typename F>
+    static lanes each(lanes a, lanes b, F f) {
+        return { { f(a.v[0], b.v[0]), f(a.v[1], b.v[1]), f(a.v[2], b.v[2]), f(a.v[3], b.v[3]) } };
+    }
+    static lanes load(const float* p) { return { { p[0], p[1], p[2], p[3] } }; }
+    static void store(float* p, lanes v) { std::copy(v.v, v.v + 4, p); }
+    static lanes splat(float x) { return { { x, x, x, x } }; }
+    static lanes add(lanes a, lanes b) { return each(a, b, [](float x, float y) { return x + y; }); }
+    static lanes sub(lanes a, lanes b) { return each(a, b, [](float x, float y) { return x - y; }); }
+    static lanes mul(lanes a, lanes b) { return each(a, b, [](float x, float y) { return x * y; }); }
+    static lanes div(lanes a, lanes b) { return each(a, b, [](float x, float y) { return x / y; }); }
+    static lanes max(lanes a, lanes b) { return each(a, b, [](float x, float y) { return x > y ? x : y; }); }
+    static lanes min(lanes a, lanes b) { return each(a, b, [](float x, float y) { return x < y ? x : y; }); }
+    static lanes sqrt(lanes a) { return each(a, a, [](float x, float) { return std::sqrt(x); }); }
+    static float luma(lanes v) { return 0.2126f * v.v[0] + 0.7152f * v.v[1] + 0.0722f * v.v[2]; }
+    static void store_bytes(uint8_t* out, lanes v) {
+        for (int c = 0; c < 3; ++c)
+            out[c] = uint8_t(v.v[c]);
+    }
+#endif
+
+    static lanes lerp(lanes a, lanes b, lanes t) { return add(a, mul(t, sub(b, a))); }
+
+    template <typename Stage>
+    static void timed(double& ms, Stage&& stage) {
+        auto start = std::chrono::steady_clock::now();
+        stage();
+        ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Calls row(y) for every y below rows, on all threads.
+    template <typename Row>
+    void for_rows(int rows, Row&& row) const {
+        const int block = 8;
+        int count = std::max(1, std::min(threads, (rows + block - 1) / block));
+        std::atomic<int> next{ 0 };
+        if (runner) {
+            std::function<bool()> step = [&] {
+                int y0 = next.fetch_add(block);
+                for (int y = y0; y < std::min(y0 + block, rows); ++y)
+                    row(y);
+                return y0 + block < rows;
+            };
+            runner->run(step, count);
+            return;
+        }
+        auto worker = [&] {
+            for (int y0 = next.fetch_add(block); y0 < rows; y0 = next.fetch_add(block))
+                for (int y = y0; y < std::min(y0 + block, rows); ++y)
+                    row(y);
+        };
+        std::vector<std::thread> pool;
+        for (int i = 1; i < count; ++i)
+            pool.emplace_back(worker);
+        worker();
+        for (auto& thread : pool)
+            thread.join();
+    }
+
+    void resolve(const std::vector<color>& sums, int samples) {
+        image.resize(size_t(w) * h * 4);
+        auto inverse = 1.0 / samples;
+        for_rows(h, [&](int y) {
+            auto in = sums.data() + size_t(y) * w;
+            auto out = image.data() + size_t(y) * w * 4;
+            for (int x = 0; x < w; ++x, out += 4) {
+                out[0] = float(in[x].x() * inverse);
+                out[1] = float(in[x].y() * inverse);
+                out[2] = float(in[x].z() * inverse);
+                out[3] = 0;
+            }
+        });
+    }
+
+    void scale(float factor) {
+        auto f = splat(factor);
+        for_rows(h, [&](int y) {
+            auto p = image.data() + size_t(y) * w * 4;
+            for (int x = 0; x < w; ++x, p += 4)
+                store(p, mul(load(p), f));
+        });
+    }
+
+    // Narkowicz's fit of the ACES filmic reference rendering transform, clamped to [0, 1].
+    void apply_tonemap() {
+        auto a = splat(2.51f), b = splat(0.03f), c = splat(2.43f), d = splat(0.59f), e = splat(0.14f);
+        auto zero = splat(0), one = splat(1);
+        for_rows(h, [&](int y) {
+            auto p = image.data() + size_t(y) * w * 4;
+            for (int x = 0; x < w; ++x, p += 4) {
+                auto v = max(load(p), zero);
+                auto mapped = div(mul(v, add(mul(a, v), b)), add(mul(v, add(mul(c, v), d)), e));
+                store(p, min(mapped, one));
+            }
+        });
+    }
+
+    void encode() {
+        bytes.resize(size_t(w) * h * 3);
+        auto zero = splat(0), top = splat(0.999f), full = splat(256);
+        for_rows(h, [&](int y) {
+            auto p = image.data() + size_t(y) * w * 4;
+            auto out = bytes.data() + size_t(y) * w * 3;
+            for (int x = 0; x < w; ++x, p += 4, out += 3)
+                store_bytes(out, mul(full, min(sqrt(max(load(p), zero)), top)));
+        });
+    }
+
+    void apply_bloom() {
+        // The first level is the thresholded image at half size; each further level halves the last.
+        int levels = std::max(1, bloom_levels);
+        pyramid.resize(size_t(levels));
+        int width = w, height = h;
+        for (int i = 0; i < levels; ++i) {
+            width = std::max(1, (width + 1) / 2);
+            height = std::max(1, (height + 1) / 2);
+            pyramid[i].width = width;
+            pyramid[i].height = height;
+            pyramid[i].pixels.resize(size_t(width) * height * 4);
+        }
+
+        level full{ w, h, {} };
+        full.pixels.swap(image);
+        downsample(full, pyramid[0], float(bloom_threshold));
+        blur(pyramid[0]);
+        for (int i = 1; i < levels; ++i) {
+            downsample(pyramid[i - 1], pyramid[i], -1);
+            blur(pyramid[i]);
+        }
+        for (int i = levels - 1; i > 0; --i)
+            upsample_add(pyramid[i], pyramid[i - 1], 1);
+        // Every level holds all of the thresholded light, so their sum is averaged.
+        upsample_add(pyramid[0], full, float(bloom_strength / levels));
+        image.swap(full.pixels);
+    }
+
+    // Averages 2x2 blocks of from into to. With a threshold of 0 or more, each pixel first keeps
+    // only the share of its light above that luminance.
+    void downsample(level& from, level& to, float threshold) const {
+        auto quarter = splat(0.25f);
+        auto bright = [threshold](lanes v) {
+            if (threshold < 0)
+                return v;
+            auto l = luma(v);
+            return l > threshold ? mul(v, splat((l - threshold) / l)) : splat(0);
+        };
+        for_rows(to.height, [&](int y) {
+            auto row0 = from.row(std::min(2 * y, from.height - 1));
+            auto row1 = from.row(std::min(2 * y + 1, from.height - 1));
+            auto out = to.row(y);
+            for (int x = 0; x < to.width; ++x, out += 4) {
+                auto x0 = size_t(std::min(2 * x, from.width - 1)) * 4;
+                auto x1 = size_t(std::min(2 * x + 1, from.width - 1)) * 4;
+                auto sum = add(add(bright(load(row0 + x0)), bright(load(row0 + x1))),
+                               add(bright(load(row1 + x0)), bright(load(row1 + x1))));
+                store(out, mul(sum, quarter));
+            }
+        });
+    }
+
+    // The binomial filter 1 4 6 4 1 along rows into scratch, then along columns back, clamped at the edges.
+    void blur(level& l) {
+        scratch.resize(l.pixels.size());
+        auto w0 = splat(1.0f / 16), w1 = splat(4.0f / 16), w2 = splat(6.0f / 16);
+        auto taps = [&](const float* a, const float* b, const float* c, const float* d, const float* e) {
+            return add(add(mul(w0, add(load(a), load(e))), mul(w1, add(load(b), load(d)))), mul(w2, load(c)));
+        };
+        auto last_x = l.width - 1, last_y = l.height - 1;
+        for_rows(l.height, [&](int y) {
+            auto in = l.row(y);
+            auto out = scratch.data() + size_t(y) * l.width * 4;
+            for (int x = 0; x < l.width; ++x, out += 4) {
+                auto at = [&](int dx) { return in + size_t(std::min(std::max(x + dx, 0), last_x)) * 4; };
+                store(out, taps(at(-2), at(-1), at(0), at(1), at(2)));
+            }
+        });
+        for_rows(l.height, [&](int y) {
+            auto at = [&](int dy) { return scratch.data() + size_t(std::min(std::max(y + dy, 0), last_y)) * l.width * 4; };
+            const float* rows[5] = { at(-2), at(-1), at(0), at(1), at(2) };
+            auto out = l.row(y);
+            for (size_t x = 0; x < size_t(l.width) * 4; x += 4)
+                store(out + x, taps(rows[0] + x, rows[1] + x, rows[2] + x, rows[3] + x, rows[4] + x));
+        });
+    }
+
+    // Adds factor times the bilinear enlargement of coarse to fine.
+    void upsample_add(level& coarse, level& fine, float factor) const {
+        std::vector<int> column(size_t(fine.width));
+        std::vector<float> weight(size_t(fine.width));
+        auto position = [](int i, int from, int to, int& index, float& t) {
+            auto s = std::max((i + 0.5f) * to / from - 0.5f, 0.0f);
+            index = std::min(int(s), to - 1);
+            t = std::min(s - index, 1.0f);
+            if (index == to - 1)
+                t = 0;
+        };
+        for (int x = 0; x < fine.width; ++x)
+            position(x, fine.width, coarse.width, column[x], weight[x]);
+
+        auto f = splat(factor);
+        for_rows(fine.height, [&](int y) {
+            int cy;
+            float ty;
+            position(y, fine.height, coarse.height, cy, ty);
+            auto row0 = coarse.row(cy);
+            auto row1 = coarse.row(std::min(cy + 1, coarse.height - 1));
+            auto out = fine.row(y);
+            auto wy = splat(ty);
+            for (int x = 0; x < fine.width; ++x, out += 4) {
+                auto c0 = size_t(column[x]) * 4;
+                auto c1 = size_t(std::min(column[x] + 1, coarse.width - 1)) * 4;
+                auto wx = splat(weight[x]);
+                auto blended = lerp(lerp(load(row0 + c0), load(row0 + c1), wx), lerp(load(row1 + c0), load(row1 + c1), wx), wy);
+                store(out, add(load(out), mul(f, blended)));
+            }
+        });
+    }
+};
+
+#endif
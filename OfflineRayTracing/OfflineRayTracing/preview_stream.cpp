@@ -0,0 +1 @@
+#include "preview_stream.h"
@@ -0,0 +1,452 @@
+#pragma once
+#ifndef PREVIEW_STREAM_H
+#define PREVIEW_STREAM_H
+
+#include "rtweekend.h"
+#include "color.h"
+#include "tiles.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "Ws2_32.lib")
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+// A live preview of a render, streamed to a viewer on the same machine over TCP on the loopback
+// interface. The renderer listens; a viewer may connect at any time, and a new one replaces the
+// last and is first brought up to date with every tile rendered so far.
+//
+// Protocol. All integers are unsigned 32-bit little endian. The renderer sends:
+//
+//   hello:  "RTPV" version(1) width height
+//   tile:   kind(1) x0 y0 x1 y1 progress size, then size bytes of delta runs
+//   done:   kind(2) 0 0 0 0 progress 0
+//
+// progress is the share of the render done, in millionths. A tile's pixels are the 8-bit RGB of
+// the image so far, as it would be written (square-root gamma), row by row, sent as the
+// difference of each byte from what the viewer already has there, modulo 256; every byte is
+// zero before the first update. The differences are run-length coded: a control byte c below
+// 128 is followed by c + 1 literal differences, and one of 128 or more stands for c - 126 zero
+// differences. Tiles that converge change little between passes, so their updates are mostly
+// zero runs.
+//
+// Render threads never wait on the viewer. They convert their tile to bytes and copy it into
+// the newest image under a lock held only for that copy, and mark it dirty. A sender thread
+// wakes every interval, takes the dirty tiles and sends them; while a slow viewer holds it up,
+// tiles updated again are just overwritten, so updates coalesce instead of queueing. A viewer
+// that takes no data for two seconds is dropped.
+
+#ifdef _WIN32
+using socket_handle = SOCKET;
+const socket_handle no_socket = INVALID_SOCKET;
+inline void close_socket(socket_handle s) { closesocket(s); }
+#else
+using socket_handle = int;
+const socket_handle no_socket = -1;
+inline void close_socket(socket_handle s) { close(s); }
+#endif
+
+namespace preview_protocol {
+    const uint32_t version = 1;
+    const uint32_t tile_message = 1;
+    const uint32_t done_message = 2;
+
+    // Starts the platform's socket library once, on Windows.
+    inline void start_sockets() {
+#ifdef _WIN32
+        static bool started = [] {
+            WSADATA data;
+            return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+        }();
+        if (!started)
+            throw std::runtime_error("cannot start Winsock");
+#endif
+    }
+
+    inline bool send_all(socket_handle s, const uint8_t* data, size_t size) {
+#ifdef MSG_NOSIGNAL
+        const int flags = MSG_NOSIGNAL;   // A viewer closing early is an error, not SIGPIPE
+#else
+        const int flags = 0;
+#endif
+        while (size > 0) {
+            auto sent = send(s, reinterpret_cast<const char*>(data), int(std::min<size_t>(size, 1 << 20)), flags);
+            if (sent <= 0)
+                return false;
+            data += sent;
+            size -= size_t(sent);
+        }
+        return true;
+    }
+
+    inline bool receive_all(socket_handle s, uint8_t* data, size_t size) {
+        while (size > 0) {
+            auto got = recv(s, reinterpret_cast<char*>(data), int(std::min<size_t>(size, 1 << 20)), 0);
+            if (got <= 0)
+                return false;
+            data += got;
+            size -= size_t(got);
+        }
+        return true;
+    }
+
+    inline void put(std::vector<uint8_t>& out, uint32_t v) {
+        for (int i = 0; i < 4; ++i)
+            out.push_back(uint8_t(v >> (8 * i)));
+    }
+
+    inline uint32_t get(const uint8_t* in) {
+        return uint32_t(in[0]) | uint32_t(in[1]) << 8 | uint32_t(in[2]) << 16 | uint32_t(in[3]) << 24;
+    }
+
+    // Appends the run-length coded differences of now from before, and makes before equal now.
+    inline void encode_delta(const uint8_t* now, uint8_t* before, size_t size, std::vector<uint8_t>& out) {
+        size_t i = 0;
+        while (i < size) {
+            size_t zeros = 0;
+            while (i + zeros < size && zeros < 129 && now[i + zeros] == before[i + zeros])
+                ++zeros;
+            if (zeros >= 2) {
+                out.push_back(uint8_t(zeros + 126));
+                i += zeros;
+                continue;
+            }
+            // Literals until the next run of two equal bytes.
+            size_t count = 0;
+            while (i + count < size && count < 128
+                   && !(i + count + 1 < size && now[i + count] == before[i + count] && now[i + count + 1] == before[i + count + 1]))
+                ++count;
+            out.push_back(uint8_t(count - 1));
+            for (size_t k = i; k < i + count; ++k) {
+                out.push_back(uint8_t(now[k] - before[k]));
+                before[k] = now[k];
+            }
+            i += count;
+        }
+    }
+
+    // Applies coded differences to size bytes; false if they do not cover exactly that many.
+    inline bool decode_delta(const uint8_t* in, size_t in_size, uint8_t* bytes, size_t size) {
+        size_t at = 0;
+        for (size_t i = 0; i < in_size;) {
+            auto c = in[i++];
+            if (c >= 128) {
+                at += size_t(c) - 126;
+                continue;
+            }
+            size_t count = size_t(c) + 1;
+            if (i + count > in_size || at + count > size)
+                return false;
+            for (size_t k = 0; k < count; ++k)
+                bytes[at + k] = uint8_t(bytes[at + k] + in[i + k]);
+            i += count;
+            at += count;
+        }
+        return at == size;
+    }
+}
+
+// The renderer's end: set camera::on_tile to call update(), and call finish() after rendering.
+class preview_stream {
+public:
+    // Listens on the loopback interface at port (0 picks a free one, see port()).
+    preview_stream(int port, int width, int height, double interval_ms = 100)
+      : width(width), height(height), interval(interval_ms) {
+        preview_protocol::start_sockets();
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        if (listener == no_socket)
+            throw std::runtime_error("cannot create the preview socket");
+        int reuse = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuse), sizeof(reuse));
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(uint16_t(port));
+        socklen_t length = sizeof(address);
+        if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, 1) != 0
+            || getsockname(listener, reinterpret_cast<sockaddr*>(&address), &length) != 0) {
+            close_socket(listener);
+            throw std::runtime_error("cannot listen for previews on port " + std::to_string(port));
+        }
+        bound_port = ntohs(address.sin_port);
+
+        latest.assign(size_t(width) * height * 3, 0);
+        sent.assign(latest.size(), 0);
+        sender = std::thread([this]() { send_updates(); });
+    }
+
+    ~preview_stream() {
+        finish();
+        close_socket(listener);
+    }
+
+    preview_stream(const preview_stream&) = delete;
+    preview_stream& operator=(const preview_stream&) = delete;
+
+    int port() const { return bound_port; }
+    uint64_t messages_sent() const { return messages; }
+    uint64_t bytes_sent() const { return total_bytes; }
+
+    // Called from render threads with a tile's pixels, row by row, and the share done.
+    void update(const tile& t, const std::vector<color>& pixels, double done) {
+        std::vector<uint8_t> rgb(pixels.size() * 3);
+        for (size_t i = 0; i < pixels.size(); ++i)
+            colorTest::to_bytes(pixels[i], 1, &rgb[3 * i]);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto row_bytes = size_t(t.x1 - t.x0) * 3;
+        for (int j = t.y0; j < t.y1; ++j)
+            std::copy(rgb.begin() + (j - t.y0) * row_bytes, rgb.begin() + (j - t.y0 + 1) * row_bytes,
+                      latest.begin() + (size_t(j) * width + t.x0) * 3);
+        auto key = uint64_t(uint32_t(t.y0)) << 32 | uint32_t(t.x0);
+        dirty[key] = t;
+        rendered[key] = t;
+        progress = std::max(progress, done);
+    }
+
+    // Sends what is left and the done message, and stops the sender.
+    void finish() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (finishing)
+                return;
+            finishing = true;
+        }
+        wake.notify_all();
+        sender.join();
+        if (viewer != no_socket)
+            close_socket(viewer);
+        viewer = no_socket;
+    }
+
+private:
+    static const int send_timeout_ms = 2000;
+
+    int width, height;
+    double interval;
+    int bound_port = 0;
+    socket_handle listener = no_socket;
+    socket_handle viewer = no_socket;   // Used only by the sender thread
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::vector<uint8_t> latest;        // The newest bytes of every pixel
+    std::map<uint64_t, tile> dirty;     // Tiles updated since they were last sent, by row then column
+    std::map<uint64_t, tile> rendered;  // Every tile updated so far, for a viewer that joins late
+    double progress = 0;
+    bool finishing = false;
+
+    std::vector<uint8_t> sent;          // The bytes the viewer has; sender thread only
+    std::thread sender;
+    std::atomic<uint64_t> messages{ 0 };
+    std::atomic<uint64_t> total_bytes{ 0 };
+
+    // Takes a waiting viewer, if any, in place of the current one. Returns true if it did.
+    bool accept_viewer() {
+        fd_set ready;
+        FD_ZERO(&ready);
+        FD_SET(listener, &ready);
+        timeval no_wait = { 0, 0 };
+        if (select(int(listener + 1), &ready, nullptr, nullptr, &no_wait) <= 0)
+            return false;
+        auto s = accept(listener, nullptr, nullptr);
+        if (s == no_socket)
+            return false;
+        if (viewer != no_socket)
+            close_socket(viewer);
+        viewer = s;
+        // A viewer that stops reading for this long is dropped, so it cannot hold up finish().
+#ifdef _WIN32
+        DWORD timeout = send_timeout_ms;
+#else
+        timeval timeout = { send_timeout_ms / 1000, send_timeout_ms % 1000 * 1000 };
+#endif
+        setsockopt(viewer, SOL_SOCKET, SO_SNDTIMEO, reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+        std::fill(sent.begin(), sent.end(), 0);
+
+        std::vector<uint8_t> hello = { 'R', 'T', 'P', 'V' };
+        preview_protocol::put(hello, preview_protocol::version);
+        preview_protocol::put(hello, uint32_t(width));
+        preview_protocol::put(hello, uint32_t(height));
+        deliver(hello);
+        return true;
+    }
+
+    void deliver(const std::vector<uint8_t>& message) {
+        if (viewer == no_socket)
+            return;
+        if (!preview_protocol::send_all(viewer, message.data(), message.size())) {
+            close_socket(viewer);
+            viewer = no_socket;
+            return;
+        }
+        ++messages;
+        total_bytes += message.size();
+    }
+
+    void send_updates() {
+        std::vector<tile> tiles;
+        std::vector<uint8_t> bytes, message;
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            wake.wait_for(lock, std::chrono::duration<double, std::milli>(interval), [this]() { return finishing; });
+            bool last = finishing;
+            lock.unlock();
+            bool joined = accept_viewer();
+            lock.lock();
+            if (joined)
+                dirty = rendered;
+
+            // Copy the dirty tiles out so the lock is not held while sending. With no viewer they
+            // stay dirty; a viewer that joins is sent every tile anyway.
+            tiles.clear();
+            bytes.clear();
+            if (viewer != no_socket) {
+                for (const auto& entry : dirty) {
+                    const auto& t = entry.second;
+                    tiles.push_back(t);
+                    for (int j = t.y0; j < t.y1; ++j) {
+                        auto row = latest.begin() + (size_t(j) * width + t.x0) * 3;
+                        bytes.insert(bytes.end(), row, row + (t.x1 - t.x0) * 3);
+                    }
+                }
+                dirty.clear();
+            }
+            auto share = uint32_t(progress * 1e6);
+            lock.unlock();
+
+            size_t offset = 0;
+            for (const auto& t : tiles) {
+                message.clear();
+                for (auto v : { preview_protocol::tile_message, uint32_t(t.x0), uint32_t(t.y0), uint32_t(t.x1), uint32_t(t.y1), share, 0u })
+                    preview_protocol::put(message, v);
+                auto row_bytes = size_t(t.x1 - t.x0) * 3;
+                for (int j = t.y0; j < t.y1; ++j, offset += row_bytes)
+                    preview_protocol::encode_delta(&bytes[offset], &sent[(size_t(j) * width + t.x0) * 3], row_bytes, message);
+                auto size = uint32_t(message.size() - 28);
+                for (int i = 0; i < 4; ++i)
+                    message[24 + i] = uint8_t(size >> (8 * i));
+                deliver(message);
+            }
+
+            if (last) {
+                message.clear();
+                for (auto v : { preview_protocol::done_message, 0u, 0u, 0u, 0u, uint32_t(1e6), 0u })
+                    preview_protocol::put(message, v);
+                deliver(message);
+                return;
+            }
+            lock.lock();
+        }
+    }
+};
+
+// The reference viewer: connects to a render's preview on this machine, keeps its image up to
+// date, and rewrites it as a binary PPM at path at most every interval_ms and once more when the
+// render is done. Each snapshot is written beside path and renamed over it, so readers never
+// see half a file. Retries connecting for up to ten seconds while the renderer starts.
+inline void watch_preview(int port, const std::string& path, double interval_ms = 500) {
+    preview_protocol::start_sockets();
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(uint16_t(port));
+
+    socket_handle s = no_socket;
+    for (int attempt = 0; attempt < 100 && s == no_socket; ++attempt) {
+        s = socket(AF_INET, SOCK_STREAM, 0);
+        if (s != no_socket && connect(s, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+            close_socket(s);
+            s = no_socket;
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    }
+    if (s == no_socket)
+        throw std::runtime_error("no preview on port " + std::to_string(port));
+
+    uint8_t header[28];
+    if (!preview_protocol::receive_all(s, header, 16) || std::string(header, header + 4) != "RTPV"
+        || preview_protocol::get(header + 4) != preview_protocol::version) {
+        close_socket(s);
+        throw std::runtime_error("not a preview stream");
+    }
+    auto width = preview_protocol::get(header + 8), height = preview_protocol::get(header + 12);
+    std::vector<uint8_t> image(size_t(width) * height * 3, 0), payload, tile_bytes;
+
+    auto write_snapshot = [&]() {
+        auto partial = path + ".part";
+        {
+            std::ofstream out(partial, std::ios::binary);
+            out << "P6\n" << width << ' ' << height << "\n255\n";
+            out.write(reinterpret_cast<const char*>(image.data()), std::streamsize(image.size()));
+            if (!out)
+                throw std::runtime_error("cannot write '" + partial + "'");
+        }
+        std::filesystem::rename(partial, path);
+    };
+
+    auto last_write = std::chrono::steady_clock::now();
+    uint64_t tiles = 0;
+    bool finished = false;
+    while (preview_protocol::receive_all(s, header, 28)) {
+        auto kind = preview_protocol::get(header);
+        uint32_t x0 = preview_protocol::get(header + 4), y0 = preview_protocol::get(header + 8);
+        uint32_t x1 = preview_protocol::get(header + 12), y1 = preview_protocol::get(header + 16);
+        auto progress = preview_protocol::get(header + 20) * 1e-6;
+        if (kind == preview_protocol::done_message) {
+            finished = true;
+            break;
+        }
+        if (kind != preview_protocol::tile_message || x0 >= x1 || y0 >= y1 || x1 > width || y1 > height)
+            throw std::runtime_error("malformed preview message");
+        payload.resize(preview_protocol::get(header + 24));
+        if (!preview_protocol::receive_all(s, payload.data(), payload.size()))
+            break;
+
+        // The runs cover the tile's rows one after another.
+        auto row_bytes = size_t(x1 - x0) * 3;
+        tile_bytes.resize(row_bytes * (y1 - y0));
+        for (uint32_t j = y0; j < y1; ++j)
+            std::copy_n(&image[(size_t(j) * width + x0) * 3], row_bytes, &tile_bytes[(j - y0) * row_bytes]);
+        if (!preview_protocol::decode_delta(payload.data(), payload.size(), tile_bytes.data(), tile_bytes.size()))
+            throw std::runtime_error("malformed preview tile");
+        for (uint32_t j = y0; j < y1; ++j)
+            std::copy_n(&tile_bytes[(j - y0) * row_bytes], row_bytes, &image[(size_t(j) * width + x0) * 3]);
+        ++tiles;
+
+        auto now = std::chrono::steady_clock::now();
+        if (std::chrono::duration<double, std::milli>(now - last_write).count() >= interval_ms) {
+            write_snapshot();
+            last_write = now;
+            std::clog << "\rPreview " << int(100 * progress) << "% (" << tiles << " tile updates)  " << std::flush;
+        }
+    }
+    close_socket(s);
+    write_snapshot();
+    std::clog << (finished ? "\rPreview complete: " : "\rPreview ended early: ") << tiles << " tile updates, " << path << '\n';
+}
+
+#endif
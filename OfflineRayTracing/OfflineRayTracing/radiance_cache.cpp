@@ -0,0 +1 @@
+#include "radiance_cache.h"
@@ -0,0 +1,150 @@
+#pragma once
+#ifndef RADIANCE_CACHE_H
+#define RADIANCE_CACHE_H
+
+#include "rtweekend.h"
+#include "color.h"
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+
+// An irradiance cache in the manner of Ward, Rubinstein and Clear, "A Ray Tracing Solution for
+// Diffuse Interreflection" (1988). Each record holds the irradiance arriving at a point of a
+// surface and the radius within which it stands for its neighbours, from the distance to the
+// surfaces around it: records in corners cover little, records in the open a lot.
+//
+// Paths are cut off at a maximum depth, so the irradiance gathered at a surface depends on how
+// many bounces the path had left there. Each record keeps that depth, and only stands for
+// surfaces reached with the same number of bounces left.
+//
+// Records live in a hashed grid whose cells are twice the largest radius across, so a record
+// covers at most two cells along each axis and is listed in each of them. A lookup then only
+// reads the list of the cell holding its point. Every list is a singly linked stack pushed with
+// compare-and-swap, and entries are never removed while the cache lives, so render threads add
+// records while others read without locks. Two threads missing near the same point may both
+// add a record there; both are valid.
+class radiance_cache {
+public:
+    // Records get radii between max_radius / 16 and max_radius.
+    radiance_cache(double max_radius)
+      : largest(max_radius), cell_size(2 * max_radius), buckets(new std::atomic<entry*>[bucket_count]) {
+        for (size_t i = 0; i < bucket_count; ++i)
+            buckets[i].store(nullptr, std::memory_order_relaxed);
+    }
+
+    ~radiance_cache() {
+        for (size_t i = 0; i < bucket_count; ++i) {
+            for (auto e = buckets[i].load(); e;) {
+                auto next = e->next;
+                delete e;
+                e = next;
+            }
+        }
+        for (auto r = newest.load(); r;) {
+            auto older = r->older;
+            delete r;
+            r = older;
+        }
+    }
+
+    radiance_cache(const radiance_cache&) = delete;
+    radiance_cache& operator=(const radiance_cache&) = delete;
+
+    double max_radius() const { return largest; }
+    double min_radius() const { return largest / 16; }
+
+    // Irradiance at p on a surface facing the unit normal n, reached with depth bounces left,
+    // blended from the records for that depth that cover p on a surface facing the same way.
+    // False when none does.
+    bool lookup(const point3& p, const vec3& n, int depth, color& irradiance) const {
+        color sum(0, 0, 0);
+        double weights = 0;
+        for (auto e = buckets[bucket_of(cell_of(p.x()), cell_of(p.y()), cell_of(p.z()))].load(std::memory_order_acquire);
+             e; e = e->next) {
+            const auto& r = *e->at;
+            if (r.depth != depth)
+                continue;
+            auto offset = p - r.p;
+            auto distance = offset.length();
+            if (distance >= r.radius || dot(n, r.n) < min_cosine)
+                continue;
+            // Off the record's plane: a different surface that happens to be close.
+            if (fabs(dot(offset, r.n)) > plane_tolerance * r.radius)
+                continue;
+            auto weight = 1 - distance / r.radius;
+            sum += weight * r.irradiance;
+            weights += weight;
+        }
+        if (weights <= 0)
+            return false;
+        irradiance = sum / weights;
+        return true;
+    }
+
+    // Adds a record at p on a surface facing the unit normal n, reached with depth bounces left,
+    // with its radius clamped to the cache's range.
+    void insert(const point3& p, const vec3& n, int depth, const color& irradiance, double radius) {
+        auto r = new record{ p, n, irradiance, fmin(fmax(radius, min_radius()), largest), depth, nullptr };
+        r->older = newest.load(std::memory_order_relaxed);
+        while (!newest.compare_exchange_weak(r->older, r, std::memory_order_release, std::memory_order_relaxed))
+            ;
+        records.fetch_add(1, std::memory_order_relaxed);
+
+        int64_t lo[3], hi[3];
+        for (int a = 0; a < 3; ++a) {
+            lo[a] = cell_of(p[a] - r->radius);
+            hi[a] = cell_of(p[a] + r->radius);
+        }
+        for (auto x = lo[0]; x <= hi[0]; ++x)
+            for (auto y = lo[1]; y <= hi[1]; ++y)
+                for (auto z = lo[2]; z <= hi[2]; ++z) {
+                    auto& head = buckets[bucket_of(x, y, z)];
+                    auto e = new entry{ r, head.load(std::memory_order_relaxed) };
+                    while (!head.compare_exchange_weak(e->next, e, std::memory_order_release, std::memory_order_relaxed))
+                        ;
+                }
+    }
+
+    size_t record_count() const { return records.load(std::memory_order_relaxed); }
+
+    // Rays traced to compute records, counted by whoever computes them.
+    void count_rays(uint64_t count) { record_rays.fetch_add(count, std::memory_order_relaxed); }
+    uint64_t rays_traced() const { return record_rays.load(std::memory_order_relaxed); }
+
+private:
+    struct record {
+        point3  p;
+        vec3    n;
+        color   irradiance;
+        double  radius;
+        int     depth;   // Bounces the paths it stands for had left
+        record* older;   // The record added before this one, for the destructor
+    };
+
+    struct entry {
+        const record* at;
+        entry*        next;
+    };
+
+    static const size_t bucket_count = size_t(1) << 18;
+    static constexpr double min_cosine = 0.95;       // Records on surfaces turned further away are skipped
+    static constexpr double plane_tolerance = 0.1;   // Largest distance off a record's plane, over its radius
+
+    double largest;
+    double cell_size;
+    std::unique_ptr<std::atomic<entry*>[]> buckets;
+    std::atomic<record*> newest{ nullptr };
+    std::atomic<size_t> records{ 0 };
+    std::atomic<uint64_t> record_rays{ 0 };
+
+    int64_t cell_of(double coordinate) const { return int64_t(std::floor(coordinate / cell_size)); }
+
+    static size_t bucket_of(int64_t x, int64_t y, int64_t z) {
+        auto h = uint64_t(x) * 73856093u ^ uint64_t(y) * 19349663u ^ uint64_t(z) * 83492791u;
+        return size_t(h ^ (h >> 29)) & (bucket_count - 1);
+    }
+};
+
+#endif
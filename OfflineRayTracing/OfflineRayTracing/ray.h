@@ -8,10 +8,20 @@ class ray {
 public:
     ray() {}
 
-    ray(const point3& origin, const vec3& direction) : orig(origin), dir(direction) {}
+    // time is the moment within the camera's shutter the ray was traced at; moving objects are
+    // intersected where they were then.
+    ray(const point3& origin, const vec3& direction, double time = 0) : orig(origin), dir(direction), tm(time) {}
+
+    // A ray that stands for a cone `width` wide at its origin, widening by `spread` per unit of
+    // distance travelled. Texture lookups use the cone's footprint to pick a MIP level.
+    ray(const point3& origin, const vec3& direction, double width, double spread, double time = 0)
+        : orig(origin), dir(direction), tm(time), cone_w(width), cone_s(spread) {}
 
     point3 origin() const { return orig; }
     vec3 direction() const { return dir; }
+    double time() const { return tm; }
+    double cone_width() const { return cone_w; }
+    double cone_spread() const { return cone_s; }
 
     point3 at(double t) const {
         return orig + t * dir;
@@ -20,6 +30,9 @@ public:
 private:
     point3 orig;
     vec3 dir;
+    double tm = 0;
+    double cone_w = 0;
+    double cone_s = 0;
 };
 
 #endif
@@ -0,0 +1,123 @@
+#pragma once
+#ifndef RENDER_POOL_H
+#define RENDER_POOL_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of render threads that any number of renders can share. A render pass hands the
+// pool a step function that renders one tile per call and returns false once there are none
+// left, then blocks until its steps are done. Pool threads take one step at a time from the
+// passes in flight in turn, so concurrent renders share the threads tile by tile: none of them
+// waits for another to finish, and together they never run more threads than the pool has.
+class render_pool {
+public:
+    // thread_count of 0 starts one thread per hardware thread.
+    explicit render_pool(int thread_count = 0) {
+        int threads = thread_count > 0 ? thread_count : int(std::thread::hardware_concurrency());
+        threads = std::max(1, threads);
+        for (int i = 0; i < threads; ++i)
+            workers.emplace_back([this]() { work(); });
+    }
+
+    ~render_pool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        available.notify_all();
+        for (auto& worker : workers)
+            worker.join();
+    }
+
+    render_pool(const render_pool&) = delete;
+    render_pool& operator=(const render_pool&) = delete;
+
+    int size() const { return int(workers.size()); }
+
+    // Calls step() on pool threads, on at most max_threads of them at once, until a call returns
+    // false; returns once every call has. An exception thrown by a step ends the pass and is
+    // rethrown here.
+    void run(const std::function<bool()>& step, int max_threads) {
+        pass p{ &step, std::max(1, max_threads), 0, false, nullptr };
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            passes.push_back(&p);
+        }
+        available.notify_all();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [&p]() { return p.exhausted && p.running == 0; });
+        passes.erase(std::find(passes.begin(), passes.end(), &p));
+        if (p.error)
+            std::rethrow_exception(p.error);
+    }
+
+private:
+    struct pass {
+        const std::function<bool()>* step;
+        int  max_threads;
+        int  running = 0;
+        bool exhausted = false;
+        std::exception_ptr error;
+    };
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable available;  // A pass may take another thread, or the pool is stopping
+    std::condition_variable finished;   // A pass may have run out of steps
+    std::deque<pass*> passes;           // In flight, next to get a thread first
+    bool stopping = false;
+
+    // The first pass in turn that can take another thread, moved to the back of the turn.
+    pass* next_pass() {
+        for (size_t i = 0; i < passes.size(); ++i) {
+            auto p = passes.front();
+            passes.pop_front();
+            passes.push_back(p);
+            if (!p->exhausted && p->running < p->max_threads)
+                return p;
+        }
+        return nullptr;
+    }
+
+    void work() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            pass* p = nullptr;
+            available.wait(lock, [&]() { return stopping || (p = next_pass()) != nullptr; });
+            if (!p)
+                return;
+
+            ++p->running;
+            lock.unlock();
+            bool more = false;
+            std::exception_ptr error;
+            try {
+                more = (*p->step)();
+            }
+            catch (...) {
+                error = std::current_exception();
+            }
+            lock.lock();
+
+            --p->running;
+            if (error && !p->error)
+                p->error = error;
+            if (!more || error)
+                p->exhausted = true;
+            if (p->exhausted && p->running == 0)
+                finished.notify_all();
+            else
+                available.notify_one();   // A thread the pass's limit held back may take it up
+        }
+    }
+};
+
+#endif
@@ -0,0 +1 @@
+#include "render_server.h"
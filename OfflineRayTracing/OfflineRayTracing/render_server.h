@@ -0,0 +1,303 @@
+#pragma once
+#ifndef RENDER_SERVER_H
+#define RENDER_SERVER_H
+
+#include "rtweekend.h"
+#include "bvh.h"
+#include "camera.h"
+#include "hittable_list.h"
+#include "render_pool.h"
+#include "scene.h"
+#include "scene_generator.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A long-running renderer driven by line requests on an input stream (normally a pipe on
+// stdin). Scenes are loaded and accelerated once and stay resident; render requests only
+// copy the scene's camera and change it, so they never rebuild anything.
+//
+// Requests:
+//   load <name> <scene file | generate:<spec> | demo>
+//   unload <name>
+//   render <job id> <scene name> [key=value ...]
+//       keys: width spp depth vfov aspect defocus focus threads, lookfrom=x,y,z lookat=x,y,z
+//       vup=x,y,z, env_sampling=bsdf|uniform|importance, light_selection=bsdf|uniform|tree,
+//       shutter=open,close, and output=<file> (default "-": stream the image back inline)
+//   wait                  blocks until every queued render has finished
+//   quit                  waits, then stops the server (end of input does the same)
+//
+// Replies, one line each on the output stream:
+//   loaded <name> <primitives> <ms>
+//   done <job id> <file | -> <ms> <rays>
+//   image <job id> <bytes>          followed by that many bytes of binary PPM
+//   error <job id | -> <message>
+//
+// Render requests queue up, and job_count of them at a time render on one shared pool of
+// threads, tile by tile, so a job running alone has every thread to itself.
+
+struct server_options {
+    int job_count = 2;        // Renders in flight at once
+    int thread_count = 0;     // Render threads shared between the jobs; 0 uses every hardware thread
+};
+
+class render_server {
+public:
+    render_server(const server_options& _options, std::istream& _in, std::ostream& _out)
+        : options(_options), in(_in), out(_out), pool(std::make_shared<render_pool>(_options.thread_count)) {}
+
+    void run() {
+        int jobs = std::max(1, options.job_count);
+        std::vector<std::thread> runners;
+        for (int k = 0; k < jobs; ++k)
+            runners.emplace_back([this]() { run_jobs(); });
+
+        std::string line;
+        while (std::getline(in, line)) {
+            std::istringstream fields(line);
+            std::string command;
+            if (!(fields >> command) || command[0] == '#')
+                continue;
+
+            if (command == "quit")
+                break;
+            try {
+                if (command == "load")         load(fields);
+                else if (command == "unload")  unload(fields);
+                else if (command == "render")  enqueue(fields);
+                else if (command == "wait")    wait_idle();
+                else throw std::runtime_error("unknown request '" + command + "'");
+            }
+            catch (const std::exception& e) {
+                reply("error - " + std::string(e.what()));
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            stopping = true;
+        }
+        queue_changed.notify_all();
+        for (auto& runner : runners)
+            runner.join();
+    }
+
+private:
+    // A loaded scene and its acceleration structure, shared read-only by every job using it.
+    struct resident_scene {
+        scene description;
+        hittable_list world;
+        std::unique_ptr<bvh> accelerated;
+    };
+
+    struct render_job {
+        std::string id;
+        std::shared_ptr<const resident_scene> resident;
+        camera cam;
+        std::string output_path;
+    };
+
+    server_options options;
+    std::istream& in;
+    std::ostream& out;
+    std::shared_ptr<render_pool> pool;
+
+    std::map<std::string, std::shared_ptr<const resident_scene>> scenes;
+
+    std::mutex queue_mutex;
+    std::condition_variable queue_changed;
+    std::deque<render_job> queue;
+    int active_jobs = 0;
+    bool stopping = false;
+
+    std::mutex out_mutex;
+
+    using clock = std::chrono::steady_clock;
+
+    static double elapsed_ms(clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(clock::now() - start).count();
+    }
+
+    void reply(const std::string& line) {
+        std::lock_guard<std::mutex> lock(out_mutex);
+        out << line << '\n' << std::flush;
+    }
+
+    void load(std::istream& fields) {
+        std::string name, source;
+        if (!(fields >> name >> source))
+            throw std::runtime_error("load needs a scene name and a source");
+
+        auto start = clock::now();
+        auto resident = std::make_shared<resident_scene>();
+        if (source == "demo")
+            resident->description = random_spheres_scene();
+        else if (source.compare(0, 9, "generate:") == 0)
+            resident->description = generate_scene(generator_settings::parse(source.substr(9)));
+        else
+            resident->description = scene::load(source);
+        resident->description.build_world(resident->world);
+        // Over the objects' whole motion, so any shutter a render asks for stays inside it.
+        resident->accelerated.reset(new bvh(resident->world));
+
+        scenes[name] = resident;
+        std::ostringstream line;
+        line << "loaded " << name << ' ' << resident->description.primitive_count() << ' ' << elapsed_ms(start);
+        reply(line.str());
+    }
+
+    // Jobs still queued or rendering keep their own reference to the scene.
+    void unload(std::istream& fields) {
+        std::string name;
+        fields >> name;
+        if (scenes.erase(name) == 0)
+            throw std::runtime_error("no scene named '" + name + "'");
+    }
+
+    void enqueue(std::istream& fields) {
+        render_job job;
+        std::string scene_name;
+        if (!(fields >> job.id >> scene_name))
+            throw std::runtime_error("render needs a job id and a scene name");
+
+        try {
+            auto found = scenes.find(scene_name);
+            if (found == scenes.end())
+                throw std::runtime_error("no scene named '" + scene_name + "'");
+            job.resident = found->second;
+            job.cam = job.resident->description.cam;
+            job.cam.show_progress = false;
+            job.cam.pool = pool;
+            job.cam.thread_count = 0;
+            job.output_path = "-";
+
+            std::string setting;
+            while (fields >> setting)
+                apply_setting(job, setting);
+        }
+        catch (const std::exception& e) {
+            reply("error " + job.id + ' ' + e.what());
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            queue.push_back(std::move(job));
+        }
+        queue_changed.notify_one();
+    }
+
+    void wait_idle() {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        queue_changed.wait(lock, [this]() { return queue.empty() && active_jobs == 0; });
+    }
+
+    static void apply_setting(render_job& job, const std::string& setting) {
+        auto eq = setting.find('=');
+        if (eq == std::string::npos)
+            throw std::runtime_error("render setting '" + setting + "' is not key=value");
+        auto key = setting.substr(0, eq);
+        auto value = setting.substr(eq + 1);
+        camera& cam = job.cam;
+
+        if (key == "width")          cam.image_width = std::stoi(value);
+        else if (key == "spp")       cam.samples_per_pixel = std::stoi(value);
+        else if (key == "depth")     cam.max_depth = std::stoi(value);
+        else if (key == "vfov")      cam.vfov = std::stod(value);
+        else if (key == "aspect")    cam.aspect_ratio = std::stod(value);
+        else if (key == "defocus")   cam.defocus_angle = std::stod(value);
+        else if (key == "focus")     cam.focus_dist = std::stod(value);
+        else if (key == "threads")   cam.thread_count = std::stoi(value);
+        else if (key == "lookfrom")  cam.lookfrom = parse_vec(value);
+        else if (key == "lookat")    cam.lookat = parse_vec(value);
+        else if (key == "vup")       cam.vup = parse_vec(value);
+        else if (key == "env_sampling") cam.env_sampling = parse_environment_sampling(value);
+        else if (key == "light_selection") cam.light_mode = parse_light_selection(value);
+        else if (key == "shutter") {
+            char comma;
+            std::istringstream fields(value);
+            if (!(fields >> cam.shutter_open >> comma >> cam.shutter_close) || comma != ',')
+                throw std::runtime_error("'" + value + "' is not open,close");
+        }
+        else if (key == "output")    job.output_path = value;
+        else
+            throw std::runtime_error("unknown render setting '" + key + "'");
+    }
+
+    static vec3 parse_vec(const std::string& text) {
+        double x, y, z;
+        char comma1, comma2;
+        std::istringstream fields(text);
+        if (!(fields >> x >> comma1 >> y >> comma2 >> z) || comma1 != ',' || comma2 != ',')
+            throw std::runtime_error("'" + text + "' is not x,y,z");
+        return vec3(x, y, z);
+    }
+
+    void run_jobs() {
+        for (;;) {
+            render_job job;
+            {
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                queue_changed.wait(lock, [this]() { return stopping || !queue.empty(); });
+                if (queue.empty())
+                    return;
+                job = std::move(queue.front());
+                queue.pop_front();
+                ++active_jobs;
+            }
+
+            try {
+                render(job);
+            }
+            catch (const std::exception& e) {
+                reply("error " + job.id + ' ' + e.what());
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex);
+                --active_jobs;
+            }
+            queue_changed.notify_all();
+        }
+    }
+
+    void render(render_job& job) {
+        auto start = clock::now();
+        std::ostringstream line;
+
+        if (job.output_path == "-") {
+            std::ostringstream image;
+            job.cam.binary_output = true;
+            job.cam.render(*job.resident->accelerated, image);
+            auto bytes = image.str();
+
+            line << "done " << job.id << " - " << elapsed_ms(start) << ' ' << job.cam.rays_traced();
+            std::lock_guard<std::mutex> lock(out_mutex);
+            out << "image " << job.id << ' ' << bytes.size() << '\n';
+            out.write(bytes.data(), std::streamsize(bytes.size()));
+            out << line.str() << '\n' << std::flush;
+            return;
+        }
+
+        std::ofstream file(job.output_path, std::ios::binary);
+        if (!file)
+            throw std::runtime_error("cannot write image '" + job.output_path + "'");
+        job.cam.render(*job.resident->accelerated, file);
+        line << "done " << job.id << ' ' << job.output_path << ' ' << elapsed_ms(start) << ' ' << job.cam.rays_traced();
+        reply(line.str());
+    }
+};
+
+#endif
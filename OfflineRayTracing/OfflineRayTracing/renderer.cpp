@@ -0,0 +1 @@
+#include "renderer.h"
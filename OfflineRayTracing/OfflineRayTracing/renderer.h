@@ -0,0 +1,185 @@
+#pragma once
+#ifndef RENDERER_H
+#define RENDERER_H
+
+#include "rtweekend.h"
+#include "bvh.h"
+#include "camera.h"
+#include "hittable_list.h"
+#include "render_pool.h"
+#include "scene.h"
+#include "scene_generator.h"
+
+#include <atomic>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// The tracer as a library, for tools that embed it rather than run it. Everything is built on
+// the same camera and hittables as the command line; only main() is left out. Scenes come from
+// scene::load, generate_scene, random_spheres_scene or a scene filled in by hand, are prepared
+// once, and are then rendered by any number of asynchronous jobs:
+//
+//   renderer r;                                             // one thread pool for every job
+//   auto prepared = renderer::prepare(scene::load("a.rts"));
+//   auto cam = prepared->cam();
+//   cam.image_width = 800;
+//   auto job = r.render(prepared, cam, [](double done) { /* on a render thread */ });
+//   auto preview = job->snapshot();                         // the image so far, while it renders
+//   job->cancel();                                          // or:
+//   std::string ppm = job->result().get();                  // throws render_cancelled if cancelled
+//
+// Jobs share the renderer's pool tile by tile (see render_pool), so running several at once
+// keeps every core busy without starting more threads than there are cores. Each job also has a
+// thread of its own that drives its camera; it sleeps while the pool renders its tiles.
+
+// A scene with its world built and accelerated, shared read-only by every job rendering it.
+class prepared_scene {
+public:
+    explicit prepared_scene(scene s) : description(std::move(s)) {
+        description.build_world(objects);
+        // Over the objects' whole motion, so any shutter a job asks for stays inside it.
+        accelerated.reset(new bvh(objects));
+    }
+
+    prepared_scene(const prepared_scene&) = delete;
+    prepared_scene& operator=(const prepared_scene&) = delete;
+
+    const scene& source() const { return description; }
+    const hittable& world() const { return *accelerated; }
+
+    // The scene's own camera, lights and environment set, for a job to adjust and render with.
+    camera cam() const { return description.cam; }
+
+private:
+    scene description;
+    hittable_list objects;
+    std::unique_ptr<bvh> accelerated;
+};
+
+enum class job_state { running, done, cancelled, failed };
+
+// The handle of one asynchronous render. Destroying it cancels the render and waits for it.
+class render_job {
+public:
+    ~render_job() {
+        cancel();
+        if (runner.joinable())
+            runner.join();
+    }
+
+    render_job(const render_job&) = delete;
+    render_job& operator=(const render_job&) = delete;
+
+    // The finished image as a PPM (binary if the camera's binary_output is set). get() rethrows
+    // what ended the render: render_cancelled after cancel(), or the error it failed with.
+    std::shared_future<std::string> result() const { return finished; }
+
+    job_state state() const { return current.load(); }
+    double progress() const { return done.load(); }   // Share of the render done, 0 to 1
+    int width() const { return image_width; }
+    int height() const { return image_height; }
+
+    // Asks the render to stop. Tiles being rendered finish; no new ones start.
+    void cancel() { cancelling = true; }
+
+    // The image so far in linear colour, row by row: every tile as of the last time a pass
+    // finished it, and black where none has yet.
+    std::vector<color> snapshot() const {
+        std::lock_guard<std::mutex> lock(preview_mutex);
+        return preview;
+    }
+
+private:
+    friend class renderer;
+
+    camera cam;
+    std::shared_ptr<const prepared_scene> prepared;
+    std::function<void(double)> on_progress;
+    int image_width, image_height;
+
+    std::atomic<bool> cancelling{ false };
+    std::atomic<job_state> current{ job_state::running };
+    std::atomic<double> done{ 0 };
+    mutable std::mutex preview_mutex;
+    std::vector<color> preview;
+    std::promise<std::string> outcome;
+    std::shared_future<std::string> finished;
+    std::thread runner;
+
+    render_job(std::shared_ptr<const prepared_scene> scene_, camera camera_, std::function<void(double)> progress)
+      : cam(std::move(camera_)), prepared(std::move(scene_)), on_progress(std::move(progress)) {
+        image_width = cam.image_width;
+        image_height = cam.pixel_height();
+        preview.assign(size_t(image_width) * image_height, color(0, 0, 0));
+        finished = outcome.get_future().share();
+
+        cam.show_progress = false;
+        cam.cancel = &cancelling;
+        cam.on_tile = [this](const tile& t, const std::vector<color>& pixels, double share) {
+            {
+                std::lock_guard<std::mutex> lock(preview_mutex);
+                auto from = pixels.begin();
+                for (int j = t.y0; j < t.y1; ++j, from += t.x1 - t.x0)
+                    std::copy(from, from + (t.x1 - t.x0), preview.begin() + size_t(j) * image_width + t.x0);
+            }
+            // Tiles finish out of order, so only ever move forward.
+            auto before = done.load();
+            while (share > before && !done.compare_exchange_weak(before, share))
+                ;
+            if (on_progress)
+                on_progress(share);
+        };
+    }
+
+    void run() {
+        try {
+            std::ostringstream image;
+            cam.render(prepared->world(), image);
+            done = 1;
+            current = job_state::done;
+            outcome.set_value(image.str());
+        }
+        catch (const render_cancelled&) {
+            current = job_state::cancelled;
+            outcome.set_exception(std::current_exception());
+        }
+        catch (...) {
+            current = job_state::failed;
+            outcome.set_exception(std::current_exception());
+        }
+    }
+};
+
+class renderer {
+public:
+    // Renders every job on thread_count shared threads; 0 uses every hardware thread.
+    explicit renderer(int thread_count = 0) : pool(std::make_shared<render_pool>(thread_count)) {}
+
+    static std::shared_ptr<const prepared_scene> prepare(scene s) {
+        return std::make_shared<const prepared_scene>(std::move(s));
+    }
+
+    // Starts rendering the prepared scene through cam and returns at once. on_progress, if
+    // given, is called from render threads with the share done after every tile. The camera's
+    // thread_count, if set, caps the pool threads this job takes at once.
+    std::shared_ptr<render_job> render(std::shared_ptr<const prepared_scene> prepared, camera cam,
+                                       std::function<void(double)> on_progress = {}) {
+        cam.pool = pool;
+        std::shared_ptr<render_job> job(new render_job(std::move(prepared), std::move(cam), std::move(on_progress)));
+        job->runner = std::thread([raw = job.get()]() { raw->run(); });
+        return job;
+    }
+
+    int thread_count() const { return pool->size(); }
+
+private:
+    std::shared_ptr<render_pool> pool;
+};
+
+#endif
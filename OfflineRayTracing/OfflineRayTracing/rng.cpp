@@ -0,0 +1 @@
+#include "rng.h"
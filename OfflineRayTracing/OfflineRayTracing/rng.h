@@ -0,0 +1,71 @@
+#pragma once
+#ifndef RNG_H
+#define RNG_H
+
+#include <cstdint>
+
+// Small, fast xoshiro256+ generator. Every thread has its own instance, so render threads never
+// share random state. The camera reseeds it for each pixel from the pixel's coordinates, which
+// makes an image independent of thread count, tile size and traversal order.
+class rng {
+public:
+    rng(uint64_t seed = 0) { reseed(seed); }
+
+    void reseed(uint64_t seed) {
+        // Expand the seed with splitmix64, as recommended for xoshiro generators.
+        for (auto& word : state) {
+            seed += 0x9e3779b97f4a7c15ull;
+            uint64_t z = seed;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            word = z ^ (z >> 31);
+        }
+    }
+
+    uint64_t next() {
+        const uint64_t result = state[0] + state[3];
+        const uint64_t t = state[1] << 17;
+
+        state[2] ^= state[0];
+        state[3] ^= state[1];
+        state[1] ^= state[2];
+        state[0] ^= state[3];
+        state[2] ^= t;
+        state[3] = rotl(state[3], 45);
+
+        return result;
+    }
+
+    // Returns a random real in [0,1) from the top 53 bits.
+    double next_double() {
+        return (next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    static rng& local() {
+        thread_local rng generator;
+        return generator;
+    }
+
+private:
+    uint64_t state[4];
+
+    static uint64_t rotl(uint64_t x, int k) {
+        return (x << k) | (x >> (64 - k));
+    }
+};
+
+inline void seed_random(uint64_t seed) {
+    rng::local().reseed(seed);
+}
+
+inline double random_double() {
+    // Returns a random real in [0,1).
+    return rng::local().next_double();
+}
+
+inline double random_double(double min, double max) {
+    // Returns a random real in [min,max).
+    return min + (max - min) * random_double();
+}
+
+#endif
@@ -0,0 +1 @@
+#include "scene.h"
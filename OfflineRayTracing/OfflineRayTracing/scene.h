@@ -0,0 +1,1218 @@
+#pragma once
+#ifndef SCENE_H
+#define SCENE_H
+
+#include "rtweekend.h"
+#include "bvh.h"
+#include "camera.h"
+#include "environment.h"
+#include "hittable_list.h"
+#include "instance.h"
+#include "light_tree.h"
+#include "material.h"
+#include "medium.h"
+#include "sphere.h"
+#include "texture.h"
+#include "triangle.h"
+
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Scene description files come in two forms holding the same content:
+//
+//   text   (.rts)   one record per line, '#' starts a comment
+//   binary (.rtsb)  the same records as bulk little-endian arrays, for multi-million-primitive scenes
+//
+// Text records:
+//   aspect_ratio <a>    image_width <n>    samples_per_pixel <n>    max_depth <n>
+//   vfov <degrees>      lookfrom <x y z>   lookat <x y z>           vup <x y z>
+//   defocus_angle <degrees>                focus_dist <d>
+//   material <name> lambertian <r g b>
+//   material <name> metal <r g b> <fuzz>
+//   material <name> dielectric <index of refraction>
+//   material <name> light <r g b>         (emits this radiance; spheres of it are sampled as lights)
+//   material <name> textured <texture>    (lambertian with a texture as its albedo)
+//   material <name> textured_metal <texture> <fuzz>
+//   texture <name> <path of a .rtx tiled texture, relative to the scene file>
+//   texture <name> noise <scale> <octaves> <r g b> <r g b>    (fBm blended between two colours)
+//   texture <name> marble <scale> <octaves> <r g b> <r g b>
+//   environment <path of an equirectangular .hdr or .pfm, relative to the scene file> [intensity]
+//   environment_sampling <bsdf | uniform | importance>
+//   light_selection <bsdf | uniform | tree>
+//   background <r g b>    (replaces the gradient sky)
+//   photons <count> [<gather count> [<gather radius>]]   (caustic photon pass; radius 0 picks one
+//       from the size of the specular spheres)
+//   sphere <x y z> <radius> <material>
+//   mesh <name> <material> <vertex count> <triangle count>
+//       followed by exactly that many "v <x y z>" and then "f <i0 i1 i2>" lines (0-based)
+//   instance <mesh> <tx ty tz> <rotate_y degrees> <scale>
+//   moving_sphere <x0 y0 z0> <x1 y1 z1> <radius> <material> [<time0> <time1>]
+//   moving_instance <mesh> <tx ty tz> <rotate_y> <scale> <tx ty tz> <rotate_y> <scale> [<time0> <time1>]
+//       (linear motion from the first placement at time0 to the second at time1, default 0 and 1)
+//   sphere_path <radius> <material> <time> <x y z> <time> <x y z> ...
+//   instance_path <mesh> <time> <tx ty tz> <rotate_y> <scale> <time> <tx ty tz> <rotate_y> <scale> ...
+//       (keyframed motion through two or more placements in time order, linear between them)
+//   shutter <open> <close>    (camera rays are spread over this time; motion blurs across it)
+//   medium constant <x0 y0 z0> <x1 y1 z1> <density> <r g b>
+//   medium smoke <x0 y0 z0> <x1 y1 z1> <density> <r g b> <resolution> <scale> <octaves>
+//       (a participating medium filling the box: extinction per unit length, the densest
+//       voxel's for smoke, and the albedo of its scattering; smoke is turbulence of the given
+//       frequency and octaves, voxelized with resolution voxels along the box's longest side)
+//
+// Textures, materials and meshes must be declared before they are referenced. Meshes are only
+// drawn through instances, so one mesh can be placed many times without copying it.
+
+enum scene_material_type : uint32_t {
+    scene_lambertian = 0,
+    scene_metal = 1,
+    scene_dielectric = 2,
+    scene_light = 3
+};
+
+struct scene_material {
+    uint32_t type;
+    float    albedo[3];
+    float    param;      // Fuzz for metal, index of refraction for dielectric
+                         // (albedo is the emitted radiance of lights)
+};
+
+struct scene_sphere {
+    float    center[3];
+    float    radius;
+    uint32_t material;
+};
+
+struct scene_instance {
+    uint32_t mesh;
+    float    offset[3];
+    float    rotate_y;
+    float    scale;
+};
+
+// Motion of the sphere or instance with the given index, kept beside the static records so those
+// stay one flat array and scenes without motion pay nothing for it. An object with several
+// motions follows them in turn, each from where the last one left it (a keyframed path), and
+// rests between them.
+struct scene_sphere_motion {
+    uint32_t sphere;
+    float    center1[3];   // Center at time1; the sphere record holds the one at time0
+    float    time0;
+    float    time1;
+};
+
+struct scene_instance_motion {
+    uint32_t instance;
+    float    offset1[3];   // Placement at time1; the instance record holds the one at time0
+    float    rotate_y1;
+    float    scale1;
+    float    time0;
+    float    time1;
+};
+
+// Marks a material without a texture in scene::material_textures.
+const uint32_t scene_no_texture = 0xffffffff;
+
+enum scene_texture_kind : uint32_t {
+    scene_image_texture = 0,
+    scene_noise_texture = 1,
+    scene_marble_texture = 2
+};
+
+struct scene_texture_params {
+    uint32_t kind;
+    float    scale;       // Procedural textures only
+    uint32_t octaves;
+    float    low[3];      // Colours blended by the noise
+    float    high[3];
+};
+
+enum scene_medium_kind : uint32_t {
+    scene_constant_medium = 0,
+    scene_smoke_medium = 1
+};
+
+struct scene_medium {
+    uint32_t kind;
+    float    low[3];       // Corners of the box the medium fills
+    float    high[3];
+    float    density;      // Extinction per unit length (of the densest voxel, for smoke)
+    float    albedo[3];    // Share of the extinction that scatters
+    uint32_t resolution;   // Smoke only: voxels along the box's longest side
+    float    scale;        // Smoke only: noise frequency across the box
+    uint32_t octaves;
+};
+
+struct scene_mesh {
+    uint32_t              material = 0;
+    std::vector<float>    vertices;   // x, y, z per vertex
+    std::vector<uint32_t> indices;    // Three vertex indices per triangle
+};
+
+inline scene_material lambertian_material(const color& albedo) {
+    return { scene_lambertian, { float(albedo.x()), float(albedo.y()), float(albedo.z()) }, 0 };
+}
+
+inline scene_material metal_material(const color& albedo, double fuzz) {
+    return { scene_metal, { float(albedo.x()), float(albedo.y()), float(albedo.z()) }, float(fuzz) };
+}
+
+inline scene_material dielectric_material(double index_of_refraction) {
+    return { scene_dielectric, { 1, 1, 1 }, float(index_of_refraction) };
+}
+
+inline scene_material light_material(const color& emission) {
+    return { scene_light, { float(emission.x()), float(emission.y()), float(emission.z()) }, 0 };
+}
+
+// The binary loader reads these records straight into the arrays, so their layout is the file format.
+static_assert(sizeof(scene_material) == 20, "scene_material is part of the binary scene format");
+static_assert(sizeof(scene_sphere) == 20, "scene_sphere is part of the binary scene format");
+static_assert(sizeof(scene_instance) == 24, "scene_instance is part of the binary scene format");
+static_assert(sizeof(scene_texture_params) == 36, "scene_texture_params is part of the binary scene format");
+static_assert(sizeof(scene_sphere_motion) == 24, "scene_sphere_motion is part of the binary scene format");
+static_assert(sizeof(scene_instance_motion) == 32, "scene_instance_motion is part of the binary scene format");
+static_assert(sizeof(scene_medium) == 56, "scene_medium is part of the binary scene format");
+
+class scene {
+public:
+    camera cam;
+
+    std::vector<std::string>    material_names;
+    std::vector<scene_material> materials;
+    std::vector<scene_sphere>   spheres;
+    std::vector<std::string>    mesh_names;
+    std::vector<scene_mesh>     meshes;
+    std::vector<scene_instance> instances;
+    std::vector<scene_sphere_motion>   sphere_motions;     // Sorted by sphere, then time
+    std::vector<scene_instance_motion> instance_motions;   // Sorted by instance, then time
+    std::vector<scene_medium>   media;
+    std::vector<std::string>    texture_names;
+    std::vector<std::string>    texture_paths;       // Empty for procedural textures
+    std::vector<scene_texture_params> texture_params;
+    std::vector<uint32_t>       material_textures;   // Texture of each material, or scene_no_texture
+    std::string environment_path;       // HDR map lighting the scene; empty keeps the gradient sky
+    double      environment_intensity = 1;
+    uint64_t    photon_count = 0;       // Caustic photons traced before rendering; 0 skips the pass
+    uint32_t    photon_gather = 64;     // Photons each diffuse hit gathers
+    double      photon_radius = 0;      // Largest gather radius; 0 derives it from the specular spheres
+
+    uint32_t add_material(const std::string& name, const scene_material& m, uint32_t texture = scene_no_texture) {
+        material_names.push_back(name);
+        materials.push_back(m);
+        material_textures.push_back(texture);
+        return static_cast<uint32_t>(materials.size() - 1);
+    }
+
+    uint32_t add_texture(const std::string& name, const std::string& path) {
+        return add_texture(name, path, { scene_image_texture, 0, 0, { 0, 0, 0 }, { 0, 0, 0 } });
+    }
+
+    uint32_t add_texture(const std::string& name, const std::string& path, const scene_texture_params& params) {
+        texture_names.push_back(name);
+        texture_paths.push_back(path);
+        texture_params.push_back(params);
+        return static_cast<uint32_t>(texture_paths.size() - 1);
+    }
+
+    void add_sphere(const point3& center, double radius, uint32_t material) {
+        spheres.push_back({ { float(center.x()), float(center.y()), float(center.z()) }, float(radius), material });
+    }
+
+    void add_moving_sphere(const point3& center0, const point3& center1, double radius, uint32_t material,
+                           double time0 = 0, double time1 = 1) {
+        add_sphere(center0, radius, material);
+        sphere_motions.push_back({ uint32_t(spheres.size() - 1),
+                                   { float(center1.x()), float(center1.y()), float(center1.z()) },
+                                   float(time0), float(time1) });
+    }
+
+    bool has_motion() const { return !sphere_motions.empty() || !instance_motions.empty(); }
+
+    // Loads environment_path into the camera, where the renderer finds it.
+    void load_environment() {
+        if (environment_path.empty()) {
+            cam.environment.reset();
+            return;
+        }
+        auto start = std::chrono::steady_clock::now();
+        auto map = make_shared<environment_map>(environment_path, environment_intensity);
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        std::clog << "Loaded environment " << environment_path << ": " << map->width() << 'x' << map->height()
+                  << ", " << map->memory_bytes() / double(1 << 20) << " MB (" << map->distribution_bytes() / double(1 << 20)
+                  << " MB sampling tables) in " << elapsed.count() << " ms\n";
+        cam.environment = map;
+    }
+
+    size_t primitive_count() const {
+        size_t count = spheres.size();
+        for (const auto& inst : instances)
+            count += meshes[inst.mesh].indices.size() / 3;
+        return count;
+    }
+
+    // Creates the renderable objects described by the scene and adds them to the world, and
+    // gives the camera a light tree over the spheres that emit and, when photons are asked
+    // for, a caustic photon pass to run before it renders. Moving emitters are left out of the
+    // light tree and moving mirrors and glass out of the photon targets, since both assume the
+    // sphere stays put; such spheres still light and reflect through the bounces that find them.
+    void build_world(hittable_list& world) {
+        // Textures only open their files here; their tiles are read on demand while rendering.
+        std::vector<shared_ptr<texture>> textures;
+        for (size_t i = 0; i < texture_paths.size(); ++i) {
+            const auto& t = texture_params[i];
+            color low(t.low[0], t.low[1], t.low[2]), high(t.high[0], t.high[1], t.high[2]);
+            switch (t.kind) {
+            case scene_noise_texture:  textures.push_back(make_shared<noise_texture>(t.scale, t.octaves, low, high)); break;
+            case scene_marble_texture: textures.push_back(make_shared<marble_texture>(t.scale, t.octaves, low, high)); break;
+            default:                   textures.push_back(make_shared<image_texture>(texture_paths[i])); break;
+            }
+        }
+
+        std::vector<shared_ptr<material>> mats;
+        mats.reserve(materials.size());
+        for (size_t i = 0; i < materials.size(); ++i) {
+            const auto& m = materials[i];
+            color albedo(m.albedo[0], m.albedo[1], m.albedo[2]);
+            if (material_textures[i] != scene_no_texture) {
+                auto albedo_texture = textures[material_textures[i]];
+                if (m.type == scene_metal)
+                    mats.push_back(make_shared<metal>(albedo_texture, m.param));
+                else
+                    mats.push_back(make_shared<lambertian>(albedo_texture));
+                continue;
+            }
+            switch (m.type) {
+            case scene_metal:      mats.push_back(make_shared<metal>(albedo, m.param)); break;
+            case scene_dielectric: mats.push_back(make_shared<dielectric>(m.param)); break;
+            case scene_light:      mats.push_back(make_shared<diffuse_light>(albedo)); break;
+            default:               mats.push_back(make_shared<lambertian>(albedo)); break;
+            }
+        }
+
+        std::vector<shared_ptr<hittable>> mesh_objects;
+        mesh_objects.reserve(meshes.size());
+        for (const auto& m : meshes) {
+            auto triangles = make_shared<hittable_list>();
+            triangles->reserve(m.indices.size() / 3);
+            for (size_t i = 0; i < m.indices.size(); i += 3) {
+                triangles->add(make_shared<triangle>(
+                    vertex(m, m.indices[i]), vertex(m, m.indices[i + 1]), vertex(m, m.indices[i + 2]), mats[m.material]));
+            }
+            mesh_objects.push_back(make_shared<bvh>(*triangles));
+        }
+
+        world.reserve(world.objects.size() + spheres.size() + instances.size());
+        std::vector<sphere_light> emitters;
+        auto sphere_motion = sphere_motions.cbegin();
+        for (size_t i = 0; i < spheres.size(); ++i) {
+            const auto& s = spheres[i];
+            point3 center(s.center[0], s.center[1], s.center[2]);
+            auto path = sphere_path(i, sphere_motion);
+            if (!path.empty()) {
+                world.add(make_shared<sphere>(std::move(path), s.radius, mats[s.material]));
+                continue;
+            }
+            const auto& m = materials[s.material];
+            int light = -1;
+            if (m.type == scene_light) {
+                light = int(emitters.size());
+                emitters.push_back({ center, s.radius, color(m.albedo[0], m.albedo[1], m.albedo[2]) });
+            }
+            world.add(make_shared<sphere>(center, s.radius, mats[s.material], light));
+        }
+
+        auto instance_motion = instance_motions.cbegin();
+        for (size_t i = 0; i < instances.size(); ++i) {
+            const auto& inst = instances[i];
+            vec3 offset(inst.offset[0], inst.offset[1], inst.offset[2]);
+            auto path = instance_path(i, instance_motion);
+            if (!path.empty()) {
+                world.add(make_shared<instance>(mesh_objects[inst.mesh], path));
+                continue;
+            }
+            world.add(make_shared<instance>(mesh_objects[inst.mesh], offset, inst.rotate_y, inst.scale));
+        }
+
+        for (const auto& m : media) {
+            aabb box(point3(m.low[0], m.low[1], m.low[2]), point3(m.high[0], m.high[1], m.high[2]));
+            color albedo(m.albedo[0], m.albedo[1], m.albedo[2]);
+            if (m.kind != scene_smoke_medium) {
+                world.add(make_shared<medium>(box, m.density, albedo));
+                continue;
+            }
+            auto start = std::chrono::steady_clock::now();
+            auto grid = smoke_grid(box, int(m.resolution), m.scale, int(m.octaves));
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            std::clog << "Voxelized smoke: " << grid->size_x() << 'x' << grid->size_y() << 'x' << grid->size_z()
+                      << ", " << grid->stored_bricks() << " of " << grid->bricks_x() * grid->bricks_y() * grid->bricks_z()
+                      << " bricks stored, " << grid->memory_bytes() / double(1 << 20) << " MB ("
+                      << grid->dense_bytes() / double(1 << 20) << " MB dense) in " << elapsed.count() << " ms\n";
+            world.add(make_shared<medium>(box, m.density, albedo, grid));
+        }
+
+        // Emissive triangles still light the scene, but only through bounces that find them.
+        cam.lights.reset();
+        if (!emitters.empty()) {
+            auto start = std::chrono::steady_clock::now();
+            auto tree = make_shared<light_tree>(std::move(emitters));
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            std::clog << "Built light tree over " << tree->size() << " lights (" << tree->node_count() << " nodes) in "
+                      << elapsed.count() << " ms\n";
+            cam.lights = tree;
+        }
+
+        cam.caustics = caustic_pass();
+    }
+
+    // A fresh caustic photon pass over the scene, or none if it asks for no photons. The pass runs
+    // once, before the first pixel it renders, so an animation needs a new one every frame.
+    //
+    // Sky photons are aimed at the mirror and glass spheres; the gather radius defaults to a
+    // quarter of their average radius, about the size of the caustic a small glass ball focuses.
+    shared_ptr<caustic_photons> caustic_pass() const {
+        if (photon_count == 0)
+            return nullptr;
+        std::vector<photon_target> targets;
+        double radius_sum = 0;
+        auto sphere_motion = sphere_motions.cbegin();
+        for (size_t i = 0; i < spheres.size(); ++i) {
+            const auto& sp = spheres[i];
+            if (!sphere_path(i, sphere_motion).empty())
+                continue;
+            auto type = materials[sp.material].type;
+            if (type == scene_metal || type == scene_dielectric) {
+                targets.push_back({ point3(sp.center[0], sp.center[1], sp.center[2]), sp.radius });
+                radius_sum += sp.radius;
+            }
+        }
+        auto radius = photon_radius > 0 ? photon_radius : (targets.empty() ? 0.05 : 0.25 * radius_sum / targets.size());
+        return make_shared<caustic_photons>(size_t(photon_count), int(photon_gather), radius, std::move(targets), cam.lights);
+    }
+
+    // Loads a scene file, picking the binary or text reader from the file's leading bytes.
+    static scene load(const std::string& path) {
+        std::ifstream in(path, std::ios::binary);
+        if (!in)
+            throw std::runtime_error("cannot open scene file '" + path + "'");
+
+        char magic[4] = {};
+        in.read(magic, sizeof(magic));
+        bool binary = in.gcount() == sizeof(magic) && std::memcmp(magic, binary_magic(), sizeof(magic)) == 0;
+        in.clear();
+        in.seekg(0);
+
+        scene result;
+        if (binary)
+            result.read_binary(in, path);
+        else
+            result.read_text(in, path);
+        result.validate(path);
+
+        // Texture paths are relative to the scene file.
+        auto base = std::filesystem::path(path).parent_path();
+        for (auto& texture_path : result.texture_paths)
+            if (!texture_path.empty() && std::filesystem::path(texture_path).is_relative())
+                texture_path = std::filesystem::absolute(base / texture_path).string();
+        if (!result.environment_path.empty() && std::filesystem::path(result.environment_path).is_relative())
+            result.environment_path = std::filesystem::absolute(base / result.environment_path).string();
+        result.load_environment();
+        return result;
+    }
+
+    // Saves the scene as binary if the path ends in ".rtsb", and as text otherwise.
+    void save(const std::string& path) const {
+        bool binary = path.size() >= 5 && path.compare(path.size() - 5, 5, ".rtsb") == 0;
+        std::ofstream out(path, binary ? std::ios::binary : std::ios::out);
+        if (!out)
+            throw std::runtime_error("cannot write scene file '" + path + "'");
+
+        if (binary)
+            write_binary(out);
+        else
+            write_text(out);
+
+        if (!out)
+            throw std::runtime_error("failed while writing scene file '" + path + "'");
+    }
+
+private:
+    static const char* binary_magic() { return "RTSB"; }
+    static const uint32_t binary_version = 8;   // 2 added image textures, 3 procedural ones, 4 environments, 5 lights, 6 photons, 7 motion, 8 media
+
+    static point3 vertex(const scene_mesh& m, uint32_t index) {
+        return point3(m.vertices[3 * index], m.vertices[3 * index + 1], m.vertices[3 * index + 2]);
+    }
+
+    // The keys of sphere index's path, taking its motions from the front of the sorted list;
+    // empty if the sphere stands still.
+    std::vector<sphere::key> sphere_path(size_t index, std::vector<scene_sphere_motion>::const_iterator& motion) const {
+        std::vector<sphere::key> keys;
+        const auto& s = spheres[index];
+        point3 at(s.center[0], s.center[1], s.center[2]);
+        for (; motion != sphere_motions.end() && motion->sphere == index; ++motion) {
+            if (keys.empty() || motion->time0 > keys.back().time)
+                keys.push_back({ motion->time0, at });
+            at = point3(motion->center1[0], motion->center1[1], motion->center1[2]);
+            keys.push_back({ motion->time1, at });
+        }
+        return keys;
+    }
+
+    std::vector<instance::key> instance_path(size_t index, std::vector<scene_instance_motion>::const_iterator& motion) const {
+        std::vector<instance::key> keys;
+        const auto& inst = instances[index];
+        instance::key at = { 0, vec3(inst.offset[0], inst.offset[1], inst.offset[2]), inst.rotate_y, inst.scale };
+        for (; motion != instance_motions.end() && motion->instance == index; ++motion) {
+            if (keys.empty() || motion->time0 > keys.back().time) {
+                at.time = motion->time0;
+                keys.push_back(at);
+            }
+            at = { motion->time1, vec3(motion->offset1[0], motion->offset1[1], motion->offset1[2]), motion->rotate_y1, motion->scale1 };
+            keys.push_back(at);
+        }
+        return keys;
+    }
+
+    void validate(const std::string& path) const {
+        auto fail = [&](const std::string& what) {
+            throw std::runtime_error(path + ": " + what);
+        };
+
+        for (const auto& m : materials)
+            if (m.type > scene_light) fail("unknown material type");
+        for (const auto& s : spheres)
+            if (s.material >= materials.size()) fail("sphere references an unknown material");
+        for (const auto& m : meshes) {
+            if (m.material >= materials.size()) fail("mesh references an unknown material");
+            if (m.indices.size() % 3 != 0) fail("mesh index count is not a multiple of three");
+            for (auto index : m.indices)
+                if (index >= m.vertices.size() / 3) fail("mesh face references a missing vertex");
+        }
+        for (const auto& inst : instances)
+            if (inst.mesh >= meshes.size()) fail("instance references an unknown mesh");
+        auto out_of_order = [](uint32_t object, float time0, float time1, uint32_t previous_object, float previous_time1) {
+            return time1 < time0 || object < previous_object || (object == previous_object && time0 < previous_time1);
+        };
+        for (size_t i = 0; i < sphere_motions.size(); ++i) {
+            const auto& m = sphere_motions[i];
+            if (m.sphere >= spheres.size()) fail("motion references an unknown sphere");
+            if (i > 0 && out_of_order(m.sphere, m.time0, m.time1, sphere_motions[i - 1].sphere, sphere_motions[i - 1].time1))
+                fail("sphere motions are out of order");
+        }
+        for (size_t i = 0; i < instance_motions.size(); ++i) {
+            const auto& m = instance_motions[i];
+            if (m.instance >= instances.size()) fail("motion references an unknown instance");
+            if (i > 0 && out_of_order(m.instance, m.time0, m.time1, instance_motions[i - 1].instance, instance_motions[i - 1].time1))
+                fail("instance motions are out of order");
+        }
+        for (const auto& t : texture_params)
+            if (t.kind > scene_marble_texture) fail("unknown texture kind");
+        for (auto texture : material_textures)
+            if (texture != scene_no_texture && texture >= texture_paths.size()) fail("material references an unknown texture");
+    }
+
+    // Splits one line of a text scene into whitespace-separated tokens and converts them.
+    class line_reader {
+    public:
+        line_reader(const std::string& _line, const std::string& _path, size_t _line_number)
+            : cursor(_line.c_str()), path(_path), line_number(_line_number) {}
+
+        bool at_end() {
+            skip_space();
+            return *cursor == '\0' || *cursor == '#';
+        }
+
+        std::string word() {
+            if (at_end()) fail("unexpected end of line");
+            const char* start = cursor;
+            while (*cursor && !isspace(static_cast<unsigned char>(*cursor)))
+                ++cursor;
+            return std::string(start, cursor);
+        }
+
+        double number() {
+            skip_space();
+            char* end;
+            double value = strtod(cursor, &end);
+            if (end == cursor) fail("expected a number");
+            cursor = end;
+            return value;
+        }
+
+        uint32_t index() {
+            skip_space();
+            char* end;
+            unsigned long value = strtoul(cursor, &end, 10);
+            if (end == cursor) fail("expected an integer");
+            cursor = end;
+            return static_cast<uint32_t>(value);
+        }
+
+        void vector(double* v) {
+            v[0] = number();
+            v[1] = number();
+            v[2] = number();
+        }
+
+        void vector(float* v) {
+            v[0] = float(number());
+            v[1] = float(number());
+            v[2] = float(number());
+        }
+
+        vec3 vector() {
+            double v[3];
+            vector(v);
+            return vec3(v[0], v[1], v[2]);
+        }
+
+        void finish() {
+            if (!at_end()) fail("unexpected trailing text");
+        }
+
+        [[noreturn]] void fail(const std::string& what) const {
+            throw std::runtime_error(path + ":" + std::to_string(line_number) + ": " + what);
+        }
+
+    private:
+        const char* cursor;
+        const std::string& path;
+        size_t line_number;
+
+        void skip_space() {
+            while (*cursor && isspace(static_cast<unsigned char>(*cursor)))
+                ++cursor;
+        }
+    };
+
+    void read_text(std::istream& in, const std::string& path) {
+        std::unordered_map<std::string, uint32_t> material_ids;
+        std::unordered_map<std::string, uint32_t> mesh_ids;
+        std::unordered_map<std::string, uint32_t> texture_ids;
+
+        auto lookup = [](const std::unordered_map<std::string, uint32_t>& ids, const std::string& name,
+                         const line_reader& reader, const char* kind) {
+            auto found = ids.find(name);
+            if (found == ids.end()) reader.fail(std::string("unknown ") + kind + " '" + name + "'");
+            return found->second;
+        };
+
+        std::string line;
+        size_t line_number = 0;
+
+        // Reads the next non-blank line that must start with the given keyword (mesh body lines).
+        auto next_record = [&](const char* keyword) {
+            while (std::getline(in, line)) {
+                ++line_number;
+                line_reader reader(line, path, line_number);
+                if (reader.at_end()) continue;
+                if (reader.word() != keyword) reader.fail(std::string("expected '") + keyword + "' record");
+                return reader;
+            }
+            throw std::runtime_error(path + ": unexpected end of file inside mesh");
+        };
+
+        while (std::getline(in, line)) {
+            ++line_number;
+            line_reader reader(line, path, line_number);
+            if (reader.at_end()) continue;
+
+            auto keyword = reader.word();
+            if (keyword == "sphere") {
+                scene_sphere s;
+                reader.vector(s.center);
+                s.radius = float(reader.number());
+                s.material = lookup(material_ids, reader.word(), reader, "material");
+                spheres.push_back(s);
+            }
+            else if (keyword == "instance") {
+                scene_instance inst;
+                inst.mesh = lookup(mesh_ids, reader.word(), reader, "mesh");
+                reader.vector(inst.offset);
+                inst.rotate_y = float(reader.number());
+                inst.scale = float(reader.number());
+                instances.push_back(inst);
+            }
+            else if (keyword == "moving_sphere") {
+                scene_sphere s;
+                scene_sphere_motion motion;
+                reader.vector(s.center);
+                reader.vector(motion.center1);
+                s.radius = float(reader.number());
+                s.material = lookup(material_ids, reader.word(), reader, "material");
+                read_motion_times(reader, motion.time0, motion.time1);
+                motion.sphere = uint32_t(spheres.size());
+                spheres.push_back(s);
+                sphere_motions.push_back(motion);
+            }
+            else if (keyword == "moving_instance") {
+                scene_instance inst;
+                scene_instance_motion motion;
+                inst.mesh = lookup(mesh_ids, reader.word(), reader, "mesh");
+                reader.vector(inst.offset);
+                inst.rotate_y = float(reader.number());
+                inst.scale = float(reader.number());
+                reader.vector(motion.offset1);
+                motion.rotate_y1 = float(reader.number());
+                motion.scale1 = float(reader.number());
+                read_motion_times(reader, motion.time0, motion.time1);
+                motion.instance = uint32_t(instances.size());
+                instances.push_back(inst);
+                instance_motions.push_back(motion);
+            }
+            else if (keyword == "sphere_path") {
+                scene_sphere s;
+                s.radius = float(reader.number());
+                s.material = lookup(material_ids, reader.word(), reader, "material");
+                auto index = uint32_t(spheres.size());
+                float time = float(reader.number());
+                reader.vector(s.center);
+                spheres.push_back(s);
+                do {
+                    scene_sphere_motion motion = { index, {}, time, float(reader.number()) };
+                    reader.vector(motion.center1);
+                    time = motion.time1;
+                    sphere_motions.push_back(motion);
+                } while (!reader.at_end());
+            }
+            else if (keyword == "instance_path") {
+                scene_instance inst;
+                inst.mesh = lookup(mesh_ids, reader.word(), reader, "mesh");
+                auto index = uint32_t(instances.size());
+                float time = float(reader.number());
+                reader.vector(inst.offset);
+                inst.rotate_y = float(reader.number());
+                inst.scale = float(reader.number());
+                instances.push_back(inst);
+                do {
+                    scene_instance_motion motion = { index, {}, 0, 0, time, float(reader.number()) };
+                    reader.vector(motion.offset1);
+                    motion.rotate_y1 = float(reader.number());
+                    motion.scale1 = float(reader.number());
+                    time = motion.time1;
+                    instance_motions.push_back(motion);
+                } while (!reader.at_end());
+            }
+            else if (keyword == "shutter") {
+                cam.shutter_open = reader.number();
+                cam.shutter_close = reader.number();
+            }
+            else if (keyword == "medium") {
+                auto kind = reader.word();
+                if (kind != "constant" && kind != "smoke")
+                    reader.fail("unknown medium '" + kind + "'");
+                scene_medium m = { kind == "smoke" ? scene_smoke_medium : scene_constant_medium, {}, {}, 0, {}, 0, 0, 0 };
+                reader.vector(m.low);
+                reader.vector(m.high);
+                m.density = float(reader.number());
+                reader.vector(m.albedo);
+                if (m.kind == scene_smoke_medium) {
+                    m.resolution = reader.index();
+                    m.scale = float(reader.number());
+                    m.octaves = reader.index();
+                }
+                media.push_back(m);
+            }
+            else if (keyword == "material") {
+                auto name = reader.word();
+                auto type = reader.word();
+                scene_material m = { scene_lambertian, { 0, 0, 0 }, 0 };
+                auto texture = scene_no_texture;
+                if (type == "lambertian") {
+                    reader.vector(m.albedo);
+                }
+                else if (type == "metal") {
+                    m.type = scene_metal;
+                    reader.vector(m.albedo);
+                    m.param = float(reader.number());
+                }
+                else if (type == "dielectric") {
+                    m.type = scene_dielectric;
+                    m.param = float(reader.number());
+                }
+                else if (type == "light") {
+                    m.type = scene_light;
+                    reader.vector(m.albedo);
+                }
+                else if (type == "textured") {
+                    m = lambertian_material(color(1, 1, 1));
+                    texture = lookup(texture_ids, reader.word(), reader, "texture");
+                }
+                else if (type == "textured_metal") {
+                    texture = lookup(texture_ids, reader.word(), reader, "texture");
+                    m = metal_material(color(1, 1, 1), reader.number());
+                }
+                else {
+                    reader.fail("unknown material type '" + type + "'");
+                }
+                reader.finish();
+                material_ids[name] = add_material(name, m, texture);
+                continue;
+            }
+            else if (keyword == "texture") {
+                auto name = reader.word();
+                auto source = reader.word();
+                if (source == "noise" || source == "marble") {
+                    scene_texture_params t;
+                    t.kind = source == "noise" ? scene_noise_texture : scene_marble_texture;
+                    t.scale = float(reader.number());
+                    t.octaves = reader.index();
+                    reader.vector(t.low);
+                    reader.vector(t.high);
+                    texture_ids[name] = add_texture(name, "", t);
+                }
+                else {
+                    texture_ids[name] = add_texture(name, source);
+                }
+            }
+            else if (keyword == "environment") {
+                environment_path = reader.word();
+                if (!reader.at_end())
+                    environment_intensity = reader.number();
+            }
+            else if (keyword == "environment_sampling") {
+                cam.env_sampling = parse_environment_sampling(reader.word());
+            }
+            else if (keyword == "light_selection") {
+                cam.light_mode = parse_light_selection(reader.word());
+            }
+            else if (keyword == "photons") {
+                photon_count = uint64_t(reader.number());
+                if (!reader.at_end())
+                    photon_gather = reader.index();
+                if (!reader.at_end())
+                    photon_radius = reader.number();
+            }
+            else if (keyword == "background") {
+                cam.gradient_sky = false;
+                cam.background = reader.vector();
+            }
+            else if (keyword == "mesh") {
+                auto name = reader.word();
+                scene_mesh m;
+                m.material = lookup(material_ids, reader.word(), reader, "material");
+                auto vertex_count = reader.index();
+                auto triangle_count = reader.index();
+                reader.finish();
+
+                m.vertices.reserve(3 * size_t(vertex_count));
+                for (uint32_t i = 0; i < vertex_count; ++i) {
+                    auto v = next_record("v");
+                    for (int k = 0; k < 3; ++k)
+                        m.vertices.push_back(float(v.number()));
+                    v.finish();
+                }
+                m.indices.reserve(3 * size_t(triangle_count));
+                for (uint32_t i = 0; i < triangle_count; ++i) {
+                    auto f = next_record("f");
+                    for (int k = 0; k < 3; ++k)
+                        m.indices.push_back(f.index());
+                    f.finish();
+                }
+
+                mesh_names.push_back(name);
+                meshes.push_back(std::move(m));
+                mesh_ids[name] = static_cast<uint32_t>(meshes.size() - 1);
+                continue;
+            }
+            else if (keyword == "aspect_ratio")      cam.aspect_ratio = reader.number();
+            else if (keyword == "image_width")       cam.image_width = int(reader.index());
+            else if (keyword == "samples_per_pixel") cam.samples_per_pixel = int(reader.index());
+            else if (keyword == "max_depth")         cam.max_depth = int(reader.index());
+            else if (keyword == "vfov")              cam.vfov = reader.number();
+            else if (keyword == "lookfrom")          cam.lookfrom = reader.vector();
+            else if (keyword == "lookat")            cam.lookat = reader.vector();
+            else if (keyword == "vup")               cam.vup = reader.vector();
+            else if (keyword == "defocus_angle")     cam.defocus_angle = reader.number();
+            else if (keyword == "focus_dist")        cam.focus_dist = reader.number();
+            else
+                reader.fail("unknown record '" + keyword + "'");
+
+            reader.finish();
+        }
+    }
+
+    static void read_motion_times(line_reader& reader, float& time0, float& time1) {
+        time0 = 0;
+        time1 = 1;
+        if (reader.at_end())
+            return;
+        time0 = float(reader.number());
+        time1 = float(reader.number());
+    }
+
+    void write_text(std::ostream& out) const {
+        auto write_vec = [&](const vec3& v) { out << v.x() << ' ' << v.y() << ' ' << v.z(); };
+
+        out << std::setprecision(9);
+        out << "aspect_ratio " << cam.aspect_ratio << '\n'
+            << "image_width " << cam.image_width << '\n'
+            << "samples_per_pixel " << cam.samples_per_pixel << '\n'
+            << "max_depth " << cam.max_depth << '\n'
+            << "vfov " << cam.vfov << '\n';
+        out << "lookfrom ";  write_vec(cam.lookfrom); out << '\n';
+        out << "lookat ";    write_vec(cam.lookat);   out << '\n';
+        out << "vup ";       write_vec(cam.vup);      out << '\n';
+        out << "defocus_angle " << cam.defocus_angle << '\n'
+            << "focus_dist " << cam.focus_dist << '\n';
+        if (cam.shutter_open != 0 || cam.shutter_close != 0)
+            out << "shutter " << cam.shutter_open << ' ' << cam.shutter_close << '\n';
+        out << '\n';
+
+        if (!environment_path.empty()) {
+            out << "environment " << environment_path << ' ' << environment_intensity << '\n'
+                << "environment_sampling " << environment_sampling_name(cam.env_sampling) << "\n\n";
+        }
+        out << "light_selection " << light_selection_name(cam.light_mode) << '\n';
+        if (!cam.gradient_sky) {
+            out << "background ";  write_vec(cam.background); out << '\n';
+        }
+        if (photon_count > 0)
+            out << "photons " << photon_count << ' ' << photon_gather << ' ' << photon_radius << '\n';
+        out << '\n';
+
+        for (size_t i = 0; i < texture_paths.size(); ++i) {
+            const auto& t = texture_params[i];
+            out << "texture " << texture_names[i] << ' ';
+            if (t.kind == scene_image_texture) {
+                out << texture_paths[i] << '\n';
+                continue;
+            }
+            out << (t.kind == scene_noise_texture ? "noise " : "marble ") << t.scale << ' ' << t.octaves << ' '
+                << t.low[0] << ' ' << t.low[1] << ' ' << t.low[2] << ' '
+                << t.high[0] << ' ' << t.high[1] << ' ' << t.high[2] << '\n';
+        }
+
+        static const char* type_names[] = { "lambertian", "metal", "dielectric", "light" };
+        for (size_t i = 0; i < materials.size(); ++i) {
+            const auto& m = materials[i];
+            if (material_textures[i] != scene_no_texture) {
+                out << "material " << material_names[i];
+                if (m.type == scene_metal)
+                    out << " textured_metal " << texture_names[material_textures[i]] << ' ' << m.param << '\n';
+                else
+                    out << " textured " << texture_names[material_textures[i]] << '\n';
+                continue;
+            }
+            out << "material " << material_names[i] << ' ' << type_names[m.type];
+            if (m.type != scene_dielectric)
+                out << ' ' << m.albedo[0] << ' ' << m.albedo[1] << ' ' << m.albedo[2];
+            if (m.type == scene_metal || m.type == scene_dielectric)
+                out << ' ' << m.param;
+            out << '\n';
+        }
+
+        auto sphere_motion = sphere_motions.cbegin();
+        for (size_t i = 0; i < spheres.size(); ++i) {
+            const auto& s = spheres[i];
+            auto path = sphere_path(i, sphere_motion);
+            if (path.size() == 2) {
+                out << "moving_sphere ";  write_vec(path[0].center); out << ' ';  write_vec(path[1].center);
+                out << ' ' << s.radius << ' ' << material_names[s.material] << ' ' << path[0].time << ' ' << path[1].time << '\n';
+                continue;
+            }
+            if (!path.empty()) {
+                out << "sphere_path " << s.radius << ' ' << material_names[s.material];
+                for (const auto& k : path) {
+                    out << ' ' << k.time << ' ';  write_vec(k.center);
+                }
+                out << '\n';
+                continue;
+            }
+            out << "sphere " << s.center[0] << ' ' << s.center[1] << ' ' << s.center[2] << ' '
+                << s.radius << ' ' << material_names[s.material] << '\n';
+        }
+
+        for (size_t i = 0; i < meshes.size(); ++i) {
+            const auto& m = meshes[i];
+            out << "mesh " << mesh_names[i] << ' ' << material_names[m.material] << ' '
+                << m.vertices.size() / 3 << ' ' << m.indices.size() / 3 << '\n';
+            for (size_t v = 0; v < m.vertices.size(); v += 3)
+                out << "v " << m.vertices[v] << ' ' << m.vertices[v + 1] << ' ' << m.vertices[v + 2] << '\n';
+            for (size_t f = 0; f < m.indices.size(); f += 3)
+                out << "f " << m.indices[f] << ' ' << m.indices[f + 1] << ' ' << m.indices[f + 2] << '\n';
+        }
+
+        auto instance_motion = instance_motions.cbegin();
+        for (size_t i = 0; i < instances.size(); ++i) {
+            const auto& inst = instances[i];
+            auto path = instance_path(i, instance_motion);
+            if (path.size() == 2) {
+                out << "moving_instance " << mesh_names[inst.mesh];
+                for (const auto& k : path) {
+                    out << ' ';  write_vec(k.offset); out << ' ' << k.rotate_y << ' ' << k.scale;
+                }
+                out << ' ' << path[0].time << ' ' << path[1].time << '\n';
+                continue;
+            }
+            if (!path.empty()) {
+                out << "instance_path " << mesh_names[inst.mesh];
+                for (const auto& k : path) {
+                    out << ' ' << k.time << ' ';  write_vec(k.offset); out << ' ' << k.rotate_y << ' ' << k.scale;
+                }
+                out << '\n';
+                continue;
+            }
+            out << "instance " << mesh_names[inst.mesh] << ' ' << inst.offset[0] << ' ' << inst.offset[1] << ' '
+                << inst.offset[2] << ' ' << inst.rotate_y << ' ' << inst.scale << '\n';
+        }
+
+        for (const auto& m : media) {
+            out << "medium " << (m.kind == scene_smoke_medium ? "smoke " : "constant ")
+                << m.low[0] << ' ' << m.low[1] << ' ' << m.low[2] << ' ' << m.high[0] << ' ' << m.high[1] << ' ' << m.high[2]
+                << ' ' << m.density << ' ' << m.albedo[0] << ' ' << m.albedo[1] << ' ' << m.albedo[2];
+            if (m.kind == scene_smoke_medium)
+                out << ' ' << m.resolution << ' ' << m.scale << ' ' << m.octaves;
+            out << '\n';
+        }
+    }
+
+    // Binary layout: magic, version, camera settings, then each record type as a count
+    // followed by the raw array. Names are length-prefixed strings.
+
+    template <typename T>
+    static void write_pod(std::ostream& out, const T& value) {
+        out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    template <typename T>
+    static void write_raw(std::ostream& out, const std::vector<T>& values) {
+        out.write(reinterpret_cast<const char*>(values.data()), std::streamsize(values.size() * sizeof(T)));
+    }
+
+    template <typename T>
+    static void write_array(std::ostream& out, const std::vector<T>& values) {
+        write_pod(out, uint64_t(values.size()));
+        write_raw(out, values);
+    }
+
+    static void write_string(std::ostream& out, const std::string& s) {
+        write_pod(out, uint32_t(s.size()));
+        out.write(s.data(), std::streamsize(s.size()));
+    }
+
+    static void write_vec(std::ostream& out, const vec3& v) {
+        for (int i = 0; i < 3; ++i)
+            write_pod(out, v[i]);
+    }
+
+    void write_binary(std::ostream& out) const {
+        out.write(binary_magic(), 4);
+        write_pod(out, uint32_t(binary_version));
+
+        write_pod(out, cam.aspect_ratio);
+        write_pod(out, int32_t(cam.image_width));
+        write_pod(out, int32_t(cam.samples_per_pixel));
+        write_pod(out, int32_t(cam.max_depth));
+        write_pod(out, cam.vfov);
+        write_vec(out, cam.lookfrom);
+        write_vec(out, cam.lookat);
+        write_vec(out, cam.vup);
+        write_pod(out, cam.defocus_angle);
+        write_pod(out, cam.focus_dist);
+
+        // Material names come first so the material records stay one contiguous array.
+        write_pod(out, uint64_t(materials.size()));
+        for (const auto& name : material_names)
+            write_string(out, name);
+        write_raw(out, materials);
+        write_array(out, spheres);
+
+        write_pod(out, uint64_t(meshes.size()));
+        for (size_t i = 0; i < meshes.size(); ++i) {
+            write_string(out, mesh_names[i]);
+            write_pod(out, meshes[i].material);
+            write_array(out, meshes[i].vertices);
+            write_array(out, meshes[i].indices);
+        }
+
+        write_array(out, instances);
+
+        write_pod(out, uint64_t(texture_paths.size()));
+        for (size_t i = 0; i < texture_paths.size(); ++i) {
+            write_string(out, texture_names[i]);
+            write_string(out, texture_paths[i]);
+        }
+        write_raw(out, texture_params);
+        write_raw(out, material_textures);
+
+        write_string(out, environment_path);
+        write_pod(out, environment_intensity);
+        write_pod(out, uint32_t(cam.env_sampling));
+
+        write_pod(out, uint32_t(cam.light_mode));
+        write_pod(out, uint32_t(cam.gradient_sky));
+        write_vec(out, cam.background);
+
+        write_pod(out, photon_count);
+        write_pod(out, photon_gather);
+        write_pod(out, photon_radius);
+
+        write_array(out, sphere_motions);
+        write_array(out, instance_motions);
+        write_pod(out, cam.shutter_open);
+        write_pod(out, cam.shutter_close);
+
+        write_array(out, media);
+    }
+
+    // Reads a fixed-size value, failing on a truncated file.
+    template <typename T>
+    static T read_pod(std::istream& in, const std::string& path) {
+        T value;
+        if (!in.read(reinterpret_cast<char*>(&value), sizeof(T)))
+            throw std::runtime_error(path + ": truncated binary scene");
+        return value;
+    }
+
+    // Bytes from the read position to the end of the file; unlimited if the stream can't seek.
+    static uint64_t bytes_left(std::istream& in) {
+        auto at = in.tellg();
+        if (at < 0 || !in.seekg(0, std::ios::end))
+            return UINT64_MAX;
+        auto end = in.tellg();
+        in.seekg(at);
+        return end < at ? 0 : uint64_t(end - at);
+    }
+
+    // Fails unless count records of at least record_bytes each fit in the rest of the file, so a
+    // corrupt count can't make a reader allocate more than the file could fill.
+    static void check_count(std::istream& in, uint64_t count, uint64_t record_bytes, const std::string& path) {
+        if (count > bytes_left(in) / record_bytes)
+            throw std::runtime_error(path + ": truncated binary scene");
+    }
+
+    // Reads count records in one bulk read straight into the destination storage.
+    template <typename T>
+    static void read_raw(std::istream& in, std::vector<T>& values, uint64_t count, const std::string& path) {
+        check_count(in, count, sizeof(T), path);
+        values.resize(size_t(count));
+        if (!in.read(reinterpret_cast<char*>(values.data()), std::streamsize(count * sizeof(T))))
+            throw std::runtime_error(path + ": truncated binary scene");
+    }
+
+    template <typename T>
+    static void read_array(std::istream& in, std::vector<T>& values, const std::string& path) {
+        read_raw(in, values, read_pod<uint64_t>(in, path), path);
+    }
+
+    static std::string read_string(std::istream& in, const std::string& path) {
+        auto length = read_pod<uint32_t>(in, path);
+        check_count(in, length, 1, path);
+        std::string s(length, '\0');
+        if (!in.read(&s[0], std::streamsize(s.size())))
+            throw std::runtime_error(path + ": truncated binary scene");
+        return s;
+    }
+
+    static vec3 read_vec(std::istream& in, const std::string& path) {
+        double v[3];
+        for (int i = 0; i < 3; ++i)
+            v[i] = read_pod<double>(in, path);
+        return vec3(v[0], v[1], v[2]);
+    }
+
+    void read_binary(std::istream& in, const std::string& path) {
+        in.ignore(4);
+        auto version = read_pod<uint32_t>(in, path);
+        if (version < 1 || version > binary_version)
+            throw std::runtime_error(path + ": unsupported binary scene version");
+
+        cam.aspect_ratio = read_pod<double>(in, path);
+        cam.image_width = read_pod<int32_t>(in, path);
+        cam.samples_per_pixel = read_pod<int32_t>(in, path);
+        cam.max_depth = read_pod<int32_t>(in, path);
+        cam.vfov = read_pod<double>(in, path);
+        cam.lookfrom = read_vec(in, path);
+        cam.lookat = read_vec(in, path);
+        cam.vup = read_vec(in, path);
+        cam.defocus_angle = read_pod<double>(in, path);
+        cam.focus_dist = read_pod<double>(in, path);
+
+        auto material_count = read_pod<uint64_t>(in, path);
+        check_count(in, material_count, sizeof(uint32_t) + sizeof(scene_material), path);
+        for (uint64_t i = 0; i < material_count; ++i)
+            material_names.push_back(read_string(in, path));
+        read_raw(in, materials, material_count, path);
+        read_array(in, spheres, path);
+
+        auto mesh_count = read_pod<uint64_t>(in, path);
+        check_count(in, mesh_count, 2 * sizeof(uint32_t) + 2 * sizeof(uint64_t), path);
+        meshes.resize(size_t(mesh_count));
+        for (auto& m : meshes) {
+            mesh_names.push_back(read_string(in, path));
+            m.material = read_pod<uint32_t>(in, path);
+            read_array(in, m.vertices, path);
+            read_array(in, m.indices, path);
+        }
+
+        read_array(in, instances, path);
+
+        if (version < 2) {
+            material_textures.assign(materials.size(), scene_no_texture);
+            return;
+        }
+        auto texture_count = read_pod<uint64_t>(in, path);
+        check_count(in, texture_count, 2 * sizeof(uint32_t), path);
+        for (uint64_t i = 0; i < texture_count; ++i) {
+            texture_names.push_back(read_string(in, path));
+            texture_paths.push_back(read_string(in, path));
+        }
+        if (version >= 3)
+            read_raw(in, texture_params, texture_count, path);
+        else
+            texture_params.assign(size_t(texture_count), { scene_image_texture, 0, 0, { 0, 0, 0 }, { 0, 0, 0 } });
+        read_raw(in, material_textures, material_count, path);
+
+        if (version < 4)
+            return;
+        environment_path = read_string(in, path);
+        environment_intensity = read_pod<double>(in, path);
+        auto sampling = read_pod<uint32_t>(in, path);
+        if (sampling > uint32_t(environment_sampling::importance))
+            throw std::runtime_error(path + ": unknown environment sampling");
+        cam.env_sampling = environment_sampling(sampling);
+
+        if (version < 5)
+            return;
+        auto selection = read_pod<uint32_t>(in, path);
+        if (selection > uint32_t(light_selection::tree))
+            throw std::runtime_error(path + ": unknown light selection");
+        cam.light_mode = light_selection(selection);
+        cam.gradient_sky = read_pod<uint32_t>(in, path) != 0;
+        cam.background = read_vec(in, path);
+
+        if (version < 6)
+            return;
+        photon_count = read_pod<uint64_t>(in, path);
+        photon_gather = read_pod<uint32_t>(in, path);
+        photon_radius = read_pod<double>(in, path);
+
+        if (version < 7)
+            return;
+        read_array(in, sphere_motions, path);
+        read_array(in, instance_motions, path);
+        cam.shutter_open = read_pod<double>(in, path);
+        cam.shutter_close = read_pod<double>(in, path);
+
+        if (version < 8)
+            return;
+        read_array(in, media, path);
+        for (const auto& m : media)
+            if (m.kind > scene_smoke_medium)
+                throw std::runtime_error(path + ": unknown medium");
+    }
+};
+
+#endif
@@ -0,0 +1,340 @@
+#pragma once
+#ifndef SCENE_GENERATOR_H
+#define SCENE_GENERATOR_H
+
+#include "rtweekend.h"
+#include "scene.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+// The demo scene: a grid of small random spheres around three large ones on a huge ground sphere.
+inline scene random_spheres_scene() {
+    scene s;
+
+    auto ground_material = s.add_material("ground", lambertian_material(color(0.5, 0.5, 0.5)));
+    s.add_sphere(point3(0, -1000, 0), 1000, ground_material);
+
+    auto glass = s.add_material("glass", dielectric_material(1.5));
+
+    for (int a = -11; a < 11; a++) {
+        for (int b = -11; b < 11; b++) {
+            auto choose_mat = random_double();
+            point3 center(a + 0.9 * random_double(), 0.2, b + 0.9 * random_double());
+
+            if ((center - point3(4, 0.2, 0)).length() > 0.9) {
+                auto name = "small" + std::to_string(s.materials.size());
+
+                if (choose_mat < 0.8) {
+                    // diffuse
+                    auto albedo = color::random() * color::random();
+                    s.add_sphere(center, 0.2, s.add_material(name, lambertian_material(albedo)));
+                }
+                else if (choose_mat < 0.95) {
+                    // metal
+                    auto albedo = color::random(0.5, 1);
+                    auto fuzz = random_double(0, 0.5);
+                    s.add_sphere(center, 0.2, s.add_material(name, metal_material(albedo, fuzz)));
+                }
+                else {
+                    // glass
+                    s.add_sphere(center, 0.2, glass);
+                }
+            }
+        }
+    }
+
+    s.add_sphere(point3(0, 1, 0), 1.0, s.add_material("material1", dielectric_material(1.5)));
+    s.add_sphere(point3(-4, 1, 0), 1.0, s.add_material("material2", lambertian_material(color(0.4, 0.2, 0.1))));
+    s.add_sphere(point3(4, 1, 0), 1.0, s.add_material("material3", metal_material(color(0.7, 0.6, 0.5), 0.0)));
+
+    camera& cam = s.cam;
+
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.image_width = 1200;
+    cam.samples_per_pixel = 10;
+    cam.max_depth = 50;
+
+    cam.vfov = 20;
+    cam.lookfrom = point3(13, 2, 3);
+    cam.lookat = point3(0, 0, 0);
+    cam.vup = vec3(0, 1, 0);
+
+    cam.defocus_angle = 0.6;
+    cam.focus_dist = 10.0;
+
+    return s;
+}
+
+// Two closed rooms joined by a doorway, lit only by a small emitter in an alcove of the far room
+// that hides it from the doorway. The camera looks around the near room, whose light all comes
+// through the doorway after at least one bounce in the far room, so most paths leaving its walls
+// in a material-sampled direction find little.
+inline scene two_rooms_scene() {
+    scene s;
+    auto wall = s.add_material("wall", lambertian_material(color(0.5, 0.5, 0.5)));
+    auto lamp = s.add_material("lamp", light_material(color(240, 220, 180)));
+
+    scene_mesh rooms;
+    rooms.material = wall;
+    auto quad = [&](point3 a, point3 b, point3 c, point3 d) {
+        auto first = uint32_t(rooms.vertices.size() / 3);
+        for (const auto& p : { a, b, c, d })
+            for (int k = 0; k < 3; ++k)
+                rooms.vertices.push_back(float(p[k]));
+        for (uint32_t i : { 0u, 1u, 2u, 0u, 2u, 3u })
+            rooms.indices.push_back(first + i);
+    };
+
+    const double x0 = -4, x1 = 4, y0 = 0, y1 = 3, z0 = -2, z1 = 2;
+    const double door_z0 = -0.4, door_z1 = 0.4, door_top = 2;
+    quad({ x0, y0, z0 }, { x1, y0, z0 }, { x1, y0, z1 }, { x0, y0, z1 });   // Floor
+    quad({ x0, y1, z0 }, { x1, y1, z0 }, { x1, y1, z1 }, { x0, y1, z1 });   // Ceiling
+    quad({ x0, y0, z0 }, { x1, y0, z0 }, { x1, y1, z0 }, { x0, y1, z0 });   // Back
+    quad({ x0, y0, z1 }, { x1, y0, z1 }, { x1, y1, z1 }, { x0, y1, z1 });   // Front
+    quad({ x0, y0, z0 }, { x0, y1, z0 }, { x0, y1, z1 }, { x0, y0, z1 });   // Ends
+    quad({ x1, y0, z0 }, { x1, y1, z0 }, { x1, y1, z1 }, { x1, y0, z1 });
+    quad({ 0, y0, z0 }, { 0, y1, z0 }, { 0, y1, door_z0 }, { 0, y0, door_z0 });   // Dividing wall
+    quad({ 0, y0, door_z1 }, { 0, y1, door_z1 }, { 0, y1, z1 }, { 0, y0, z1 });
+    quad({ 0, door_top, door_z0 }, { 0, y1, door_z0 }, { 0, y1, door_z1 }, { 0, door_top, door_z1 });
+    quad({ 0, y0, 0.9 }, { 1.2, y0, 0.9 }, { 1.2, y1, 0.9 }, { 0, y1, 0.9 });   // Alcove
+    s.mesh_names.push_back("rooms");
+    s.meshes.push_back(std::move(rooms));
+    s.instances.push_back({ 0, { 0, 0, 0 }, 0, 1 });
+
+    s.add_sphere(point3(0.6, 1.5, 1.5), 0.2, lamp);
+
+    camera& cam = s.cam;
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.image_width = 400;
+    cam.samples_per_pixel = 64;
+    cam.max_depth = 8;
+    cam.vfov = 75;
+    cam.lookfrom = point3(-3.6, 1.6, 1.7);
+    cam.lookat = point3(0, 1.1, -0.6);
+    cam.vup = vec3(0, 1, 0);
+    cam.gradient_sky = false;
+    cam.background = color(0, 0, 0);
+
+    return s;
+}
+
+// Parameters of a procedurally generated stress scene. The same settings always produce the
+// same scene on every platform, independent of anything else drawn from random_double().
+struct generator_settings {
+    size_t   sphere_count = 10000;
+    double   metal_fraction = 0.15;       // The rest of the mix after metal and glass is lambertian
+    double   dielectric_fraction = 0.05;
+    bool     clustered = false;           // Gaussian clusters instead of a uniform spread
+    int      cluster_count = 32;
+    int      layers = 1;                  // Stacked slabs of spheres; raises depth complexity
+    size_t   light_count = 0;             // Small emissive spheres floating over the field, lit by nothing else
+    double   motion_fraction = 0;         // Share of the field's spheres that move during the shutter [0, 1]
+    double   fog_density = 0;             // Extinction of a layer of ground fog over the field; 0 for none
+    double   smoke_density = 0;           // Extinction of the densest part of a smoke plume over the field's center
+    uint32_t seed = 1;
+
+    // Parses "key=value,key=value" with keys spheres, metal, glass, distribution
+    // (uniform|clustered), clusters, layers, lights, motion, fog, smoke and seed. Unmentioned keys keep
+    // their defaults.
+    static generator_settings parse(const std::string& spec) {
+        generator_settings settings;
+        std::istringstream fields(spec);
+        std::string field;
+        while (std::getline(fields, field, ',')) {
+            auto eq = field.find('=');
+            if (eq == std::string::npos)
+                throw std::runtime_error("generator setting '" + field + "' is not key=value");
+            auto key = field.substr(0, eq);
+            auto value = field.substr(eq + 1);
+
+            if (key == "spheres")           settings.sphere_count = size_t(std::stod(value));
+            else if (key == "metal")        settings.metal_fraction = std::stod(value);
+            else if (key == "glass")        settings.dielectric_fraction = std::stod(value);
+            else if (key == "clusters")     settings.cluster_count = std::stoi(value);
+            else if (key == "layers")       settings.layers = std::stoi(value);
+            else if (key == "lights")       settings.light_count = size_t(std::stod(value));
+            else if (key == "motion")       settings.motion_fraction = std::stod(value);
+            else if (key == "fog")          settings.fog_density = std::stod(value);
+            else if (key == "smoke")        settings.smoke_density = std::stod(value);
+            else if (key == "seed")         settings.seed = uint32_t(std::stoul(value));
+            else if (key == "distribution") {
+                if (value != "uniform" && value != "clustered")
+                    throw std::runtime_error("unknown distribution '" + value + "'");
+                settings.clustered = value == "clustered";
+            }
+            else
+                throw std::runtime_error("unknown generator setting '" + key + "'");
+        }
+        if (settings.layers < 1) settings.layers = 1;
+        if (settings.cluster_count < 1) settings.cluster_count = 1;
+        return settings;
+    }
+
+    std::string describe() const {
+        std::ostringstream out;
+        out << "spheres=" << sphere_count << ",metal=" << metal_fraction << ",glass=" << dielectric_fraction
+            << ",distribution=" << (clustered ? "clustered" : "uniform") << ",clusters=" << cluster_count
+            << ",layers=" << layers << ",seed=" << seed;
+        if (light_count > 0)
+            out << ",lights=" << light_count;
+        if (motion_fraction > 0)
+            out << ",motion=" << motion_fraction;
+        if (fog_density > 0)
+            out << ",fog=" << fog_density;
+        if (smoke_density > 0)
+            out << ",smoke=" << smoke_density;
+        return out.str();
+    }
+};
+
+// Builds a field of equally sized small spheres on a ground plane. The field grows with the
+// sphere count so the density per layer stays constant, and each extra layer stacks another
+// slab of spheres above the first.
+inline scene generate_scene(const generator_settings& settings) {
+    // Only the raw mt19937 sequence is specified by the standard, so the distributions are
+    // derived by hand to keep the scene identical across standard libraries.
+    std::mt19937 rng(settings.seed);
+    auto next = [&]() { return rng() / 4294967296.0; };
+    auto pick = [&](uint32_t count) { return static_cast<uint32_t>(next() * count); };
+    auto gaussian = [&]() {
+        auto u1 = next();
+        auto u2 = next();
+        return sqrt(-2 * log(1 - u1)) * cos(2 * pi * u2);
+    };
+    // Draws in a fixed order, since argument evaluation order differs between compilers.
+    auto random_vec = [&](double min, double max) {
+        auto x = min + (max - min) * next();
+        auto y = min + (max - min) * next();
+        auto z = min + (max - min) * next();
+        return vec3(x, y, z);
+    };
+
+    scene s;
+
+    const double spacing = 1.0;     // Average distance between neighbouring sphere centers
+    const double radius = 0.2;
+    const size_t per_layer = (settings.sphere_count + settings.layers - 1) / settings.layers;
+    const double half_extent = 0.5 * spacing * sqrt(double(per_layer));
+
+    auto ground = s.add_material("ground", lambertian_material(color(0.5, 0.5, 0.5)));
+    s.add_sphere(point3(0, -1000, 0), 1000, ground);
+
+    // A small shared palette keeps the material table tiny even for millions of spheres.
+    const int palette_size = 64;
+    uint32_t first_material = static_cast<uint32_t>(s.materials.size());
+    for (int i = 0; i < palette_size; ++i) {
+        auto choose = (i + 0.5) / palette_size;
+        auto name = "palette" + std::to_string(i);
+        if (choose < settings.metal_fraction) {
+            auto albedo = random_vec(0.5, 1);
+            s.add_material(name, metal_material(albedo, 0.5 * next()));
+        }
+        else if (choose < settings.metal_fraction + settings.dielectric_fraction) {
+            s.add_material(name, dielectric_material(1.5));
+        }
+        else {
+            auto albedo = random_vec(0, 1);
+            s.add_material(name, lambertian_material(albedo * random_vec(0, 1)));
+        }
+    }
+
+    std::vector<point3> cluster_centers;
+    const double cluster_sigma = half_extent / (2 * sqrt(double(settings.cluster_count)));
+    if (settings.clustered) {
+        for (int i = 0; i < settings.cluster_count; ++i) {
+            auto c = random_vec(-half_extent, half_extent);
+            cluster_centers.push_back(point3(c.x(), 0, c.z()));
+        }
+    }
+
+    s.spheres.reserve(s.spheres.size() + settings.sphere_count);
+    for (size_t i = 0; i < settings.sphere_count; ++i) {
+        auto layer = static_cast<int>(i % settings.layers);
+        double x, z;
+        if (settings.clustered) {
+            const auto& c = cluster_centers[pick(settings.cluster_count)];
+            x = c.x() + cluster_sigma * gaussian();
+            z = c.z() + cluster_sigma * gaussian();
+        }
+        else {
+            x = (2 * next() - 1) * half_extent;
+            z = (2 * next() - 1) * half_extent;
+        }
+        auto y = radius + layer * 4 * radius;
+        auto material = first_material + pick(palette_size);
+        s.add_sphere(point3(x, y, z), radius, material);
+    }
+
+    // Emitters hover a little above the top layer, clear of the spheres, like lanterns over a
+    // crowd, in a few warm and cool tints; the sky is switched off so they are the only light.
+    if (settings.light_count > 0) {
+        const int tint_count = 8;
+        uint32_t first_light = static_cast<uint32_t>(s.materials.size());
+        for (int i = 0; i < tint_count; ++i) {
+            auto tint = random_vec(0.3, 1);
+            s.add_material("light" + std::to_string(i), light_material(40 * tint));
+        }
+        const double bottom = 2 * radius + (settings.layers - 1) * 4 * radius + 0.1;
+        for (size_t i = 0; i < settings.light_count; ++i) {
+            auto x = (2 * next() - 1) * half_extent;
+            auto z = (2 * next() - 1) * half_extent;
+            auto y = bottom + next() * 0.5;
+            s.add_sphere(point3(x, y, z), 0.05, first_light + pick(tint_count));
+        }
+        s.cam.gradient_sky = false;
+    }
+
+    // Moving spheres slide up to a sphere spacing in x and z while the shutter is open. They are
+    // picked after everything else is drawn, so the rest of the scene matches the static one.
+    if (settings.motion_fraction > 0) {
+        const size_t first_sphere = 1;   // After the ground
+        for (size_t i = 0; i < settings.sphere_count; ++i) {
+            if (next() >= settings.motion_fraction)
+                continue;
+            auto dx = (2 * next() - 1) * spacing;
+            auto dz = (2 * next() - 1) * spacing;
+            const auto& sp = s.spheres[first_sphere + i];
+            s.sphere_motions.push_back({ uint32_t(first_sphere + i),
+                                         { float(sp.center[0] + dx), sp.center[1], float(sp.center[2] + dz) }, 0, 1 });
+        }
+        s.cam.shutter_open = 0;
+        s.cam.shutter_close = 1;
+    }
+
+    // Fog fills the field up to a little above its top layer; smoke rises from its center. Neither
+    // draws random numbers, so the spheres match the scene without them.
+    const double top = 2 * radius + (settings.layers - 1) * 4 * radius;
+    if (settings.fog_density > 0) {
+        s.media.push_back({ scene_constant_medium, { float(-half_extent), 0, float(-half_extent) },
+                            { float(half_extent), float(top + 0.3), float(half_extent) },
+                            float(settings.fog_density), { 0.9f, 0.9f, 0.9f }, 0, 0, 0 });
+    }
+    if (settings.smoke_density > 0) {
+        auto width = std::min(2.0, half_extent);
+        s.media.push_back({ scene_smoke_medium, { float(-width), 0, float(-width) },
+                            { float(width), float(top + 3 * width), float(width) },
+                            float(settings.smoke_density), { 0.8f, 0.8f, 0.8f }, 128, 3, 5 });
+    }
+
+    // Look across the field from just outside one corner so rays cross many spheres.
+    camera& cam = s.cam;
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.image_width = 400;
+    cam.samples_per_pixel = 4;
+    cam.max_depth = 8;
+    cam.vfov = 40;
+    cam.lookfrom = point3(half_extent + 2, 2 + settings.layers * 0.8, half_extent + 2);
+    cam.lookat = point3(0, 0, 0);
+    cam.vup = vec3(0, 1, 0);
+    cam.defocus_angle = 0;
+    cam.focus_dist = (cam.lookfrom - cam.lookat).length();
+
+    return s;
+}
+
+#endif
@@ -0,0 +1 @@
+#include "sequence.h"
@@ -0,0 +1,398 @@
+#pragma once
+#ifndef SEQUENCE_H
+#define SEQUENCE_H
+
+#include "rtweekend.h"
+#include "bvh.h"
+#include "camera.h"
+#include "color.h"
+#include "hittable_list.h"
+#include "scene.h"
+#include "tiles.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Renders a range of frames of an animation in one process, loading and accelerating the scene
+// once. Objects animate through the scene's moving_*, sphere_path and instance_path records;
+// frame f's shutter opens at scene time f * frame_duration.
+//
+// Sequence files hold one record per line; '#' starts a comment:
+//   scene <path>                 scene to animate, relative to the sequence file (--scene and
+//                                --generate take precedence)
+//   frames <first> <last>        frames to render, inclusive (default 0 0)
+//   frame_duration <time>        scene time per frame (default 1, so scene times count frames)
+//   shutter <fraction>           share of each frame the shutter is open (default 0.5)
+//   camera <frame> <lookfrom x y z> <lookat x y z> <vfov>
+//                                a camera key; lookfrom and lookat run through the keys on a
+//                                Catmull-Rom spline, vfov linearly, and focus stays on lookat
+//   output <pattern>             image path with a printf-style %d for the frame, e.g. out/f%04d.ppm
+//   frames_in_flight <n>         frames rendered at the same time (default 2)
+//   rebuild_threshold <ratio>    rebuild a frame's BVH rather than refit it once its SAH cost
+//                                passes this multiple of its cost when last built (default 1.5)
+
+struct camera_key {
+    double frame;
+    point3 lookfrom;
+    point3 lookat;
+    double vfov;
+};
+
+struct sequence_settings {
+    std::string scene_path;
+    int    first_frame = 0;
+    int    last_frame = 0;
+    double frame_duration = 1;
+    double shutter = 0.5;
+    std::vector<camera_key> camera_path;   // In frame order
+    std::string output_pattern = "frame_%04d.ppm";
+    int    frames_in_flight = 2;
+    double rebuild_threshold = 1.5;
+
+    static sequence_settings load(const std::string& path) {
+        std::ifstream in(path);
+        if (!in)
+            throw std::runtime_error("cannot open sequence file '" + path + "'");
+
+        sequence_settings settings;
+        std::string line;
+        size_t line_number = 0;
+        while (std::getline(in, line)) {
+            ++line_number;
+            auto fail = [&](const std::string& what) {
+                throw std::runtime_error(path + ":" + std::to_string(line_number) + ": " + what);
+            };
+            auto comment = line.find('#');
+            std::istringstream fields(line.substr(0, comment));
+            std::string keyword;
+            if (!(fields >> keyword))
+                continue;
+
+            if (keyword == "scene") {
+                fields >> settings.scene_path;
+                auto base = std::filesystem::path(path).parent_path();
+                if (std::filesystem::path(settings.scene_path).is_relative())
+                    settings.scene_path = (base / settings.scene_path).string();
+            }
+            else if (keyword == "frames")            fields >> settings.first_frame >> settings.last_frame;
+            else if (keyword == "frame_duration")    fields >> settings.frame_duration;
+            else if (keyword == "shutter")           fields >> settings.shutter;
+            else if (keyword == "output")            fields >> settings.output_pattern;
+            else if (keyword == "frames_in_flight")  fields >> settings.frames_in_flight;
+            else if (keyword == "rebuild_threshold") fields >> settings.rebuild_threshold;
+            else if (keyword == "camera") {
+                camera_key key;
+                double v[6];
+                fields >> key.frame >> v[0] >> v[1] >> v[2] >> v[3] >> v[4] >> v[5] >> key.vfov;
+                key.lookfrom = point3(v[0], v[1], v[2]);
+                key.lookat = point3(v[3], v[4], v[5]);
+                if (!settings.camera_path.empty() && key.frame <= settings.camera_path.back().frame)
+                    fail("camera keys must be in frame order");
+                settings.camera_path.push_back(key);
+            }
+            else
+                fail("unknown record '" + keyword + "'");
+
+            std::string rest;
+            if (fields.fail())
+                fail("malformed '" + keyword + "' record");
+            if (fields >> rest)
+                fail("unexpected trailing text");
+        }
+        if (settings.last_frame < settings.first_frame)
+            throw std::runtime_error(path + ": the last frame comes before the first");
+        output_path(settings.output_pattern, 0);   // Check the pattern before rendering anything
+        return settings;
+    }
+
+    // Places the camera on the path at the given frame; without camera keys it stays as it is.
+    void pose(camera& cam, double frame) const {
+        if (camera_path.empty())
+            return;
+        const auto& keys = camera_path;
+        size_t k = 0;
+        while (k + 1 < keys.size() && keys[k + 1].frame <= frame)
+            ++k;
+        if (k + 1 == keys.size() || frame <= keys[k].frame) {
+            cam.lookfrom = keys[k].lookfrom;
+            cam.lookat = keys[k].lookat;
+            cam.vfov = keys[k].vfov;
+        }
+        else {
+            auto h = keys[k + 1].frame - keys[k].frame;
+            auto s = (frame - keys[k].frame) / h;
+            cam.lookfrom = hermite(k, s, h, &camera_key::lookfrom);
+            cam.lookat = hermite(k, s, h, &camera_key::lookat);
+            cam.vfov = keys[k].vfov + s * (keys[k + 1].vfov - keys[k].vfov);
+        }
+        cam.focus_dist = (cam.lookfrom - cam.lookat).length();
+    }
+
+    // The pattern with its one %d conversion (flags and width allowed) replaced by the frame.
+    static std::string output_path(const std::string& pattern, int frame) {
+        auto percent = pattern.find('%');
+        auto conversion = pattern.find_first_not_of("0123456789", percent + 1);
+        if (percent == std::string::npos || conversion == std::string::npos || pattern[conversion] != 'd' ||
+            pattern.find('%', conversion) != std::string::npos)
+            throw std::runtime_error("output pattern '" + pattern + "' needs exactly one %d for the frame number");
+        auto spec = pattern.substr(percent + 1, conversion - percent - 1);
+        auto width = spec.empty() ? 0 : std::stoi(spec);
+        auto number = std::to_string(frame < 0 ? -frame : frame);
+        if (int(number.size()) < width)
+            number.insert(0, width - number.size(), spec[0] == '0' ? '0' : ' ');
+        return pattern.substr(0, percent) + (frame < 0 ? "-" : "") + number + pattern.substr(conversion + 1);
+    }
+
+    std::string output_path(int frame) const { return output_path(output_pattern, frame); }
+
+private:
+    // Cubic Hermite segment from key k to k + 1, with Catmull-Rom tangents that allow for
+    // unevenly spaced keys; the first and last keys take one-sided tangents.
+    point3 hermite(size_t k, double s, double h, point3 camera_key::*member) const {
+        const auto& keys = camera_path;
+        auto tangent = [&](size_t i) {
+            auto lo = i > 0 ? i - 1 : i;
+            auto hi = i + 1 < keys.size() ? i + 1 : i;
+            return (keys[hi].*member - keys[lo].*member) / (keys[hi].frame - keys[lo].frame);
+        };
+        auto s2 = s * s, s3 = s2 * s;
+        return (2 * s3 - 3 * s2 + 1) * (keys[k].*member) + (s3 - 2 * s2 + s) * h * tangent(k)
+             + (-2 * s3 + 3 * s2) * (keys[k + 1].*member) + (s3 - s2) * h * tangent(k + 1);
+    }
+};
+
+// Renders the frames with one pool of threads that take tiles from the oldest frame still in
+// flight, so the tail of one frame overlaps the start of the next instead of leaving threads
+// idle. Each frame in flight has its own BVH, refit from the frame it rendered before and
+// rebuilt only once refitting has let its quality slip too far. The thread that finishes a
+// frame writes it and moves its slot on to the next frame while the others keep rendering.
+class sequence_renderer {
+public:
+    sequence_renderer(scene& _description, const sequence_settings& _settings, int _thread_count)
+        : description(_description), settings(_settings), thread_count(_thread_count) {}
+
+    void render() {
+        auto start = clock::now();
+        description.build_world(world);
+        std::clog << "Built the world of " << world.objects.size() << " objects in " << elapsed_ms(start) << " ms\n";
+
+        int threads = thread_count > 0 ? thread_count : int(std::thread::hardware_concurrency());
+        threads = std::max(1, threads);
+        int frame_count = settings.last_frame - settings.first_frame + 1;
+        slots.resize(size_t(std::max(1, std::min(settings.frames_in_flight, frame_count))));
+
+        start = clock::now();
+        next_frame = settings.first_frame;
+        for (auto& slot : slots)
+            open(slot, next_frame++, threads);
+
+        std::vector<std::thread> pool;
+        for (int t = 1; t < threads; ++t)
+            pool.emplace_back([&]() { work(threads); });
+        work(threads);
+        for (auto& thread : pool)
+            thread.join();
+        if (error)
+            std::rethrow_exception(error);
+
+        auto seconds = elapsed_ms(start) / 1000;
+        std::clog << "Rendered " << frame_count << " frames in " << seconds << " s: "
+                  << frame_count * 3600 / seconds << " frames per hour; BVH updates took "
+                  << update_ms / frame_count << " ms per frame (" << rebuilds << " builds, "
+                  << frame_count - rebuilds << " refits)\n";
+    }
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    struct frame_slot {
+        bool   active = false;       // Not while the slot is being moved on, or once there is nothing left
+        int    frame = 0;
+        camera cam;
+        std::unique_ptr<bvh> tree;
+        double built_cost = 0;       // SAH cost of tree when it was last built
+        std::vector<tile>  tiles;
+        size_t next_tile = 0;
+        size_t tiles_done = 0;
+        std::vector<color> sums;     // Sum of the samples of each pixel, row by row
+        clock::time_point opened;
+        double update_ms = 0;
+        bool   rebuilt = false;
+    };
+
+    scene& description;
+    sequence_settings settings;
+    int thread_count;
+    hittable_list world;
+    std::vector<frame_slot> slots;
+
+    std::mutex lock;
+    std::condition_variable changed;
+    int    next_frame = 0;
+    int    opening = 0;              // Slots being moved on to their next frame
+    std::exception_ptr error;        // The first failure, which stops every thread
+    int    rebuilds = 0;
+    double update_ms = 0;
+
+    static double elapsed_ms(clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(clock::now() - start).count();
+    }
+
+    // Sets the slot up for a frame: poses its camera and brings its BVH to the frame's shutter.
+    // Called without the lock, while no thread is rendering from the slot.
+    void open(frame_slot& slot, int frame, int threads) {
+        slot.opened = clock::now();
+        slot.cam = description.cam;
+        settings.pose(slot.cam, frame);
+        slot.cam.frame = frame;
+        slot.cam.shutter_open = frame * settings.frame_duration;
+        slot.cam.shutter_close = (frame + settings.shutter) * settings.frame_duration;
+        slot.cam.caustics = description.caustic_pass();
+        slot.cam.thread_count = threads;   // Only the photon pass and guide training use them; each tile is one thread's
+        slot.cam.show_progress = false;
+
+        interval shutter(slot.cam.shutter_open, slot.cam.shutter_close);
+        auto start = clock::now();
+        slot.rebuilt = !slot.tree;
+        if (slot.tree) {
+            slot.tree->refit(shutter);
+            slot.rebuilt = slot.tree->sah_cost() > settings.rebuild_threshold * slot.built_cost;
+        }
+        if (slot.rebuilt) {
+            slot.tree.reset(new bvh(world, shutter));
+            slot.built_cost = slot.tree->sah_cost();
+        }
+        slot.update_ms = elapsed_ms(start);
+        if (slot.cam.guide_paths)
+            slot.cam.frame_guide = slot.cam.learn_guide(*slot.tree);   // Shared by every tile of the frame
+
+        slot.tiles = make_tiles(slot.cam.image_width, slot.cam.pixel_height(), slot.cam.tile_size, slot.cam.order);
+        slot.next_tile = 0;
+        slot.tiles_done = 0;
+        slot.sums.assign(size_t(slot.cam.image_width) * slot.cam.pixel_height(), color(0, 0, 0));
+
+        std::lock_guard<std::mutex> guard(lock);
+        slot.frame = frame;
+        slot.active = true;
+        update_ms += slot.update_ms;
+        rebuilds += slot.rebuilt;
+    }
+
+    void work(int threads) {
+        try {
+            render_tiles(threads);
+        }
+        catch (...) {
+            std::lock_guard<std::mutex> guard(lock);
+            if (!error)
+                error = std::current_exception();
+            changed.notify_all();
+        }
+    }
+
+    void render_tiles(int threads) {
+        camera cam;              // This thread's copy of the camera of the frame it renders
+        const frame_slot* cam_slot = nullptr;
+        int cam_frame = 0;
+        std::unique_lock<std::mutex> guard(lock);
+        while (!error) {
+            frame_slot* slot = nullptr;
+            bool busy = opening > 0 || next_frame <= settings.last_frame;
+            for (auto& s : slots) {
+                busy = busy || s.active;
+                if (s.active && s.next_tile < s.tiles.size() && (!slot || s.frame < slot->frame))
+                    slot = &s;
+            }
+            if (!slot) {
+                if (!busy)
+                    break;
+                changed.wait(guard);
+                continue;
+            }
+
+            auto area = slot->tiles[slot->next_tile++];
+            if (cam_slot != slot || cam_frame != slot->frame) {
+                cam = slot->cam;
+                cam_slot = slot;
+                cam_frame = slot->frame;
+            }
+            guard.unlock();
+
+            auto sums = cam.render_region(*slot->tree, area);
+            int width = area.x1 - area.x0;
+            for (int y = area.y0; y < area.y1; ++y)
+                std::copy(sums.begin() + size_t(y - area.y0) * width, sums.begin() + size_t(y - area.y0 + 1) * width,
+                          slot->sums.begin() + size_t(y) * cam.image_width + area.x0);
+
+            guard.lock();
+            if (++slot->tiles_done < slot->tiles.size())
+                continue;
+
+            // The last tile of the frame: write it out and move the slot on.
+            slot->active = false;
+            bool more = next_frame <= settings.last_frame;
+            int next = next_frame;
+            if (more) {
+                ++next_frame;
+                ++opening;
+            }
+            guard.unlock();
+
+            write_frame(*slot, slot->frame);
+            if (more)
+                open(*slot, next, threads);
+
+            guard.lock();
+            if (more)
+                --opening;
+            changed.notify_all();
+        }
+    }
+
+    void write_frame(const frame_slot& slot, int frame) const {
+        auto path = settings.output_path(frame);
+        auto parent = std::filesystem::path(path).parent_path();
+        if (!parent.empty())
+            std::filesystem::create_directories(parent);
+        std::ofstream out(path, std::ios::binary);
+        if (!out)
+            throw std::runtime_error("cannot write image '" + path + "'");
+
+        const auto& cam = slot.cam;
+        out << (cam.binary_output ? "P6" : "P3") << '\n' << cam.image_width << ' ' << cam.pixel_height() << "\n255\n";
+        if (cam.post.enabled()) {
+            // A copy of its own, as render threads write frames concurrently; on one thread, as
+            // the others are still rendering the next frames.
+            auto post = cam.post;
+            post.write(out, slot.sums, cam.image_width, cam.pixel_height(), cam.samples_per_pixel, cam.binary_output, 1);
+        }
+        else {
+            for (const auto& pixel_color : slot.sums) {
+                if (cam.binary_output)
+                    colorTest::write_color_binary(out, pixel_color, cam.samples_per_pixel);
+                else
+                    colorTest::write_color(out, pixel_color, cam.samples_per_pixel);
+            }
+        }
+        if (!out)
+            throw std::runtime_error("failed writing image '" + path + "'");
+
+        std::clog << "Frame " << frame << ": " << path << " after " << elapsed_ms(slot.opened) << " ms; BVH "
+                  << (slot.rebuilt ? "built" : "refit") << " in " << slot.update_ms << " ms, SAH cost "
+                  << slot.tree->sah_cost() << '\n';
+    }
+};
+
+#endif
@@ -5,14 +5,42 @@
 #include "hittable.h"
 #include "vec3.h"
 
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
 class sphere : public hittable {
 public:
-    sphere(point3 _center, double _radius, shared_ptr<material> _material)
-        : center(_center), radius(_radius), mat(_material) {}
+    // A point a moving sphere's center passes through.
+    struct key {
+        double time;
+        point3 center;
+    };
+
+    sphere(point3 _center, double _radius, shared_ptr<material> _material, int _light = -1)
+        : center(_center), radius(_radius), mat(_material), light(_light)
+    {
+        auto rvec = vec3(radius, radius, radius);
+        bbox = aabb(center - rvec, center + rvec);
+    }
+
+    // A sphere moving in a straight line from center0 at time0 to center1 at time1, and resting
+    // at either end outside those times.
+    sphere(point3 center0, point3 center1, double time0, double time1, double _radius, shared_ptr<material> _material)
+        : sphere({ { time0, center0 }, { time1, center1 } }, _radius, _material) {}
 
+    // A sphere following a path through keys in time order, in a straight line from each to the
+    // next, and resting at the first and last outside their times. Throws std::invalid_argument
+    // for fewer than two keys or keys out of order.
+    sphere(std::vector<key> _path, double _radius, shared_ptr<material> _material)
+        : center(checked(_path).front().center), radius(_radius), mat(_material), light(-1), path(std::move(_path)), moving(true)
+    {
+        bbox = motion_bounds(interval(path.front().time, path.back().time));
+    }
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        vec3 oc = r.origin() - center;
+        point3 current = moving ? center_at(r.time()) : center;
+        vec3 oc = r.origin() - current;
         auto a = r.direction().length_squared();
         auto half_b = dot(oc, r.direction());
         auto c = oc.length_squared() - radius * radius;
@@ -31,17 +59,76 @@ public:
 
         rec.t = root;
         rec.p = r.at(rec.t);
-        vec3 outward_normal = (rec.p - center) / radius;
+        vec3 outward_normal = (rec.p - current) / radius;
         rec.set_face_normal(r, outward_normal);
+        get_sphere_uv(outward_normal, rec.u, rec.v);
+        rec.uv_size = pi * radius;
         rec.mat = mat;
+        rec.light = light;
+        rec.sphere = !moving;
 
         return true;
     }
 
+    aabb bounding_box() const override { return bbox; }
+
+    // The path is straight between keys, so the ends of the interval and the keys inside it bound it.
+    aabb motion_bounds(const interval& time) const override {
+        if (!moving)
+            return bbox;
+        auto rvec = vec3(radius, radius, radius);
+        auto a = center_at(time.min), b = center_at(time.max);
+        aabb box(aabb(a - rvec, a + rvec), aabb(b - rvec, b + rvec));
+        for (const auto& k : path)
+            if (time.surrounds(k.time))
+                box = aabb(box, aabb(k.center - rvec, k.center + rvec));
+        return box;
+    }
+
 private:
+    static void get_sphere_uv(const point3& p, double& u, double& v) {
+        // p: a given point on the sphere of radius one, centered at the origin.
+        // u: returned value [0,1] of angle around the Y axis from X=-1.
+        // v: returned value [0,1] of angle from Y=-1 to Y=+1.
+        //     <1 0 0> yields <0.50 0.50>       <-1  0  0> yields <0.00 0.50>
+        //     <0 1 0> yields <0.50 1.00>       < 0 -1  0> yields <0.50 0.00>
+        //     <0 0 1> yields <0.25 0.50>       < 0  0 -1> yields <0.75 0.50>
+
+        auto theta = acos(-p.y());
+        auto phi = atan2(-p.z(), p.x()) + pi;
+
+        u = phi / (2 * pi);
+        v = theta / pi;
+    }
+
     point3 center;
     double radius;
     shared_ptr<material> mat;
+    int light;      // Index in the scene's light list when the material emits
+    aabb bbox;
+    std::vector<key> path;  // Moving spheres only
+    bool moving = false;
+
+    static const std::vector<key>& checked(const std::vector<key>& keys) {
+        if (keys.size() < 2)
+            throw std::invalid_argument("a sphere path needs at least two keys");
+        for (size_t i = 1; i < keys.size(); ++i)
+            if (keys[i].time < keys[i - 1].time)
+                throw std::invalid_argument("sphere path keys are out of time order");
+        return keys;
+    }
+
+    point3 center_at(double time) const {
+        auto next = std::upper_bound(path.begin(), path.end(), time,
+                                     [](double t, const key& k) { return t < k.time; });
+        if (next == path.begin())
+            return path.front().center;
+        if (next == path.end())
+            return path.back().center;
+        const auto& prev = *(next - 1);
+        auto s = (time - prev.time) / (next->time - prev.time);
+        return prev.center + s * (next->center - prev.center);
+    }
 };
 
 #endif
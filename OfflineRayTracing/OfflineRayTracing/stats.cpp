@@ -0,0 +1 @@
+#include "stats.h"
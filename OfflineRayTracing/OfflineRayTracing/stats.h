@@ -0,0 +1,196 @@
+#pragma once
+#ifndef STATS_H
+#define STATS_H
+
+// Opt-in ray tracing statistics. Define RT_STATS (for example in the project's preprocessor
+// definitions) to collect them. Without it every RT_STAT(...) statement compiles to nothing
+// and none of the counters below are touched.
+#ifdef RT_STATS
+#define RT_STAT(...) __VA_ARGS__
+#else
+#define RT_STAT(...)
+#endif
+
+#include "rtweekend.h"
+#include "color.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+enum stat_material {
+    stat_lambertian,
+    stat_metal,
+    stat_dielectric,
+    stat_material_count
+};
+
+struct stat_counters {
+    static const int depth_slots = 64;   // Bounces deeper than this share the last slot
+
+    uint64_t rays_by_depth[depth_slots] = {};
+    uint64_t primitive_tests = 0;        // Calls to a primitive's hit()
+    uint64_t box_tests = 0;              // BVH node bounds tested, or grid cells visited
+    uint64_t scatters[stat_material_count] = {};
+    uint64_t absorbed = 0;               // Hits whose material scattered nothing
+    uint64_t escaped = 0;                // Rays that left the scene
+    uint64_t cache_lookups = 0;          // Diffuse hits that asked the radiance cache
+    uint64_t cache_hits = 0;             // ... and found records covering them
+    int      deepest_bounce = 0;         // Per-pixel scratch for the depth heatmap
+
+    void add(const stat_counters& other) {
+        for (int i = 0; i < depth_slots; ++i)
+            rays_by_depth[i] += other.rays_by_depth[i];
+        primitive_tests += other.primitive_tests;
+        box_tests += other.box_tests;
+        for (int i = 0; i < stat_material_count; ++i)
+            scatters[i] += other.scatters[i];
+        absorbed += other.absorbed;
+        escaped += other.escaped;
+        cache_lookups += other.cache_lookups;
+        cache_hits += other.cache_hits;
+    }
+
+    uint64_t rays() const {
+        uint64_t total = 0;
+        for (auto count : rays_by_depth)
+            total += count;
+        return total;
+    }
+
+    void count_ray(int bounce) {
+        rays_by_depth[bounce < depth_slots ? bounce : depth_slots - 1]++;
+        if (bounce > deepest_bounce) deepest_bounce = bounce;
+    }
+};
+
+// Each thread counts into its own stat_counters without synchronization. The counters of
+// every thread are registered here so a report can merge them, and a thread's counts are
+// folded into a retired total when it exits.
+class render_stats {
+public:
+    static stat_counters& local() {
+        thread_local thread_slot slot;
+        return slot.counters;
+    }
+
+    static stat_counters total() {
+        std::lock_guard<std::mutex> lock(registry().mutex);
+        stat_counters sum = registry().retired;
+        for (auto counters : registry().live)
+            sum.add(*counters);
+        return sum;
+    }
+
+    static void reset() {
+        std::lock_guard<std::mutex> lock(registry().mutex);
+        registry().retired = stat_counters();
+        for (auto counters : registry().live)
+            *counters = stat_counters();
+    }
+
+    // Prints the merged counters along with the distribution of per-region render times.
+    static void report(std::ostream& out, const std::vector<double>& region_ms, const char* region_name) {
+        auto sum = total();
+        auto rays = sum.rays();
+        auto per_ray = [&](uint64_t count) { return rays ? double(count) / rays : 0.0; };
+
+        out << "Ray tracing statistics\n"
+            << "  rays traced          " << rays << '\n'
+            << "  rays per depth      ";
+        int last_depth = stat_counters::depth_slots - 1;
+        while (last_depth > 0 && sum.rays_by_depth[last_depth] == 0)
+            --last_depth;
+        for (int d = 0; d <= last_depth; ++d)
+            out << ' ' << sum.rays_by_depth[d];
+        out << '\n'
+            << "  primitive tests/ray  " << per_ray(sum.primitive_tests) << '\n'
+            << "  box tests/ray        " << per_ray(sum.box_tests) << '\n'
+            << "  scatters             lambertian " << sum.scatters[stat_lambertian]
+            << ", metal " << sum.scatters[stat_metal]
+            << ", dielectric " << sum.scatters[stat_dielectric] << '\n'
+            << "  absorbed             " << sum.absorbed << '\n'
+            << "  escaped              " << sum.escaped << '\n';
+        if (sum.cache_lookups > 0)
+            out << "  radiance cache       " << sum.cache_hits << " of " << sum.cache_lookups << " lookups hit ("
+                << 100.0 * sum.cache_hits / sum.cache_lookups << "%)\n";
+
+        if (!region_ms.empty()) {
+            auto sorted = region_ms;
+            std::sort(sorted.begin(), sorted.end());
+            double total_ms = 0;
+            for (auto ms : sorted)
+                total_ms += ms;
+            out << "  time per " << region_name << " (ms)  min " << sorted.front()
+                << ", median " << sorted[sorted.size() / 2]
+                << ", max " << sorted.back()
+                << ", mean " << total_ms / sorted.size() << '\n';
+        }
+    }
+
+    // Writes a false-colour PPM where black is zero and white is the largest value.
+    static void write_heatmap(const std::string& path, const std::vector<double>& values, int width, int height) {
+        std::ofstream out(path);
+        if (!out) {
+            std::clog << "Cannot write heatmap '" << path << "'\n";
+            return;
+        }
+
+        double largest = 0;
+        for (auto v : values)
+            largest = std::max(largest, v);
+
+        out << "P3\n" << width << ' ' << height << "\n255\n";
+        for (auto v : values) {
+            auto c = heat_color(largest > 0 ? v / largest : 0);
+            out << int(255.999 * c.x()) << ' ' << int(255.999 * c.y()) << ' ' << int(255.999 * c.z()) << '\n';
+        }
+    }
+
+private:
+    struct registry_data {
+        std::mutex mutex;
+        std::vector<stat_counters*> live;
+        stat_counters retired;
+    };
+
+    struct thread_slot {
+        stat_counters counters;
+
+        thread_slot() {
+            std::lock_guard<std::mutex> lock(registry().mutex);
+            registry().live.push_back(&counters);
+        }
+
+        ~thread_slot() {
+            std::lock_guard<std::mutex> lock(registry().mutex);
+            registry().retired.add(counters);
+            auto& live = registry().live;
+            live.erase(std::remove(live.begin(), live.end(), &counters), live.end());
+        }
+    };
+
+    static registry_data& registry() {
+        static registry_data data;
+        return data;
+    }
+
+    // Black -> blue -> red -> yellow -> white.
+    static color heat_color(double t) {
+        static const color ramp[] = {
+            color(0, 0, 0), color(0, 0, 1), color(1, 0, 0), color(1, 1, 0), color(1, 1, 1)
+        };
+        const int segments = 4;
+        t = std::min(std::max(t, 0.0), 1.0) * segments;
+        int i = std::min(int(t), segments - 1);
+        auto f = t - i;
+        return (1 - f) * ramp[i] + f * ramp[i + 1];
+    }
+};
+
+#endif
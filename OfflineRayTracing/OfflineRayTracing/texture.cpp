@@ -0,0 +1 @@
+#include "texture.h"
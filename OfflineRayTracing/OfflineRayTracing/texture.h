@@ -0,0 +1,132 @@
+#pragma once
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+#include "rtweekend.h"
+#include "color.h"
+#include "perlin.h"
+#include "texture_cache.h"
+
+#include <cmath>
+#include <memory>
+#include <string>
+
+class texture {
+public:
+    virtual ~texture() = default;
+
+    // Colour at surface coordinates (u, v) and point p, filtered over a footprint `width`
+    // wide in uv units (see hit_record::uv_footprint).
+    virtual color value(double u, double v, const point3& p, double width) const = 0;
+};
+
+class solid_color : public texture {
+public:
+    solid_color(color c) : color_value(c) {}
+
+    color value(double u, double v, const point3& p, double width) const override {
+        return color_value;
+    }
+
+private:
+    color color_value;
+};
+
+// Fractal (fBm) Perlin noise blended between two colours; needs no texture memory.
+class noise_texture : public texture {
+public:
+    noise_texture(double sc, int oct, color a, color b) : scale(sc), octaves(oct), low(a), high(b) {}
+
+    color value(double u, double v, const point3& p, double width) const override {
+        auto t = 0.5 * (1 + noise.fbm(scale * p, octaves));
+        t = t < 0 ? 0 : (t > 1 ? 1 : t);
+        return (1 - t) * low + t * high;
+    }
+
+private:
+    perlin noise;
+    double scale;
+    int octaves;
+    color low, high;
+};
+
+// Marble: sine bands along z disturbed by turbulence, blended between two colours.
+class marble_texture : public texture {
+public:
+    marble_texture(double sc, int oct, color a, color b) : scale(sc), octaves(oct), low(a), high(b) {}
+
+    color value(double u, double v, const point3& p, double width) const override {
+        auto t = 0.5 * (1 + sin(scale * p.z() + 10 * noise.turb(scale * p, octaves)));
+        return (1 - t) * low + t * high;
+    }
+
+private:
+    perlin noise;
+    double scale;
+    int octaves;
+    color low, high;
+};
+
+// A texture read from a tiled MIP pyramid file through the shared texture_cache. The ray
+// footprint picks the MIP level, and neighbouring levels are blended (trilinear filtering),
+// so distant or diffusely bounced rays touch few, small tiles.
+class image_texture : public texture {
+public:
+    image_texture(const std::string& path)
+        : file(std::make_shared<tiled_texture_file>(path)), id(texture_cache::next_texture_id()) {}
+
+    color value(double u, double v, const point3& p, double width) const override {
+        // Footprint in texels of the full-resolution level, then the level that is one texel wide.
+        auto texels = width * std::max(file->width, file->height);
+        auto level = texels > 1 ? std::log2(texels) : 0.0;
+        auto last = double(file->levels.size() - 1);
+        if (level >= last)
+            return bilinear(uint32_t(last), u, v);
+
+        auto fine = uint32_t(level);
+        auto blend = level - fine;
+        if (blend < 1e-3)
+            return bilinear(fine, u, v);
+        return (1 - blend) * bilinear(fine, u, v) + blend * bilinear(fine + 1, u, v);
+    }
+
+private:
+    std::shared_ptr<tiled_texture_file> file;
+    uint32_t id;
+
+    // Stored bytes are gamma 2, like the images the renderer writes.
+    static double to_linear(unsigned char byte) {
+        auto value = byte / 255.0;
+        return value * value;
+    }
+
+    color bilinear(uint32_t level, double u, double v) const {
+        const auto& l = file->levels[level];
+        // Repeat outside [0,1], flip v so the image's first row is at the top.
+        auto x = (u - std::floor(u)) * l.width - 0.5;
+        auto y = (1 - (v - std::floor(v))) * l.height - 0.5;
+        auto x0 = std::floor(x), y0 = std::floor(y);
+        auto fx = x - x0, fy = y - y0;
+
+        // The four texels usually share a tile; look each distinct tile up once.
+        std::shared_ptr<const texture_tile> tile;
+        uint32_t tile_x = ~0u, tile_y = ~0u;
+        auto texel = [&](double tx, double ty) {
+            auto px = uint32_t((int64_t(tx) % l.width + l.width) % l.width);
+            auto py = uint32_t((int64_t(ty) % l.height + l.height) % l.height);
+            auto size = file->tile_size;
+            if (px / size != tile_x || py / size != tile_y) {
+                tile_x = px / size;
+                tile_y = py / size;
+                tile = texture_cache::global().get(id, level, tile_x, tile_y, *file);
+            }
+            auto rgb = &tile->rgb[(size_t(py % size) * size + px % size) * 3];
+            return color(to_linear(rgb[0]), to_linear(rgb[1]), to_linear(rgb[2]));
+        };
+
+        return (1 - fy) * ((1 - fx) * texel(x0, y0) + fx * texel(x0 + 1, y0))
+             + fy * ((1 - fx) * texel(x0, y0 + 1) + fx * texel(x0 + 1, y0 + 1));
+    }
+};
+
+#endif
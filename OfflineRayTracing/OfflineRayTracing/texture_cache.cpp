@@ -0,0 +1 @@
+#include "texture_cache.h"
@@ -0,0 +1,306 @@
+#pragma once
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Tiled, mip-mapped texture files (.rtx). Every MIP level is cut into square tiles of RGB
+// bytes so a renderer can read just the tiles it touches:
+//
+//   "RTTX", version, width, height, tile size, level count       (uint32 each)
+//   per level: width, height, tiles across, tiles down (uint32), offset of its first tile (uint64)
+//   tiles, level by level, row by row, each tile_size * tile_size * 3 bytes
+//
+// Tiles on the right and bottom edges are padded to full size.
+
+struct texture_level {
+    uint32_t width, height;
+    uint32_t tiles_x, tiles_y;
+    uint64_t offset;
+};
+
+struct texture_tile {
+    std::vector<unsigned char> rgb;   // tile_size * tile_size texels
+};
+
+class tiled_texture_file {
+public:
+    uint32_t width = 0, height = 0;
+    uint32_t tile_size = 0;
+    std::vector<texture_level> levels;
+
+    static const char* magic() { return "RTTX"; }
+    static constexpr uint32_t version = 1;
+
+    explicit tiled_texture_file(const std::string& _path) : path(_path), in(_path, std::ios::binary) {
+        if (!in)
+            throw std::runtime_error("cannot open texture '" + path + "'");
+
+        char file_magic[4];
+        uint32_t header[5];
+        if (!in.read(file_magic, 4) || std::memcmp(file_magic, magic(), 4) != 0 ||
+            !in.read(reinterpret_cast<char*>(header), sizeof(header)) || header[0] != version)
+            throw std::runtime_error(path + ": not a tiled texture (convert images with --make-texture)");
+
+        width = header[1];
+        height = header[2];
+        tile_size = header[3];
+        levels.resize(header[4]);
+        for (auto& level : levels) {
+            uint32_t sizes[4];
+            if (!in.read(reinterpret_cast<char*>(sizes), sizeof(sizes)) ||
+                !in.read(reinterpret_cast<char*>(&level.offset), sizeof(level.offset)))
+                throw std::runtime_error(path + ": truncated texture header");
+            level = { sizes[0], sizes[1], sizes[2], sizes[3], level.offset };
+        }
+        if (levels.empty() || tile_size == 0)
+            throw std::runtime_error(path + ": texture has no levels");
+    }
+
+    size_t tile_bytes() const { return size_t(tile_size) * tile_size * 3; }
+
+    // Reads one tile from disk. Threads share the file handle, so reads are serialized.
+    std::shared_ptr<texture_tile> read_tile(uint32_t level, uint32_t tx, uint32_t ty) {
+        auto tile = std::make_shared<texture_tile>();
+        tile->rgb.resize(tile_bytes());
+        const auto& l = levels[level];
+        uint64_t offset = l.offset + (uint64_t(ty) * l.tiles_x + tx) * tile_bytes();
+
+        std::lock_guard<std::mutex> lock(file_mutex);
+        in.seekg(std::streamoff(offset));
+        if (!in.read(reinterpret_cast<char*>(tile->rgb.data()), std::streamsize(tile->rgb.size())))
+            throw std::runtime_error(path + ": truncated texture tile");
+        return tile;
+    }
+
+    // Converts an 8-bit RGB image into a tiled MIP pyramid. Each level halves the one above,
+    // averaging 2x2 blocks in linear space, down to a single texel.
+    static void write(const std::string& out_path, const std::vector<unsigned char>& rgb,
+                      uint32_t image_width, uint32_t image_height, uint32_t tile_size = 64) {
+        std::vector<std::vector<unsigned char>> pyramid = { rgb };
+        std::vector<texture_level> level_info = { { image_width, image_height, 0, 0, 0 } };
+        while (level_info.back().width > 1 || level_info.back().height > 1) {
+            const auto& above = level_info.back();
+            const auto& src = pyramid.back();
+            uint32_t w = std::max(1u, above.width / 2), h = std::max(1u, above.height / 2);
+            std::vector<unsigned char> level(size_t(w) * h * 3);
+            for (uint32_t y = 0; y < h; ++y) {
+                for (uint32_t x = 0; x < w; ++x) {
+                    for (int c = 0; c < 3; ++c) {
+                        double sum = 0;
+                        for (uint32_t dy = 0; dy < 2; ++dy)
+                            for (uint32_t dx = 0; dx < 2; ++dx) {
+                                auto sx = std::min(2 * x + dx, above.width - 1);
+                                auto sy = std::min(2 * y + dy, above.height - 1);
+                                auto value = src[(size_t(sy) * above.width + sx) * 3 + c] / 255.0;
+                                sum += value * value;     // Stored values are gamma 2
+                            }
+                        level[(size_t(y) * w + x) * 3 + c] = static_cast<unsigned char>(std::sqrt(sum / 4) * 255 + 0.5);
+                    }
+                }
+            }
+            pyramid.push_back(std::move(level));
+            level_info.push_back({ w, h, 0, 0, 0 });
+        }
+
+        uint64_t offset = 4 + 5 * sizeof(uint32_t) + level_info.size() * (4 * sizeof(uint32_t) + sizeof(uint64_t));
+        const size_t tile_bytes = size_t(tile_size) * tile_size * 3;
+        for (auto& level : level_info) {
+            level.tiles_x = (level.width + tile_size - 1) / tile_size;
+            level.tiles_y = (level.height + tile_size - 1) / tile_size;
+            level.offset = offset;
+            offset += uint64_t(level.tiles_x) * level.tiles_y * tile_bytes;
+        }
+
+        std::ofstream out(out_path, std::ios::binary);
+        if (!out)
+            throw std::runtime_error("cannot write texture '" + out_path + "'");
+        uint32_t header[5] = { version, image_width, image_height, tile_size, uint32_t(level_info.size()) };
+        out.write(magic(), 4);
+        out.write(reinterpret_cast<const char*>(header), sizeof(header));
+        for (const auto& level : level_info) {
+            uint32_t sizes[4] = { level.width, level.height, level.tiles_x, level.tiles_y };
+            out.write(reinterpret_cast<const char*>(sizes), sizeof(sizes));
+            out.write(reinterpret_cast<const char*>(&level.offset), sizeof(level.offset));
+        }
+
+        std::vector<unsigned char> tile(tile_bytes);
+        for (size_t l = 0; l < level_info.size(); ++l) {
+            const auto& level = level_info[l];
+            for (uint32_t ty = 0; ty < level.tiles_y; ++ty) {
+                for (uint32_t tx = 0; tx < level.tiles_x; ++tx) {
+                    std::fill(tile.begin(), tile.end(), 0);
+                    for (uint32_t y = 0; y < tile_size && ty * tile_size + y < level.height; ++y) {
+                        auto row = std::min(tile_size, level.width - tx * tile_size);
+                        auto src = &pyramid[l][(size_t(ty * tile_size + y) * level.width + tx * tile_size) * 3];
+                        std::copy(src, src + row * 3, &tile[size_t(y) * tile_size * 3]);
+                    }
+                    out.write(reinterpret_cast<const char*>(tile.data()), std::streamsize(tile.size()));
+                }
+            }
+        }
+        if (!out)
+            throw std::runtime_error("failed while writing texture '" + out_path + "'");
+    }
+
+private:
+    std::string path;
+    std::ifstream in;
+    std::mutex file_mutex;
+};
+
+// Reads a binary (P6) or text (P3) PPM image with 8-bit channels as RGB bytes, row by row.
+inline std::vector<unsigned char> read_ppm(const std::string& path, uint32_t& width, uint32_t& height) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+        throw std::runtime_error("cannot open image '" + path + "'");
+
+    std::string format;
+    uint32_t max_value = 0;
+    in >> format >> width >> height >> max_value;
+    if (!in || (format != "P3" && format != "P6") || max_value == 0 || max_value > 255)
+        throw std::runtime_error(path + ": not an 8-bit P3 or P6 PPM image");
+
+    std::vector<unsigned char> rgb(size_t(width) * height * 3);
+    if (format == "P6") {
+        in.get();     // The single whitespace byte after the header
+        in.read(reinterpret_cast<char*>(rgb.data()), std::streamsize(rgb.size()));
+    }
+    else {
+        for (auto& byte : rgb) {
+            unsigned value;
+            in >> value;
+            byte = static_cast<unsigned char>(value);
+        }
+    }
+    if (!in)
+        throw std::runtime_error(path + ": truncated image");
+    if (max_value != 255)
+        for (auto& byte : rgb)
+            byte = static_cast<unsigned char>(byte * 255 / max_value);
+    return rgb;
+}
+
+// A fixed-size, least-recently-used cache of texture tiles shared by every texture and render
+// thread. Tiles are paged in from their files on a miss, so memory stays at the configured
+// capacity however much texture data a scene references. The cache is split into shards with
+// their own lock, so threads touching different tiles rarely wait for each other.
+class texture_cache {
+public:
+    struct statistics {
+        uint64_t lookups, hits, misses, evictions, bytes_read;
+        size_t   resident_bytes;
+    };
+
+    static texture_cache& global() {
+        static texture_cache cache;
+        return cache;
+    }
+
+    // Applies to tiles cached from now on; shrinking evicts on the next insertions.
+    void set_capacity(size_t bytes) {
+        shard_capacity = std::max<size_t>(bytes / shard_count, 1);
+    }
+
+    size_t capacity() const { return shard_capacity * shard_count; }
+
+    // Returns the tile, reading it through `file` when it is not cached.
+    std::shared_ptr<const texture_tile> get(uint32_t texture_id, uint32_t level, uint32_t tx, uint32_t ty,
+                                            tiled_texture_file& file) {
+        uint64_t key = (uint64_t(texture_id) << 40) | (uint64_t(level) << 32) | (uint64_t(ty) << 16) | tx;
+        auto& s = shards[std::hash<uint64_t>()(key) % shard_count];
+        lookups.fetch_add(1, std::memory_order_relaxed);
+
+        {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            auto found = s.index.find(key);
+            if (found != s.index.end()) {
+                s.entries.splice(s.entries.begin(), s.entries, found->second);
+                return found->second->tile;
+            }
+        }
+
+        // Read outside the lock; a tile two threads miss at once is simply read twice.
+        std::shared_ptr<const texture_tile> tile = file.read_tile(level, tx, ty);
+        misses.fetch_add(1, std::memory_order_relaxed);
+        bytes_read.fetch_add(tile->rgb.size(), std::memory_order_relaxed);
+
+        std::lock_guard<std::mutex> lock(s.mutex);
+        auto found = s.index.find(key);
+        if (found != s.index.end())
+            return found->second->tile;
+
+        s.entries.push_front({ key, tile });
+        s.index[key] = s.entries.begin();
+        s.bytes += tile->rgb.size();
+        while (s.bytes > shard_capacity && s.entries.size() > 1) {
+            s.bytes -= s.entries.back().tile->rgb.size();
+            s.index.erase(s.entries.back().key);
+            s.entries.pop_back();
+            evictions.fetch_add(1, std::memory_order_relaxed);
+        }
+        return tile;
+    }
+
+    statistics stats() {
+        statistics result = { lookups, 0, misses, evictions, bytes_read, 0 };
+        result.hits = result.lookups - result.misses;
+        for (auto& s : shards) {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            result.resident_bytes += s.bytes;
+        }
+        return result;
+    }
+
+    void report(std::ostream& out) {
+        auto s = stats();
+        if (s.lookups == 0)
+            return;
+        out << "Texture cache: " << s.lookups << " tile lookups, "
+            << 100.0 * s.hits / s.lookups << "% hits, " << s.misses << " misses, "
+            << s.evictions << " evictions, " << s.bytes_read / (1024.0 * 1024.0) << " MB read, "
+            << s.resident_bytes / (1024.0 * 1024.0) << " of " << capacity() / (1024.0 * 1024.0) << " MB resident\n";
+    }
+
+    // Identifies a texture's tiles in the cache.
+    static uint32_t next_texture_id() {
+        static std::atomic<uint32_t> next{ 0 };
+        return next++;
+    }
+
+private:
+    static constexpr int shard_count = 16;
+
+    struct entry {
+        uint64_t key;
+        std::shared_ptr<const texture_tile> tile;
+    };
+
+    struct shard {
+        std::mutex mutex;
+        std::list<entry> entries;     // Most recently used first
+        std::unordered_map<uint64_t, std::list<entry>::iterator> index;
+        size_t bytes = 0;
+    };
+
+    shard shards[shard_count];
+    size_t shard_capacity = (size_t(64) << 20) / shard_count;
+    std::atomic<uint64_t> lookups{ 0 }, misses{ 0 }, evictions{ 0 }, bytes_read{ 0 };
+
+    texture_cache() = default;
+};
+
+#endif
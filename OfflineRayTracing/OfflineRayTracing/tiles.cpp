@@ -0,0 +1 @@
+#include "tiles.h"
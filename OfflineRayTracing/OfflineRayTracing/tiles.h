@@ -0,0 +1,136 @@
+#pragma once
+#ifndef TILES_H
+#define TILES_H
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Order in which the camera hands out image tiles to render threads.
+enum class tile_order {
+    scanline,   // Whole image rows, pixels left to right (the original traversal)
+    morton,     // Square tiles along a Z-order curve, pixels in Z-order inside each tile
+    hilbert     // Square tiles along a Hilbert curve, pixels in Z-order inside each tile
+};
+
+inline tile_order parse_tile_order(const std::string& name) {
+    if (name == "scanline") return tile_order::scanline;
+    if (name == "morton") return tile_order::morton;
+    if (name == "hilbert") return tile_order::hilbert;
+    throw std::runtime_error("unknown tile order '" + name + "' (scanline, morton or hilbert)");
+}
+
+inline const char* tile_order_name(tile_order order) {
+    switch (order) {
+    case tile_order::scanline: return "scanline";
+    case tile_order::morton:   return "morton";
+    default:                   return "hilbert";
+    }
+}
+
+// A rectangle of pixels [x0, x1) x [y0, y1).
+struct tile {
+    int x0, y0, x1, y1;
+
+    int pixel_count() const { return (x1 - x0) * (y1 - y0); }
+};
+
+struct pixel_offset {
+    uint16_t x, y;
+};
+
+// Interleaves the bits of x and y, x in the even bits.
+inline uint32_t morton_encode(uint32_t x, uint32_t y) {
+    auto spread = [](uint32_t v) {
+        v &= 0xffff;
+        v = (v | (v << 8)) & 0x00ff00ff;
+        v = (v | (v << 4)) & 0x0f0f0f0f;
+        v = (v | (v << 2)) & 0x33333333;
+        v = (v | (v << 1)) & 0x55555555;
+        return v;
+    };
+    return spread(x) | (spread(y) << 1);
+}
+
+// Maps a distance along the Hilbert curve filling an n x n grid (n a power of two) to (x, y).
+inline void hilbert_point(uint32_t n, uint32_t d, uint32_t& x, uint32_t& y) {
+    x = y = 0;
+    for (uint32_t s = 1; s < n; s *= 2) {
+        uint32_t rx = 1 & (d / 2);
+        uint32_t ry = 1 & (d ^ rx);
+        if (ry == 0) {
+            if (rx == 1) {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            std::swap(x, y);
+        }
+        x += s * rx;
+        y += s * ry;
+        d /= 4;
+    }
+}
+
+// Splits the image into tiles and returns them in the order they should be rendered.
+inline std::vector<tile> make_tiles(int width, int height, int tile_size, tile_order order) {
+    std::vector<tile> tiles;
+
+    if (order == tile_order::scanline) {
+        for (int y = 0; y < height; ++y)
+            tiles.push_back({ 0, y, width, y + 1 });
+        return tiles;
+    }
+
+    tile_size = std::max(tile_size, 1);
+    const int columns = (width + tile_size - 1) / tile_size;
+    const int rows = (height + tile_size - 1) / tile_size;
+    auto make = [&](int tx, int ty) {
+        return tile{ tx * tile_size, ty * tile_size,
+                     std::min((tx + 1) * tile_size, width), std::min((ty + 1) * tile_size, height) };
+    };
+
+    if (order == tile_order::morton) {
+        std::vector<std::pair<uint32_t, tile>> keyed;
+        for (int ty = 0; ty < rows; ++ty)
+            for (int tx = 0; tx < columns; ++tx)
+                keyed.push_back({ morton_encode(tx, ty), make(tx, ty) });
+        std::sort(keyed.begin(), keyed.end(),
+                  [](const std::pair<uint32_t, tile>& a, const std::pair<uint32_t, tile>& b) { return a.first < b.first; });
+        for (const auto& k : keyed)
+            tiles.push_back(k.second);
+        return tiles;
+    }
+
+    // Walk the Hilbert curve over the smallest power-of-two square covering the tile grid,
+    // skipping the cells that fall outside the image.
+    uint32_t n = 1;
+    while (n < uint32_t(columns) || n < uint32_t(rows))
+        n *= 2;
+    for (uint32_t d = 0; d < n * n; ++d) {
+        uint32_t tx, ty;
+        hilbert_point(n, d, tx, ty);
+        if (tx < uint32_t(columns) && ty < uint32_t(rows))
+            tiles.push_back(make(int(tx), int(ty)));
+    }
+    return tiles;
+}
+
+// Pixel offsets of a tile_size x tile_size tile in the order they should be rendered. Tiles cut
+// short by the image edge skip the offsets that fall outside them.
+inline std::vector<pixel_offset> tile_pixel_order(int tile_size, tile_order order) {
+    std::vector<pixel_offset> offsets;
+    if (order == tile_order::scanline)
+        return offsets;    // Scanline tiles are walked left to right directly
+
+    for (int y = 0; y < tile_size; ++y)
+        for (int x = 0; x < tile_size; ++x)
+            offsets.push_back({ uint16_t(x), uint16_t(y) });
+    std::sort(offsets.begin(), offsets.end(), [](const pixel_offset& a, const pixel_offset& b) {
+        return morton_encode(a.x, a.y) < morton_encode(b.x, b.y);
+    });
+    return offsets;
+}
+
+#endif
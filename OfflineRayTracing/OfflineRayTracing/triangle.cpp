@@ -0,0 +1 @@
+#include "triangle.h"
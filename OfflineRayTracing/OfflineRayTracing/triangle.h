@@ -0,0 +1,62 @@
+#pragma once
+#ifndef TRIANGLE_H
+#define TRIANGLE_H
+
+#include "hittable.h"
+#include "vec3.h"
+
+class triangle : public hittable {
+public:
+    triangle(point3 _a, point3 _b, point3 _c, shared_ptr<material> _material)
+        : a(_a), edge1(_b - _a), edge2(_c - _a), mat(_material)
+    {
+        auto n = cross(edge1, edge2);
+        normal = unit_vector(n);
+        uv_size = sqrt(n.length());      // The barycentric uv square has twice the triangle's area
+        bbox = aabb(aabb(_a, _b), aabb(_a, _c)).pad();
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        // Moller-Trumbore intersection, solving for t and the barycentric coordinates at once.
+        vec3 pvec = cross(r.direction(), edge2);
+        auto det = dot(edge1, pvec);
+        if (fabs(det) < 1e-12) return false;   // Ray is parallel to the triangle plane
+        auto inv_det = 1.0 / det;
+
+        vec3 tvec = r.origin() - a;
+        auto b1 = dot(tvec, pvec) * inv_det;
+        if (b1 < 0 || b1 > 1) return false;
+
+        vec3 qvec = cross(tvec, edge1);
+        auto b2 = dot(r.direction(), qvec) * inv_det;
+        if (b2 < 0 || b1 + b2 > 1) return false;
+
+        auto root = dot(edge2, qvec) * inv_det;
+        if (!ray_t.surrounds(root))
+            return false;
+
+        rec.t = root;
+        rec.p = r.at(rec.t);
+        rec.set_face_normal(r, normal);
+        rec.u = b1;
+        rec.v = b2;
+        rec.uv_size = uv_size;
+        rec.mat = mat;
+        rec.light = -1;
+        rec.sphere = false;
+
+        return true;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+private:
+    point3 a;
+    vec3 edge1, edge2;
+    vec3 normal;
+    double uv_size;
+    shared_ptr<material> mat;
+    aabb bbox;
+};
+
+#endif
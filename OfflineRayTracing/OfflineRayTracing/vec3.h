@@ -6,6 +6,7 @@
 #include <iostream>
 #include <random>
 #include <cstdlib>
+#include "rng.h"
 using std::sqrt;
 
 class vec3 {
@@ -56,16 +57,16 @@ public:
     }
 
     static vec3 random() {
-        double x = rand() / (RAND_MAX + 1.0);
-        double y = rand() / (RAND_MAX + 1.0);
-        double z = rand() / (RAND_MAX + 1.0);
+        double x = random_double();
+        double y = random_double();
+        double z = random_double();
         return vec3(x, y, z);
     }
 
     static vec3 random(double min, double max) {
-        double x = (min + (max - min)) * (rand() / (RAND_MAX + 1.0));
-        double y = (min + (max - min)) * (rand() / (RAND_MAX + 1.0));
-        double z = (min + (max - min)) * (rand() / (RAND_MAX + 1.0));
+        double x = random_double(min, max);
+        double y = random_double(min, max);
+        double z = random_double(min, max);
         return vec3(x, y, z);
     }
 };
@@ -122,7 +123,9 @@ inline vec3 unit_vector(vec3 v) {
 
 inline vec3 random_in_unit_disk() {
     while (true) {
-        auto p = vec3((-1 + (1 - -1)) * (rand() / (RAND_MAX + 1.0)), (-1 + (1 - -1)) * (rand() / (RAND_MAX + 1.0)), 0);
+        double x = random_double(-1, 1);
+        double y = random_double(-1, 1);
+        auto p = vec3(x, y, 0);
         if (p.length_squared() < 1)
             return p;
     }